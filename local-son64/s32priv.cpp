@@ -1289,3 +1289,15 @@ int TSon32File::ReadWave(TChanNum chan, float* pData, int nMax, TSTime64 tFrom,
         tFirst = first;
     return S64Err(n);
 }
+
+// The 32-bit library has no access to the positions of the data blocks, so there is no
+// advice to give.
+int TSon32File::Prefetch(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto)
+{
+    return S64_OK;
+}
+
+int TSon32File::Release(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto)
+{
+    return S64_OK;
+}
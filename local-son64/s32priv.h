@@ -169,6 +169,9 @@ namespace ceds64
 
         virtual int WriteExtMarks(TChanNum chan, const TExtMark* pData, size_t count);
         virtual int ReadExtMarks(TChanNum chan, TExtMark* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter = nullptr);
+
+        virtual int Prefetch(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto);
+        virtual int Release(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto);
     
         // This is the end of the defined interface
     };
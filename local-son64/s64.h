@@ -366,13 +366,19 @@ namespace ceds64
         BAD_PARAM= -22,         //!< a bad parameter to a call
         OVER_WRITE= -23,        //!< attempt to over-write data when not allowed
         MORE_DATA= -24,         //!< file is bigger than header says; maybe not closed correctly
-        S64_MINERROR = MORE_DATA
+        CANCELLED= -25,         //!< an asynchronous operation was cancelled
+        S64_MINERROR = CANCELLED
     };
 
     //! Constants defining channels, revisions and the like
     /*!
     REV_MINOR changed from 0 to 1 July 2017 to warn that header extension count
     could be wrong for files with lots of channels and strings in minro rev 0.
+
+    Files are created with REV_MAJOR. The major revision is changed to REV_MAJOR_REUSE
+    when the first data blocks are passed to the free block map. Older libraries refuse
+    these files, as they would undelete channels or read dropped data from blocks that
+    may now belong to other channels.
     */
     enum
     {
@@ -381,6 +387,7 @@ namespace ceds64
         MAXHEADUSER = 65536,    //!< maximum user space in the header (arbitrary)
         REV_MAJOR = 1,          //!< major revision number, first is 1
         REV_MINOR = 1,          //!< minor revision number, up to 99
+        REV_MAJOR_REUSE = 2,    //!< major revision of files that have freed data blocks
         TEXTMARK_MIN = 8,       //!< if smaller, increase to this size
         TEXTMARK_MAX = 4000,    //!< arbitrary limit on size of text mark
         NUMFILECOMMENTS = 8,    //!< Number of file comments available
@@ -427,6 +434,9 @@ namespace ceds64
         eOF_none = 0,       //!< to make it easy to set no flags
         eOF_shared = 1,     //!< Reserved for opening shared, not yet implemented
         eOF_test = 2,       //!< If set, open the file even if verify of the file head fails
+        eOF_direct = 4,     //!< If set, write data and index blocks bypassing the OS cache (if possible)
+        eOF_index = 8,      //!< If set, use a .s64idx block index file next to the data file if it matches
+        eOF_makeIndex = 16, //!< If set, write or update the .s64idx index file when the file is closed
     };
 
     //! flags to set when calling Commit
@@ -1091,7 +1101,9 @@ namespace ceds64
         /*!
         \ingroup GpChan
         This deletes a channel from the file. In a 64-bit file, channels are deleted in such a way that
-        as long as you do not reuse the channel, it is possible to undelete them.
+        as long as you do not reuse the channel, it is possible to undelete them. The disk space used
+        by the channel data is made available to other channels; once any of it has been used, the
+        channel can no longer be undeleted.
 
         \sa ChanUndelete()
         */
@@ -1722,6 +1734,34 @@ namespace ceds64
         \return      The number of items read or a negative error code.
         */
         virtual int ReadExtMarks(TChanNum chan, TExtMark* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter = nullptr) = 0;
+
+        //! Advise that a time range of a channel will be read soon
+        /*!
+        \ingroup GpFile
+        This is only advice and has no effect on the data that is read. The 64-bit library finds the
+        data blocks that hold the range from the channel index and asks the OS to read them into its
+        cache in the background, so a read that follows does not wait for the disk. The 32-bit
+        library does nothing.
+        \sa Release()
+        \param chan  The channel number.
+        \param tFrom The start of the time range.
+        \param tUpto The end of the time range (not included).
+        \return      S64_OK (0) or a negative error code.
+        */
+        virtual int Prefetch(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto) = 0;
+
+        //! Advise that a time range of a channel will not be read again soon
+        /*!
+        \ingroup GpFile
+        This is only advice and has no effect on the data that is read. The 64-bit library asks the
+        OS to drop the data blocks that hold the range from its cache. The 32-bit library does nothing.
+        \sa Prefetch()
+        \param chan  The channel number.
+        \param tFrom The start of the time range.
+        \param tUpto The end of the time range (not included).
+        \return      S64_OK (0) or a negative error code.
+        */
+        virtual int Release(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto) = 0;
     };
 }
 #undef DllClass
@@ -34,32 +34,54 @@ INSTALLS += headers
 
 SOURCES += s3264.cpp \
    s32priv.cpp \
+   s64async.cpp \
+   s64batch.cpp \
    s64blkmgr.cpp \
    s64chan.cpp \
+   s64copy.cpp \
+   s64count.cpp \
    s64dblk.cpp \
+   s64drop.cpp \
    s64event.cpp \
    s64filt.cpp \
+   s64find.cpp \
    s64head.cpp \
+   s64hint.cpp \
+   s64idx.cpp \
+   s64io.cpp \
    s64mark.cpp \
+   s64query.cpp \
+   s64rank.cpp \
+   s64snap.cpp \
+   s64spike.cpp \
+   s64srv.cpp \
    s64ss.cpp \
    s64st.cpp \
+   s64text.cpp \
    s64wave.cpp \
    s64xmark.cpp \
    son64.cpp
 
 HEADERS += s3264.h \
    s32priv.h \
+   s64async.h \
    s64chan.h \
    s64circ.h \
+   s64count.h \
    s64dblk.h \
    s64doc.h \
    s64filt.h \
    s64.h \
+   s64idx.h \
+   s64io.h \
    s64iter.h \
    s64priv.h \
    s64range.h \
+   s64rank.h \
+   s64srv.h \
    s64ss.h \
-   s64st.h
+   s64st.h \
+   s64text.h
 
 QMAKE_CXXFLAGS += -I/opt/mxe/usr/include -static
 QMAKE_LFLAGS += -static
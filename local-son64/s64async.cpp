@@ -0,0 +1,284 @@
+// s64async.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64async.cpp
+//! \brief Asynchronous reads that run on a pool of worker threads
+/*!
+\internal
+Each file has a pool of worker threads that is created when the first asynchronous read
+is requested and is destroyed when the file is closed. The reads themselves are the normal
+blocking reads, so they share the channel block managers with all other reads. Long reads
+are done in chunks, and cancellation is checked between chunks.
+*/
+#include <assert.h>
+#include <algorithm>
+#include "s64priv.h"
+#include "s64filt.h"
+#include "s64async.h"
+
+using namespace std;
+using namespace ceds64;
+
+//! The number of items we read between checks for cancellation
+static const int nAsyncChunk = 65536;
+
+//! The most threads we use for asynchronous reads of one file
+static const unsigned int nMaxAsyncThreads = 8;
+
+/*!
+\param nThreads The number of worker threads to start.
+*/
+CReadPool::CReadPool(unsigned int nThreads)
+    : m_bStop( false )
+{
+    for (unsigned int i = 0; i < nThreads; ++i)
+        m_vThreads.emplace_back(&CReadPool::Worker, this);
+}
+
+//! Cancel all queued tasks and wait for running tasks to finish
+CReadPool::~CReadPool()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_bStop = true;
+    }
+    m_cv.notify_all();
+    for (auto& t : m_vThreads)
+        t.join();
+}
+
+//! Queue a task to run on a worker thread
+void CReadPool::Post(TTask task)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_queue.push_back(move(task));
+    }
+    m_cv.notify_one();
+}
+
+//! The worker thread loop
+/*!
+Runs tasks until the pool is stopped, then passes any tasks that are still queued false
+so that they report that they were cancelled.
+*/
+void CReadPool::Worker()
+{
+    while (true)
+    {
+        TTask task;
+        bool bRun;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]{return m_bStop || !m_queue.empty();});
+            if (m_queue.empty())        // we are stopping and there is nothing left
+                return;
+            task = move(m_queue.front());
+            m_queue.pop_front();
+            bRun = !m_bStop;
+        }
+        task(bRun);
+    }
+}
+
+//! Queue a task on the pool of threads for asynchronous reads, creating it if needed
+/*!
+The task is posted while we hold m_mutPool, so Close() cannot destroy the pool under us. It
+either runs or is passed false when Close() destroys the pool.
+\param task The task to run.
+*/
+void TSon64File::PostToPool(function<void(bool bRun)> task)
+{
+    lock_guard<mutex> lock(m_mutPool);
+    if (!m_pPool)
+    {
+        unsigned int nThreads = min(max(2u, thread::hardware_concurrency()), nMaxAsyncThreads);
+        m_pPool.reset(new CReadPool(nThreads));
+    }
+    m_pPool->Post(move(task));
+}
+
+//! Make a pool task for a read, and the future for the result
+/*!
+\tparam R       The result type.
+\param fut      Set to the future that will hold the result.
+\param pCancel  Either nullptr or a cancellation flag. If it is set before the read starts,
+                the read is not done and the result is CANCELLED.
+\param fn       The read to run, returning the result.
+\return         The task to pass to TSon64File::PostToPool().
+*/
+template <typename R, typename F>
+static CReadPool::TTask ReadTask(future<R>& fut, const TAsyncCancel* pCancel, F fn)
+{
+    auto pProm = make_shared<promise<R>>();
+    fut = pProm->get_future();
+    return [pProm, pCancel, fn](bool bRun)
+    {
+        if (!bRun || (pCancel && pCancel->Cancelled()))
+            pProm->set_value(CANCELLED);
+        else
+            pProm->set_value(fn());
+    };
+}
+
+//! Read a waveform in chunks, checking for cancellation between chunks
+/*!
+This gives the same result as ReadWave() unless it is cancelled.
+\return The number of points read or a negative error code.
+*/
+template <typename T>
+static int ReadWaveChunks(TSon64File& file, TChanNum chan, T* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                          TSTime64& tFirst, const CSFilter* pFilter, const TAsyncCancel* pCancel)
+{
+    const TSTime64 tDiv = file.ChanDivide(chan);
+    const int nChunk = (tDiv > 0) ? nAsyncChunk : nMax;   // no sample interval, so one read
+    int nRead = 0;
+    while ((nRead < nMax) && (tFrom < tUpto))
+    {
+        if (pCancel && pCancel->Cancelled())
+            return CANCELLED;
+        const int nWant = min(nMax - nRead, nChunk);
+        TSTime64 t;
+        int n = file.ReadWave(chan, pData + nRead, nWant, tFrom, tUpto, t, pFilter);
+        if (n < 0)
+            return n;
+        if (nRead == 0)
+            tFirst = t;
+        else if ((n > 0) && (t != tFrom))
+            break;                      // a gap, so the data we have is all there is
+        nRead += n;
+        if (n < nWant)
+            break;
+        tFrom = t + n*tDiv;
+    }
+    return nRead;
+}
+
+//! Read waveform data as 16-bit integers without waiting
+/*!
+The read is queued and done by a worker thread, so several reads can be outstanding at
+once. This gives the same result as ReadWave(). The data and time arguments and the
+cancellation flag are owned by the caller, and must remain valid until the future is
+ready. The filter is copied. The file must not be closed until the future is ready;
+closing the file cancels reads that have not started.
+\param chan     The channel to read.
+\param pData    The buffer to read into, with space for nMax values.
+\param nMax     The maximum number of values to read.
+\param tFrom    The first time of interest.
+\param tUpto    One tick beyond the last time of interest.
+\param tFirst   Set to the time of the first value read.
+\param pFilter  Either nullptr or a filter for AdcMark channels.
+\param pCancel  Either nullptr or a flag that can be set to cancel the read. A cancelled
+                read may have written part of the data.
+\return         A future that will hold the number of values read or a negative error code
+                (CANCELLED if the read was cancelled).
+*/
+future<int> TSon64File::ReadWaveAsync(TChanNum chan, short* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                                      TSTime64& tFirst, const CSFilter* pFilter, const TAsyncCancel* pCancel)
+{
+    shared_ptr<CSFilter> pFilt(pFilter ? new CSFilter(*pFilter) : nullptr);
+    TSTime64* pFirst = &tFirst;
+    future<int> fut;
+    PostToPool(ReadTask(fut, pCancel, [=]()
+    {
+        return ReadWaveChunks(*this, chan, pData, nMax, tFrom, tUpto, *pFirst, pFilt.get(), pCancel);
+    }));
+    return fut;
+}
+
+//! Read waveform data as floats without waiting
+/*!
+This is the same as the short version of ReadWaveAsync(), but the data is read in user
+units, as for ReadWave().
+*/
+future<int> TSon64File::ReadWaveAsync(TChanNum chan, float* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                                      TSTime64& tFirst, const CSFilter* pFilter, const TAsyncCancel* pCancel)
+{
+    shared_ptr<CSFilter> pFilt(pFilter ? new CSFilter(*pFilter) : nullptr);
+    TSTime64* pFirst = &tFirst;
+    future<int> fut;
+    PostToPool(ReadTask(fut, pCancel, [=]()
+    {
+        return ReadWaveChunks(*this, chan, pData, nMax, tFrom, tUpto, *pFirst, pFilt.get(), pCancel);
+    }));
+    return fut;
+}
+
+//! Read event times without waiting
+/*!
+The read is queued and done by a worker thread. This gives the same result as
+ReadEvents(). The buffer and cancellation flag are owned by the caller and must remain
+valid until the future is ready. The filter is copied.
+\param chan     The channel to read.
+\param pData    The buffer to read into, with space for nMax times.
+\param nMax     The maximum number of times to read.
+\param tFrom    The first time of interest.
+\param tUpto    One tick beyond the last time of interest.
+\param pFilter  Either nullptr or a filter for marker-based channels.
+\param pCancel  Either nullptr or a flag that can be set to cancel the read.
+\return         A future that will hold the number of times read or a negative error code.
+*/
+future<int> TSon64File::ReadEventsAsync(TChanNum chan, TSTime64* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                                        const CSFilter* pFilter, const TAsyncCancel* pCancel)
+{
+    shared_ptr<CSFilter> pFilt(pFilter ? new CSFilter(*pFilter) : nullptr);
+    future<int> fut;
+    PostToPool(ReadTask(fut, pCancel, [=]()
+    {
+        int nRead = 0;
+        TSTime64 t = tFrom;
+        while ((nRead < nMax) && (t < tUpto))
+        {
+            if (pCancel && pCancel->Cancelled())
+                return static_cast<int>(CANCELLED);
+            const int nWant = min(nMax - nRead, nAsyncChunk);
+            int n = ReadEvents(chan, pData + nRead, nWant, t, tUpto, pFilt.get());
+            if (n < 0)
+                return n;
+            nRead += n;
+            if (n < nWant)
+                break;
+            t = pData[nRead-1] + 1;
+        }
+        return nRead;
+    }));
+    return fut;
+}
+
+//! Search backwards for an event time without waiting
+/*!
+The search is queued and done by a worker thread. This gives the same result as
+PrevNTime(). The filter is copied and the cancellation flag must remain valid until the
+future is ready. A search that has started is not cancelled.
+\return A future that will hold the time or a negative error code.
+*/
+future<TSTime64> TSon64File::PrevNTimeAsync(TChanNum chan, TSTime64 tStart, TSTime64 tEnd, uint32_t n,
+                                            const CSFilter* pFilter, bool bAsWave, const TAsyncCancel* pCancel)
+{
+    shared_ptr<CSFilter> pFilt(pFilter ? new CSFilter(*pFilter) : nullptr);
+    future<TSTime64> fut;
+    PostToPool(ReadTask(fut, pCancel, [=]()
+    {
+        return PrevNTime(chan, tStart, tEnd, n, pFilt.get(), bAsWave);
+    }));
+    return fut;
+}
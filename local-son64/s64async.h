@@ -0,0 +1,64 @@
+// s64async.h
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __S64ASYNC_H__
+#define __S64ASYNC_H__
+//! \file s64async.h
+//! \brief Worker threads for the asynchronous reads
+//! \internal
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+namespace ceds64
+{
+    //! A pool of threads that run the asynchronous reads of a file
+    /*!
+     Tasks are run in the order they are posted. Several threads are used so that reads from
+     different channels (and the disk reads they need) can overlap. Each task is passed true
+     if it should run, or false if the pool is being destroyed before the task started, in
+     which case the task should just report that it was cancelled.
+    */
+    class CReadPool
+    {
+    public:
+        typedef std::function<void(bool bRun)> TTask;   //!< A queued task
+
+        explicit CReadPool(unsigned int nThreads);
+        ~CReadPool();
+        void Post(TTask task);
+
+    private:
+        void Worker();
+
+        std::vector<std::thread> m_vThreads;    //!< The worker threads
+        std::deque<TTask> m_queue;      //!< Tasks waiting to run
+        std::mutex m_mutex;             //!< Protects m_queue and m_bStop
+        std::condition_variable m_cv;   //!< Signalled when a task is queued or we stop
+        bool m_bStop;                   //!< Set when the pool is being destroyed
+    };
+}
+#endif
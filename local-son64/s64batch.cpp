@@ -0,0 +1,347 @@
+// s64batch.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64batch.cpp
+//! \brief Batched reads of many time windows from one or more channels
+/*!
+\internal
+Each channel has one read block manager, which keeps the last data block it read. If the
+windows for a channel are read in time order, each data block is read from disk at most
+once. The windows for each channel are sorted and read in one forward pass: overlapping
+event windows share the same reads of the channel, and overlapping waveform windows copy
+the overlap from the earlier window. Different channels are read in parallel.
+*/
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <numeric>
+#include <thread>
+#include "s64priv.h"
+
+using namespace std;
+using namespace ceds64;
+
+//! Number of events we read from the channel at a time
+static const int nBatchBuf = 4096;
+
+//! The windows in a batch sorted into channel and then time order
+class CWindowOrder
+{
+public:
+    CWindowOrder(TReadWindow* pWin, size_t nWin);
+    size_t Groups() const {return m_vGroup.size() - 1;} //!< The number of channels
+    const size_t* Group(size_t i) const {return m_vOrder.data() + m_vGroup[i];}
+    size_t GroupSize(size_t i) const {return m_vGroup[i+1] - m_vGroup[i];}
+    const vector<size_t>& Offsets() const {return m_vOff;}   //!< Window data offsets
+
+private:
+    vector<size_t> m_vOrder;            //!< Window indices in channel, then time order
+    vector<size_t> m_vGroup;            //!< Start of each channel in m_vOrder, plus the end
+    vector<size_t> m_vOff;              //!< Offset to the data for each window
+};
+
+/*!
+The data for each window is placed after the data for the previous window, allowing
+m_nMax items per window. Windows that cannot hold data are set to 0 items and omitted.
+\param pWin The list of windows.
+\param nWin The number of windows.
+*/
+CWindowOrder::CWindowOrder(TReadWindow* pWin, size_t nWin)
+    : m_vOff( nWin )
+{
+    size_t nOff = 0;
+    for (size_t i = 0; i < nWin; ++i)
+    {
+        TReadWindow& w = pWin[i];
+        m_vOff[i] = nOff;
+        w.m_nRead = 0;
+        w.m_tFirst = -1;
+        if (w.m_nMax > 0)
+        {
+            nOff += w.m_nMax;
+            if ((w.m_tFrom < w.m_tUpto) && (w.m_tUpto > 0))
+                m_vOrder.push_back(i);
+        }
+    }
+
+    stable_sort(m_vOrder.begin(), m_vOrder.end(), [pWin](size_t a, size_t b)
+    {
+        return (pWin[a].m_chan < pWin[b].m_chan) ||
+               ((pWin[a].m_chan == pWin[b].m_chan) && (pWin[a].m_tFrom < pWin[b].m_tFrom));
+    });
+
+    for (size_t i = 0; i < m_vOrder.size(); ++i)
+    {
+        if ((i == 0) || (pWin[m_vOrder[i]].m_chan != pWin[m_vOrder[i-1]].m_chan))
+            m_vGroup.push_back(i);
+    }
+    m_vGroup.push_back(m_vOrder.size());
+}
+
+//! Read the event times for the time-sorted windows of one channel
+/*!
+The channel is read forwards in chunks and each event is given to all the windows that
+want it, so overlapping windows do not read the same data again. Gaps between windows are
+skipped.
+\param file     The file holding the channel.
+\param pWin     The list of all the windows.
+\param pOrder   The indices into pWin of the windows for this channel, in time order.
+\param n        The number of windows for this channel.
+\param pOff     The data offset for each window in pWin.
+\param pData    The data arena.
+\param pFilter  A marker filter or nullptr.
+\return         S64_OK (0) or a negative error code.
+*/
+static int ReadEventGroup(TSon64File& file, TReadWindow* pWin, const size_t* pOrder, size_t n,
+                          const size_t* pOff, TSTime64* pData, const CSFilter* pFilter)
+{
+    const TChanNum chan = pWin[pOrder[0]].m_chan;
+    vector<TSTime64> buf(nBatchBuf);
+    vector<size_t> vAct;                // windows that have started and want more data
+    size_t next = 0;                    // the next window in pOrder to start
+    TSTime64 pos = 0;                   // we have seen all the events before this time
+    while (true)
+    {
+        vAct.erase(remove_if(vAct.begin(), vAct.end(), [pWin, pos](size_t i)
+        {
+            return (pWin[i].m_nRead >= pWin[i].m_nMax) || (pWin[i].m_tUpto <= pos);
+        }), vAct.end());
+
+        if (vAct.empty())               // skip the gap to the next window
+        {
+            if (next == n)
+                break;
+            pos = max(pos, pWin[pOrder[next]].m_tFrom);
+        }
+        while ((next < n) && (pWin[pOrder[next]].m_tFrom <= pos))
+            vAct.push_back(pOrder[next++]);
+
+        TSTime64 tUpto = pos;           // read up to the end of the started windows
+        for (size_t i : vAct)
+            tUpto = max(tUpto, pWin[i].m_tUpto);
+        int nRead = file.ReadEvents(chan, buf.data(), nBatchBuf, pos, tUpto, pFilter);
+        if (nRead < 0)
+            return nRead;
+
+        for (int j = 0; j < nRead; ++j)
+        {
+            const TSTime64 t = buf[j];
+            while ((next < n) && (pWin[pOrder[next]].m_tFrom <= t))
+                vAct.push_back(pOrder[next++]);
+            for (size_t i : vAct)
+            {
+                TReadWindow& w = pWin[i];
+                if ((t < w.m_tUpto) && (w.m_nRead < w.m_nMax))
+                    pData[pOff[i] + w.m_nRead++] = t;
+            }
+        }
+        pos = (nRead == nBatchBuf) ? buf[nRead-1] + 1 : tUpto;
+    }
+
+    for (size_t i = 0; i < n; ++i)      // report the first event in each window
+    {
+        TReadWindow& w = pWin[pOrder[i]];
+        if (w.m_nRead)
+            w.m_tFirst = pData[pOff[pOrder[i]]];
+    }
+    return S64_OK;
+}
+
+//! Read the waveform data for the time-sorted windows of one channel
+/*!
+If a window starts inside the data already read for an earlier window, the overlap is
+copied and only the rest of the window is read from the channel. As the windows are in
+time order, each data block is read at most once.
+\tparam T       The data type to read, short or float.
+\param file     The file holding the channel.
+\param pWin     The list of all the windows.
+\param pOrder   The indices into pWin of the windows for this channel, in time order.
+\param n        The number of windows for this channel.
+\param pOff     The data offset for each window in pWin.
+\param pData    The data arena.
+\param pFilter  A marker filter or nullptr.
+\return         S64_OK (0) or a negative error code.
+*/
+template <typename T>
+static int ReadWaveGroup(TSon64File& file, TReadWindow* pWin, const size_t* pOrder, size_t n,
+                         const size_t* pOff, T* pData, const CSFilter* pFilter)
+{
+    const TChanNum chan = pWin[pOrder[0]].m_chan;
+    const TSTime64 tDiv = file.ChanDivide(chan);
+    if (tDiv <= 0)
+        return (tDiv < 0) ? static_cast<int>(tDiv) : CHANNEL_TYPE;
+
+    const TReadWindow* pRef = nullptr;  // the window with the latest end of data
+    const T* pRefData = nullptr;
+    TSTime64 tRefEnd = 0;               // time of the point after the pRef data
+    for (size_t i = 0; i < n; ++i)
+    {
+        TReadWindow& w = pWin[pOrder[i]];
+        T* pOut = pData + pOff[pOrder[i]];
+        TSTime64 tFrom = w.m_tFrom;     // where we read from
+        int nCopy = 0;                  // points copied from the reference window
+        TSTime64 k = 0;                 // index of our first point in the reference data
+        if (pRef && (tFrom < tRefEnd))
+            k = (max(tFrom, pRef->m_tFirst) - pRef->m_tFirst + tDiv - 1) / tDiv;
+        const bool bOverlap = pRef && (tFrom < tRefEnd) && (k < pRef->m_nRead);
+        if (bOverlap)                   // our first point is in the reference data
+        {
+            w.m_tFirst = pRef->m_tFirst + k*tDiv;
+            if (w.m_tFirst < w.m_tUpto)
+            {
+                const TSTime64 nWant = (w.m_tUpto - w.m_tFirst + tDiv - 1) / tDiv;
+                nCopy = static_cast<int>(min<TSTime64>(min<TSTime64>(pRef->m_nRead - k, nWant), w.m_nMax));
+                memcpy(pOut, pRefData + k, nCopy*sizeof(T));
+            }
+            tFrom = tRefEnd;            // continue after the copied data
+        }
+
+        int nRead = 0;
+        if (!bOverlap || ((nCopy > 0) && (w.m_tFirst + nCopy*tDiv == tRefEnd) &&
+                          (nCopy < w.m_nMax) && (tFrom < w.m_tUpto)))
+        {
+            TSTime64 tFirst;
+            nRead = file.ReadWave(chan, pOut + nCopy, w.m_nMax - nCopy, tFrom, w.m_tUpto, tFirst, pFilter);
+            if (nRead < 0)
+                return nRead;
+            if (!bOverlap)
+                w.m_tFirst = tFirst;
+            else if ((nRead > 0) && (tFirst != tRefEnd))
+                nRead = 0;              // there is a gap, so the window ends at the copy
+        }
+        w.m_nRead = nCopy + nRead;
+        if (w.m_nRead == 0)
+            w.m_tFirst = -1;
+        else if (!pRef || (w.m_tFirst + w.m_nRead*tDiv > tRefEnd))
+        {
+            pRef = &w;
+            pRefData = pOut;
+            tRefEnd = w.m_tFirst + w.m_nRead*tDiv;
+        }
+    }
+    return S64_OK;
+}
+
+//! Read all the channels in a batch, using several threads if there is more than one channel
+/*!
+\param order    The sorted windows.
+\param fn       Called with the list of windows for each channel, returns 0 or an error.
+\return         S64_OK (0) or the first negative error code.
+*/
+template <typename F>
+static int ReadGroups(const CWindowOrder& order, const F& fn)
+{
+    const size_t nGroups = order.Groups();
+    atomic<size_t> nextGroup(0);        // the next channel to read
+    atomic<int> firstErr(0);            // the first error we detect
+    auto worker = [&]()
+    {
+        size_t g;
+        while ((g = nextGroup++) < nGroups)
+        {
+            int err = fn(order.Group(g), order.GroupSize(g));
+            int expect = 0;
+            if (err)
+                firstErr.compare_exchange_strong(expect, err);
+        }
+    };
+
+    const size_t nThreads = min<size_t>(nGroups, max(1u, thread::hardware_concurrency()));
+    vector<thread> vThreads;
+    for (size_t i = 1; i < nThreads; ++i)
+        vThreads.emplace_back(worker);
+    worker();                           // this thread does its share
+    for (auto& t : vThreads)
+        t.join();
+    return firstErr;
+}
+
+//! Read event times for a list of time windows
+/*!
+This gives the same results as calling ReadEvents() for each window, but the windows for
+each channel are read in time order in a single pass, so each data block is read once,
+however the windows overlap. Different channels are read in parallel.
+\param pWin     The list of nWin windows. For each window, set m_chan, m_tFrom, m_tUpto and
+                m_nMax. On return, m_nRead is the number of events read into the window and
+                m_tFirst is the first event time or -1 if there are none.
+\param nWin     The number of windows.
+\param pData    The arena to hold the data. The data for each window is stored after the
+                data for the previous window, allowing space for m_nMax events per window,
+                so this must have space for the sum of the m_nMax values.
+\param pFilter  If the channels are marker or derived types, a filter that limits the events
+                that are read, otherwise nullptr.
+\return         S64_OK (0) or a negative error code. If there is an error, some windows may
+                not have been read.
+*/
+int TSon64File::ReadEventWindows(TReadWindow* pWin, size_t nWin, TSTime64* pData, const CSFilter* pFilter)
+{
+    CWindowOrder order(pWin, nWin);
+    const size_t* pOff = order.Offsets().data();
+    return ReadGroups(order, [&](const size_t* pOrder, size_t n)
+    {
+        return ReadEventGroup(*this, pWin, pOrder, n, pOff, pData, pFilter);
+    });
+}
+
+//! Read waveform data as 16-bit integers for a list of time windows
+/*!
+This gives the same results as calling ReadWave() for each window, but the windows for each
+channel are read in time order in a single pass, so each data block is read once. Where
+windows overlap, the common data is copied rather than read again. Different channels are
+read in parallel.
+\param pWin     The list of nWin windows. For each window, set m_chan, m_tFrom, m_tUpto and
+                m_nMax. On return, m_nRead is the number of contiguous points read into the
+                window and m_tFirst is the time of the first point or -1 if there are none.
+\param nWin     The number of windows.
+\param pData    The arena to hold the data. The data for each window is stored after the
+                data for the previous window, allowing space for m_nMax points per window,
+                so this must have space for the sum of the m_nMax values.
+\param pFilter  If the channels are AdcMark, a filter that limits the data that is read,
+                otherwise nullptr.
+\return         S64_OK (0) or a negative error code. If there is an error, some windows may
+                not have been read.
+*/
+int TSon64File::ReadWaveWindows(TReadWindow* pWin, size_t nWin, short* pData, const CSFilter* pFilter)
+{
+    CWindowOrder order(pWin, nWin);
+    const size_t* pOff = order.Offsets().data();
+    return ReadGroups(order, [&](const size_t* pOrder, size_t n)
+    {
+        return ReadWaveGroup(*this, pWin, pOrder, n, pOff, pData, pFilter);
+    });
+}
+
+//! Read waveform data as floats for a list of time windows
+/*!
+This is the same as the short version of ReadWaveWindows(), but the data is read as user
+units, as for ReadWave().
+*/
+int TSon64File::ReadWaveWindows(TReadWindow* pWin, size_t nWin, float* pData, const CSFilter* pFilter)
+{
+    CWindowOrder order(pWin, nWin);
+    const size_t* pOff = order.Offsets().data();
+    return ReadGroups(order, [&](const size_t* pOrder, size_t n)
+    {
+        return ReadWaveGroup(*this, pWin, pOrder, n, pOff, pData, pFilter);
+    });
+}
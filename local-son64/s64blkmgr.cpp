@@ -24,8 +24,10 @@
 //! \brief Code to manage a data block and the list of indices that locate it on disk.
 
 #include <assert.h>
+#include <algorithm>
 #include "s64priv.h"
 #include "s64chan.h"
+#include "s64idx.h"
 #include <iostream>
 
 using namespace ceds64;
@@ -39,10 +41,29 @@ using namespace std;
 CBlockManager::CBlockManager(CSon64Chan& rChan)
     : m_chan( rChan )
     , m_nBlock( -1 )
+    , m_pFlat( nullptr )
+    , m_nFlat( 0 )
+    , m_pHead( &rChan.m_chanHead )          // these are constructed before the channel...
+    , m_pAppend( &rChan.m_vAppend )         // ...constructs its block manager
 {
     // Warning: rChan must not be used in constructor as may be partially constructed
 }
 
+//! Set the channel head and write index blocks that we work from
+/*!
+A block manager usually works from the state of its channel, which changes as data is
+written, so you must hold the channel mutex to use it. A block manager used for a snapshot
+read works from copies made at the time of the snapshot, so it can be used without the
+channel mutex. Whatever we hold must be found again.
+\param head     The channel head to use. It must exist for as long as we use it.
+\param vAppend  The write index blocks to use. It must exist for as long as we use it.
+*/
+void CBlockManager::SetView(const TChanHead& head, const VIndex& vAppend)
+{
+    m_pHead = &head;
+    m_pAppend = &vAppend;
+}
+
 // Utility to read a disk lookup block into m_vIndex[i].
 int CBlockManager::ReadIndex(CIndex& index, TDiskOff pos)
 {
@@ -54,7 +75,11 @@ int CBlockManager::ReadIndex(CIndex& index, TDiskOff pos)
         if (!index.GetTable()->Verify())
             index.GetTable()->Dump();
 #endif
-        assert((index.GetTable()->m_nItems <= DLUItems) && (index.GetTable()->m_nItems > 0));
+        // The items are used as array indices, so check them in all builds. A snapshot read
+        // can meet an index block that is being rewritten.
+        const unsigned int nItems = index.GetTable()->m_nItems;
+        if ((nItems > DLUItems) || (nItems == 0))
+            return CORRUPT_FILE;
         index.SetDiskOffset(pos);  // item is now up to date
     }
     return err;
@@ -105,8 +130,9 @@ void CBlockManager::UpdateData(const CDataBlock& block)
 int CBlockManager::ReadDataBlock(TDiskOff pos)
 {
     assert(m_pDB &&                         // Trap stupid errors
-           (m_vIndex[0].GetLevel() == 1) && // Make sure table seems OK
-           ((pos & (DBSize-1)) == 0));      // Not completely bad read - release test?
+           (m_pFlat || (m_vIndex[0].GetLevel() == 1))); // Make sure table seems OK
+    if ((pos <= 0) || (pos & (DBSize-1)))   // Not completely bad read
+        return CORRUPT_FILE;
     if (pos == m_pDB->DiskOff())            // if we already have it...
         return 0;                           // ...we are done, no read needed
 
@@ -130,7 +156,7 @@ void CBlockManager::CalcReuse(size_t nLevel)
     m_vReuse.resize(nLevel);                // clears if not reusing
     if (nLevel)
     {
-        uint64_t nLeft = m_chan.m_chanHead.m_nBlocks-1; // highest valid index
+        uint64_t nLeft = m_pHead->m_nBlocks-1;  // highest valid index
         for (auto& n : m_vReuse)
         {
             n = (nLeft % DLUItems) + 1;     // items in last block at this level
@@ -147,6 +173,11 @@ routine sort it all out.
 */
 void CBlockManager::BlockAdded()
 {
+    if (m_pFlat)                        // the index file table is now out of date
+    {
+        SetFlat(nullptr, 0);
+        return;
+    }
     if ((m_nBlock >= 0) && !m_vReuse.empty())
     {
         for (auto& n : m_vReuse)
@@ -164,7 +195,8 @@ void CBlockManager::BlockAdded()
 
 //! Load the block manager with a block that includes a nominated time.
 /*!
-You MUST hold the channel mutex to perform this operation.
+You MUST hold the channel mutex to perform this operation, unless we work from a snapshot
+of the channel (see SetView()).
 
 m_vIndex holds one or more index blocks. Index 0 holds a list of disk offsets of data
 blocks. Higher indexes hold lists of disk offsets to index blocks. The final index is
@@ -176,16 +208,26 @@ in which case m_nBlock will be set negative to force a reload.
 We must also allow for reuse of a channel. In this case the disk index blocks will refer
 to blocks that have not yet been used, so must not be used for searches for data.
 
+A ring archive channel that has wrapped is a special case of reuse. The blocks that have
+not yet been reused hold the oldest data, so if tFind is before the first reused block we
+search them, treating the oldest block as the start of the channel.
+
+If blocks were dropped from the start of the channel, the index items that lead to them
+must not be used, so the search starts at block m_nFirstBlock. The ring archive case uses
+the same mechanism with the oldest block as the start.
+
 \param tFind The time to search for. Get the first block that holds it or a later time.
 \return    0 if the block is found, 1 if no block holds data, -ve for error.
 */
 int CBlockManager::LoadBlock(TSTime64 tFind)
 {
-    if (m_chan.m_chanHead.m_nBlocks == 0)  // can do nothing if nothing is written
+    if (m_pHead->m_nBlocks == 0)    // can do nothing if nothing is written
         return 1;                   // no block holds any data
+    if (m_pFlat)                    // if we have the table from the index file...
+        return LoadFlat(tFind);     // ...we need not read the index blocks
 
     // bReuse will be true if we are reusing previously allocated blocks
-    bool bReuse = m_chan.m_chanHead.ReusingBlocks(); 
+    bool bReuse = m_pHead->ReusingBlocks(); 
 
     int err = 0;
 
@@ -193,7 +235,7 @@ int CBlockManager::LoadBlock(TSTime64 tFind)
     // a writing operation has increased the number of data levels.
     if (m_nBlock < 0)               // must read the entire chain in block by block
     {
-        size_t n = m_chan.DepthFor();
+        size_t n = CSon64Chan::DepthFor(*m_pHead);
         m_vIndex.clear();           // remove memory of previous data (fixes reusing bug)
         m_vIndex.resize(n);         // make sure we have the correct size
         CalcReuse(bReuse ? n : 0);  // recalculate reuse indices (if needed)
@@ -203,14 +245,23 @@ int CBlockManager::LoadBlock(TSTime64 tFind)
     // We could reuse the m_indexReuse member of CIndex and eliminate m_vReuse.
     assert(!bReuse || (m_vReuse.size() == m_vIndex.size()));
 
-    const VIndex& wrIndex = m_chan.m_vAppend;   // local ref to save typing
+    const VIndex& wrIndex = *m_pAppend;     // local ref to save typing
     bool bHasWrite = wrIndex.size() == m_vIndex.size();
 
     // Values used when bReuse is true to work out actual block to use
     int iReuseIndex = (int)m_vIndex.size();     // if reusing, m_vReuse index +1
 
+    // Values used to skip blocks before the start of the channel, which is the first block
+    // in use, or the oldest block of a wrapped ring archive channel.
+    const bool bRing = m_pHead->RingOldLap();
+    uint64_t nLow = m_pHead->m_nFirstBlock; // the first block we can use
+    bool bOnEdge = nLow > 0;        // set while following the path to the first block
+    uint64_t nDiv = 1;              // blocks per index item at the current level
+    for (size_t i = 1; i < m_vIndex.size(); ++i)
+        nDiv *= DLUItems;
+
     // Fill in the lookup table for all blocks that are not already read.
-    TDiskOff doLast = m_chan.m_chanHead.m_doIndex; // first index block to read
+    TDiskOff doLast = m_pHead->m_doIndex;   // first index block to read
     uint64_t nBlock = 0;            // to build the block number
     unsigned int ub = 0;            // Parent index of index blocks
     auto wit = wrIndex.rbegin();    // iterator to the reverse list of write blocks
@@ -233,18 +284,40 @@ int CBlockManager::LoadBlock(TSTime64 tFind)
                  (it->GetDiskOffset() != doLast))   // ...doesn't match
         {
             err = ReadIndex(*it, doLast);   // update the index entry
+            if (err)
+                break;
             it->SetParentIndex(ub);         // in case not set due to bug in old versions
             bHasWrite = false;              // Tree must match all the way, so no longer using it.
         }
 
-        // If reusing blocks and still at the end (if we are not at the end, then all the
-        // blocks are full, so no need to reduce the counts), limit the indices used.
-        size_t nBlockSize = bReuse ? m_vReuse[--iReuseIndex] : 0;
-        ub = it->UpperBound(tFind, nBlockSize); // find first entry past
-        if (ub)                             // leave 0 alone...
-            --ub;                           // ...else decrement
-        if (bReuse && (ub < nBlockSize-1))  // if not the last block, then...
+        // The first item of the top block is the start of the reused blocks of a ring
+        if (bRing && (it == m_vIndex.rbegin()) && (tFind < it->GetTable()->m_items[0].m_time))
+        {
+            nLow = m_pHead->m_nBlocks;      // tFind is before the reused blocks, so...
+            bOnEdge = true;                 // ...start at the oldest block...
+            bReuse = false;                 // ...and the reused counts are not wanted
+        }
+
+        // While on the path to the first block, the items before the edge item are not used.
+        // The edge item is used if tFind is before all the later items. If reusing blocks and
+        // still at the end (if we are not at the end, then all the blocks are full, so no need
+        // to reduce the counts), limit the indices used.
+        const TDiskLookup& dlu = *it->GetTable();
+        const unsigned int lo = bOnEdge ? static_cast<unsigned int>((nLow / nDiv) % DLUItems) : 0;
+        const unsigned int hi = bReuse ? m_vReuse[--iReuseIndex] : dlu.m_nItems;
+        if (hi <= lo)                       // the index does not match the head
+        {
+            err = CORRUPT_FILE;
+            break;
+        }
+        auto itUB = std::upper_bound(dlu.m_items.begin() + lo + 1, dlu.m_items.begin() + hi, tFind,
+                                     [](TSTime64 t, const TDiskTableItem& item){return t < item.m_time;});
+        ub = static_cast<unsigned int>(itUB - dlu.m_items.begin()) - 1;
+        if (ub != lo)                       // off the edge, so all later items are usable
+            bOnEdge = false;
+        if (ub+1 != hi)                     // if not the last block, then...
             bReuse = false;                 // ...no need to mess with indices
+        nDiv /= DLUItems;
 
         doLast = it->GetTable()->m_items[ub].m_do;
         assert(doLast != 0);
@@ -287,12 +360,22 @@ sequence and we check for being off the end of the used blocks.
 int CBlockManager::NextBlock(unsigned int i)
 {
     assert(m_nBlock >= 0);                  // if this fires, another thread has written
+    if (m_pFlat)                            // the index file table has all the blocks
+        return LoadFlatNumbered(static_cast<uint64_t>(m_nBlock+1));
     size_t n;                               // the index to increment
     if (i == 0)
     {
         assert(m_pDB && !m_vIndex.empty());  // madness check
-        // if we are at the end...
-        if (static_cast<uint64_t>(m_nBlock+1) >= m_chan.m_chanHead.m_nBlocks)
+        const TChanHead& ch = *m_pHead;
+        const uint64_t nNext = static_cast<uint64_t>(m_nBlock+1);
+        if (ch.RingOldLap())                // a ring archive holding data from before it wrapped
+        {
+            if (nNext == ch.m_nBlocks)      // the next block is the oldest...
+                return 1;                   // ...so we are at the end
+            if (nNext == ch.m_nAllocatedBlocks) // the last old block is followed...
+                return LoadNumbered(0);     // ...by the first reused block
+        }
+        else if (nNext >= ch.m_nBlocks)     // if we are at the end...
             return 1;                        // ...then we are done
         TDataBlock* pb = m_pDB->DataBlock(); // saves typing
         assert(pb->GetParentBlock() == m_vIndex[0].GetDiskOffset());
@@ -310,7 +393,7 @@ int CBlockManager::NextBlock(unsigned int i)
 
     // We must be careful when reading indices as there may be a write buffer associated
     // with the channel. If there is, we must use the write buffer version of any index.
-    bool bHasWr = m_chan.m_vAppend.size() == m_vIndex.size();
+    bool bHasWr = m_pAppend->size() == m_vIndex.size();
     int err = 0;
     TDiskLookup* pLU = m_vIndex[i].GetTable();
     if (pLU->m_nItems <= n + 1)             // if this will pass the end...
@@ -324,14 +407,14 @@ int CBlockManager::NextBlock(unsigned int i)
             TDiskLookup* pLU1 = m_vIndex[i+1].GetTable();   // next layer up table
             assert(pLU1->m_nItems);                         // madness check
             TDiskOff doRead = pLU1->m_items[n1].m_do;       // the block to read
-            if (bHasWr && (m_chan.m_vAppend[i].GetDiskOffset() == doRead))
-                m_vIndex[i] = m_chan.m_vAppend[i];
+            if (bHasWr && ((*m_pAppend)[i].GetDiskOffset() == doRead))
+                m_vIndex[i] = (*m_pAppend)[i];
             else
             {
                 err = ReadIndex(m_vIndex[i], doRead);
                 m_vIndex[i].SetParentIndex(n1); // in case it is not set
             }
-            assert(n1 == m_vIndex[i].GetParentIndex());
+            assert(err || (n1 == m_vIndex[i].GetParentIndex()));
         }
         n = 0;                              // start at first item
     }
@@ -364,11 +447,21 @@ sequence and we check for being off the end of the used blocks.
 int CBlockManager::PrevBlock(unsigned int i)
 {
     assert(m_nBlock >= 0);                  // if this fires, another thread has written
+    if (m_pFlat)                            // the index file table has all the blocks
+        return (m_nBlock > 0) ? LoadFlatNumbered(static_cast<uint64_t>(m_nBlock-1)) : 1;
     size_t n;                               // the index to decrement
     if (i == 0)
     {
         assert(m_pDB && !m_vIndex.empty()); // madness check
-        if (m_nBlock == 0)                  // if we are at the start...
+        const TChanHead& ch = *m_pHead;
+        if (ch.RingOldLap())                // a ring archive holding data from before it wrapped
+        {
+            if (static_cast<uint64_t>(m_nBlock) == ch.m_nBlocks)   // the oldest block...
+                return 1;                   // ...is the start
+            if (m_nBlock == 0)              // the first reused block follows...
+                return LoadNumbered(ch.m_nAllocatedBlocks-1);   // ...the last old block
+        }
+        else if (static_cast<uint64_t>(m_nBlock) == ch.m_nFirstBlock)  // if we are at the start...
             return 1;                       // ...then we are done
         TDataBlock* pb = m_pDB->DataBlock(); // saves typing
         assert(pb->GetParentBlock() == m_vIndex[0].GetDiskOffset());
@@ -426,6 +519,106 @@ int CBlockManager::PrevBlock(unsigned int i)
     return err;
 }
 
+//! Load the data block at a position in the channel index
+/*!
+You MUST hold the channel mutex. This is used to move between the last and the first block
+of a ring archive channel, which are not next to each other in the index tree.
+\param nBlock The index of the block in the channel, which must be less than the number of
+              blocks allocated to the channel.
+\return       0 if the block was read, else a negative error code.
+*/
+int CBlockManager::LoadNumbered(uint64_t nBlock)
+{
+    if (m_pFlat)
+    {
+        int err = LoadFlatNumbered(nBlock);
+        return (err > 0) ? BAD_PARAM : err;
+    }
+    const size_t nLevels = CSon64Chan::DepthFor(*m_pHead);
+    if (m_vIndex.size() != nLevels)         // the tree has changed, so...
+    {
+        m_vIndex.resize(nLevels);           // ...start again
+        CalcReuse(m_pHead->ReusingBlocks() ? nLevels : 0);
+    }
+    const VIndex& wrIndex = *m_pAppend;
+    const bool bHasWrite = wrIndex.size() == nLevels;
+
+    uint64_t nDiv = 1;                      // blocks per index item at the top level
+    for (size_t i = 1; i < nLevels; ++i)
+        nDiv *= DLUItems;
+
+    int err = 0;
+    TDiskOff doLast = m_pHead->m_doIndex;   // first index block to read
+    unsigned int ub = 0;                    // Parent index of index blocks
+    for (size_t level = nLevels; (err == 0) && (level-- > 0); nDiv /= DLUItems)
+    {
+        CIndex& index = m_vIndex[level];
+        if (bHasWrite && (wrIndex[level].GetDiskOffset() == doLast))
+            index = wrIndex[level];         // the write version may not be on disk yet
+        else
+        {
+            err = ReadIndex(index, doLast);
+            index.SetParentIndex(ub);       // in case not set due to bug in old versions
+        }
+        ub = static_cast<unsigned int>((nBlock / nDiv) % DLUItems);
+        doLast = index.GetTable()->m_items[ub].m_do;
+    }
+
+    if (err == 0)
+        err = ReadDataBlock(doLast);
+    m_nBlock = err ? -1 : static_cast<int64_t>(nBlock);
+    return err;
+}
+
+//! Use a block table from the index file in place of the channel index
+/*!
+You MUST hold the channel mutex. The table must list every block in use by the channel,
+starting at TChanHead::m_nFirstBlock, in index order. Once set, the index blocks are not
+read; the table is dropped if a block is added to the channel.
+\param pFlat    The table or nullptr to go back to using the channel index.
+\param nFlat    The number of items in the table.
+*/
+void CBlockManager::SetFlat(const TIdxBlock* pFlat, uint64_t nFlat)
+{
+    m_pFlat = nFlat ? pFlat : nullptr;
+    m_nFlat = m_pFlat ? nFlat : 0;
+    m_nBlock = -1;                          // whatever we hold must be found again
+}
+
+//! Load the block manager with a block that includes a time, using the index file table
+/*!
+You MUST hold the channel mutex. This does the same job as LoadBlock() with a search of the
+table in memory and a single data block read.
+\param tFind The time to search for. Get the first block that holds it or a later time.
+\return    0 if the block is found, 1 if no block holds data, -ve for error.
+*/
+int CBlockManager::LoadFlat(TSTime64 tFind)
+{
+    auto it = std::upper_bound(m_pFlat + 1, m_pFlat + m_nFlat, tFind,
+                               [](TSTime64 t, const TIdxBlock& b){return t < b.m_time;});
+    int err = LoadFlatNumbered(m_pHead->m_nFirstBlock + static_cast<uint64_t>(it - m_pFlat) - 1);
+    if ((err == 0) && (m_pDB->LastTime() < tFind))  // if block does not have wanted data...
+        err = NextBlock();                  // ...we want the next block
+    return err;
+}
+
+//! Load the data block at a position in the channel index, using the index file table
+/*!
+You MUST hold the channel mutex.
+\param nBlock The index of the block in the channel.
+\return       0 if the block was read, 1 if the channel has no such block, else a negative
+              error code.
+*/
+int CBlockManager::LoadFlatNumbered(uint64_t nBlock)
+{
+    const uint64_t nFirst = m_pHead->m_nFirstBlock;
+    if ((nBlock < nFirst) || (nBlock - nFirst >= m_nFlat))
+        return 1;
+    int err = ReadDataBlock(m_pFlat[nBlock - nFirst].m_do);
+    m_nBlock = err ? -1 : static_cast<int64_t>(nBlock);
+    return err;
+}
+
 //! Save this data block if it exists, has a known disk address and is modified
 /*!
 If this block is modified, write it to disk (as long as it exists etc). This is only
@@ -441,6 +634,7 @@ int CBlockManager::SaveIfUnsaved()
         return 0;                           // ...we are done
     assert(m_vIndex[0].GetLevel() == 1);    // just to be sure we are not insane
     TDataBlock* pb = m_pDB->DataBlock();
+    ++m_chan.m_nRewrite;                    // snapshot reads may have the old data
     int err = m_chan.m_file.Write(pb, DBSize, pos);
     m_pDB->SetSaved();
     return err;
@@ -461,7 +655,7 @@ no write buffer, so all we need do if fix, if needed, the index blocks.
 int CBlockManager::FixIndex()
 {
     m_nBlock = -1;                  // force re-read after we mess about
-    unsigned int n = m_chan.DepthFor();
+    unsigned int n = CSon64Chan::DepthFor(*m_pHead);
     if (n < 2)                      // If not two levels there can be no problem
         return 1;                   // too small to have a problem
 
@@ -470,7 +664,7 @@ int CBlockManager::FixIndex()
 
     // Fill in the lookup table so that we have the index for block DLUItems (0-based)
     // loaded. There is no point starting at 0, as we cannot tell if this is bad or not.
-    TDiskOff doLast = m_chan.m_chanHead.m_doIndex; // first index block to read
+    TDiskOff doLast = m_pHead->m_doIndex;   // first index block to read
     for (int i = n - 1; i >= 0; --i)            // fill from the end to match other use
     {
         int err = ReadIndex(m_vIndex[i], doLast);   // update the index entry
@@ -511,7 +705,7 @@ int CBlockManager::PatchIndex(unsigned int level, unsigned int uiParent)
 
         // If reusing we must scan until we see a zero in the table as m_nItems relates to the
         // items in use, not the total we have.
-        const unsigned int nTest = m_chan.m_chanHead.ReusingBlocks() ? DLUItems+1 : dlu.m_nItems;
+        const unsigned int nTest = m_pHead->ReusingBlocks() ? DLUItems+1 : dlu.m_nItems;
         for (unsigned int i = 0; (i < nTest) && dlu.m_items[i].m_do && !err; ++i)
         {
             int err = ReadIndex(lower, dlu.m_items[i].m_do);
@@ -22,6 +22,7 @@
 #include <assert.h>
 #include "s64priv.h"
 #include "s64chan.h"
+#include "s64io.h"
 #include <iostream>
 
 using namespace ceds64;
@@ -55,10 +56,9 @@ TDiskLookup::TDiskLookup()
                 DLUItems if the table is already full or a negative error code, being
                 CORRUPT_FILE if time is not greater than the last item in the lookup.
 
- It turns out that added data should be at a position that is after previous data. We
- do not (currently) check for this, but it does seem to be a consequence of how the data
- is written, and we could enforce this (here) if we wanted to. Having items in physical
- disk order does help when attempting to fix a damaged file.
+ Added data is usually at a position that is after previous data, which does help when
+ attempting to fix a damaged file. However, blocks taken from the free block map can lie
+ before the previous data, so this is not checked.
 */
 int TDiskLookup::AddIndexItem(TDiskOff pos, TSTime64 time)
 {
@@ -71,7 +71,6 @@ int TDiskLookup::AddIndexItem(TDiskOff pos, TSTime64 time)
             assert(false);              // if debugging, warn of serious error
             return CORRUPT_FILE;
         }
-        assert(m_items[m_nItems-1].m_do < pos);
     }
     m_items[m_nItems].m_do = pos;       // set new values
     m_items[m_nItems].m_time = time;
@@ -293,17 +292,54 @@ TChanHead::TChanHead()
     , m_dYLow( -1.0 )
     , m_dYHigh( 1.0 )
     , m_flags( 0 )
+    , m_nRingBlocks( 0 )        // not a ring archive
+    , m_nFirstBlock( 0 )        // no blocks dropped
 {
     m_pad.fill(0);              // fill in the padding (added Feb, 2015)
+    ClearStats();               // no data, so the summary is valid
+}
+
+//! Combine the summary of later data into this summary
+/*!
+\param rhs  The summary of data that starts after the data summarised by this object.
+*/
+void TChanStats::Add(const TChanStats& rhs)
+{
+    if (rhs.m_nItems == 0)
+        return;
+    if (m_nItems == 0)
+    {
+        *this = rhs;
+        return;
+    }
+    m_nItems += rhs.m_nItems;
+    m_tLast = rhs.m_tLast;
+    m_dMin = std::min(m_dMin, rhs.m_dMin);
+    m_dMax = std::max(m_dMax, rhs.m_dMax);
+}
+
+//! Set the data summary for a channel with no data on disk
+void TChanHead::ClearStats()
+{
+    m_stats.Clear();
+    m_statsBase.Clear();
+    m_flags |= ChanFlag_Stats;
 }
 
 //! Empty the channel head for reuse
 /*!
 We want to reuse a channel, preserving all the current state except to state that the
-channel now has no data. If the channel had any data we increment m_chanID.
+channel now has no data. If the channel had any data we increment m_chanID. If blocks
+were dropped from the start of the channel, the index cannot be reused, so we start a new
+one. The caller should have passed the blocks still in use to the free block map.
 */
 void TChanHead::EmptyForReuse()
 {
+    if (m_nFirstBlock)                      // if blocks were dropped from the start...
+    {
+        m_doIndex = 0;                      // ...forget the index and the blocks
+        m_nBlocks = m_nAllocatedBlocks = m_nFirstBlock = 0;
+    }
     if (m_nAllocatedBlocks == 0)			// if we had any blocks in use...
         m_nAllocatedBlocks = m_nBlocks;		// ...we will now reuse them
     m_nBlocks = 0;							// the channel has no blocks
@@ -311,6 +347,8 @@ void TChanHead::EmptyForReuse()
         ++m_chanID;							// ...move ID on to aid recovery
 
     m_lastTime = -1;						// no data in the channel, no last time
+    m_flags &= ~static_cast<uint64_t>(ChanFlag_RingWrap);  // no old ring data to read
+    ClearStats();                           // and nothing to summarise
 }
 
 //! Reset a previously used channel for reuse
@@ -331,6 +369,7 @@ void TChanHead::ResetForReuse()
     m_title = m_units = m_comment = 0;		// caller should have released any strings
     m_tDivide = 0;							// time per value for wave, Wavemark
     m_dRate = 0.0;							// ideal rate
+    m_nRingBlocks = 0;                      // not a ring archive
 }
 
 //! Increment blocks used when resusing blocks
@@ -392,11 +431,15 @@ CSon64Chan::CSon64Chan(TSon64File& file, TChanNum nChan, TDataKind kind)
     , m_bmRead( *this )                     // Warning: ctor must not USE
     , m_chanHead( file.ChanHead(nChan) )    // copy channel head from file
     , m_bModified( kind != m_chanHead.m_chanKind )  // we are setting things
+    , m_nRewrite( 0 )
+    , m_nSnapActive( 0 )
 {
     assert(kind != ChanOff);
     bool bWasInUse = m_chanHead.m_lastKind != ChanOff;
     if (bWasInUse)                          // If the channel was in use...
         ResetForReuse();                    // ...let it go
+    if (m_bModified && (m_chanHead.m_nBlocks == 0)) // a new channel...
+        m_chanHead.ClearStats();            // ...has a valid (empty) data summary
     m_chanHead.m_chanKind = kind;
 
     // Insist that the strings exist or are empty
@@ -431,6 +474,7 @@ int CSon64Chan::Delete()
     if (err == 0)
     {
         TChanLock lock(m_mutex);
+        ++m_nRewrite;                   // the blocks may be reused
         m_pWr.reset();                  // free up any write buffer
         m_bModified |= m_chanHead.Delete();
     }
@@ -504,9 +548,17 @@ int CSon64Chan::EmptyForReuse()
 {
     if (m_chanHead.IsUnused())
         return NO_CHANNEL;
+    ++m_nRewrite;                           // the blocks will be reused
 
     // We must get the append list written to disk before we clear it (to restart use)
     int iErr = Commit();                    // get the lookup table written
+    vector<TDiskOff> vDO;                   // blocks we no longer own
+    if (m_chanHead.m_nFirstBlock)           // the index cannot be reused...
+    {
+        int locErr = CollectLiveBlocks(vDO);    // ...so let other channels have the blocks
+        if (iErr == 0)
+            iErr = locErr;
+    }
     m_vAppend.clear();                      // force it to reload the list
     m_bmRead.Invalidate();                  // next use must reread
     if (m_pWr)
@@ -514,6 +566,9 @@ int CSon64Chan::EmptyForReuse()
     m_chanHead.EmptyForReuse();
     m_st.Reset();                           // forget about save/no save times
     m_bModified = true;                     // Header needs writing
+    int locErr = ReleaseBlocks(vDO);        // writes the header first
+    if (iErr == 0)
+        iErr = locErr;
     return iErr;
 }
 
@@ -535,6 +590,7 @@ int CSon64Chan::ResetForReuse()
 {
     if (m_chanHead.IsUsed())	            // Channel must not be in use...
         return CHANNEL_USED;                // ...else this is an error
+    ++m_nRewrite;                           // the blocks will be reused
 
     // Release any used strings (not done by delete). Strings are zeroed by TChanHead
     m_file.m_ss.Sub(m_chanHead.m_title);
@@ -899,6 +955,46 @@ int CSon64Chan::SaveAppendIndex(int level)
     return 0;
 }
 
+//! Write all the modified Append items to disk in one batch
+/*!
+This has the same effect as calling SaveAppendIndex() for each level, but the writes are
+passed to the OS together. You must hold the channel mutex.
+\param pData Either nullptr or a data block write to add to the batch (see AppendBlock()).
+\return      0 if OK, or a negative error if a write fails. If any write fails, no level
+             is marked as saved.
+*/
+int CSon64Chan::SaveAppendIndices(const TIOReq* pData)
+{
+    vector<TIOReq> vReq;
+    if (pData)
+        vReq.push_back(*pData);
+    vector<int> vLevel;                 // the level of each write
+    for (int level = 0; level < (int)m_vAppend.size(); ++level)
+    {
+        if (m_vAppend[level].IsModified())
+        {
+#ifdef DEBUG
+            if (!m_vAppend[level].GetTable()->Verify())
+                m_vAppend[level].GetTable()->Dump();
+#endif
+            vReq.emplace_back(m_vAppend[level].GetTable(), DLSize, m_vAppend[level].GetDiskOffset());
+            vLevel.push_back(level);
+        }
+    }
+    if (vReq.empty())
+        return 0;
+
+    int err = m_file.WriteBatch(vReq.data(), vReq.size());
+    if (err)
+        return err;
+    for (int level : vLevel)
+    {
+        m_vAppend[level].ClearModified();
+        m_bmRead.UpdateIndex(level, m_vAppend[level]); // tell read stack of change
+    }
+    return 0;
+}
+
 //! Add an index item into the index table
 /*!
  Given the disk offset at which we are to add the block and the time of the first
@@ -975,9 +1071,11 @@ int CSon64Chan::AddIndexItem(TDiskOff doItem, TSTime64 time, unsigned int level)
  and assume that all the block tracking stuff is already done.
  \param pBlock  Points at the data block to be written. If the disk offset is already
                 set we just update it, otherwise we append a new disk block to the channel.
+ \param bWithIndex If true, the block is written in one batch with the modified Append
+                index blocks, as SaveAppendIndices(). This is used by Commit().
  \return 0 if no error detected or an error code.
 */
-int CSon64Chan::AppendBlock(CDataBlock* pBlock)
+int CSon64Chan::AppendBlock(CDataBlock* pBlock, bool bWithIndex)
 {
     int err = 0;
     if (pBlock->size() == 0)           // if no data, don't waste our time
@@ -988,12 +1086,24 @@ int CSon64Chan::AppendBlock(CDataBlock* pBlock)
 
     TDiskOff doWrite = pBlock->DiskOff();   // already allocated space?
     bool bUpdate = doWrite != 0;            // remember, as must tell read block manager
- 
+    bool bReused = false;                   // set if we overwrite a block of older data
+
+    // A full ring archive channel goes back to reuse its blocks from the first one
+    if (!doWrite && m_chanHead.m_nRingBlocks && !m_chanHead.ReusingBlocks() &&
+        (m_chanHead.m_nBlocks >= m_chanHead.m_nRingBlocks))
+    {
+        err = WrapRing();
+        if (err)
+            return err;
+    }
+
     // If we are reusing channel space, just grab the next block. If update of existing
     // we must preserve the parent block index.
     unsigned int uiParentIndex = bUpdate ? pBlock->GetParentIndex() : 0;
     if (!doWrite && m_chanHead.ReusingBlocks())
     {
+        if (m_chanHead.RingOldLap())        // the oldest ring data is about to go...
+            InvalidateStats();              // ...so the summary must be made again
         // We are appending. m_vAppend is our chain of blocks to the current last block,
         // and if it is not empty, it is assumed valid. If it is empty, we must load it up.
         // If it is not empty, we move on to the next block except for the special case of
@@ -1010,6 +1120,7 @@ int CSon64Chan::AppendBlock(CDataBlock* pBlock)
         {
             m_chanHead.IncReusedBlocks();   // we have used another block, may end reuse
             uiParentIndex = m_vAppend[0].GetReuseIndex();
+            bReused = true;
         }
     }
 
@@ -1017,7 +1128,10 @@ int CSon64Chan::AppendBlock(CDataBlock* pBlock)
     if (!doWrite)                           // if not already allocated disk space
     {
         assert(pBlock->FirstTime() >= m_chanHead.m_lastTime);   // == means a duplicated time
-        doWrite = m_file.AllocateDiskBlock();  // set first block position
+        TDiskOff doNear = 0;                // our last block, to keep the channel together
+        if (!m_vAppend.empty() && m_vAppend[0].Items())
+            doNear = m_vAppend[0].GetTable()->m_items[m_vAppend[0].Items()-1].m_do;
+        doWrite = m_file.AllocateDiskBlock(doNear);  // set first block position
         if (!doWrite)
             return NO_BLOCK;
         ++m_chanHead.m_nBlocks;				// we have another block
@@ -1052,21 +1166,60 @@ int CSon64Chan::AppendBlock(CDataBlock* pBlock)
 #endif
 
     pBlock->m_chanID = m_chanHead.m_chanID; // ensure latest channel ID used
-    err = m_file.Write(pBlock->DataBlock(), DBSize, doWrite);
+    if (bWithIndex)
+    {
+        const TIOReq req(pBlock->DataBlock(), DBSize, doWrite);
+        err = SaveAppendIndices(&req);
+    }
+    else
+        err = m_file.Write(pBlock->DataBlock(), DBSize, doWrite);
     if (err == 0)
     {
+        if (m_chanHead.StatsValid())        // keep the data summary up to date
+        {
+            if (!bUpdate)                   // a new last block, so...
+                m_chanHead.m_statsBase = m_chanHead.m_stats;  // ...the old last block is in the base
+            TChanStats block;
+            pBlock->GetStats(block, m_chanHead.m_chanKind, m_chanHead.m_nRows*m_chanHead.m_nColumns);
+            m_chanHead.m_stats = m_chanHead.m_statsBase;
+            m_chanHead.m_stats.Add(block);
+        }
         m_chanHead.m_lastTime = pBlock->LastTime();
         m_file.ExtendMaxTime(m_chanHead.m_lastTime);
         m_bModified = true;                 // Disk version of channel is modified
         pBlock->SetSaved();                 // clear the unsaved flag
 
-        if (bUpdate)                        // if already on disk...
+        if (bUpdate || bReused)             // if already on disk...
             m_bmRead.UpdateData(*pBlock);   // ...tell the read manager
         m_bmRead.BlockAdded();              // there is a new block
     }
     return err;
 }
 
+//! Start to reuse the blocks of a full ring archive channel
+/*!
+You must hold the channel mutex. The channel is treated as if it was emptied for reuse,
+except that the channel ID is not changed and ChanFlag_RingWrap is set, so the data in
+the blocks that have not yet been reused can still be read. The index blocks are reused
+with the data blocks, so they must be saved first.
+\return S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::WrapRing()
+{
+    for (int i = 0; i < static_cast<int>(m_vAppend.size()); ++i)
+    {
+        int err = SaveAppendIndex(i);   // the reuse code reads these from disk
+        if (err)
+            return err;
+    }
+    m_chanHead.m_nAllocatedBlocks = m_chanHead.m_nBlocks;
+    m_chanHead.m_nBlocks = 0;           // start again at the first block
+    m_chanHead.m_flags |= ChanFlag_RingWrap;
+    m_bModified = true;                 // Header needs writing
+    m_bmRead.Invalidate();              // the read tree must allow for the wrap
+    return S64_OK;
+}
+
 //! Internal routine used to work out index table depth
 /*!
 Given a block count, how many lookup table items do we need. If any blocks are
@@ -1081,7 +1234,18 @@ such as when opening the channel.
 */
 unsigned int CSon64Chan::DepthFor()
 {
-    uint64_t nBlock = max(m_chanHead.m_nAllocatedBlocks, m_chanHead.m_nBlocks);
+    return DepthFor(m_chanHead);
+}
+
+//! Get the index table depth needed for the blocks of a channel head
+/*!
+This is the same as DepthFor() for a copy of a channel head, as used by snapshot reads.
+\param ch The channel head.
+\return   The required index table depth
+*/
+unsigned int CSon64Chan::DepthFor(const TChanHead& ch)
+{
+    uint64_t nBlock = max(ch.m_nAllocatedBlocks, ch.m_nBlocks);
     if (nBlock == 0)
         return 0;
     unsigned int n = 1;
@@ -1262,6 +1426,118 @@ bool CSon64Chan::IsModified() const
     return false;
 }
 
+//! Get the summary statistics of the channel data on disk
+/*!
+You _must not_ be holding the channel mutex to call this. The summary is kept in the
+channel header and is updated as blocks are written. If it is not valid (the file was
+written by an older library, or data was edited) we make it by reading all the blocks
+once, then keep it up to date from then on.
+\param stats    Returned holding the summary. Adc and AdcMark values are in user units.
+\return         S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::GetStats(TChanStats& stats)
+{
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    if (!m_chanHead.StatsValid())
+    {
+        const TDataKind kind = m_chanHead.m_chanKind;
+        const size_t nValues = m_chanHead.m_nRows*m_chanHead.m_nColumns;
+        TChanStats all, base, block;
+        all.Clear();
+        base.Clear();
+        int err = m_bmRead.LoadBlock(0);
+        while (err == 0)
+        {
+            base = all;                 // summary without the last block
+            m_bmRead.DataBlock().GetStats(block, kind, nValues);
+            all.Add(block);
+            err = m_bmRead.NextBlock();
+        }
+        if (err < 0)
+            return err;
+
+        m_chanHead.m_stats = all;
+        m_chanHead.m_statsBase = base;
+        m_chanHead.m_flags |= ChanFlag_Stats;
+        m_bModified = true;             // save the summary if we are writing
+    }
+
+    stats = m_chanHead.m_stats;
+    if (((m_chanHead.m_chanKind == Adc) || (m_chanHead.m_chanKind == AdcMark)) && stats.m_nItems)
+    {
+        const double dScale = m_chanHead.m_dScale/6553.6;
+        stats.m_dMin = stats.m_dMin*dScale + m_chanHead.m_dOffset;
+        stats.m_dMax = stats.m_dMax*dScale + m_chanHead.m_dOffset;
+        if (dScale < 0.0)
+            std::swap(stats.m_dMin, stats.m_dMax);
+    }
+    return S64_OK;
+}
+
+//! Set the number of data blocks kept by a ring archive channel
+/*!
+Once the channel has written this many blocks, each new block replaces the oldest one, so
+the channel keeps the most recent data and the disk space it uses does not grow.
+\param nBlocks The number of data blocks to keep, or 0 to cancel ring mode. This can be
+               changed until the ring first fills and wraps, but it cannot be less than the
+               blocks the channel already owns. Once wrapped, it can only be set to the
+               same value.
+\return        S64_OK (0) or BAD_PARAM.
+*/
+int CSon64Chan::SetRing(uint64_t nBlocks)
+{
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    if (nBlocks == m_chanHead.m_nRingBlocks)
+        return S64_OK;
+    if ((m_chanHead.m_flags & ChanFlag_RingWrap) || (nBlocks && m_chanHead.m_nFirstBlock) ||
+        (nBlocks && (nBlocks < max(m_chanHead.m_nBlocks, m_chanHead.m_nAllocatedBlocks))))
+        return BAD_PARAM;
+    m_chanHead.m_nRingBlocks = nBlocks;
+    m_bModified = true;                 // Header needs writing
+    return S64_OK;
+}
+
+//! Get the number of data blocks kept by a ring archive channel, 0 if not a ring
+uint64_t CSon64Chan::GetRing() const
+{
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    return m_chanHead.m_nRingBlocks;
+}
+
+//! Get the time of the first item in the channel
+/*!
+You _must not_ be holding the channel mutex to call this. For a ring archive channel, this
+moves on as the oldest data is replaced.
+\return The time of the first item, -1 if the channel has no data, or a negative error code.
+*/
+TSTime64 CSon64Chan::MinTime()
+{
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    if (m_chanHead.m_nBlocks)
+    {
+        int err = m_bmRead.LoadBlock(0);
+        if (err < 0)
+            return err;
+        if (err == 0)
+            return m_bmRead.DataBlock().FirstTime();
+    }
+    return (m_pWr && m_pWr->size()) ? m_pWr->FirstTime() : -1;
+}
+
+//! Mark the data summary as out of date after data on disk is edited
+/*!
+You _must_ hold the channel mutex to call this. The summary is made again when it is next
+needed.
+*/
+void CSon64Chan::InvalidateStats()
+{
+    if (m_chanHead.m_flags & ChanFlag_Stats)
+    {
+        m_chanHead.m_flags &= ~static_cast<uint64_t>(ChanFlag_Stats);
+        m_bModified = true;             // Header needs writing
+    }
+}
+
 //! Commit all buffered and committed data to the operating system
 /*!
 You _must not_ be holding the channel mutex to call this.
@@ -1276,18 +1552,15 @@ int CSon64Chan::Commit()
     int err = 0;
 
     if (m_pWr && m_pWr->Unsaved())
-        err = AppendBlock(m_pWr.get()); // will mark as saved
+        err = AppendBlock(m_pWr.get(), true); // will mark as saved, writes the indices with it
 
     // If any read buffer is modified...
     m_bmRead.SaveIfUnsaved();           // save any unsaved modified data
 
     // Write any modified elements of the lookup tree and mark as not modified
-    for (int i = 0; i < (int)m_vAppend.size(); ++i)
-    {
-        int locErr = SaveAppendIndex(i);
-        if (err == 0)                   // We report the first error
-            err = locErr;
-    }
+    int locErr = SaveAppendIndices();
+    if (err == 0)                       // We report the first error
+        err = locErr;
 
     if (m_bModified)                    // if the channel header is modified
     {
@@ -1310,7 +1583,8 @@ the file were closed now.
 uint64_t CSon64Chan::GetChanBytes() const
 {
     TChanLock lock(m_mutex);            // take ownership of the channel
-    uint64_t bytes = m_chanHead.m_nBlocks * DBSize; // used on disk
+    uint64_t nBlocks = m_chanHead.RingOldLap() ? m_chanHead.m_nAllocatedBlocks : m_chanHead.m_nBlocks;
+    uint64_t bytes = (nBlocks - m_chanHead.m_nFirstBlock) * DBSize; // used on disk
     if (m_pWr && m_pWr->size() && m_pWr->Unsaved()) // if a write block pending
         bytes += m_pWr->size()*m_chanHead.m_nObjSize;
     return bytes;
@@ -1495,12 +1769,19 @@ TSTime64 CSon64Chan::PrevNTime(CSRange& r, const CSFilter* pFilter, bool bAsWave
     // should start skipping backwards.
     if (err >= 0)
     {
+        const bool bWave = (ChanKind() == Adc) || (ChanKind() == RealWave);
         do
         {
             TSTime64 t = bAsWave ? m_bmRead.DataBlock().PrevNTimeW(r, pFilter, m_chanHead.m_nRows, m_chanHead.m_tDivide)
                                  : m_bmRead.DataBlock().PrevNTime(r, pFilter);
             if (!r.HasRange())                      // Found, or not possible...
                 return t;                           // ...we are done
+            if (bWave)                              // contiguous data lets us skip the blocks
+            {
+                t = PrevNTimeRun(r);
+                if (!r.HasRange())
+                    return t;
+            }
             if (r.TimeOut())                        // see if we have read enough blocks...
                 return CALL_AGAIN;                  // ...lets run round again, please
             err = m_bmRead.PrevBlock();             // go back one block, err==1 hit the start
@@ -1510,6 +1791,90 @@ TSTime64 CSon64Chan::PrevNTime(CSRange& r, const CSFilter* pFilter, bool bAsWave
     return (err < 0) ? err : -1;                // either an error, or fell off the end
 }
 
+//! Skip back through contiguous waveform data without reading every block
+/*!
+You must hold the channel mutex. This is called from PrevNTime() for a waveform channel when
+the search has reached the start of the current read block, which starts a run of data that
+we want to go back r.Max() more points from. If the data is contiguous, the answer is
+r.Upto() - r.Max()*m_tDivide (or the first point at or after r.From()). To check this, we
+load the block holding the answer and check that the run that ends it holds the answer.
+Any blocks between that one and the current block must each hold one run, which we check by
+reading the block head and the wave head of each block, many blocks at a time.
+\param r    The search range. If the answer is found or there is an error, r.Max() is set 0.
+\return     The found time, a negative error code, or -1 if we did not find it, in which case
+            the current block and r are unchanged and the caller should carry on back block
+            by block.
+*/
+TSTime64 CSon64Chan::PrevNTimeRun(CSRange& r)
+{
+    const TSTime64 tDvd = m_chanHead.m_tDivide;
+    const TSTime64 tUpto = r.Upto();
+    const int64_t nCur = m_bmRead.BlockNumber();
+    if (r.First() || (nCur <= 0) || m_chanHead.RingOldLap() || (m_bmRead.DataBlock().FirstTime() != tUpto))
+        return -1;
+    const TSTime64 nBack = min(static_cast<TSTime64>(r.Max()), (tUpto - r.From()) / tDvd);
+    if (nBack <= 0)
+        return -1;
+    const TSTime64 tStart = tUpto - nBack*tDvd;
+
+    // Load the block holding the start time. It must end with a run that holds it.
+    bool bOK = m_bmRead.LoadBlock(tStart) == 0;
+    const int64_t nStart = m_bmRead.BlockNumber();
+    if (bOK)
+    {
+        const CDataBlock& db = m_bmRead.DataBlock();
+        const TSTime64 tRun = db.LastRunStart();
+        bOK = (nStart >= 0) && (nStart < nCur) && (tRun >= 0) && (tRun <= tStart) &&
+              (tStart <= db.LastTime()) && ((tStart - tRun) % tDvd == 0);
+        TSTime64 tNext = db.LastTime() + tDvd;  // the next contiguous time
+
+        // Blocks between must each hold one run that starts at the next contiguous time
+        struct TRunStart
+        {
+            TDiskBlockHead m_head;
+            TSTime64 m_time;                    // start of the first run...
+            uint32_t m_nItems;                  // ...and the points in it
+            uint32_t m_pad;
+        };
+        if (bOK && (nStart + 1 < nCur))
+        {
+            uint64_t nSpan = 1;                 // data blocks per item of the top index block
+            for (unsigned int i = DepthFor(); i > 1; --i)
+                nSpan *= DLUItems;
+            vector<TDiskOff> vDO;
+            bOK = (CollectBlocks(m_chanHead.m_doIndex, nSpan, 0, nStart + 1, nCur, vDO) == 0) &&
+                  (vDO.size() == static_cast<size_t>(nCur - nStart - 1));
+            vector<TRunStart> vRun(min<size_t>(vDO.size(), DLUItems));
+            vector<TIOReq> vReq;
+            for (size_t i = 0; bOK && (i < vDO.size()); i += vRun.size())
+            {
+                const size_t n = min(vDO.size() - i, vRun.size());
+                vReq.clear();
+                for (size_t j = 0; j < n; ++j)
+                    vReq.emplace_back(&vRun[j], static_cast<uint32_t>(sizeof(TRunStart)), vDO[i+j]);
+                bOK = m_file.ReadBatch(vReq.data(), n) == 0;
+                for (size_t j = 0; bOK && (j < n); ++j)
+                {
+                    bOK = (vRun[j].m_head.m_nItems == 1) && (vRun[j].m_time == tNext);
+                    tNext += vRun[j].m_nItems * tDvd;
+                }
+            }
+        }
+        bOK = bOK && (tNext == tUpto);
+    }
+
+    if (!bOK)                                   // not contiguous, so put back the block...
+    {
+        int err = m_bmRead.LoadNumbered(static_cast<uint64_t>(nCur));
+        if (err == 0)
+            return -1;                          // ...so the caller can carry on
+        r.ZeroMax();
+        return err;
+    }
+    r.ZeroMax();
+    return tStart;
+}
+
 //! Generic routine to read event times from the channel (unless overridden)
 /*!
 Read data from the channel. If the write buffer exists and overlaps the read request,
@@ -1526,6 +1891,11 @@ int CSon64Chan::ReadData(TSTime64* pData, CSRange& r, const CSFilter* pFilter)
 
     int nRead = 0;                          // will be the count of read data
 
+    // If the channel is being written, do not hold up the writer while we read the disk
+    if (SnapRead(r, [pData, pFilter](const CDataBlock& db, CSRange& rs, size_t nDone)
+                    {TSTime64* p = pData + nDone; return db.GetData(p, rs, pFilter);}, false, nRead))
+        return nRead;
+
     TChanLock lock(m_mutex);                // take ownership of the channel
 
     // If we have a write buffer, and our time range includes data in the buffer, use that
@@ -1580,6 +1950,11 @@ int CSon64Chan::ReadData(TMarker* pData, CSRange& r, const CSFilter* pFilter)
 
     int nRead = 0;                          // will be the count of read data
 
+    // If the channel is being written, do not hold up the writer while we read the disk
+    if (SnapRead(r, [pData, pFilter](const CDataBlock& db, CSRange& rs, size_t nDone)
+                    {TMarker* p = pData + nDone; return db.GetData(p, rs, pFilter);}, false, nRead))
+        return nRead;
+
     TChanLock lock(m_mutex);                // take ownership of the channel
 
     // If we have a write buffer, and our time range includes data in the buffer, use that
@@ -56,6 +56,7 @@ namespace ceds64
     class TSon64File;
     class CSon64Chan;
     class CSRange;
+    struct TIOReq;
 
     enum
     {
@@ -177,8 +178,13 @@ namespace ceds64
         unique_ptr<CDataBlock> m_pDB;   //!< the data block
         int64_t m_nBlock;               //!< The block number, or -1 if invalid
         std::vector<uint16_t> m_vReuse; //!< number of reused items in last block at this level
+        const TIdxBlock* m_pFlat;       //!< block table from the index file, or nullptr
+        uint64_t m_nFlat;               //!< the number of items in m_pFlat
+        const TChanHead* m_pHead;       //!< the channel head we use, usually the channel's own
+        const VIndex* m_pAppend;        //!< the write index blocks we use, usually the channel's own
     public:
         explicit CBlockManager(CSon64Chan& rChan);
+        void SetView(const TChanHead& head, const VIndex& vAppend);
 
         bool HasDataBlock() const {return static_cast<bool>(m_pDB);}   //!< True if we are holding memory for a data block
         //! Take ownership of the data block passed in
@@ -194,11 +200,17 @@ namespace ceds64
         const CDataBlock& DataBlock() const {return *m_pDB;}    //!< Get a const reference to the block
         CDataBlock& DataBlock() {return *m_pDB;}    //!< Get a reference to the block
         void Invalidate(){m_nBlock = -1;}   //!< Mark block so next use must reread entire tree
+        //! Mark block so next use must reread the tree and the data block from disk
+        void Forget(){m_nBlock = -1; if (m_pDB) m_pDB->SetDiskOff(0);}
         void UpdateIndex(unsigned int level, const CIndex& index);
         void UpdateData(const CDataBlock& block);
         void BlockAdded();              // Wrote a new block to the channel
         int FixIndex();                // Attempt to fix index chain if not OK
         int PatchIndex(unsigned int level, unsigned int uiParent);
+        int LoadNumbered(uint64_t nBlock); // Load a block by its position in the index
+        int64_t BlockNumber() const {return m_nBlock;}  //!< The position of the block in the index, -1 if none
+        void SetFlat(const TIdxBlock* pFlat, uint64_t nFlat);
+        const TIdxBlock* Flat(uint64_t& nFlat) const {nFlat = m_nFlat; return m_pFlat;} //!< The index file table, if any
 
         int SaveIfUnsaved();            // data can be modified, but not index blocks
         bool Unsaved() const            //!< true if an unsaved disk block with a known disk address
@@ -209,6 +221,27 @@ namespace ceds64
         int ReadIndex(CIndex& index, TDiskOff pos);
         int ReadDataBlock(TDiskOff pos);
         void CalcReuse(size_t nLevel);  // calculate reused item vector for this many levels
+        int LoadFlat(TSTime64 tFind);   // LoadBlock() using m_pFlat
+        int LoadFlatNumbered(uint64_t nBlock);
+    };
+
+    //! A block manager for snapshot reads, and the channel state it last matched
+    /*!
+    \internal
+    A channel keeps idle ones for its snapshot reads (see s64snap.cpp). A thread that makes
+    many reads of one channel can own one and pass it with each read (see CSRange::SetReader()),
+    so it has a block manager to itself and does not take one from the channel.
+    */
+    struct TSnapReader
+    {
+        unique_ptr<CBlockManager> m_pBM;    //!< the block manager
+        const CSon64Chan* m_pChan;      //!< the channel it was made for
+        TChanHead m_head;               //!< the channel head at the last snapshot
+        VIndex m_vAppend;               //!< the write index blocks at the last snapshot
+        TDiskOff m_doWr;                //!< disk offset of the write buffer at the last snapshot
+        uint32_t m_nRewrite;            //!< m_nRewrite at the last snapshot
+
+        TSnapReader() : m_pChan( nullptr ), m_doWr( 0 ), m_nRewrite( 0 ) {}
     };
 
     //! Encapsulates the concept of a data channel.
@@ -235,6 +268,11 @@ namespace ceds64
         mutable std::mutex m_mutex;     //!< channel mutex (MUST acquire before mutHead)
         typedef std::lock_guard<std::mutex> TChanLock;  //!< Used to acquire channel mutex
 
+        std::atomic<uint32_t> m_nRewrite;   //!< incremented before data on disk is changed or freed
+        vector<TSnapReader> m_vSnap;    //!< idle block managers for snapshot reads (see s64snap.cpp)
+        unsigned int m_nSnapActive;     //!< snapshot reads in progress
+        vector<TDiskOff> m_vFreeLater;  //!< released blocks held for snapshot reads or a full free map
+
     public:
         CSon64Chan(TSon64File& file, TChanNum nChan, TDataKind kind);
         virtual ~CSon64Chan();
@@ -275,10 +313,39 @@ namespace ceds64
         virtual TSTime64 MaxTime() const;
         virtual TSTime64 PrevNTime(CSRange& r, const CSFilter* pFilter = nullptr, bool bAsWave = false);// = 0;
 
-        virtual int AppendBlock(CDataBlock* pBlock);
+        virtual int AppendBlock(CDataBlock* pBlock, bool bWithIndex = false);
         virtual int Commit();
         virtual bool IsModified() const;
         virtual uint64_t GetChanBytes() const;
+        int GetStats(TChanStats& stats);
+        void InvalidateStats();
+        int SetRing(uint64_t nBlocks);
+        uint64_t GetRing() const;
+        TSTime64 MinTime();
+
+        // Block-level copying between channels (see s64copy.cpp)
+        CDataBlock* NewDataBlock() const;
+        CDataBlock* CopyRange(const CDataBlock& src, TSTime64 tFrom, TSTime64 tUpto) const;
+        int CopyBlocksOut(vector<unique_ptr<CDataBlock>>& vBlk, TSTime64& tFrom, TSTime64 tUpto, size_t nMax, TSTime64 tShift = 0);
+        int AppendBlocks(vector<unique_ptr<CDataBlock>>& vBlk);
+
+        // Dropping old or unwanted data (see s64drop.cpp)
+        int TruncateBefore(TSTime64 t);
+        int DropFrom(TSTime64 t);
+
+        // Finding the disk blocks that hold a time range (see s64hint.cpp)
+        int DiskBlocks(TSTime64 tFrom, TSTime64 tUpto, vector<TDiskOff>& vDO);
+
+        // Building the block table of the index file (see s64idx.cpp)
+        int FlatBlocks(vector<TIdxBlock>& vBlk, uint64_t nFrom = 0);
+
+        // Item number lookups (see s64rank.cpp)
+        bool BlockSpan(uint64_t& nFirst, uint64_t& nEnd);
+
+        // Reads from a snapshot that do not hold the channel mutex (see s64snap.cpp)
+        //! Copy data from a block into the output after nDone items have been read
+        typedef std::function<int(const CDataBlock& db, CSRange& r, size_t nDone)> TSnapCopy;
+        bool SnapRead(CSRange& r, const TSnapCopy& copy, bool bWave, int& nRead);
 
         //=============================================================================
         // Routines to write data that are overridden in classes that implement them.
@@ -535,9 +602,22 @@ namespace ceds64
         virtual TDiskOff GetReuseOffsetSetTime(TSTime64 t);
         virtual int AddIndexItem(TDiskOff doItem, TSTime64 time, unsigned int level);
         virtual int SaveAppendIndex(int level);
+        int SaveAppendIndices(const TIOReq* pData = nullptr);
+        int WrapRing();
+        int IndexTable(TDiskOff pos, TDiskLookup& buf, const TDiskLookup*& pDLU);
+        int CollectBlocks(TDiskOff pos, uint64_t nSpan, uint64_t nBase, uint64_t nFrom, uint64_t nUpto, vector<TDiskOff>& vDO);
+        int CollectTimeBlocks(TDiskOff pos, uint64_t nSpan, uint64_t nBase, uint64_t nFrom, uint64_t nUpto,
+                              TSTime64 tFrom, TSTime64 tUpto, TSTime64 tNext, vector<TDiskOff>& vDO);
+        TSTime64 PrevNTimeRun(CSRange& r);
+        int CollectLiveBlocks(vector<TDiskOff>& vDO);
+        int ReleaseBlocks(vector<TDiskOff>& vDO);
+        int DropAll();
+        int ReplaceBlock(const CDataBlock& src, TSTime64 tFrom, TSTime64 tUpto);
         CSon64Chan(const CSon64Chan&);  // = delete; NO copy constructor 
         CSon64Chan& operator=(const CSon64Chan&); // = delete; No operator =
 		unsigned int DepthFor();
+    public:
+        static unsigned int DepthFor(const TChanHead& ch);
     };
 
     //! Handles simple event channels without circular buffering
@@ -663,12 +743,30 @@ namespace ceds64
     */
     class CExtMarkChan : public CSon64Chan
     {
+        //! The range of a RealMark value in one data block
+        struct TBlockRange
+        {
+            TSTime64 m_tLast;           //!< The last time in the block
+            float m_fMin;               //!< The smallest value in the block
+            float m_fMax;               //!< The largest value in the block
+        };
+        //! The block ranges of one value in the items
+        struct TValueRanges
+        {
+            size_t m_nOff;              //!< Offset in each item of the value
+            uint32_t m_nGen;            //!< File edit generation when m_vRange was made
+            vector<TBlockRange> m_vRange;   //!< Value ranges of all but the last data block
+        };
+        vector<TValueRanges> m_vRanges; //!< Most recently used value first
+
     public:
         CExtMarkChan(TSon64File& file, TChanNum nChan, TDataKind xKind, size_t nRow, size_t nCol = 1, TSTime64 tDvd = 0);
         virtual int WriteData(const TExtMark* pData, size_t count);
         virtual int ReadData(short* pData, CSRange& r, TSTime64& tFirst, const CSFilter* pFilter = nullptr);
         virtual int ReadData(TExtMark* pData, CSRange& r, const CSFilter* pFilter = nullptr);
         virtual int EditMarker(TSTime64 t, const TMarker* pM, size_t nCopy);
+        int FindValues(size_t nOff, float fLo, float fHi, TSTime64* pTimes, TExtMark* pData, int nMax,
+                       TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter, uint32_t nGen);
     };
 
 	//! Class to handle buffered extended marker channels
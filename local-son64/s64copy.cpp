@@ -0,0 +1,603 @@
+// s64copy.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64copy.cpp
+//! \brief Block-level copying of channel data between SON64 files
+/*!
+\internal
+Data blocks that lie entirely inside the copied time range are copied as they stand;
+only the channel number and the parent information in the block header changes. Only
+the blocks at the ends of the range are trimmed. The blocks are appended to the target
+channel through CSon64Chan::AppendBlock(), which builds the index tree from the bottom
+up as each block is added, exactly as when data is written.
+*/
+#include <assert.h>
+#include <atomic>
+#include <thread>
+#include "s64priv.h"
+#include "s64chan.h"
+
+using namespace std;
+using namespace ceds64;
+
+//! Number of data blocks we move between channels while holding a channel mutex
+static const size_t nCopyBatch = 16;
+
+//! Find the index of the first item in an event-based block at or after a time
+/*!
+All event-based blocks hold items of a fixed size that start with the item time.
+\param db       The data block to search.
+\param nStride  The size of each item in bytes.
+\param t        The time to search for.
+\return         The index of the first item with time >= t, or db.m_nItems if none.
+*/
+static uint32_t ItemIndexFor(const TDataBlock& db, size_t nStride, TSTime64 t)
+{
+    const uint8_t* pBase = reinterpret_cast<const uint8_t*>(db.m_event);
+    uint32_t lo = 0;
+    uint32_t hi = db.m_nItems;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) >> 1;
+        if (*reinterpret_cast<const TSTime64*>(pBase + mid*nStride) < t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+//! Copy the waveform points in a time range from one wave block to another
+/*!
+\tparam B       The wave block type, CAdcBlock or CRealWaveBlock.
+\tparam T       The waveform data type, short or float.
+\param src      The source block.
+\param dst      The (empty) destination block of the same type.
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range (not included).
+\param tDvd     The channel sample interval.
+*/
+template<class B, typename T>
+static void TrimWave(const B& src, CDataBlock& dst, TSTime64 tFrom, TSTime64 tUpto, TSTime64 tDvd)
+{
+    auto itEnd = src.cend();
+    for (auto it = src.cbegin(); it != itEnd; ++it)
+    {
+        const TSTime64 tStart = it->m_startTime;
+        const TSTime64 n = it->m_nItems;
+        TSTime64 i0 = (tFrom > tStart) ? (tFrom - tStart + tDvd - 1) / tDvd : 0;
+        TSTime64 i1 = (tUpto > tStart) ? min(n, (tUpto - tStart + tDvd - 1) / tDvd) : 0;
+        if (i1 > i0)
+        {
+            const T* pData = it->m_data + i0;
+            dst.AddData(pData, static_cast<size_t>(i1 - i0), tStart + i0*tDvd);
+        }
+    }
+}
+
+//! Move all the sub-blocks of a wave block earlier in time
+/*!
+\tparam B       The wave block type, CAdcBlock or CRealWaveBlock.
+\param blk      The block to change.
+\param tShift   The time to subtract from each sub-block start time.
+*/
+template<class B>
+static void ShiftWave(CDataBlock& blk, TSTime64 tShift)
+{
+    B& wb = static_cast<B&>(blk);
+    auto itEnd = wb.end();
+    for (auto it = wb.begin(); it != itEnd; ++it)
+        it->m_startTime -= tShift;
+}
+
+//! Create an empty data block of the type used by this channel
+/*!
+The caller takes ownership of the returned block.
+\return A new data block or nullptr if the channel type has no data blocks.
+*/
+CDataBlock* CSon64Chan::NewDataBlock() const
+{
+    switch (m_chanHead.m_chanKind)
+    {
+    case Adc:
+        return new CAdcBlock(m_nChan, m_chanHead.m_tDivide);
+    case RealWave:
+        return new CRealWaveBlock(m_nChan, m_chanHead.m_tDivide);
+    case EventFall:
+    case EventRise:
+        return new CEventBlock(m_nChan);
+    case EventBoth:
+    case Marker:
+        return new CMarkerBlock(m_nChan);
+    case AdcMark:
+    case RealMark:
+    case TextMark:
+        return new CExtMarkBlock(m_nChan, m_chanHead.m_nObjSize);
+    default:
+        return nullptr;
+    }
+}
+
+//! Make a copy of the part of a data block that lies in a time range
+/*!
+The caller takes ownership of the returned block, which has no disk position and may be
+empty. The source must be a block of the type used by this channel.
+\param src      The block to copy from.
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range (not included).
+\return         A new data block holding the copied data.
+*/
+CDataBlock* CSon64Chan::CopyRange(const CDataBlock& src, TSTime64 tFrom, TSTime64 tUpto) const
+{
+    const TDataKind kind = m_chanHead.m_chanKind;
+    const size_t nStride = m_chanHead.m_nObjSize;
+    const TSTime64 tDvd = m_chanHead.m_tDivide;
+
+    CDataBlock* pBlk = NewDataBlock();
+    if ((src.FirstTime() >= tFrom) && (src.LastTime() < tUpto))
+    {
+        *pBlk->DataBlock() = *src.DataBlock();  // whole block is wanted
+        pBlk->NewDataRead();
+    }
+    else if (kind == Adc)
+        TrimWave<CAdcBlock, short>(static_cast<const CAdcBlock&>(src), *pBlk, tFrom, tUpto, tDvd);
+    else if (kind == RealWave)
+        TrimWave<CRealWaveBlock, float>(static_cast<const CRealWaveBlock&>(src), *pBlk, tFrom, tUpto, tDvd);
+    else
+    {
+        const TDataBlock& db = *src.DataBlock();
+        uint32_t i0 = ItemIndexFor(db, nStride, tFrom);
+        uint32_t i1 = ItemIndexFor(db, nStride, tUpto);
+        if (i1 > i0)
+        {
+            memcpy(pBlk->DataBlock()->m_event, reinterpret_cast<const uint8_t*>(db.m_event) + i0*nStride, (i1-i0)*nStride);
+            pBlk->m_nItems = i1 - i0;
+        }
+    }
+    return pBlk;
+}
+
+//! Collect copies of the data blocks that hold data in a time range
+/*!
+You _must not_ hold the channel mutex. Blocks that lie entirely inside the range are
+copied without change. Blocks that straddle the range ends are trimmed so they only hold
+data in the range. Only data that has been committed to disk is seen; call Commit() first
+if you want buffered data.
+\param vBlk     Cleared, then filled with up to nMax blocks. The blocks have this channel
+                type, but have no disk position.
+\param tFrom    The start of the range. This is returned as the time to continue from, and
+                is set to tUpto when there is no more data.
+\param tUpto    The end of the range (not included).
+\param nMax     The maximum number of blocks to return.
+\param tShift   A time to subtract from all the item times in the returned blocks. This
+                must not be more than the first time returned.
+\return         S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::CopyBlocksOut(vector<unique_ptr<CDataBlock>>& vBlk, TSTime64& tFrom, TSTime64 tUpto, size_t nMax, TSTime64 tShift)
+{
+    vBlk.clear();
+    const TDataKind kind = m_chanHead.m_chanKind;
+    const size_t nStride = m_chanHead.m_nObjSize;
+
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    int err = m_bmRead.LoadBlock(tFrom);
+    while ((err == 0) && (vBlk.size() < nMax))
+    {
+        const CDataBlock& src = m_bmRead.DataBlock();
+        if (src.FirstTime() >= tUpto)   // if past the range...
+        {
+            tFrom = tUpto;              // ...we are done
+            break;
+        }
+
+        unique_ptr<CDataBlock> pBlk(CopyRange(src, tFrom, tUpto));
+        tFrom = src.LastTime() + 1;     // where to continue from
+        if (!pBlk->empty())
+        {
+            if (tShift)                 // move the block in time
+            {
+                if (kind == Adc)
+                    ShiftWave<CAdcBlock>(*pBlk, tShift);
+                else if (kind == RealWave)
+                    ShiftWave<CRealWaveBlock>(*pBlk, tShift);
+                else                    // all other items start with the time
+                {
+                    uint8_t* pItem = reinterpret_cast<uint8_t*>(pBlk->DataBlock()->m_event);
+                    for (uint32_t i = 0; i < pBlk->m_nItems; ++i, pItem += nStride)
+                        *reinterpret_cast<TSTime64*>(pItem) -= tShift;
+                }
+                pBlk->NewDataRead();
+            }
+            vBlk.push_back(move(pBlk));
+        }
+        if (tFrom >= tUpto)
+            break;
+        err = m_bmRead.NextBlock();     // 1 means no more blocks
+    }
+
+    if (err > 0)                        // no more data blocks...
+    {
+        tFrom = tUpto;                  // ...so no more data
+        err = 0;
+    }
+    return err;
+}
+
+//! Append copied data blocks to the end of this channel
+/*!
+You _must not_ hold the channel mutex. The blocks must be of the type used by this channel,
+must be in time order and must follow any data already in the channel. Any partly-filled
+write buffer is saved first and is then released so that later writes append after the
+copied blocks.
+\param vBlk The blocks to append. These are modified (channel number, disk position and
+            parent information), but are left owned by the caller.
+\return     S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::AppendBlocks(vector<unique_ptr<CDataBlock>>& vBlk)
+{
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    int err = 0;
+    if (m_pWr)                          // save any partial block, then forget it
+    {
+        if (m_pWr->Unsaved())
+            err = AppendBlock(m_pWr.get());
+        m_pWr.reset();
+    }
+    else if (m_chanHead.m_nBlocks && m_vAppend.empty() && !m_chanHead.ReusingBlocks())
+        err = LoadAppendList(false);    // find the current end of the channel
+
+    for (auto it = vBlk.begin(); (err == 0) && (it != vBlk.end()); ++it)
+    {
+        CDataBlock* pBlk = it->get();
+        if (pBlk->FirstTime() <= m_chanHead.m_lastTime)
+        {
+            err = OVER_WRITE;
+            break;
+        }
+        pBlk->m_chan = static_cast<uint16_t>(m_nChan);
+        pBlk->SetDiskOff(0);            // this is a new block for this channel
+        pBlk->SetUnsaved();
+        err = AppendBlock(pBlk);
+    }
+
+    // The index must be on disk as a later write will reload the append list from disk
+    for (int i = 0; (err == 0) && (i < (int)m_vAppend.size()); ++i)
+        err = SaveAppendIndex(i);
+    return err;
+}
+
+//! Copy or check a channel definition in a target file
+/*!
+If the target channel is unused, it is created with the same type, layout and channel
+information as this file channel. If it is in use, it must have the same data layout.
+\param srcChan  The channel in this file.
+\param dst      The target file (which can be this file).
+\param dstChan  The channel in the target file.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::CopyChanDef(TChanNum srcChan, TSon64File& dst, TChanNum dstChan)
+{
+    TChanHead ch;
+    string title, units, comment;
+    {
+        TChRdLock lock(m_mutChans);     // we are not changing the #chans
+        if ((srcChan >= m_vChanHead.size()) || !m_vChan[srcChan])
+            return NO_CHANNEL;
+        ch = m_vChanHead[srcChan];
+        title = m_vChan[srcChan]->GetTitle();
+        units = m_vChan[srcChan]->GetUnits();
+        comment = m_vChan[srcChan]->GetComment();
+    }
+
+    {
+        TChRdLock lock(dst.m_mutChans);
+        if (dstChan >= dst.m_vChanHead.size())
+            return NO_CHANNEL;
+        if (dst.m_vChan[dstChan])       // If the channel is in use, check the layout
+        {
+            const TChanHead& dh = dst.m_vChanHead[dstChan];
+            bool bOK = (dh.m_chanKind == ch.m_chanKind) && (dh.m_nObjSize == ch.m_nObjSize) &&
+                       (dh.m_nRows == ch.m_nRows) && (dh.m_nColumns == ch.m_nColumns) &&
+                       (dh.m_tDivide == ch.m_tDivide);
+            return bOK ? S64_OK : CHANNEL_TYPE;
+        }
+    }
+
+    int err;
+    switch (ch.m_chanKind)
+    {
+    case Adc:
+    case RealWave:
+        err = dst.SetWaveChan(dstChan, ch.m_tDivide, ch.m_chanKind, ch.m_dRate, ch.m_iPhyCh);
+        break;
+    case EventFall:
+    case EventRise:
+        err = dst.SetEventChan(dstChan, ch.m_dRate, ch.m_chanKind, ch.m_iPhyCh);
+        break;
+    case EventBoth:
+        err = dst.SetLevelChan(dstChan, ch.m_dRate, ch.m_iPhyCh);
+        if (err == 0)
+            err = dst.SetInitLevel(dstChan, (ch.m_flags & ChanFlag_LevelHigh) != 0);
+        break;
+    case Marker:
+        err = dst.SetMarkerChan(dstChan, ch.m_dRate, Marker, ch.m_iPhyCh);
+        break;
+    case AdcMark:
+    case RealMark:
+    case TextMark:
+        err = dst.SetExtMarkChan(dstChan, ch.m_dRate, ch.m_chanKind, ch.m_nRows, ch.m_nColumns,
+                                 ch.m_iPhyCh, ch.m_tDivide, ch.m_nPreTrig);
+        break;
+    default:
+        err = CHANNEL_TYPE;
+    }
+
+    if (err == 0)
+    {
+        dst.SetChanTitle(dstChan, title.c_str());
+        dst.SetChanUnits(dstChan, units.c_str());
+        dst.SetChanComment(dstChan, comment.c_str());
+        dst.SetChanScale(dstChan, ch.m_dScale);
+        dst.SetChanOffset(dstChan, ch.m_dOffset);
+        dst.SetChanYRange(dstChan, ch.m_dYLow, ch.m_dYHigh);
+    }
+    return err;
+}
+
+//! Copy channel data in a time range to a channel in another file
+/*!
+This copies data blocks without decoding them, so it runs at disk speed. If the target
+channel is unused it is created to match the source channel, otherwise it must have the same
+data layout and the copied data must start after any data already in it. A target channel
+that already holds data must not have a circular buffer (as this would hide the copied
+blocks); this is only the case in a file that was opened rather than created.
+\param srcChan  The channel in this file to copy from.
+\param dst      The target file, which can be this file.
+\param dstChan  The channel in the target file. This must differ from srcChan if the target
+                is this file.
+\param tFrom    The start of the time range to copy.
+\param tUpto    The end of the range to copy (not included).
+\param tShift   A time to subtract from all copied item times. For example, set this to
+                tFrom to copy an epoch to start at time 0. It must not exceed tFrom.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::CopyChannel(TChanNum srcChan, TSon64File& dst, TChanNum dstChan, TSTime64 tFrom, TSTime64 tUpto, TSTime64 tShift)
+{
+    if (dst.m_bReadOnly)
+        return READ_ONLY;
+    if ((&dst == this) && (srcChan == dstChan))
+        return BAD_PARAM;
+    if (tFrom < 0)
+        tFrom = 0;
+    if ((tShift < 0) || (tShift > tFrom))
+        return BAD_PARAM;
+    if (tFrom >= tUpto)                 // nothing to do is not an error
+        return S64_OK;
+
+    int err = CopyChanDef(srcChan, dst, dstChan);
+    if (err)
+        return err;
+
+    // We hold read locks on the channel lists so the channels cannot be deleted under us.
+    TChRdLock lock(m_mutChans);
+    TChRdLock lockDst(dst.m_mutChans, std::defer_lock);
+    if (&dst != this)
+        lockDst.lock();
+    if (!m_vChan[srcChan] || !dst.m_vChan[dstChan])
+        return NO_CHANNEL;
+    CSon64Chan& src = *m_vChan[srcChan];
+    CSon64Chan& out = *dst.m_vChan[dstChan];
+
+    TSTime64 tLast = out.MaxTime();     // last time already in the target
+    if (tLast >= 0)
+    {
+        if (tFrom - tShift <= tLast)
+            return OVER_WRITE;
+        if (out.WriteBufferSize())
+            return CHANNEL_USED;
+    }
+
+    if (!m_bReadOnly)                   // get all the source data onto disk
+    {
+        err = src.Commit();
+        if (err)
+            return err;
+    }
+
+    vector<unique_ptr<CDataBlock>> vBlk;
+    vBlk.reserve(nCopyBatch);
+    bool bFirst = tLast < 0;            // true until data is written to the target
+    while ((err == 0) && (tFrom < tUpto))
+    {
+        err = src.CopyBlocksOut(vBlk, tFrom, tUpto, nCopyBatch, tShift);
+        if ((err == 0) && !vBlk.empty())
+        {
+            // A level channel starts in the opposite state to its first transition
+            if (bFirst && (out.ChanKind() == EventBoth))
+                err = out.SetInitLevel(vBlk[0]->DataBlock()->m_mark[0].m_code[0] == 0);
+            bFirst = false;
+            if (err == 0)
+                err = out.AppendBlocks(vBlk);
+        }
+    }
+
+    int locErr = out.Commit();          // write the channel header
+    return err ? err : locErr;
+}
+
+//! Copy a list of channels in a time range to another file
+/*!
+Each channel is copied by CopyChannel(). The channels are copied in parallel, using up to
+one thread per processor.
+\param pSrc     The list of nChans channels in this file to copy from.
+\param nChans   The number of channels to copy.
+\param dst      The target file, which can be this file.
+\param pDst     The list of nChans target channels. If this is nullptr, the target channels
+                have the same numbers as the source channels (dst must not be this file).
+\param tFrom    The start of the time range to copy.
+\param tUpto    The end of the range to copy (not included).
+\param tShift   A time to subtract from all copied item times (see CopyChannel()).
+\return         S64_OK (0) or the first negative error code detected.
+*/
+int TSon64File::CopyChannels(const TChanNum* pSrc, size_t nChans, TSon64File& dst, const TChanNum* pDst, TSTime64 tFrom, TSTime64 tUpto, TSTime64 tShift)
+{
+    if (!pDst)
+        pDst = pSrc;
+
+    // Channel creation changes the channel list, so do this before starting the threads.
+    for (size_t i = 0; i < nChans; ++i)
+    {
+        int err = CopyChanDef(pSrc[i], dst, pDst[i]);
+        if (err)
+            return err;
+    }
+
+    atomic<size_t> next(0);             // the next channel to copy
+    atomic<int> firstErr(0);            // the first error we detect
+    auto worker = [&]()
+    {
+        size_t i;
+        while ((i = next++) < nChans)
+        {
+            int err = CopyChannel(pSrc[i], dst, pDst[i], tFrom, tUpto, tShift);
+            int expect = 0;
+            if (err)
+                firstErr.compare_exchange_strong(expect, err);
+        }
+    };
+
+    size_t nThreads = min<size_t>(nChans, max(1u, thread::hardware_concurrency()));
+    vector<thread> vThreads;
+    for (size_t i = 1; i < nThreads; ++i)
+        vThreads.emplace_back(worker);
+    worker();                           // this thread does its share
+    for (auto& t : vThreads)
+        t.join();
+
+    return firstErr;
+}
+
+//! Move a time and date on by a number of seconds
+/*!
+\param td       The time and date to change. This must be valid.
+\param dSecs    The (positive) number of seconds to add.
+*/
+static void AddSeconds(TTimeDate& td, double dSecs)
+{
+    // Days since 1 March of year 0 from the civil date, and back again
+    int64_t y = td.wYear - ((td.ucMon <= 2) ? 1 : 0);
+    int64_t m = td.ucMon;
+    int64_t yoe = y % 400;
+    int64_t doy = (153*(m + ((m > 2) ? -3 : 9)) + 2)/5 + td.ucDay - 1;
+    int64_t days = (y / 400)*146097 + yoe*365 + yoe/4 - yoe/100 + doy;
+
+    int64_t hun = td.ucHun + 100*(td.ucSec + 60*(td.ucMin + 60*td.ucHour)) +
+                  static_cast<int64_t>(dSecs*100.0 + 0.5);
+    days += hun / 8640000;
+    hun %= 8640000;
+
+    int64_t era = days / 146097;
+    int64_t doe = days - era*146097;
+    yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    doy = doe - (365*yoe + yoe/4 - yoe/100);
+    int64_t mp = (5*doy + 2)/153;
+    m = mp + ((mp < 10) ? 3 : -9);
+    td.wYear = static_cast<uint16_t>(yoe + era*400 + ((m <= 2) ? 1 : 0));
+    td.ucMon = static_cast<uint8_t>(m);
+    td.ucDay = static_cast<uint8_t>(doy - (153*mp + 2)/5 + 1);
+    td.ucHun = static_cast<uint8_t>(hun % 100);
+    td.ucSec = static_cast<uint8_t>((hun / 100) % 60);
+    td.ucMin = static_cast<uint8_t>((hun / 6000) % 60);
+    td.ucHour = static_cast<uint8_t>(hun / 360000);
+}
+
+//! Extract a time range of all the channels into a new file
+/*!
+The new file has the same number of channels, time base, creator, file comments and extra
+data as this file and each channel in use is copied (with the same channel number, type
+and channel information) by CopyChannels(), so the data blocks are copied without decoding.
+If there is data buffered for writing in this file it is committed first.
+\param szName       The name of the new file. Any existing file of this name is replaced.
+\param tFrom        The start of the time range to extract.
+\param tUpto        The end of the time range (not included).
+\param bShiftToZero If true, all times are reduced by tFrom so the epoch starts at time 0 and
+                    the file time and date (if set) is moved on to match.
+\return             S64_OK (0) or a negative error code.
+*/
+int TSon64File::ExtractEpoch(const char* szName, TSTime64 tFrom, TSTime64 tUpto, bool bShiftToZero)
+{
+    if (tFrom < 0)
+        tFrom = 0;
+    if (tUpto <= tFrom)
+        return BAD_PARAM;
+
+    TSon64File dst;
+    int err = dst.Create(szName, static_cast<uint16_t>(MaxChans()), GetExtraDataSize());
+    if (err)
+        return err;
+
+    dst.SetTimeBase(GetTimeBase());
+    TCreator creator;
+    AppID(&creator);
+    dst.AppID(nullptr, &creator);
+
+    TTimeDate td;
+    if (TimeDate(&td) > 0)              // only copy a valid time and date
+    {
+        if (bShiftToZero)
+            AddSeconds(td, tFrom*GetTimeBase());
+        dst.TimeDate(nullptr, &td);
+    }
+
+    for (int i = 0; i < FHComments; ++i)
+    {
+        string comment;
+        {
+            THeadLock lock(m_mutHead);  // protect the head and string table
+            comment = m_ss.String(m_Head.m_comments[i]);
+        }
+        if (!comment.empty())
+            dst.SetFileComment(i, comment.c_str());
+    }
+
+    uint32_t nExtra = GetExtraDataSize();
+    if (nExtra)
+    {
+        vector<uint8_t> vExtra(nExtra);
+        err = GetExtraData(vExtra.data(), nExtra, 0);
+        if (err == 0)
+            err = dst.SetExtraData(vExtra.data(), nExtra, 0);
+    }
+
+    vector<TChanNum> vChans;            // the channels in use
+    for (TChanNum chan = 0; chan < static_cast<TChanNum>(MaxChans()); ++chan)
+    {
+        if (ChanKind(chan) != ChanOff)
+            vChans.push_back(chan);
+    }
+
+    if ((err == 0) && !vChans.empty())
+        err = CopyChannels(vChans.data(), vChans.size(), dst, nullptr, tFrom, tUpto, bShiftToZero ? tFrom : 0);
+
+    int closeErr = dst.Close();
+    return err ? err : closeErr;
+}
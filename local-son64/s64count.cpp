@@ -0,0 +1,384 @@
+// s64count.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64count.cpp
+//! \brief Multi-resolution event counts for event-based channels
+/*!
+\internal
+The counts for a channel are built the first time that a wide time range of the channel
+is counted, and are then kept up to date as data is written. Like the text indexes, each
+set of counts records the channel ID, last time and file edit generation and is built
+again if these no longer match the channel. Narrow time ranges are counted from the data,
+as this is exact and reads little data.
+
+The counts are only held in memory; they are not saved in the data file or in a sidecar
+file, so each process that opens a file builds them again with a read of the channel.
+*/
+#include <assert.h>
+#include <algorithm>
+#include "s64priv.h"
+#include "s64filt.h"
+#include "s64count.h"
+
+using namespace std;
+using namespace ceds64;
+
+//! Constants for the count pyramid
+enum
+{
+    CountFanSh = 3,                     //!< Each level has bins (1 << CountFanSh) times wider
+    CountFanMask = (1 << CountFanSh) - 1,
+    CountLevels = 8,                    //!< The number of levels
+    CountBaseSh = 16,                   //!< Initially aim for (1 << CountBaseSh) level 0 bins
+    CountBaseMax = 1 << 18,             //!< Level 0 bins allowed before we use wider bins
+    CountMinBins = 16,                  //!< Minimum level 0 bins per output bin to use counts
+};
+
+//! Number of events we read at a time when counting from the data
+static const int nCountBuf = 4096;
+
+//! Get the level 0 bin width shift to use for a channel
+/*!
+\param tMax The last time in the channel.
+\return     The shift so that there are at most 1 << CountBaseSh level 0 bins.
+*/
+static int CountShiftFor(TSTime64 tMax)
+{
+    int nShift = 0;
+    while ((tMax >> nShift) >= (TSTime64(1) << CountBaseSh))
+        ++nShift;
+    return nShift;
+}
+
+/*!
+\param tMax     The last time in the channel, used to choose the level 0 bin width.
+\param bCodes   True to keep counts for each marker code.
+*/
+CCountPyramid::CCountPyramid(TSTime64 tMax, bool bCodes)
+    : m_chanID( 0 )
+    , m_tLast( -1 )
+    , m_nGen( 0 )
+    , m_nShift( CountShiftFor(tMax) )
+    , m_bCodes( bCodes )
+    , m_total( CountLevels )
+{
+}
+
+//! Add an event to the counts of one code (or the total)
+/*!
+\param lv   The levels to add the event to.
+\param bin  The level 0 bin that holds the event.
+*/
+void CCountPyramid::AddTo(TLevels& lv, uint64_t bin)
+{
+    for (auto& level : lv)
+    {
+        if (bin >= level.size())
+            level.resize(static_cast<size_t>(bin + 1), 0);
+        ++level[static_cast<size_t>(bin)];
+        bin >>= CountFanSh;
+    }
+}
+
+//! Double the width of the level 0 bins CountFanSh times
+/*!
+The old level 0 is dropped and a new top level is made from the old top level.
+*/
+void CCountPyramid::Coarsen(TLevels& lv)
+{
+    const auto& top = lv.back();
+    vector<uint32_t> newTop((top.size() + CountFanMask) >> CountFanSh, 0);
+    for (size_t i = 0; i < top.size(); ++i)
+        newTop[i >> CountFanSh] += top[i];
+    lv.erase(lv.begin());
+    lv.push_back(move(newTop));
+}
+
+//! Add an event to the counts
+/*!
+Events must be added in time order.
+\param t    The event time.
+\param code The first marker code of the event (ignored if we do not keep codes).
+*/
+void CCountPyramid::Add(TSTime64 t, int code)
+{
+    while ((t >> m_nShift) >= CountBaseMax)     // keep level 0 a sensible size
+    {
+        Coarsen(m_total);
+        for (auto& p : m_code)
+        {
+            if (p)
+                Coarsen(*p);
+        }
+        m_nShift += CountFanSh;
+    }
+
+    const uint64_t bin = static_cast<uint64_t>(t >> m_nShift);
+    AddTo(m_total, bin);
+    if (m_bCodes)
+    {
+        auto& p = m_code[code & 0xff];
+        if (!p)
+            p.reset(new TLevels(m_total.size()));
+        AddTo(*p, bin);
+    }
+    m_tLast = t;
+}
+
+//! Sum a run of level 0 bins
+/*!
+\param lv   The levels to use.
+\param lo   The first level 0 bin.
+\param hi   One beyond the last level 0 bin.
+\return     The total count in the bins.
+*/
+uint64_t CCountPyramid::Sum(const TLevels& lv, uint64_t lo, uint64_t hi)
+{
+    uint64_t sum = 0;
+    for (size_t k = 0; (k < lv.size()) && (lo < hi); ++k)
+    {
+        const auto& level = lv[k];
+        auto get = [&level](uint64_t i) -> uint32_t {return (i < level.size()) ? level[static_cast<size_t>(i)] : 0;};
+        if (k+1 < lv.size())            // use part bins at the ends, then move up a level
+        {
+            while ((lo < hi) && (lo & CountFanMask))
+                sum += get(lo++);
+            while ((lo < hi) && (hi & CountFanMask))
+                sum += get(--hi);
+            lo >>= CountFanSh;
+            hi >>= CountFanSh;
+        }
+        else
+        {
+            hi = min<uint64_t>(hi, level.size());
+            for (; lo < hi; ++lo)
+                sum += level[static_cast<size_t>(lo)];
+        }
+    }
+    return sum;
+}
+
+//! Count the events in a time range
+/*!
+The range ends are rounded down to multiples of the level 0 bin width.
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range.
+\param pFilter  nullptr or a filter that only uses the first marker code.
+\return         The number of events.
+*/
+uint64_t CCountPyramid::Count(TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter) const
+{
+    const uint64_t lo = static_cast<uint64_t>(tFrom >> m_nShift);
+    const uint64_t hi = static_cast<uint64_t>(tUpto >> m_nShift);
+    if (!pFilter || !m_bCodes)
+        return Sum(m_total, lo, hi);
+
+    uint64_t sum = 0;
+    for (int code = 0; code < 256; ++code)
+    {
+        if (m_code[code] && pFilter->GetItem(0, code))
+            sum += Sum(*m_code[code], lo, hi);
+    }
+    return sum;
+}
+
+//! Test if a filter only depends on the first marker code
+/*!
+In eM_and mode a marker must pass every layer that the filter tests, so the first code is
+all that matters if every other layer passes all codes. An empty layer passes nothing.
+*/
+static bool FirstCodeOnly(const CSFilter& filt)
+{
+    if (filt.GetMode() != CSFilter::eM_and)
+        return false;
+    for (int layer = 1; layer < filt.GetLayers(); ++layer)
+    {
+        for (int item = 0; item < 256; ++item)
+        {
+            if (!filt.GetItem(layer, item))
+                return false;
+        }
+    }
+    return true;
+}
+
+//! Get the event counts of a channel, building them if they are missing or out of date
+/*!
+You must hold m_mutCount and must not hold m_mutChans.
+\param chan     The channel, which must be an event-based type.
+\param pCount   Returned pointing at the counts.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::CountPyramid(TChanNum chan, const CCountPyramid*& pCount)
+{
+    const TDataKind kind = ChanKind(chan);
+    TChanID id;
+    const TSTime64 tLast = TextStamp(chan, id);
+    auto& pCP = m_mapCount[chan];
+    if (pCP && (pCP->m_chanID == id) && (pCP->m_tLast == tLast) && (pCP->m_nGen == m_nEditGen))
+    {
+        pCount = pCP.get();
+        return S64_OK;
+    }
+
+    // Build new counts from the channel data
+    const bool bCodes = (kind != EventFall) && (kind != EventRise);
+    unique_ptr<CCountPyramid> pNew(new CCountPyramid(tLast, bCodes));
+    pNew->m_chanID = id;
+    pNew->m_nGen = m_nEditGen;
+    vector<TMarker> vMark(bCodes ? nCountBuf : 0);
+    vector<TSTime64> vTime(bCodes ? 0 : nCountBuf);
+    TSTime64 tFrom = 0;
+    while (true)
+    {
+        int n = bCodes ? ReadMarkers(chan, vMark.data(), nCountBuf, tFrom, TSTIME64_MAX) :
+                         ReadEvents(chan, vTime.data(), nCountBuf, tFrom, TSTIME64_MAX);
+        if (n < 0)
+            return n;
+        for (int i = 0; i < n; ++i)
+        {
+            if (bCodes)
+                pNew->Add(vMark[i].m_time, vMark[i].m_code[0]);
+            else
+                pNew->Add(vTime[i], 0);
+        }
+        if (n < nCountBuf)
+            break;
+        tFrom = pNew->m_tLast + 1;
+    }
+
+    // If items were written while we read, we may hold items after tLast, so cannot match
+    pNew->m_tLast = (pNew->m_tLast > tLast) ? -2 : tLast;
+    pCP = move(pNew);
+    pCount = pCP.get();
+    return S64_OK;
+}
+
+//! Add newly written items to the channel event counts, if there are any
+/*!
+You must not hold m_mutChans. If the counts are not up to date with the channel state
+before the write, they are left alone and will be rebuilt when next used.
+\param chan     The channel.
+\param pData    The items that were written. Each item starts with its time.
+\param nStride  The size of each item in bytes.
+\param count    The number of items.
+\param bCodes   True if the items are markers, so have codes after the time.
+\param tPrev    The last time in the channel before the write.
+*/
+void TSon64File::AddToCounts(TChanNum chan, const void* pData, size_t nStride, size_t count, bool bCodes, TSTime64 tPrev)
+{
+    std::lock_guard<std::mutex> lock(m_mutCount);
+    auto it = m_mapCount.find(chan);
+    if ((it == m_mapCount.end()) || (it->second->m_tLast != tPrev) || (it->second->m_nGen != m_nEditGen))
+        return;
+
+    CCountPyramid& cp = *it->second;
+    const uint8_t* pItem = static_cast<const uint8_t*>(pData);
+    for (size_t i = 0; i < count; ++i, pItem += nStride)
+    {
+        if (bCodes)
+        {
+            const TMarker& m = *reinterpret_cast<const TMarker*>(pItem);
+            cp.Add(m.m_time, m.m_code[0]);
+        }
+        else
+            cp.Add(*reinterpret_cast<const TSTime64*>(pItem), 0);
+    }
+}
+
+//! Count the events in a channel in a list of equal width time bins
+/*!
+This is intended for raster and rate displays of long time ranges. The first count of a
+wide range of a channel builds a summary of the channel event counts at several time
+resolutions, which is then kept up to date as data is written. Wide ranges are then
+counted from the summary without reading the channel data. In this case, each bin edge
+is rounded down to the summary resolution, which is no more than 1/16 of the bin width.
+Narrow ranges, and filters that use marker codes other than the first, count the data.
+\param chan     An event, marker or extended marker channel.
+\param tFrom    The start of the first bin.
+\param tUpto    The end of the time range. The bins are ceil((tUpto-tFrom)/nBins) wide, so
+                the last bin may be narrower than the others.
+\param nBins    The number of bins.
+\param pCounts  Set to the nBins counts.
+\param pFilter  Either nullptr or a filter to select marker-based items.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::EventCounts(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto, int nBins, uint32_t* pCounts, const CSFilter* pFilter)
+{
+    if ((nBins <= 0) || (tFrom < 0) || (tFrom >= tUpto))
+        return BAD_PARAM;
+    const TDataKind kind = ChanKind(chan);
+    if (kind == ChanOff)
+        return NO_CHANNEL;
+    if ((kind == Adc) || (kind == RealWave))
+        return CHANNEL_TYPE;
+
+    fill(pCounts, pCounts + nBins, 0);
+    if (pFilter && (pFilter->Active() == CSFilter::eA_all))
+        pFilter = nullptr;
+    if (pFilter && (pFilter->Active() == CSFilter::eA_none))
+        return S64_OK;
+    const TSTime64 span = tUpto - tFrom;
+    const TSTime64 tBin = span / nBins + ((span % nBins) ? 1 : 0);
+
+    if (!pFilter || FirstCodeOnly(*pFilter))
+    {
+        std::lock_guard<std::mutex> lock(m_mutCount);
+        auto it = m_mapCount.find(chan);
+        const TSTime64 tWidth = (it != m_mapCount.end()) ? it->second->BinWidth() :
+                                TSTime64(1) << CountShiftFor(ChanMaxTime(chan));
+        if (tBin / CountMinBins >= tWidth)  // wide enough to use the summary
+        {
+            const CCountPyramid* pCount = nullptr;
+            int err = CountPyramid(chan, pCount);
+            if (err)
+                return err;
+
+            // The summary still counts the data a ring archive channel has replaced
+            const TSTime64 tMin = (ChanRing(chan) > 0) ? ChanMinTime(chan) : 0;
+            for (int i = 0; i < nBins; ++i)
+            {
+                const TSTime64 t = max(tFrom + i*tBin, tMin);
+                const TSTime64 tEnd = (tUpto - tFrom - i*tBin > tBin) ? tFrom + (i+1)*tBin : tUpto;
+                if (t < tEnd)
+                    pCounts[i] = static_cast<uint32_t>(min<uint64_t>(pCount->Count(t, tEnd, pFilter), UINT32_MAX));
+            }
+            return S64_OK;
+        }
+    }
+
+    // Count from the channel data
+    vector<TSTime64> vTime(nCountBuf);
+    TSTime64 tRead = tFrom;
+    while (tRead < tUpto)
+    {
+        int n = ReadEvents(chan, vTime.data(), nCountBuf, tRead, tUpto, pFilter);
+        if (n < 0)
+            return n;
+        for (int i = 0; i < n; ++i)
+            ++pCounts[(vTime[i] - tFrom) / tBin];
+        if (n < nCountBuf)
+            break;
+        tRead = vTime[n-1] + 1;
+    }
+    return S64_OK;
+}
@@ -0,0 +1,73 @@
+// s64count.h
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __S64COUNT_H__
+#define __S64COUNT_H__
+//! \file s64count.h
+//! \brief Multi-resolution event counts for event-based channels
+//! \internal
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <array>
+#include "s64.h"
+
+namespace ceds64
+{
+    class CSFilter;
+
+    //! Counts of the events in a channel in time bins at several resolutions
+    /*!
+     Level 0 counts events in bins of 1 << m_nShift ticks. Each level above has bins that
+     are 1 << CountFanSh times wider. The count of events in any run of level 0 bins is the sum
+     of a few bins from each level. For channels with marker codes, we also keep counts
+     for each first marker code so that counts can be filtered.
+
+     The object records the state of the channel it was built from so that the owner can
+     tell if the counts are still current.
+    */
+    class CCountPyramid
+    {
+    public:
+        TChanID m_chanID;               //!< The channel ID when the counts were made
+        TSTime64 m_tLast;               //!< Time of the last item in the channel that is counted
+        uint32_t m_nGen;                //!< The file edit generation when the counts were made
+
+        CCountPyramid(TSTime64 tMax, bool bCodes);
+        void Add(TSTime64 t, int code);
+        TSTime64 BinWidth() const {return TSTime64(1) << m_nShift;} //!< Level 0 bin width
+        uint64_t Count(TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter) const;
+
+    private:
+        typedef std::vector<std::vector<uint32_t>> TLevels;     //!< Counts at each level
+        int m_nShift;                   //!< Level 0 bins are 1 << m_nShift ticks wide
+        bool m_bCodes;                  //!< True if we keep counts for each marker code
+        TLevels m_total;                //!< Counts of all the events
+        std::array<std::unique_ptr<TLevels>, 256> m_code;  //!< Counts for each marker code
+
+        void AddTo(TLevels& lv, uint64_t bin);
+        static uint64_t Sum(const TLevels& lv, uint64_t lo, uint64_t hi);
+        static void Coarsen(TLevels& lv);
+    };
+}
+#endif
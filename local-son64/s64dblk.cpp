@@ -20,11 +20,217 @@
     along with SON64.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <assert.h>
+#include <limits>
 #include "s64dblk.h"
 #include "s64range.h"
 
 using namespace ceds64;
 
+//! Inline version of CSFilter::Filter() with the mode known at compile time
+/*!
+\internal
+This is a friend of CSFilter so that it can see the masks. It is only for the read loops
+below, so it is not part of the public interface.
+*/
+struct ceds64::TFilterPass
+{
+    //! Test a marker against a filter
+    /*!
+    See CSFilter::Filter() for the rules. The mode is a template argument so that the read
+    loops below test it once per block, not once per item.
+    \tparam mode The filter mode, which must match filt.GetMode().
+    \param filt  The filter.
+    \param mark  A TMarker object that is to be filtered
+    \return true, the filter accepts the marker, false it does not
+    */
+    template <CSFilter::eMode mode>
+    static bool Pass(const CSFilter& filt, const TMarker& mark)
+    {
+        for (int i=0; i<filt.m_nLayers; ++i)
+        {
+            const uint8_t code = mark.m_code[i];
+            const TMask& m = filt.m_mask[(mode == CSFilter::eM_and) ? i : 0];  // OR mode only uses mask 0
+            const bool bSet = (m.m_mask[code >> TMask::IndexShift] & (1u << (code & TMask::IndexMask))) != 0;
+            if (mode == CSFilter::eM_and)
+            {
+                if (!bSet)              // all codes must be in...
+                    return false;       // ...all masks, else we fail
+            }
+            else if (bSet && ((i==0) || code)) // layer 0 or non-zero code
+                return true;            // and present means accept it
+        }
+        return mode == CSFilter::eM_and;
+    }
+};
+
+namespace
+{
+    //! Branchless lower bound in a short run of items in time order
+    /*!
+    \internal
+    The loop has no data-dependent branch, so it does not stall on mispredictions. The
+    last few items are counted rather than searched, a loop that the compiler can unroll
+    or vectorise.
+    \param it   Iterator to the first item to search.
+    \param n    The number of items to search (can be 0).
+    \param t    The time to search for.
+    \return     Iterator to the first item at or after t, or it+n if there is none.
+    */
+    template <typename It>
+    It LowerBound(It it, ptrdiff_t n, TSTime64 t)
+    {
+        while (n > 8)
+        {
+            const ptrdiff_t half = n / 2;
+            it += (static_cast<TSTime64>(it[half]) < t) ? half : 0;
+            n -= half;
+        }
+        ptrdiff_t i = 0;
+        for (ptrdiff_t j = 0; j < n; ++j)
+            i += static_cast<TSTime64>(it[j]) < t;
+        return it + i;
+    }
+
+    //! Find the first item at or after a time in a block of items in time order
+    /*!
+    \internal
+    This does the same job as std::lower_bound() for all the TSTime64-based block types,
+    including the variable size extended markers. Spike times are usually spread evenly
+    enough through a block that a guess made from the block first and last times is close
+    to the answer. We step out from the guess in doubling steps to bracket the answer,
+    then search the bracket with LowerBound().
+    \param it   Iterator to the first item.
+    \param iEnd Iterator to the end of the items.
+    \param t    The time to search for.
+    \return     Iterator to the first item at or after t, or iEnd if there is none.
+    */
+    template <typename It>
+    It FindTime(It it, It iEnd, TSTime64 t)
+    {
+        const ptrdiff_t n = iEnd - it;
+        if (n <= 64)                    // short blocks are not worth the guess
+            return LowerBound(it, n, t);
+
+        const TSTime64 tFirst = it[0];
+        const TSTime64 tLast = it[n-1];
+        if (t <= tFirst)
+            return it;
+        if (t > tLast)
+            return iEnd;
+
+        // The answer is in [1, n-1]. Guess, then step out to bracket it in [lo, hi].
+        ptrdiff_t g = static_cast<ptrdiff_t>(static_cast<double>(t - tFirst) /
+                                             static_cast<double>(tLast - tFirst) * (n-1));
+        g = std::min(std::max(g, ptrdiff_t(1)), n-1);
+        ptrdiff_t lo, hi, step = 8;
+        if (static_cast<TSTime64>(it[g]) < t)   // answer is after g
+        {
+            lo = g+1;
+            hi = std::min(lo + step, n);
+            while ((hi < n) && (static_cast<TSTime64>(it[hi-1]) < t))
+            {
+                lo = hi;
+                step *= 2;
+                hi = std::min(lo + step, n);
+            }
+        }
+        else                            // answer is at or before g
+        {
+            hi = g;
+            lo = std::max(hi - step, ptrdiff_t(0));
+            while ((lo > 0) && (static_cast<TSTime64>(it[lo]) >= t))
+            {
+                hi = lo;
+                step *= 2;
+                lo = std::max(hi - step, ptrdiff_t(0));
+            }
+        }
+        return LowerBound(it + lo, hi - lo, t);
+    }
+
+    //! The inner copy loop of the GetData() routines of TSTime64-based blocks
+    /*!
+    \internal
+    This is compiled once for each filter state, so the per-item code has no tests of the
+    filter state or mode and the filter test is inlined.
+    \tparam act  eA_all to copy everything, else eA_some to test each item.
+    \tparam mode The filter mode when act is eA_some (ignored otherwise).
+    \param iOut  The output iterator, moved on by the items copied.
+    \param iLim  The output iterator limit.
+    \param it    The input iterator, moved on by the items read.
+    \param iEnd  The end of the input items.
+    \param tUpto Items at or after this time are not copied.
+    \param pFilt The filter, only used when act is eA_some.
+    */
+    template <CSFilter::eActive act, CSFilter::eMode mode, typename TOut, typename TIn>
+    void CopyItems(db_iterator<TOut>& iOut, const db_iterator<TOut>& iLim,
+                   db_iterator<const TIn>& it, const db_iterator<const TIn>& iEnd,
+                   TSTime64 tUpto, const CSFilter* pFilt)
+    {
+        if (act == CSFilter::eA_all)    // iLim is never beyond iEnd here
+        {
+            while ((iOut < iLim) && (tUpto > *it))
+                iOut.assign(*it++), ++iOut;
+        }
+        else
+        {
+            while ((iOut < iLim) && (it < iEnd) && (tUpto > *it))
+            {
+                if (TFilterPass::Pass<mode>(*pFilt, *it))
+                    iOut.assign(*it), ++iOut;
+                ++it;
+            }
+        }
+    }
+
+    //! Shared body of the GetData() routines of TSTime64-based blocks
+    /*!
+    \internal
+    Copy items from a block in a given time range and indicate if we found items past
+    the time range. The filter state and mode are tested once, here, to choose the copy
+    loop to use.
+    \param pData    The target buffer. This is updated.
+    \param nOutSize The size of each output item in bytes.
+    \param it       Iterator to the first item in the block (there must be one).
+    \param iEnd     The end of the items in the block.
+    \param r        The range to fetch, including the max number to return. This is adjusted
+                    to show done if we find data at or beyond the Upto time.
+    \param pFilt    The filter, only used if eAct is eA_some.
+    \param eAct     The filter state from CDataBlock::TestActive(), not eA_none.
+    \return         The number of items copied from the buffer.
+    */
+    template <typename TOut, typename TIn>
+    int GetItems(TOut*& pData, size_t nOutSize, db_iterator<const TIn> it,
+                 const db_iterator<const TIn>& iEnd, CSRange& r, const CSFilter* pFilt,
+                 CSFilter::eActive eAct)
+    {
+        if (*it < r.From())             // not from the start?
+        {
+            it = FindTime(it, iEnd, r.From());
+            if (it == iEnd)
+                return 0;               // nothing in this buffer
+        }
+
+        size_t nCopyMax = std::min(static_cast<size_t>(iEnd - it), r.Max());
+        db_iterator<TOut> iOut(pData, nOutSize);    // output iterator
+        db_iterator<TOut> iFrom(iOut);              // where we started from
+        db_iterator<TOut> iLimit(iOut + nCopyMax);  // limit of iteration
+        if (eAct == CSFilter::eA_all)
+            CopyItems<CSFilter::eA_all, CSFilter::eM_and>(iOut, iLimit, it, iEnd, r.Upto(), pFilt);
+        else if (pFilt->GetMode() == CSFilter::eM_and)   // mode for Pass<>() must match
+            CopyItems<CSFilter::eA_some, CSFilter::eM_and>(iOut, iLimit, it, iEnd, r.Upto(), pFilt);
+        else
+            CopyItems<CSFilter::eA_some, CSFilter::eM_or>(iOut, iLimit, it, iEnd, r.Upto(), pFilt);
+
+        pData = &*iOut;                 // update the pointer
+        auto nCopy = iOut - iFrom;      // number of items copied
+        r.ReduceMax(static_cast<size_t>(nCopy));
+        r.SetDone((iOut < iLimit) && (it < iEnd)); // done if we were timed out
+
+        return static_cast<int>(nCopy);
+    }
+}
+
 //! Test if a read will have any result and to check if a filter need be used
 /*!
 Called by all the GetData() routines to see if there is anything to do and if we
@@ -52,6 +258,42 @@ CSFilter::eActive CDataBlock::TestActive(CSRange& r, const CSFilter* pFilt) cons
     return pFilt ? pFilt->Active() : CSFilter::eA_all;
 }
 
+//! Get the summary statistics of the data in the block
+/*!
+This version counts the items and gets the first and last times, which is all that we
+need for event-based blocks.
+\param s        Returned holding the block summary.
+\param kind     The channel type.
+\param nValues  The number of values attached to each item (rows x columns).
+*/
+void CDataBlock::GetStats(TChanStats& s, TDataKind kind, size_t nValues) const
+{
+    s.Clear();
+    if (m_nItems)
+    {
+        s.m_nItems = m_nItems;
+        s.m_tFirst = FirstTime();
+        s.m_tLast = LastTime();
+    }
+}
+
+//! Extend a value range with a list of values
+/*!
+\param p    The values.
+\param n    The number of values.
+\param lo   The low end of the range, which is extended as needed.
+\param hi   The high end of the range, which is extended as needed.
+*/
+template <typename T>
+static void ExtendRange(const T* p, size_t n, T& lo, T& hi)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        lo = (p[i] < lo) ? p[i] : lo;
+        hi = (p[i] > hi) ? p[i] : hi;
+    }
+}
+
 //================================ CEventBlock ======================================
 
 //! Add event data into the buffer and report items added
@@ -96,7 +338,7 @@ int CEventBlock::GetData(TSTime64*& pData, CSRange& r, const CSFilter* pFilt) co
     citer it(cbegin());
     if (FirstTime() < r.From())         // not from the start?
     {
-        it = std::lower_bound(cbegin(), cend(), r.From());
+        it = FindTime(cbegin(), cend(), r.From());
         if (it == cend())
             return 0;                   // nothing in this buffer
     }
@@ -130,7 +372,7 @@ CEventBlock::citer CEventBlock::IterFor(TSTime64 t) const
         return cbegin();                // ...no data or if before the buffer
     if (LastTime() < t)                 // Quick return if...
         return cend();                  // ...past the end, else we must search
-    return std::lower_bound(cbegin(), cend(), t);
+    return FindTime(cbegin(), cend(), t);
 }
 
 // Find the r.Max() item before r.Upto().
@@ -200,40 +442,7 @@ int CMarkerBlock::GetData(TSTime64*& pData, CSRange& r, const CSFilter* pFilt) c
     CSFilter::eActive eAct = TestActive(r, pFilt);  // See if anything to do
     if (eAct == CSFilter::eA_none)      // bail now if nothing to do
         return 0;
-
-    citer it(cbegin());
-    if (FirstTime() < r.From())         // not from the start?
-    {
-        it = std::lower_bound(cbegin(), cend(), r.From());
-        if (it == cend())
-            return 0;                   // nothing in this buffer
-    }
-
-    size_t nCopyMax = std::min(static_cast<size_t>(cend() - it), r.Max());
-    db_iterator<TSTime64> iOut(pData, sizeof(TSTime64));    // output iterator
-    db_iterator<TSTime64> iFrom(iOut);                      // where we started from
-    db_iterator<TSTime64> iLimit(iOut + nCopyMax);          // limit of iteration
-    if (eAct == CSFilter::eA_all)
-    {
-        while ((iOut < iLimit) && (r.Upto() > *it))
-            iOut.assign(*it++), ++iOut;
-    }
-    else
-    {
-        while ((iOut < iLimit) && (it < cend()) && (r.Upto() > *it))
-        {
-            if (pFilt->Filter(*it))
-                iOut.assign(*it), ++iOut;
-            ++it;
-        }
-    }
-
-    pData = &*iOut;                     // update the pointer
-    auto nCopy = iOut - iFrom;          // number of items copied
-    r.ReduceMax(static_cast<size_t>(nCopy));
-    r.SetDone((iOut < iLimit) && (it < cend())); // done if we were timed out
-
-    return static_cast<int>(nCopy);
+    return GetItems(pData, sizeof(TSTime64), cbegin(), cend(), r, pFilt, eAct);
 }
 
 int CMarkerBlock::GetData(TMarker*& pData, CSRange& r, const CSFilter* pFilt) const
@@ -242,40 +451,7 @@ int CMarkerBlock::GetData(TMarker*& pData, CSRange& r, const CSFilter* pFilt) co
     CSFilter::eActive eAct = TestActive(r, pFilt);  // See if anything to do
     if (eAct == CSFilter::eA_none)      // bail now if nothing to do
         return 0;
-
-    citer it(cbegin());
-    if (FirstTime() < r.From())         // not from the start?
-    {
-        it = std::lower_bound(cbegin(), cend(), r.From());
-        if (it == cend())
-            return 0;                   // nothing in this buffer
-    }
-
-    size_t nCopyMax = std::min(static_cast<size_t>(cend() - it), r.Max());
-    iter iOut(pData, sizeof(TMarker));  // output iterator
-    iter iFrom(iOut);                   // where we started from
-    iter iLimit(iOut + nCopyMax);       // limit of iteration
-    if (eAct == CSFilter::eA_all)
-    {
-        while ((iOut < iLimit) && (r.Upto() > *it))
-            iOut.assign(*it++), ++iOut;
-    }
-    else
-    {
-        while ((iOut < iLimit) && (it < cend()) && (r.Upto() > *it))
-        {
-            if (pFilt->Filter(*it))
-                iOut.assign(*it), ++iOut;
-            ++it;
-        }
-    }
-
-    pData = &*iOut;                     // update the pointer
-    auto nCopy = iOut - iFrom;          // number of items copied
-    r.ReduceMax(static_cast<size_t>(nCopy));
-    r.SetDone((iOut < iLimit) && (it < cend())); // done if we were timed out
-
-    return static_cast<int>(nCopy);
+    return GetItems(pData, sizeof(TMarker), cbegin(), cend(), r, pFilt, eAct);
 }
 
 //! Get iterator for a time
@@ -293,7 +469,7 @@ CMarkerBlock::citer CMarkerBlock::IterFor(TSTime64 t) const
         return cbegin();                // ...no data or if before the buffer
     if (LastTime() < t)                 // Quick return if...
         return cend();                  // ...past the end, else we must search
-    return std::lower_bound(cbegin(), cend(), t);
+    return FindTime(cbegin(), cend(), t);
 }
 
 //! Edit a marker at a given time
@@ -310,7 +486,7 @@ int CMarkerBlock::EditMarker(TSTime64 t, const TMarker* pM, size_t nCopy)
         return 0;                       // no data or before the buffer
     if (LastTime() < t)                 // Quick return if...
         return 0;                       // ...past the end, else we must search
-    auto it = std::lower_bound(begin(), end(), t);
+    auto it = FindTime(begin(), end(), t);
     if (it->m_time != t)
         return 0;                       // no exact match
 
@@ -436,7 +612,7 @@ int CExtMarkBlock::GetData(short*& pData, CSRange& r, TSTime64& tFirst, const CS
     citer it(cbegin());
     if (FirstTime() < r.From()-tAdd)        // not from the start?
     {
-        it = std::lower_bound(cbegin(), cend(), r.From()-tAdd);
+        it = FindTime(cbegin(), cend(), r.From()-tAdd);
         if (it == cend())                   // if not found...
         {
             r.SetDone();                    // Nothing to be found...
@@ -537,40 +713,7 @@ int CExtMarkBlock::GetData(TSTime64*& pData, CSRange& r, const CSFilter* pFilt)
     CSFilter::eActive eAct = TestActive(r, pFilt);  // See if anything to do
     if (eAct == CSFilter::eA_none)      // bail now if nothing to do
         return 0;
-
-    citer it(cbegin());
-    if (FirstTime() < r.From())         // not from the start?
-    {
-        it = std::lower_bound(cbegin(), cend(), r.From());
-        if (it == cend())
-            return 0;                   // nothing in this buffer
-    }
-
-    size_t nCopyMax = std::min(static_cast<size_t>(cend() - it), r.Max());
-    db_iterator<TSTime64> iOut(pData, sizeof(TSTime64));    // output iterator
-    db_iterator<TSTime64> iFrom(iOut);                      // where we started from
-    db_iterator<TSTime64> iLimit(iOut + nCopyMax);          // limit of iteration
-    if (eAct == CSFilter::eA_all)
-    {
-        while ((iOut < iLimit) && (r.Upto() > *it))
-            iOut.assign(*it++), ++iOut;
-    }
-    else
-    {
-        while ((iOut < iLimit) && (it < cend()) && (r.Upto() > *it))
-        {
-            if (pFilt->Filter(*it))
-                iOut.assign(*it), ++iOut;
-            ++it;
-        }
-    }
-
-    pData = &*iOut;                     // update the pointer
-    auto nCopy = iOut - iFrom;          // number of items copied
-    r.ReduceMax(static_cast<size_t>(nCopy));
-    r.SetDone((iOut < iLimit) && (it < cend())); // done if we were timed out
-
-    return static_cast<int>(nCopy);
+    return GetItems(pData, sizeof(TSTime64), cbegin(), cend(), r, pFilt, eAct);
 }
 
 int CExtMarkBlock::GetData(TMarker*& pData, CSRange& r, const CSFilter* pFilt) const
@@ -579,40 +722,7 @@ int CExtMarkBlock::GetData(TMarker*& pData, CSRange& r, const CSFilter* pFilt) c
     CSFilter::eActive eAct = TestActive(r, pFilt);  // See if anything to do
     if (eAct == CSFilter::eA_none)      // bail now if nothing to do
         return 0;
-
-    citer it(cbegin());
-    if (FirstTime() < r.From())         // not from the start?
-    {
-        it = std::lower_bound(cbegin(), cend(), r.From());
-        if (it == cend())
-            return 0;                   // nothing in this buffer
-    }
-
-    size_t nCopyMax = std::min(static_cast<size_t>(cend() - it), r.Max());
-    db_iterator<TMarker> iOut(pData, sizeof(TMarker));     // output iterator
-    db_iterator<TMarker> iFrom(iOut);                      // where we started from
-    db_iterator<TMarker> iLimit(iOut + nCopyMax);          // limit of iteration
-    if (eAct == CSFilter::eA_all)
-    {
-        while ((iOut < iLimit) && (r.Upto() > *it))
-            iOut.assign(*it++), ++iOut;
-    }
-    else
-    {
-        while ((iOut < iLimit) && (it < cend()) && (r.Upto() > *it))
-        {
-            if (pFilt->Filter(*it))
-                iOut.assign(*it), ++iOut;
-            ++it;
-        }
-    }
-
-    pData = &*iOut;                     // update the pointer
-    auto nCopy = iOut - iFrom;          // number of items copied
-    r.ReduceMax(static_cast<size_t>(nCopy));
-    r.SetDone((iOut < iLimit) && (it < cend())); // done if we were timed out
-
-    return static_cast<int>(nCopy);
+    return GetItems(pData, sizeof(TMarker), cbegin(), cend(), r, pFilt, eAct);
 }
 
 int CExtMarkBlock::GetData(TExtMark*& pData, CSRange& r, const CSFilter* pFilt) const
@@ -621,40 +731,7 @@ int CExtMarkBlock::GetData(TExtMark*& pData, CSRange& r, const CSFilter* pFilt)
     CSFilter::eActive eAct = TestActive(r, pFilt);  // See if anything to do
     if (eAct == CSFilter::eA_none)      // bail now if nothing to do
         return 0;
-
-    citer it(cbegin());
-    if (FirstTime() < r.From())         // not from the start?
-    {
-        it = std::lower_bound(cbegin(), cend(), r.From());
-        if (it == cend())
-            return 0;                   // nothing in this buffer
-    }
-
-    size_t nCopyMax = std::min(static_cast<size_t>(cend() - it), r.Max());
-    iter iOut(pData, m_itemSize);       // output iterator
-    iter iFrom(iOut);                   // where we started from
-    iter iLimit(iOut + nCopyMax);       // limit of iteration
-    if (eAct == CSFilter::eA_all)
-    {
-        while ((iOut < iLimit) && (r.Upto() > *it))
-            iOut.assign(*it++), ++iOut;
-    }
-    else
-    {
-        while ((iOut < iLimit) && (it < cend()) && (r.Upto() > *it))
-        {
-            if (pFilt->Filter(*it))
-                iOut.assign(*it), ++iOut;
-            ++it;
-        }
-    }
-
-    pData = &*iOut;                     // update the pointer
-    auto nCopy = iOut - iFrom;          // number of items copied
-    r.ReduceMax(static_cast<size_t>(nCopy));
-    r.SetDone((iOut < iLimit) && (it < cend())); // done if we were timed out
-
-    return static_cast<int>(nCopy);
+    return GetItems(pData, m_itemSize, cbegin(), cend(), r, pFilt, eAct);
 }
 
 //! Get const iterator to where time t woould be placed in the block
@@ -670,7 +747,7 @@ CExtMarkBlock::citer CExtMarkBlock::IterFor(TSTime64 t) const
         return cbegin();                // ...no data or if before the buffer
     if (LastTime() < t)                 // Quick return if...
         return cend();                  // ...past the end, else we must search
-    return std::lower_bound(cbegin(), cend(), t);
+    return FindTime(cbegin(), cend(), t);
 }
 
 //! Edit a marker at a given time
@@ -687,7 +764,7 @@ int CExtMarkBlock::EditMarker(TSTime64 t, const TMarker* pM, size_t nCopy)
         return 0;                       // no data or before the buffer
     if (LastTime() < t)                 // Quick return if...
         return 0;                       // ...past the end, else we must search
-    auto it = std::lower_bound(begin(), end(), t);
+    auto it = FindTime(begin(), end(), t);
     if (it->m_time != t)
         return 0;                       // no exact match
 
@@ -704,6 +781,79 @@ int CExtMarkBlock::EditMarker(TSTime64 t, const TMarker* pM, size_t nCopy)
     return 1;
 }
 
+//! Get the range of a float value held in each item of a RealMark block
+/*!
+\param nOff The byte offset of the value in each item.
+\param fMin Returned as the smallest value, or +infinity if there are no (non-NaN) values.
+\param fMax Returned as the largest value, or -infinity if there are no (non-NaN) values.
+*/
+void CExtMarkBlock::ValueRange(size_t nOff, float& fMin, float& fMax) const
+{
+    fMin = std::numeric_limits<float>::infinity();
+    fMax = -fMin;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(m_eMark) + nOff;
+    for (uint32_t i = 0; i < m_nItems; ++i, p += m_itemSize)
+    {
+        float v;
+        memcpy(&v, p, sizeof(v));
+        fMin = (v < fMin) ? v : fMin;
+        fMax = (v > fMax) ? v : fMax;
+    }
+}
+
+//! Get the value range of the attached values of an extended marker type
+template <typename T>
+static void ItemRange(const uint8_t* p, size_t nItems, size_t nStride, size_t nValues, TChanStats& s)
+{
+    T lo = std::numeric_limits<T>::max();
+    T hi = std::numeric_limits<T>::lowest();
+    for (size_t i = 0; i < nItems; ++i, p += nStride)
+        ExtendRange(reinterpret_cast<const T*>(p + sizeof(TMarker)), nValues, lo, hi);
+    s.m_dMin = lo;
+    s.m_dMax = hi;
+}
+
+//! Get the summary statistics of the data in the block
+/*!
+As well as the item count and times, we get the range of the attached values for
+AdcMark and RealMark data.
+*/
+void CExtMarkBlock::GetStats(TChanStats& s, TDataKind kind, size_t nValues) const
+{
+    CDataBlock::GetStats(s, kind, nValues);
+    if (!m_nItems || !nValues)
+        return;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(m_eMark);
+    if (kind == RealMark)
+        ItemRange<float>(p, m_nItems, m_itemSize, nValues, s);
+    else if (kind == AdcMark)
+        ItemRange<short>(p, m_nItems, m_itemSize, nValues, s);
+}
+
+//! Find the items in a RealMark block with a float value in a range
+/*!
+The loop has no branches that depend on the data; each index is stored, then kept only
+if the value is in range, so the time taken does not depend on how many items match.
+\param nOff The byte offset of the value in each item.
+\param fLo  The lowest value to find.
+\param fHi  The highest value to find.
+\param pIdx Space for size() indices, set to the indices of the matching items in order.
+\return     The number of matching items.
+*/
+size_t CExtMarkBlock::FindValues(size_t nOff, float fLo, float fHi, uint32_t* pIdx) const
+{
+    size_t n = 0;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(m_eMark) + nOff;
+    for (uint32_t i = 0; i < m_nItems; ++i, p += m_itemSize)
+    {
+        float v;
+        memcpy(&v, p, sizeof(v));
+        pIdx[n] = i;
+        n += (v >= fLo) & (v <= fHi);
+    }
+    return n;
+}
+
 // Find the r.Max() item before r.Upto().
 // Returns  found time or -1. Reduce r.Max() by the number of skipped items. If item is
 //          found, r.Max() is set zero. If not found, if previous block could not
@@ -865,6 +1015,28 @@ CAdcBlock::cwiter CAdcBlock::cend() const
     return ++w;
 }
 
+//! Get the summary statistics of the data in the block
+/*!
+The item count is the number of data points and we get the range of the values.
+*/
+void CAdcBlock::GetStats(TChanStats& s, TDataKind kind, size_t nValues) const
+{
+    CDataBlock::GetStats(s, kind, nValues);
+    if (!m_nItems)
+        return;
+    s.m_nItems = 0;
+    short lo = std::numeric_limits<short>::max();
+    short hi = std::numeric_limits<short>::lowest();
+    const auto itEnd = cend();
+    for (auto it = cbegin(); it != itEnd; ++it)
+    {
+        s.m_nItems += it->m_nItems;
+        ExtendRange(it->m_data, it->m_nItems, lo, hi);
+    }
+    s.m_dMin = lo;
+    s.m_dMax = hi;
+}
+
 TSTime64 CAdcBlock::LastTime() const
 {
     if (m_nItems)
@@ -1233,6 +1405,28 @@ CRealWaveBlock::cwiter CRealWaveBlock::cend() const
     return ++w;
 }
 
+//! Get the summary statistics of the data in the block
+/*!
+The item count is the number of data points and we get the range of the values.
+*/
+void CRealWaveBlock::GetStats(TChanStats& s, TDataKind kind, size_t nValues) const
+{
+    CDataBlock::GetStats(s, kind, nValues);
+    if (!m_nItems)
+        return;
+    s.m_nItems = 0;
+    float lo = std::numeric_limits<float>::max();
+    float hi = std::numeric_limits<float>::lowest();
+    const auto itEnd = cend();
+    for (auto it = cbegin(); it != itEnd; ++it)
+    {
+        s.m_nItems += it->m_nItems;
+        ExtendRange(it->m_data, it->m_nItems, lo, hi);
+    }
+    s.m_dMin = lo;
+    s.m_dMax = hi;
+}
+
 TSTime64 CRealWaveBlock::LastTime() const
 {
     if (m_nItems)
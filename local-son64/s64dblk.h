@@ -139,6 +139,7 @@ namespace ceds64
 
         // Routines that are used in a generic way for all data blocks
         virtual TSTime64 LastTime() const = 0;              //!< Time of the last item in a block or -1 if none.
+        virtual TSTime64 LastRunStart() const {return -1;}  //!< Start of the contiguous wave data that ends the block or -1
 
         //! Get the last code written to the data block
         /*!
@@ -349,6 +350,8 @@ namespace ceds64
         */
         virtual void NewDataRead(){};   // Opportunity to clean any cached data
 
+        virtual void GetStats(TChanStats& s, TDataKind kind, size_t nValues) const;
+
     protected:
         CSFilter::eActive TestActive(CSRange& r, const CSFilter* pFilt = nullptr) const;
     };
@@ -469,6 +472,9 @@ namespace ceds64
         virtual TSTime64 PrevNTime(CSRange& r, const CSFilter* pFilt = nullptr) const;
         virtual TSTime64 PrevNTimeW(CSRange& r, const CSFilter* pFilt, size_t nRow, TSTime64 tDvd) const;
         virtual int EditMarker(TSTime64 t, const TMarker* pN, size_t nCopy);
+        virtual void GetStats(TChanStats& s, TDataKind kind, size_t nValues) const;
+        void ValueRange(size_t nOff, float& fMin, float& fMax) const;
+        size_t FindValues(size_t nOff, float fLo, float fHi, uint32_t* pIdx) const;
     };
 
 	//! Handles blocks of 16-bit integer data
@@ -506,6 +512,8 @@ namespace ceds64
 
         // Routines that are used in a generic way for all data blocks
         virtual TSTime64 LastTime() const;
+        virtual TSTime64 LastRunStart() const {return m_nItems ? back().m_startTime : -1;}
+        virtual void GetStats(TChanStats& s, TDataKind kind, size_t nValues) const;
         virtual int AddData(const short*& pData, size_t count, TSTime64 tFrom);
         virtual int GetData(short*& pData, CSRange& r, TSTime64& tFirst, const CSFilter* pFilter = nullptr) const;
         virtual TSTime64 PrevNTime(CSRange& r, const CSFilter* pFilt = nullptr) const;
@@ -551,6 +559,8 @@ namespace ceds64
 
         // Routines that are used in a generic way for all data blocks
         virtual TSTime64 LastTime() const;
+        virtual TSTime64 LastRunStart() const {return m_nItems ? back().m_startTime : -1;}
+        virtual void GetStats(TChanStats& s, TDataKind kind, size_t nValues) const;
         virtual int AddData(const float*& pData, size_t count, TSTime64 tFrom);
         virtual int GetData(float*& pData, CSRange& r, TSTime64& tFirst, const CSFilter* pFilter = nullptr) const;
         virtual TSTime64 PrevNTime(CSRange& r, const CSFilter* pFilt = nullptr) const;
@@ -536,6 +536,24 @@ to locate the channel data efficiently. If the channel is later reused, the chan
 increased by 1. When a Data block is reused, the new channel ID is written to it. This
 allows us to differentiate between the current data in a reused channel and older data
 from a previous use when recovering a damaged file.
+\par
+A ring archive channel (see TSon64File::SetChanRing()) reuses its own blocks. When it has
+written TChanHead::m_nRingBlocks blocks it is set to reuse them from the first, as if it
+were emptied, but the channel ID is not changed and the ChanFlag_RingWrap flag is set.
+The blocks that have not yet been reused still hold the oldest channel data, which is
+read before the data in the reused blocks.
+\par
+When data is dropped from the start of a channel (see TSon64File::TruncateBefore()), the
+dropped blocks are passed to the free block map and TChanHead::m_nFirstBlock is set to the
+index of the first block still in use. Index items before this block are not used. If all
+the blocks in use lie below one item of the top lookup table, that lookup table becomes the
+new top of the index and the block counts are reduced to match.
+\par
+The lookup tables can also be held outside the data file in an optional index file (see
+TSon64File::WriteIndexFile()) named by adding .s64idx to the data file name. This holds
+a flat table of the first time, offset and item count of every data block in use by each
+channel. It is only used when it matches TFileHead::m_doNextBlock and the block counts of
+each channel, so the data file remains the only authority.
 
 \par Count of items in the block
 This is used by data blocks and by lookup table blocks. This is always non-zero except
@@ -550,7 +568,9 @@ When used by data blocks, this is the number of items in the block. For event an
 marker-based channels, all blocks except the last will hold the maximum number of
 items that will fit in a block. However, the items counted for wave-based channels
 (Adc and RealWave) are the number of contiguous sections in the block, so this
-number may vary.
+number may vary. The library sums the counts of event and marker-based channels to
+find items by their position in the channel (see TSon64File::ItemIndexAt()); the sums
+are held in memory, not in the file.
 
 \section fileHeadBlocks Header blocks
 The header starts with a TFileHead structure that holds basic
@@ -588,7 +608,10 @@ has a value of 12.
 For the standard configuration, the first 6 bytes of a Son64 file hold: "S64pl" followed
 by a zero byte. byte 7 is the minor revision of the file system and byte 8 is the major
 revision (changed for incompatible format changes). The file revision is set in the
-source code as REV_MAJOR (currently 1) and REV_MINOR (currently 0).
+source code as REV_MAJOR (currently 1) and REV_MINOR (currently 0). The major revision of
+a file is changed to REV_MAJOR_REUSE (2) when data blocks are first passed to the free block
+map, by deleting a channel or dropping data, so that older libraries, which do not know about
+the map, refuse the file.
 
 In all header blocks, the channel number is set to 0xffff (65536), and the channel ID and
 item count are set to 0. Expansion header blocks also set the first 8 bytes of
@@ -2160,7 +2183,11 @@ aware of and deadlock situations in the library.
 You can read from a channel that is being written to by another thread. In this case the
 write thread has priority. However, we maintain separate structures for read and write
 which can greatly minimise contention (so that disk indices are not constantly being
-updated between reads in one place and writes at the end of the channel).
+updated between reads in one place and writes at the end of the channel). A read that
+needs data from the disk while a channel is being written takes a snapshot of the channel
+and reads the disk without holding the channel mutex, so a long read does not hold up the
+writer. The read returns the data as it was when it started. Ring archive channels are
+the exception; reads of these hold the channel mutex.
 */
 
 //-----------------------------------------------------------------------
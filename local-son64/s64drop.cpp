@@ -0,0 +1,423 @@
+// s64drop.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64drop.cpp
+//! \brief Dropping old or unwanted data from a channel
+/*!
+\internal
+Data is dropped a whole block at a time; only the block at the edge of the dropped range
+is trimmed and rewritten. Blocks dropped from the start of a channel are passed to the free
+block map and TChanHead::m_nFirstBlock records the first block still in use, so the work is
+proportional to the index blocks that are read, not to the data. The channel header is
+written before the blocks are freed, so the file on disk never has a channel that leads to
+blocks that another channel may be using. When all the blocks in use
+lie below one item of the top index block, that item becomes the new top of the index.
+Index blocks share disk blocks with other channels, so they are not released. Blocks dropped
+from the end of a channel are kept by the channel to be reused, exactly as for a channel that
+is emptied for reuse.
+*/
+#include <assert.h>
+#include <algorithm>
+#include "s64priv.h"
+#include "s64chan.h"
+
+using namespace std;
+using namespace ceds64;
+
+//! Get an index block of the channel
+/*!
+You must hold the channel mutex. An index block that is in the append list is taken from
+memory, so it need not be saved.
+\param pos      The disk offset of the index block.
+\param buf      Space to read the block into if it is not in the append list.
+\param pDLU     Set to point at the block, either buf or a block in the append list.
+\return         S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::IndexTable(TDiskOff pos, TDiskLookup& buf, const TDiskLookup*& pDLU)
+{
+    auto itApp = find_if(m_vAppend.cbegin(), m_vAppend.cend(), [pos](const CIndex& ind){return ind.GetDiskOffset() == pos;});
+    if (itApp != m_vAppend.cend())
+    {
+        pDLU = itApp->GetTable();
+        return S64_OK;
+    }
+    pDLU = &buf;
+    return m_file.Read(&buf, DLSize, pos);
+}
+
+//! Collect the disk offsets of a range of data blocks from the channel index
+/*!
+You must hold the channel mutex. Only the index blocks that lead to the range are used. An
+index block that is in the append list is taken from memory, so it need not be saved.
+\param pos      The disk offset of the index block to search.
+\param nSpan    The number of data blocks covered by each item of this index block.
+\param nBase    The number of the first data block covered by this index block.
+\param nFrom    The first data block number to collect.
+\param nUpto    The data block number to collect up to (not included).
+\param vDO      The disk offsets of the data blocks are added to this.
+\return         S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::CollectBlocks(TDiskOff pos, uint64_t nSpan, uint64_t nBase, uint64_t nFrom, uint64_t nUpto, vector<TDiskOff>& vDO)
+{
+    TDiskLookup buf;
+    const TDiskLookup* pDLU;
+    int err = IndexTable(pos, buf, pDLU);
+    if (err)
+        return err;
+    const TDiskLookup& dlu = *pDLU;
+    const unsigned int nItems = min<unsigned int>(dlu.m_nItems, DLUItems);
+    unsigned int i = (nFrom > nBase) ? static_cast<unsigned int>((nFrom - nBase) / nSpan) : 0;
+    for (; (i < nItems) && (nBase + i*nSpan < nUpto); ++i)
+    {
+        const TDiskOff doItem = dlu.m_items[i].m_do;
+        if (nSpan == 1)                 // an item that points at a data block
+        {
+            if ((doItem == 0) || (doItem & (DBSize-1)))
+                return CORRUPT_FILE;
+            vDO.push_back(doItem);
+        }
+        else
+        {
+            err = CollectBlocks(doItem, nSpan / DLUItems, nBase + i*nSpan, nFrom, nUpto, vDO);
+            if (err)
+                return err;
+        }
+    }
+    return S64_OK;
+}
+
+//! Collect all the data blocks the channel still owns
+/*!
+You must hold the channel mutex or otherwise be sure that no other thread can use the
+channel. This is used when the channel index is about to be abandoned. Pass the blocks
+to ReleaseBlocks() once the channel header no longer leads to them.
+\param vDO  The disk offsets of the data blocks are added to this.
+\return     S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::CollectLiveBlocks(vector<TDiskOff>& vDO)
+{
+    const uint64_t nOwned = max(m_chanHead.m_nBlocks, m_chanHead.m_nAllocatedBlocks);
+    if (!m_chanHead.m_doIndex || (nOwned <= m_chanHead.m_nFirstBlock))
+        return S64_OK;
+    uint64_t nSpan = 1;                 // data blocks per item of the top index block
+    for (unsigned int i = DepthFor(); i > 1; --i)
+        nSpan *= DLUItems;
+    return CollectBlocks(m_chanHead.m_doIndex, nSpan, 0, m_chanHead.m_nFirstBlock, nOwned, vDO);
+}
+
+//! Pass data blocks that the channel no longer uses to the free block map
+/*!
+You must hold the channel mutex. The channel header must already have been changed so that
+it does not lead to the blocks. We write it before the blocks can be given to another
+channel, so that a crash cannot leave this channel using blocks that now hold other data.
+If the header cannot be written, the blocks are not freed. A snapshot read that is in
+progress may be reading the blocks, so if there are any, the blocks are held until the
+last of them is done. Blocks that do not fit in the free block map are also held, and are
+offered to the map again with the next blocks that we release.
+\param vDO  The disk offsets of the data blocks. This is sorted.
+\return     S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::ReleaseBlocks(vector<TDiskOff>& vDO)
+{
+    if (vDO.empty())
+        return S64_OK;
+    int err = m_file.WriteChanHeader(m_nChan);
+    if (err)
+        return err;
+    m_bModified = false;                // the header is up to date
+    m_vFreeLater.insert(m_vFreeLater.end(), vDO.begin(), vDO.end());
+    if (m_nSnapActive == 0)             // snapshot reads may be using the blocks
+        m_file.FreeDataBlocks(m_vFreeLater);    // leaves the blocks that do not fit
+    return S64_OK;
+}
+
+//! Replace a data block with the part of it that lies in a time range
+/*!
+You must hold the channel mutex. The new block is written to the same disk position with
+the same parent, so the index is unchanged, and the read manager is told of the change.
+\param src      The block to trim, which must have a disk position.
+\param tFrom    The start of the time range to keep.
+\param tUpto    The end of the time range to keep (not included).
+\return         S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::ReplaceBlock(const CDataBlock& src, TSTime64 tFrom, TSTime64 tUpto)
+{
+    assert(src.DiskOff());
+    unique_ptr<CDataBlock> pBlk(CopyRange(src, tFrom, tUpto));
+    pBlk->SetDiskOff(src.DiskOff());
+    pBlk->SetParent(src.GetParentBlock(), src.GetParentIndex(), 0);
+    pBlk->m_chanID = src.m_chanID;
+    int err = m_file.Write(pBlk->DataBlock(), DBSize, pBlk->DiskOff());
+    if (err == 0)
+        m_bmRead.UpdateData(*pBlk);     // src may be the read block
+    return err;
+}
+
+//! Drop all the data in the channel
+/*!
+You must hold the channel mutex. Unlike EmptyForReuse(), the blocks are passed to the free
+block map for any channel to use and the channel starts a new index when it is written.
+\return S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::DropAll()
+{
+    vector<TDiskOff> vDO;
+    int err = CollectLiveBlocks(vDO);
+    if (err)
+        return err;
+    m_chanHead.m_doIndex = 0;           // the channel has no index or blocks
+    m_chanHead.m_nBlocks = m_chanHead.m_nAllocatedBlocks = m_chanHead.m_nFirstBlock = 0;
+    m_chanHead.m_lastTime = -1;         // and no data
+    m_vAppend.clear();
+    m_bmRead.Invalidate();
+    if (m_pWr)
+        m_pWr->clear();                 // forget the (saved) last block
+    InvalidateStats();
+    m_bModified = true;                 // Header needs writing
+    return ReleaseBlocks(vDO);
+}
+
+//! Drop all the data before a time from the start of the channel
+/*!
+You _must not_ hold the channel mutex and the channel should be committed. Whole blocks
+before the block that holds t are passed to the free block map; the block holding t is
+trimmed. This cannot be used with a ring archive channel, which drops its own old data.
+\param t    The time of the first data to keep.
+\return     S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::TruncateBefore(TSTime64 t)
+{
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    if (m_chanHead.m_nRingBlocks)       // a ring archive manages its own blocks
+        return BAD_PARAM;
+    if (m_chanHead.m_nBlocks == 0)      // nothing on disk, nothing to drop
+        return S64_OK;
+    ++m_nRewrite;                       // blocks are changed and freed under snapshot reads
+    for (int i = 0; i < static_cast<int>(m_vAppend.size()); ++i)
+    {
+        int err = SaveAppendIndex(i);   // we read the index from disk
+        if (err)
+            return err;
+    }
+
+    int err = m_bmRead.LoadBlock(t);    // find the first block to keep
+    if (err < 0)
+        return err;
+    if (err > 0)                        // no data at or after t...
+        return DropAll();               // ...so everything goes
+    uint64_t nKeep = static_cast<uint64_t>(m_bmRead.BlockNumber());
+    if (m_bmRead.DataBlock().FirstTime() < t)
+    {
+        err = ReplaceBlock(m_bmRead.DataBlock(), t, TSTIME64_MAX);
+        if (err)
+            return err;
+    }
+
+    TChanHead& ch = m_chanHead;         // to save typing
+    vector<TDiskOff> vDO;               // the blocks we drop
+    if (nKeep > ch.m_nFirstBlock)       // there are whole blocks to drop
+    {
+        uint64_t nOwned = max(ch.m_nBlocks, ch.m_nAllocatedBlocks);
+        unsigned int level = DepthFor();
+        uint64_t nSpan = 1;             // data blocks per item of the top index block
+        for (unsigned int i = level; i > 1; --i)
+            nSpan *= DLUItems;
+        err = CollectBlocks(ch.m_doIndex, nSpan, 0, ch.m_nFirstBlock, nKeep, vDO);
+        if (err)
+            return err;
+
+        // While the blocks in use all lie below one item of the top index block, make the
+        // index block that the item points at the new top of the index. We work in locals
+        // and only change the header once all the disk reads and writes have worked.
+        TDiskOff doTop = ch.m_doIndex;
+        uint64_t nFirst = nKeep;        // the new header values
+        uint64_t nBlocks = ch.m_nBlocks;
+        uint64_t nAllocated = ch.m_nAllocatedBlocks;
+        TDiskLookup dlu;
+        while ((level > 1) && (nFirst / nSpan == (nOwned-1) / nSpan))
+        {
+            err = m_file.Read(&dlu, DLSize, doTop);
+            if (err)
+                return err;
+            const uint64_t nItem = nFirst / nSpan;
+            const uint64_t nSkip = nItem * nSpan;   // blocks below the items we lose
+            doTop = dlu.m_items[nItem].m_do;
+            nFirst -= nSkip;
+            nBlocks -= nSkip;
+            if (nAllocated)
+                nAllocated -= nSkip;
+            nOwned -= nSkip;
+            nSpan /= DLUItems;
+            --level;
+        }
+        if (doTop != ch.m_doIndex)      // if we have a new top block...
+        {
+            err = m_file.Read(&dlu, DLSize, doTop);
+            if (err)
+                return err;
+            dlu.SetParent(0, 0, level); // ...it has no parent
+            err = m_file.Write(&dlu, DLSize, doTop);
+            if (err)
+                return err;
+        }
+        ch.m_doIndex = doTop;           // all is well, so change the header
+        ch.m_nFirstBlock = nFirst;
+        ch.m_nBlocks = nBlocks;
+        ch.m_nAllocatedBlocks = nAllocated;
+    }
+
+    m_vAppend.clear();                  // the append list must be loaded again
+    m_bmRead.Invalidate();              // as must the read tree
+    InvalidateStats();
+    m_bModified = true;                 // Header needs writing
+    err = ReleaseBlocks(vDO);           // writes the header first
+    if ((err == 0) && m_pWr)            // reload the last block for appending
+        err = InitWriteBlock(m_pWr.release());
+    return err;
+}
+
+//! Drop all the data at and after a time from the end of the channel
+/*!
+You _must not_ hold the channel mutex and the channel should be committed. The block that
+holds t is trimmed and the blocks after it are kept by the channel to be reused as more
+data is written, so the disk space used does not change. This cannot be used with a ring
+archive channel.
+\param t    The time of the first data to drop.
+\return     S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::DropFrom(TSTime64 t)
+{
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    if (m_chanHead.m_nRingBlocks)       // a ring archive manages its own blocks
+        return BAD_PARAM;
+    if (m_chanHead.m_nBlocks == 0)      // nothing on disk, nothing to drop
+        return S64_OK;
+    ++m_nRewrite;                       // blocks are changed and freed under snapshot reads
+
+    int err = m_bmRead.LoadBlock(t);    // find the first block to drop
+    if (err)                            // if error, or no data at or after t...
+        return (err < 0) ? err : S64_OK;    // ...we are done
+    uint64_t nBlocks = static_cast<uint64_t>(m_bmRead.BlockNumber());   // blocks to keep
+    if (m_bmRead.DataBlock().FirstTime() < t)
+    {
+        err = ReplaceBlock(m_bmRead.DataBlock(), 0, t);
+        if (err)
+            return err;
+        ++nBlocks;                      // the trimmed block is kept
+    }
+    if (nBlocks <= m_chanHead.m_nFirstBlock)    // if nothing is left...
+        return DropAll();
+
+    for (int i = 0; i < static_cast<int>(m_vAppend.size()); ++i)
+    {
+        err = SaveAppendIndex(i);       // the reuse code reads these from disk
+        if (err)
+            return err;
+    }
+    const uint64_t nOwned = max(m_chanHead.m_nBlocks, m_chanHead.m_nAllocatedBlocks);
+    m_chanHead.m_nBlocks = nBlocks;
+    m_chanHead.m_nAllocatedBlocks = (nOwned > nBlocks) ? nOwned : 0;
+    m_vAppend.clear();                  // the append list must be loaded again
+    m_bmRead.Invalidate();
+
+    err = m_bmRead.LoadNumbered(nBlocks-1); // get the new last block
+    if (err == 0)
+        m_chanHead.m_lastTime = m_bmRead.DataBlock().LastTime();
+    m_bmRead.Invalidate();              // the reuse counts must be worked out again
+    if ((err == 0) && m_pWr)            // reload the last block for appending
+        err = InitWriteBlock(m_pWr.release());
+    InvalidateStats();
+    m_bModified = true;                 // Header needs writing
+    return err;
+}
+
+//! Drop all the data before a time from a channel
+/*!
+This is for keeping a bounded time window of data in a long-running recording. Whole data
+blocks before the block that holds t are released to the free block map, where any channel
+can reuse them, and only the block that holds t is rewritten. The work done is proportional
+to the index blocks that are read, not to the amount of data that is dropped. The channel
+index is not rebuilt; when the remaining data lies below one item of the top index block,
+the index is shortened. Afterwards, ChanMinTime() is at or after t. This cannot be used
+with ring archive channels, which drop their oldest data themselves.
+\param chan The channel number.
+\param t    The time of the first data to keep. If this is after all the channel data, the
+            channel is emptied.
+\return     S64_OK (0) or a negative error code.
+*/
+int TSon64File::TruncateBefore(TChanNum chan, TSTime64 t)
+{
+    if (m_bReadOnly)
+        return READ_ONLY;
+    TChRdLock lock(m_mutChans);         // we are not changing the #chans
+    if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+        return NO_CHANNEL;
+    CSon64Chan& ch = *m_vChan[chan];
+    int err = ch.Commit();              // get buffered data and the index on disk
+    if (err == 0)
+        err = ch.TruncateBefore(t);
+    ++m_nEditGen;                       // any text index of the channel is out of date
+    int locErr = ch.Commit();           // write the channel header
+    return err ? err : locErr;
+}
+
+//! Drop the data in a time range from the start or the end of a channel
+/*!
+Data dropped from the start is handled as for TruncateBefore(). When data is dropped from
+the end, the blocks after the dropped time are kept by the channel and are reused as new
+data is written, so you can then write data from tFrom onwards. The range must include the
+start or the end of the channel data; a range in the middle of the channel would need the
+data after it to be moved, so it is not allowed.
+\param chan     The channel number.
+\param tFrom    The start of the range to drop.
+\param tUpto    The end of the range to drop (not included).
+\return         S64_OK (0) or a negative error code. BAD_PARAM means that the range is in the
+                middle of the channel data (or the channel is a ring archive).
+*/
+int TSon64File::DropRange(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto)
+{
+    if (m_bReadOnly)
+        return READ_ONLY;
+    TChRdLock lock(m_mutChans);         // we are not changing the #chans
+    if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+        return NO_CHANNEL;
+    CSon64Chan& ch = *m_vChan[chan];
+    int err = ch.Commit();              // get buffered data and the index on disk
+    if (err)
+        return err;
+
+    const TSTime64 tMin = ch.MinTime();
+    if (tMin < -1)
+        return static_cast<int>(tMin);
+    const TSTime64 tMax = ch.MaxTime();
+    if ((tMin < 0) || (tUpto <= tFrom) || (tFrom > tMax) || (tUpto <= tMin))
+        return S64_OK;                  // nothing to drop
+    if (tFrom <= tMin)                  // dropping from the start
+        err = ch.TruncateBefore(tUpto);
+    else if (tUpto > tMax)              // dropping the end
+        err = ch.DropFrom(tFrom);
+    else
+        return BAD_PARAM;               // cannot drop from the middle
+    ++m_nEditGen;                       // any text index of the channel is out of date
+    int locErr = ch.Commit();           // write the channel header
+    return err ? err : locErr;
+}
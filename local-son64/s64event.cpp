@@ -399,14 +399,34 @@ int TSon64File::WriteEvents(TChanNum chan, const TSTime64* pData, size_t count)
     if (count == 0)
         return 0;
 
-    TChRdLock lock(m_mutChans);     // we are not changing the #chans
-    if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
-        return NO_CHANNEL;
+    int err;
+    TSTime64 tPrev;                 // last time before the write
+    {
+        TChRdLock lock(m_mutChans);     // we are not changing the #chans
+        if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+            return NO_CHANNEL;
+
+        tPrev = m_vChan[chan]->MaxTime();
+        err = m_vChan[chan]->WriteData(pData, count);
+    }
 
-    return m_vChan[chan]->WriteData(pData, count);
+    if (err == 0)                   // we must not hold m_mutChans for this
+        AddToCounts(chan, pData, sizeof(TSTime64), count, false, tPrev);
+    return err;
 }
 
 int TSon64File::ReadEvents(TChanNum chan, TSTime64* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    return ReadEventsWith(chan, pData, nMax, tFrom, tUpto, pFilter, nullptr);
+}
+
+//! Read event times, reading the disk with a snapshot reader owned by the caller
+/*!
+This is ReadEvents() for a thread that makes many reads of one channel (see s64snap.cpp).
+\param pReader  A reader that the calling thread owns for reads of this channel, or nullptr.
+*/
+int TSon64File::ReadEventsWith(TChanNum chan, TSTime64* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                               const CSFilter* pFilter, TSnapReader* pReader)
 {
     assert(nMax > 0);
     if ((nMax <= 0) || (tUpto < 0) || (tFrom >= tUpto) )
@@ -416,6 +436,7 @@ int TSon64File::ReadEvents(TChanNum chan, TSTime64* pData, int nMax, TSTime64 tF
         return NO_CHANNEL;
 
     CSRange r(tFrom, tUpto, nMax);   // make a range object to manage the request
+    r.SetReader(pReader);
     int nGot = 0;
     while (true)
     {
@@ -121,6 +121,16 @@ CSFilter::eMode CSFilter::GetMode() const
     return m_mode;
 }
 
+//! Return the number of layers in use
+/*!
+\ingroup GpFilter
+\return The number of marker code layers that the filter tests (4 or 8).
+*/
+int CSFilter::GetLayers() const
+{
+    return m_nLayers;
+}
+
 //! Set the current filter mode
 /*!
 \ingroup GpFilter
@@ -45,6 +45,7 @@
 namespace ceds64
 {
     struct TMarker;
+    struct TFilterPass;                 // internal, see s64dblk.cpp
 
     /*! \defgroup GpFilter CSFilter and member functions
     \brief The CSFilter class used to filter marker and extended marker data.
@@ -109,6 +110,7 @@ namespace ceds64
             eM_or           //!< Any code may match
         };
         eMode DllClass GetMode() const;
+        int DllClass GetLayers() const;
         void DllClass SetMode(eMode mode);
         bool DllClass Filter(const TMarker& mark) const;
 
@@ -139,6 +141,7 @@ namespace ceds64
         void DllClass SetElements(const void* pCopy, int layer);
 
     private:
+        friend struct TFilterPass;      // the block read loops in s64dblk.cpp
         std::array<TMask, 8> m_mask;
         int m_nLayers;                  //!< The number of layers in use (4 or 8).
         int m_nColumn;                  //!< -1 for all, else trace number to use with AdcMark
@@ -0,0 +1,216 @@
+// s64find.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64find.cpp
+//! \brief Batched searches for the events around many query times
+/*!
+\internal
+The queries are sorted, then merged against the channel data, which is read forwards in
+large chunks. Each part of the channel that holds queries is read once. When there is a
+large gap between queries, we use PrevNTime() to skip the gap rather than read through it.
+Large query sets are split into contiguous time ranges that are searched in parallel. Each
+search has its own snapshot reader (see s64snap.cpp), so the threads read the disk side by
+side rather than queue for the channel mutex and its one block manager.
+*/
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <thread>
+#include "s64priv.h"
+#include "s64chan.h"
+
+using namespace std;
+using namespace ceds64;
+
+//! Number of events we read from the channel at a time
+static const int nFindBuf = 4096;
+
+//! The minimum number of queries worth giving to a thread
+static const size_t nFindPerThread = 16384;
+
+//! Search a channel for the events around a time-sorted list of queries
+/*!
+\param chan     The channel to search.
+\param pQuery   The list of queries.
+\param pOrder   The indices into pQuery of the queries to search, in time order.
+\param n        The number of indices in pOrder.
+\param pOut     The result for query pQuery[i] is written to pOut[i]. This is the time of
+                the last event at or before the query time, or if bNearest, the time of the
+                nearest event (the earlier one if there is a tie). It is -1 if there is no
+                such event.
+\param pFilter  A marker filter or nullptr.
+\param bNearest If true, find the nearest event, else the previous event.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::FindSorted(TChanNum chan, const TSTime64* pQuery, const size_t* pOrder, size_t n, TSTime64* pOut,
+                           const CSFilter* pFilter, bool bNearest)
+{
+    if (n == 0)
+        return S64_OK;
+
+    // When we want the previous event, we never need data after the last query
+    const TSTime64 tLastQ = pQuery[pOrder[n-1]];
+    const TSTime64 tUpto = (bNearest || (tLastQ == TSTIME64_MAX)) ? TSTIME64_MAX : tLastQ + 1;
+
+    vector<TSTime64> buf(nFindBuf);
+    TSnapReader reader;                 // our own place in the channel
+    int nIn = 0;                        // events in the buffer
+    int pos = 0;                        // first buffered event after the last query
+    TSTime64 tLast = -1;                // last event at or before the current query
+    TSTime64 tRead = max<TSTime64>(pQuery[pOrder[0]], 0);  // where the next read starts
+    if (tRead > 0)                      // find the event before the first query
+    {
+        tLast = PrevNTime(chan, tRead, 0, 1, pFilter);
+        if (tLast < -1)
+            return static_cast<int>(tLast);
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        const TSTime64 q = pQuery[pOrder[i]];
+        bool bRead = false;             // set once we read for this query
+        while (true)
+        {
+            while ((pos < nIn) && (buf[pos] <= q))
+                tLast = buf[pos++];
+            if ((pos < nIn) || (tRead >= tUpto) || (!bNearest && (tRead > q)))
+                break;                  // we have all we need
+
+            // If a full buffer did not reach the query, skip the rest of the gap.
+            if (bRead && (tRead <= q))
+            {
+                TSTime64 t = PrevNTime(chan, q+1, tRead, 1, pFilter);
+                if (t < -1)
+                    return static_cast<int>(t);
+                if (t >= 0)
+                    tLast = t;
+                tRead = q + 1;
+                if (!bNearest && (tRead >= tUpto))
+                    break;
+            }
+
+            nIn = ReadEventsWith(chan, buf.data(), nFindBuf, tRead, tUpto, pFilter, &reader);
+            if (nIn < 0)
+                return nIn;
+            pos = 0;
+            tRead = (nIn == nFindBuf) ? buf[nIn-1] + 1 : tUpto;
+            bRead = true;
+        }
+
+        TSTime64 tOut = tLast;
+        if (bNearest && (pos < nIn))    // buf[pos] is the first event after q
+        {
+            const TSTime64 tNext = buf[pos];
+            if ((tLast < 0) || (tNext - q < q - tLast))
+                tOut = tNext;
+        }
+        pOut[pOrder[i]] = tOut;
+    }
+    return S64_OK;
+}
+
+//! Search a channel for the events around a list of query times
+/*!
+\param chan     The channel to search.
+\param pQuery   The list of n query times, in any order.
+\param n        The number of queries.
+\param pOut     The list of n results, one per query.
+\param pFilter  A marker filter or nullptr.
+\param bNearest If true, find the nearest event, else the previous event.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::FindEvents(TChanNum chan, const TSTime64* pQuery, size_t n, TSTime64* pOut,
+                           const CSFilter* pFilter, bool bNearest)
+{
+    TDataKind kind = ChanKind(chan);
+    if (kind == ChanOff)
+        return NO_CHANNEL;
+    if ((kind == Adc) || (kind == RealWave))
+        return CHANNEL_TYPE;            // only event-based channels
+    if (n == 0)
+        return S64_OK;
+
+    vector<size_t> vOrder(n);           // queries sorted into time order
+    iota(vOrder.begin(), vOrder.end(), 0);
+    if (!is_sorted(pQuery, pQuery+n))
+        stable_sort(vOrder.begin(), vOrder.end(), [pQuery](size_t a, size_t b){return pQuery[a] < pQuery[b];});
+
+    size_t nThreads = min<size_t>(n / nFindPerThread, max(1u, thread::hardware_concurrency()));
+    if (nThreads <= 1)
+        return FindSorted(chan, pQuery, vOrder.data(), n, pOut, pFilter, bNearest);
+
+    // Each thread searches a contiguous time range of the sorted queries
+    atomic<int> firstErr(0);            // the first error we detect
+    auto worker = [&](size_t iFrom, size_t iUpto)
+    {
+        int err = FindSorted(chan, pQuery, vOrder.data()+iFrom, iUpto-iFrom, pOut, pFilter, bNearest);
+        int expect = 0;
+        if (err)
+            firstErr.compare_exchange_strong(expect, err);
+    };
+
+    vector<thread> vThreads;
+    for (size_t i = 1; i < nThreads; ++i)
+        vThreads.emplace_back(worker, n*i/nThreads, n*(i+1)/nThreads);
+    worker(0, n/nThreads);              // this thread does its share
+    for (auto& t : vThreads)
+        t.join();
+    return firstErr;
+}
+
+//! Find the last event at or before each of a list of times
+/*!
+This is equivalent to calling PrevNTime(chan, pQuery[i]+1) for each query, but the channel
+is read forwards, so each data block is read once. The queries need not be sorted, but
+sorted queries save a sort. Large query lists are searched by several threads.
+\param chan     The channel to search. This can be any channel type except waveforms.
+\param pQuery   The list of n query times.
+\param n        The number of queries.
+\param pOut     The list of n results. pOut[i] is set to the time of the last event at or
+                before pQuery[i], or -1 if there is no such event.
+\param pFilter  If the channel is a marker or derived type, a filter that limits the events
+                that are considered, otherwise nullptr.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::FindPrevious(TChanNum chan, const TSTime64* pQuery, size_t n, TSTime64* pOut, const CSFilter* pFilter)
+{
+    return FindEvents(chan, pQuery, n, pOut, pFilter, false);
+}
+
+//! Find the nearest event to each of a list of times
+/*!
+This works in the same way as FindPrevious(), but finds the nearest event on either side
+of each query time. If two events are equally near, the earlier event is returned.
+\param chan     The channel to search. This can be any channel type except waveforms.
+\param pQuery   The list of n query times.
+\param n        The number of queries.
+\param pOut     The list of n results. pOut[i] is set to the time of the event nearest to
+                pQuery[i], or -1 if the channel holds no events.
+\param pFilter  If the channel is a marker or derived type, a filter that limits the events
+                that are considered, otherwise nullptr.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::FindNearest(TChanNum chan, const TSTime64* pQuery, size_t n, TSTime64* pOut, const CSFilter* pFilter)
+{
+    return FindEvents(chan, pQuery, n, pOut, pFilter, true);
+}
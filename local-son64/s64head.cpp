@@ -21,6 +21,7 @@
 */
 
 #include "s64priv.h"
+#include "s64io.h"
 #include <assert.h>
 using namespace ceds64;
 using namespace std;
@@ -38,6 +39,15 @@ struct TExpBlock : public TDiskBlockHead
 	TExpBlock(){fill_n(space, size_t(nFill), 0);}       //!< Constructor zeros the space
 };
 
+//! Structure used to hold the free block map on disk.
+//! \internal
+struct TFreeMapBlock : public TDiskBlockHead
+{
+    TFreeRun m_runs[FreeRunsMax];                       //!< The free runs, sorted by offset
+    TFreeMapBlock(){memset(m_runs, 0, sizeof(m_runs));} //!< Constructor zeros the space
+};
+static_assert(sizeof(TFreeMapBlock) <= DBSize, "TFreeMapBlock too large");
+
 TFileHeadID::TFileHeadID(uint8_t major, uint8_t minor)
     : m_Minor( minor )
     , m_Major( major )
@@ -165,6 +175,8 @@ void TFileHead::Init(uint16_t nChannels, uint32_t nFUser)
 
     m_doNextBlock = DBSize;     // The header is always assigned (0 means size exceeded)
     m_doNextIndex = 0;          // No index block yet assigned
+    m_nFreeRuns = 0;            // No free block map
+    m_doFreeMap = 0;
 
     fill(m_pad.begin(), m_pad.end(), 0);    // fill in the padding space
 }
@@ -173,7 +185,7 @@ void TFileHead::Init(uint16_t nChannels, uint32_t nFUser)
 int TFileHead::Verify() const
 {
     if ((m_chan != 0xffff) ||                       // correct ident for header
-        (TFileHeadID(m_doParent).m_Major > REV_MAJOR) || // cannot cope with this
+        (TFileHeadID(m_doParent).m_Major > REV_MAJOR_REUSE) || // cannot cope with this
         (!TFileHeadID(m_doParent).IdentOK()) ||     // File ident wrong
         (m_nUserStart < sizeof(TFileHead)) ||       // user start in wrong place
         (m_nChanStart < m_nUserStart+m_nUserSize) ||
@@ -182,7 +194,11 @@ int TFileHead::Verify() const
         (m_nStringStart < m_nChanStart+m_nChannels*m_nChanHeadSize) ||
         (m_nChanHeadSize != sizeof(TChanHead)) ||
         (m_doNextIndex > m_doNextBlock) ||
-        (m_nHeaderExt > HD_EXT))                    // not too many extensions
+        (m_nHeaderExt > HD_EXT) ||                  // not too many extensions
+        (m_nFreeRuns > FreeRunsMax) ||              // free map must fit in a block
+        (m_doFreeMap & (DBSize-1)) ||               // and be a block in the file
+        (m_doFreeMap >= m_doNextBlock) ||
+        (m_nFreeRuns && !m_doFreeMap))
         return WRONG_FILE;
 
     // Check that the string table starts within the header
@@ -204,12 +220,30 @@ int TFileHead::Version() const
 }
 
 //---------------------- TSon64File ------------------------------------------------
-// Call to allocate the next disk block of size DBSize bytes at the end of the file.
-// The first block is always allocated to the head when a file is created, so this can
-// never return 0 (unless the file is full... unlikely with current disk systems!).
+// Call to allocate the next disk block of size DBSize bytes. Blocks released by deleted
+// channels are used first, preferring the block that follows doNear, otherwise the block
+// is at the end of the file. The first block is always allocated to the head when a file
+// is created, so this can never return 0 (unless the file is full... unlikely with current
+// disk systems!).
 // YOU MUST HOLD m_mutHead TO DO THIS.
-TDiskOff TSon64File::LockedAllocateDiskBlock()
+TDiskOff TSon64File::LockedAllocateDiskBlock(TDiskOff doNear)
 {
+    if (!m_vFree.empty())                       // if we have released blocks, use them
+    {
+        // Use the run that follows doNear if there is one, else the first run
+        auto it = lower_bound(m_vFree.begin(), m_vFree.end(), doNear + DBSize,
+                              [](const TFreeRun& r, TDiskOff pos){return r.m_do < pos;});
+        if ((it == m_vFree.end()) || (it->m_do != doNear + DBSize))
+            it = m_vFree.begin();
+        TDiskOff doReturn = it->m_do;
+        if (--it->m_nBlocks == 0)               // if the run is used up...
+            m_vFree.erase(it);                  // ...forget it
+        else
+            it->m_do += DBSize;
+        m_bFreeDirty = true;                    // the map has changed
+        return doReturn;
+    }
+
     TDiskOff doReturn = m_Head.m_doNextBlock;   // next block to be written
     if (doReturn)                               // 0 means file is full!
     {
@@ -219,6 +253,27 @@ TDiskOff TSon64File::LockedAllocateDiskBlock()
     return doReturn;
 }
 
+//! Mark the file as holding data blocks that have been passed to the free block map
+/*!
+\internal
+You must hold the head mutex. Older libraries ignore the free block map, so they could
+undelete a channel, or read dropped data, from blocks that now belong to another channel.
+The first time blocks are freed we change the file major revision to REV_MAJOR_REUSE,
+which older libraries refuse, and write the file head at once so that it is on disk
+before any freed block can be used again.
+\return S64_OK (0) if all done OK or a negative error code.
+*/
+int TSon64File::LockedMarkReuse()
+{
+    const TFileHeadID id(m_Head.m_doParent);
+    if (id.m_Major >= REV_MAJOR_REUSE)      // already marked
+        return S64_OK;
+    if (m_bReadOnly)
+        return READ_ONLY;
+    m_Head.m_doParent = TFileHeadID(REV_MAJOR_REUSE, id.m_Minor);
+    return WriteHeader(&m_Head, sizeof(m_Head), 0);
+}
+
 //! Allocate the next free disk block
 /*!
 \internal
@@ -226,12 +281,14 @@ Call to allocate the next disk block of size DBSize bytes at the end of the file
 The first block is always allocated to the head when a file is created, so this can
 never return 0 (unless the file is full... unlikely with current disk systems!).
 You must NOT be holding m_mutHead or you will deadlock here.
+\param doNear If there are free blocks, we prefer the block after this one, so pass in
+              the last block of the channel to keep channel data together.
 \return Offset to the block or 0 if the file/disk is full.
 */
-TDiskOff TSon64File::AllocateDiskBlock()
+TDiskOff TSon64File::AllocateDiskBlock(TDiskOff doNear)
 {
     THeadLock lock(m_mutHead);
-    return LockedAllocateDiskBlock();
+    return LockedAllocateDiskBlock(doNear);
 }
 
 //! Allocate the next index block
@@ -380,17 +437,15 @@ int TSon64File::ReadHeader(void* pBuffer, uint32_t bytes, uint32_t hOffset)
 	TVXfer vXfer;						// to get the sections to break into
     if (!HeadOffset(hOffset, bytes, vXfer))
         return PAST_EOF;                // read past end of header section
-    auto it = vXfer.cbegin();
-    while (it != vXfer.cend())
+    vector<TIOReq> vReq;                // read all the sections in one go
+    vReq.reserve(vXfer.size());
+    for (const auto& x : vXfer)
     {
-        int iErr = Read(pBuffer, it->m_nUse, it->m_os);
-        if (iErr < 0)
-            return iErr;
-        pBuffer = static_cast<char*>(pBuffer) + it->m_nUse;
-        ++it;
+        vReq.emplace_back(pBuffer, x.m_nUse, x.m_os);
+        pBuffer = static_cast<char*>(pBuffer) + x.m_nUse;
     }
 
-    return S64_OK;
+    return ReadBatch(vReq.data(), vReq.size());
 }
 
 
@@ -417,17 +472,15 @@ int TSon64File::WriteHeader(const void* pBuffer, uint32_t bytes, uint32_t hOffse
 	TVXfer vXfer;						// to get the sections to break into
     if (!HeadOffset(hOffset, bytes, vXfer, true))   // allow to extend
         return PAST_EOF;                // read past end of header section
-    auto it = vXfer.cbegin();
-    while (it != vXfer.cend())
+    vector<TIOReq> vReq;                // write all the sections in one go
+    vReq.reserve(vXfer.size());
+    for (const auto& x : vXfer)
     {
-        int iErr = Write(pBuffer, it->m_nUse, it->m_os);
-        if (iErr < 0)
-            return iErr;
-        pBuffer = static_cast<const char*>(pBuffer) + it->m_nUse;
-        ++it;
+        vReq.emplace_back(pBuffer, x.m_nUse, x.m_os);
+        pBuffer = static_cast<const char*>(pBuffer) + x.m_nUse;
     }
 
-    return S64_OK;
+    return WriteBatch(vReq.data(), vReq.size());
 }
 
 //! Write the string store into the file head. You must hold the head mutex.
@@ -501,6 +554,83 @@ int TSon64File::ReadStringStore()
    return 0;
 }
 
+//! Read the free block map from the file. You must hold the head mutex.
+/*!
+\internal
+The channel headers must already be read. Runs that claim to come from a deleted channel
+that is no longer deleted (because a library that predates REV_MAJOR_REUSE reused or
+undeleted it) are dropped as the blocks are in use.
+\return S64_OK (0) if all done OK or a negative error code.
+*/
+int TSon64File::ReadFreeMap()
+{
+    m_vFree.clear();
+    m_bFreeDirty = false;
+    if (m_Head.m_nFreeRuns == 0)
+        return S64_OK;
+
+    TFreeMapBlock blk;
+    int err = Read(&blk, DBSize, m_Head.m_doFreeMap);
+    if (err)
+        return err;
+
+    for (uint32_t i = 0; i < m_Head.m_nFreeRuns; ++i)
+    {
+        const TFreeRun& r = blk.m_runs[i];
+        if ((r.m_do & (DBSize-1)) || (r.m_do + static_cast<TDiskOff>(r.m_nBlocks)*DBSize > m_Head.m_doNextBlock))
+            return CORRUPT_FILE;
+        if (r.m_chan != FreeRunNoChan)
+        {
+            if ((r.m_chan >= m_vChanHead.size()) || !m_vChanHead[r.m_chan].IsDeleted() ||
+                !(m_vChanHead[r.m_chan].m_flags & ChanFlag_BlocksFree))
+            {
+                m_bFreeDirty = true;        // the map has changed
+                continue;
+            }
+        }
+        m_vFree.push_back(r);
+    }
+    return S64_OK;
+}
+
+//! Write the free block map to the file. You must hold the head mutex.
+/*!
+\internal
+The map block is allocated the first time there is something to save; after that it is
+always rewritten in the same place. The file head is marked as needing to be written.
+\return S64_OK (0) if all done OK or a negative error code.
+*/
+int TSon64File::WriteFreeMap()
+{
+    if (m_bReadOnly)
+        return READ_ONLY;
+    if (!m_Head.m_doFreeMap)                // if no map block on disk...
+    {
+        if (m_vFree.empty())                // ...and nothing to save...
+        {
+            m_bFreeDirty = false;           // ...there is no work to do
+            return S64_OK;
+        }
+        TDiskOff doMap = LockedAllocateDiskBlock(); // may use a free block
+        if (!doMap)
+            return NO_BLOCK;
+        m_Head.m_doFreeMap = doMap;
+    }
+
+    assert(m_vFree.size() <= FreeRunsMax);
+    TFreeMapBlock blk;
+    blk.Init(0, 0xffff);                    // 0xffff is header channel ID
+    copy(m_vFree.begin(), m_vFree.end(), blk.m_runs);
+    int err = Write(&blk, DBSize, m_Head.m_doFreeMap);
+    if (err == 0)
+    {
+        m_Head.m_nFreeRuns = static_cast<uint32_t>(m_vFree.size());
+        m_bHeadDirty = true;                // Header needs writing
+        m_bFreeDirty = false;
+    }
+    return err;
+}
+
 // You will already hold the relevant channel mutex to call this, or it will not
 // matter (as when creating a file). We are calling from the channel, so channel
 // number MUST be correct (hence only an assert).
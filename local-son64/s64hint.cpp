@@ -0,0 +1,233 @@
+// s64hint.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64hint.cpp
+//! \brief Telling the OS which parts of a channel will be read next, and which will not
+/*!
+\internal
+The library keeps one data block per channel in memory, so the only block cache worth
+warming is the one in the OS. The time range is resolved to data block positions through the
+channel index and the positions are passed to the OS as advice. This is done on the pool of
+threads used for asynchronous reads, so the caller does not wait for the index reads.
+*/
+#include <assert.h>
+#include <algorithm>
+#include "s64priv.h"
+#include "s64chan.h"
+#include "s64async.h"
+
+using namespace std;
+using namespace ceds64;
+
+//! The most data blocks we pass in one piece of advice. Linux quietly limits how much it
+//! reads ahead for one call, so long runs are split.
+static const size_t nAdviseMax = 32;
+
+//! Collect the disk offsets of the data blocks in a block range that hold a time range
+/*!
+You must hold the channel mutex. This is CollectBlocks() with the index item times used to
+skip the parts of the index that are outside the time range, so only the index blocks that
+lead to the wanted data blocks are read. The times in the block range must increase. An item
+time is only used when the item and its subtree start inside the block range, as the first
+item of a ring archive index block that is partly reused holds the time of the newer lap.
+\param pos      The disk offset of the index block to search.
+\param nSpan    The number of data blocks covered by each item of this index block.
+\param nBase    The number of the first data block covered by this index block.
+\param nFrom    The first data block number to collect.
+\param nUpto    The data block number to collect up to (not included).
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range (not included).
+\param tNext    The time of the data that follows this index block, or TSTIME64_MAX if not
+                known.
+\param vDO      The disk offsets of the data blocks are added to this.
+\return         S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::CollectTimeBlocks(TDiskOff pos, uint64_t nSpan, uint64_t nBase, uint64_t nFrom, uint64_t nUpto,
+                                  TSTime64 tFrom, TSTime64 tUpto, TSTime64 tNext, vector<TDiskOff>& vDO)
+{
+    TDiskLookup buf;
+    const TDiskLookup* pDLU;
+    int err = IndexTable(pos, buf, pDLU);
+    if (err)
+        return err;
+    const TDiskLookup& dlu = *pDLU;
+    const unsigned int nItems = min<unsigned int>(dlu.m_nItems, DLUItems);
+    unsigned int i = (nFrom > nBase) ? static_cast<unsigned int>((nFrom - nBase) / nSpan) : 0;
+    for (; (i < nItems) && (nBase + i*nSpan < nUpto); ++i)
+    {
+        const uint64_t nStart = nBase + i*nSpan;    // the first block of this item
+        if ((nStart >= nFrom) && (dlu.m_items[i].m_time >= tUpto))
+            break;                      // this item and all later items are too late
+        const bool bNextIn = (i+1 < nItems) && (nStart + nSpan < nUpto);
+        const TSTime64 tItemNext = bNextIn ? dlu.m_items[i+1].m_time : tNext;
+        if (tItemNext <= tFrom)         // all the data of this item is before the range
+            continue;
+
+        const TDiskOff doItem = dlu.m_items[i].m_do;
+        if (nSpan == 1)                 // an item that points at a data block
+        {
+            if ((doItem == 0) || (doItem & (DBSize-1)))
+                return CORRUPT_FILE;
+            vDO.push_back(doItem);
+        }
+        else
+        {
+            err = CollectTimeBlocks(doItem, nSpan / DLUItems, nStart, nFrom, nUpto, tFrom, tUpto, tItemNext, vDO);
+            if (err)
+                return err;
+        }
+    }
+    return S64_OK;
+}
+
+//! Get the disk offsets of the data blocks that hold a time range
+/*!
+You _must not_ hold the channel mutex. Only blocks that are on disk are found; data in
+the write buffer is not included. Only the channel index is read; the data blocks are not
+read and the read manager is not used.
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range (not included).
+\param vDO      The disk offsets of the blocks are added to this, in time order.
+\return         S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::DiskBlocks(TSTime64 tFrom, TSTime64 tUpto, vector<TDiskOff>& vDO)
+{
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    const TChanHead& ch = m_chanHead;   // to save typing
+    if ((tUpto <= tFrom) || (ch.m_nBlocks == 0) || !ch.m_doIndex)
+        return S64_OK;
+
+    uint64_t nSpan = 1;                 // data blocks per item of the top index block
+    for (unsigned int i = DepthFor(); i > 1; --i)
+        nSpan *= DLUItems;
+
+    // In a wrapped ring archive the oldest lap is after the newest in the index
+    int err = S64_OK;
+    if (ch.RingOldLap())
+        err = CollectTimeBlocks(ch.m_doIndex, nSpan, 0, ch.m_nBlocks, ch.m_nAllocatedBlocks,
+                                tFrom, tUpto, TSTIME64_MAX, vDO);
+    if (err == 0)
+        err = CollectTimeBlocks(ch.m_doIndex, nSpan, 0, ch.m_nFirstBlock, ch.m_nBlocks,
+                                tFrom, tUpto, TSTIME64_MAX, vDO);
+    return err;
+}
+
+//! Pass advice about the data blocks of a channel time range to the OS
+/*!
+The work is done on the asynchronous read pool; we return once the work is queued.
+\param chan     The channel number.
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range (not included).
+\param bNeed    True if the blocks will be wanted soon, false if they will not.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::AdviseBlocks(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto, bool bNeed)
+{
+    if (m_file == NOFILE_ID)
+        return NO_FILE;
+    {
+        TChRdLock lock(m_mutChans);     // we are not changing the #chans
+        if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+            return NO_CHANNEL;
+    }
+    if (tUpto <= tFrom)
+        return S64_OK;
+
+    PostToPool([=](bool bRun)
+    {
+        if (!bRun)                      // the file is closing
+            return;
+        vector<TDiskOff> vDO;
+        {
+            TChRdLock lock(m_mutChans);
+            if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+                return;                 // the channel has gone
+            if (m_vChan[chan]->DiskBlocks(tFrom, tUpto, vDO) < 0)
+                return;                 // this is only advice, so give up quietly
+        }
+        sort(vDO.begin(), vDO.end());   // blocks are not always in disk order
+
+#if S64_OS == S64_OS_WINDOWS
+        // There is no advice call, so read the blocks to get them into the system cache.
+        // There is no way to drop part of a file from the cache.
+        if (bNeed)
+        {
+            vector<uint8_t> vBuf(DBSize);
+            for (TDiskOff pos : vDO)
+            {
+                if (Read(vBuf.data(), DBSize, pos))
+                    break;
+            }
+        }
+#elif S64_OS == S64_OS_LINUX
+        // Pass each run of adjacent blocks to the OS as one range
+        const int advice = bNeed ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED;
+        TFileLock lock(m_mutFile);      // m_file is not changed while the pool exists
+        for (size_t i = 0; i < vDO.size();)
+        {
+            size_t j = i + 1;
+            while ((j < vDO.size()) && (j - i < nAdviseMax) && (vDO[j] == vDO[j-1] + DBSize))
+                ++j;
+            posix_fadvise64(m_file, vDO[i], static_cast<TDiskOff>(j - i) * DBSize, advice);
+            i = j;
+        }
+#endif
+    });
+    return S64_OK;
+}
+
+//! Advise that a time range of a channel will be read soon
+/*!
+Use this when you know which data you will read next, for example, the next window of a
+pipelined analysis. The data blocks that hold the range are found through the channel
+index and the OS is asked to read them into its cache, so the read that follows does not
+wait for the disk. This returns at once; the work is done by the threads that run the
+asynchronous reads. It is only advice: errors in the background work are ignored, and it
+has no effect on the data that is read. Data that is not yet written to disk is not
+affected.
+\param chan     The channel number.
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range (not included).
+\return         S64_OK (0) or a negative error code, for example NO_CHANNEL.
+\sa Release()
+*/
+int TSon64File::Prefetch(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto)
+{
+    return AdviseBlocks(chan, tFrom, tUpto, true);
+}
+
+//! Advise that a time range of a channel will not be read again soon
+/*!
+This is the reverse of Prefetch(). The OS is told that it can drop the data blocks that
+hold the range from its cache, so that a long analysis does not push more useful data out
+of the cache. It returns at once and has no effect on the data that is read. On Windows
+this does nothing.
+\param chan     The channel number.
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range (not included).
+\return         S64_OK (0) or a negative error code, for example NO_CHANNEL.
+\sa Prefetch()
+*/
+int TSon64File::Release(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto)
+{
+    return AdviseBlocks(chan, tFrom, tUpto, false);
+}
@@ -0,0 +1,467 @@
+// s64idx.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64idx.cpp
+//! \brief The optional .s64idx index file of flat channel block tables
+/*!
+\internal
+The first read of a channel in a large file must read one index block for each level of
+the channel index before it can read any data, and each new process that opens the file
+pays this again. The index file holds a flat table of the data blocks of each channel: the
+first time, disk offset and item count of every block in use. It is memory mapped when a
+file is opened read only with eOF_index, so a read of any time in a channel is a search
+in memory plus a single data block read.
+
+The index file is only used if its head matches the data file head, and the table of each
+channel is only used if it matches the channel header and every block offset in it is a
+block in the data file, so an index file that is out of date or damaged is ignored, never
+trusted. It is written by WriteIndexFile() or, if the data file was opened with
+eOF_makeIndex, when the file is closed and the index file was missing, out of date or the
+data file could have been changed. Opening a file with eOF_index alone never writes. It is
+written to a temporary file that is then renamed, so other processes never map a partly
+written file.
+*/
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include "s64priv.h"
+#include "s64chan.h"
+#include "s64io.h"
+#include "s64idx.h"
+
+#if S64_OS == S64_OS_LINUX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+using namespace ceds64;
+
+static const char szIdxMagic[8] = "S64IDX";    //!< The TIdxHead::m_magic value
+static const uint32_t nIdxVersion = 1;          //!< The TIdxHead::m_nVersion value
+
+//! The number of block heads we read at a time to build a block table
+static const size_t nIdxBatch = 256;
+
+//! Get the name of the index file for a data file
+static TFilePath IndexName(const TFilePath& name)
+{
+    static const char szExt[] = ".s64idx";
+    TFilePath s(name);
+    s.append(szExt, szExt + sizeof(szExt) - 1);
+    return s;
+}
+
+CIndexFile::CIndexFile()
+    : m_pMap( nullptr )
+    , m_nMap( 0 )
+#if S64_OS == S64_OS_WINDOWS
+    , m_hMap( NULL )
+#endif
+{
+}
+
+CIndexFile::~CIndexFile()
+{
+    Unmap();
+}
+
+//! Release the mapping, if any
+void CIndexFile::Unmap()
+{
+    if (m_pMap)
+    {
+#if S64_OS == S64_OS_WINDOWS
+        UnmapViewOfFile(m_pMap);
+        CloseHandle(m_hMap);
+        m_hMap = NULL;
+#elif S64_OS == S64_OS_LINUX
+        munmap(const_cast<uint8_t*>(m_pMap), m_nMap);
+#endif
+    }
+    m_pMap = nullptr;
+    m_nMap = 0;
+    m_vValid.clear();
+}
+
+//! Map an index file and check that it belongs to a data file
+/*!
+\param name         The name of the index file.
+\param head         The head of the data file.
+\param vChanHead    The channel headers of the data file.
+\return             true if the file is mapped and matches the data file. Individual channel
+                    tables may still not match; use Blocks() to get them.
+*/
+bool CIndexFile::Map(const TFilePath& name, const TFileHead& head, const vector<TChanHead>& vChanHead)
+{
+    Unmap();
+#if S64_OS == S64_OS_WINDOWS
+    HANDLE hFile = CreateFile(name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER llSize;
+    if (GetFileSizeEx(hFile, &llSize) && (llSize.QuadPart >= sizeof(TIdxHead)) &&
+        (static_cast<uint64_t>(llSize.QuadPart) <= SIZE_MAX))
+    {
+        m_hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m_hMap)
+        {
+            m_pMap = static_cast<const uint8_t*>(MapViewOfFile(m_hMap, FILE_MAP_READ, 0, 0, 0));
+            if (m_pMap)
+                m_nMap = static_cast<size_t>(llSize.QuadPart);
+            else
+            {
+                CloseHandle(m_hMap);
+                m_hMap = NULL;
+            }
+        }
+    }
+    CloseHandle(hFile);
+#elif S64_OS == S64_OS_LINUX
+    int fd = open64(name.c_str(), O_BINARY | O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat64 st;
+    if ((fstat64(fd, &st) == 0) && (st.st_size >= static_cast<off64_t>(sizeof(TIdxHead))))
+    {
+        void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            m_pMap = static_cast<const uint8_t*>(p);
+            m_nMap = static_cast<size_t>(st.st_size);
+        }
+    }
+    close(fd);                          // the mapping keeps the file
+#endif
+    if (!m_pMap)
+        return false;
+
+    // The head must match the data file and the size must match the head
+    const TIdxHead& ih = *reinterpret_cast<const TIdxHead*>(m_pMap);
+    const size_t nChans = vChanHead.size();
+    const uint64_t nTables = sizeof(TIdxHead) + nChans*sizeof(TIdxChan);
+    if ((memcmp(ih.m_magic, szIdxMagic, sizeof(ih.m_magic)) != 0) ||
+        (ih.m_nVersion != nIdxVersion) ||
+        (ih.m_nChans != nChans) ||
+        (ih.m_doNextBlock != head.m_doNextBlock) ||
+        (m_nMap < nTables) ||
+        (ih.m_nBlocks != (m_nMap - nTables) / sizeof(TIdxBlock)) ||
+        (m_nMap != nTables + ih.m_nBlocks*sizeof(TIdxBlock)))
+    {
+        Unmap();
+        return false;
+    }
+
+    // Each channel table must match the channel header and hold only data file blocks
+    const TIdxChan* pChan = reinterpret_cast<const TIdxChan*>(m_pMap + sizeof(TIdxHead));
+    const TIdxBlock* pBlk = reinterpret_cast<const TIdxBlock*>(m_pMap + nTables);
+    m_vValid.resize(nChans);
+    for (size_t i = 0; i < nChans; ++i)
+    {
+        const TChanHead& ch = vChanHead[i];
+        const TIdxChan& ic = pChan[i];
+        m_vValid[i] = (ic.m_nEntries > 0) && !ch.RingOldLap() &&
+                      (ic.m_nBlocks == ch.m_nBlocks) && (ic.m_nFirstBlock == ch.m_nFirstBlock) &&
+                      (ic.m_nEntries == ch.m_nBlocks - ch.m_nFirstBlock) &&
+                      (ic.m_doIndex == ch.m_doIndex) && (ic.m_lastTime == ch.m_lastTime) &&
+                      (ic.m_chanID == ch.m_chanID) &&
+                      (ic.m_nEntry <= ih.m_nBlocks) && (ic.m_nEntries <= ih.m_nBlocks - ic.m_nEntry) &&
+                      ValidBlocks(pBlk + ic.m_nEntry, ic.m_nEntries, head.m_doNextBlock);
+    }
+    return true;
+}
+
+//! Check that a channel table only holds data blocks that are in the data file
+/*!
+The block manager reads the blocks in a table without going through the channel index, so
+a table that points outside the data file, or part way into a block, must not be used.
+\param pBlk     The table.
+\param nBlocks  The number of items in the table.
+\param doEnd    The end of the blocks in use in the data file (TFileHead::m_doNextBlock).
+\return         true if every item is a whole block in the data file and is not empty.
+*/
+bool CIndexFile::ValidBlocks(const TIdxBlock* pBlk, uint64_t nBlocks, TDiskOff doEnd)
+{
+    for (uint64_t i = 0; i < nBlocks; ++i)
+    {
+        const TIdxBlock& b = pBlk[i];
+        if ((b.m_do <= 0) || (b.m_do & (DBSize-1)) || (b.m_do > doEnd - DBSize) || (b.m_nItems == 0))
+            return false;
+    }
+    return true;
+}
+
+//! Get the block table of a channel
+/*!
+\param chan     The channel number.
+\param nBlocks  Set to the number of items in the table.
+\return         The table, or nullptr if there is no table for the channel that matches
+                the channel header.
+*/
+const TIdxBlock* CIndexFile::Blocks(TChanNum chan, uint64_t& nBlocks) const
+{
+    nBlocks = 0;
+    if (!m_pMap || (chan >= m_vValid.size()) || !m_vValid[chan])
+        return nullptr;
+    const TIdxChan& ic = reinterpret_cast<const TIdxChan*>(m_pMap + sizeof(TIdxHead))[chan];
+    nBlocks = ic.m_nEntries;
+    return reinterpret_cast<const TIdxBlock*>(m_pMap + sizeof(TIdxHead) + m_vValid.size()*sizeof(TIdxChan)) + ic.m_nEntry;
+}
+
+//! Write an index file
+/*!
+\param name         The name of the index file.
+\param head         The head of the data file.
+\param vChanHead    The channel headers of the data file.
+\param vTables      The block table of each channel, empty if the channel has no table.
+\return             S64_OK (0) or a negative error code.
+*/
+int CIndexFile::Write(const TFilePath& name, const TFileHead& head, const vector<TChanHead>& vChanHead,
+                      const vector<vector<TIdxBlock>>& vTables)
+{
+    assert(vTables.size() == vChanHead.size());
+    TIdxHead ih;
+    memset(&ih, 0, sizeof(ih));
+    memcpy(ih.m_magic, szIdxMagic, sizeof(ih.m_magic));
+    ih.m_nVersion = nIdxVersion;
+    ih.m_nChans = static_cast<uint32_t>(vChanHead.size());
+    ih.m_doNextBlock = head.m_doNextBlock;
+
+    vector<TIdxChan> vChan(vChanHead.size());
+    for (size_t i = 0; i < vChan.size(); ++i)
+    {
+        const TChanHead& ch = vChanHead[i];
+        TIdxChan& ic = vChan[i];
+        memset(&ic, 0, sizeof(ic));
+        ic.m_nBlocks = ch.m_nBlocks;
+        ic.m_nFirstBlock = ch.m_nFirstBlock;
+        ic.m_doIndex = ch.m_doIndex;
+        ic.m_lastTime = ch.m_lastTime;
+        ic.m_chanID = ch.m_chanID;
+        ic.m_nEntry = ih.m_nBlocks;
+        ic.m_nEntries = vTables[i].size();
+        ih.m_nBlocks += ic.m_nEntries;
+    }
+
+    TFilePath tmp(name);                // write to a temporary file, then rename it
+    tmp.push_back('~');
+    bool bOK = true;
+#if S64_OS == S64_OS_WINDOWS
+    HANDLE hFile = CreateFile(tmp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return NO_ACCESS;
+    auto put = [&](const void* p, size_t n)
+    {
+        const char* pc = static_cast<const char*>(p);
+        while (bOK && n)
+        {
+            DWORD dwWritten;
+            const DWORD dwWrite = static_cast<DWORD>(min<size_t>(n, 0x40000000));
+            bOK = WriteFile(hFile, pc, dwWrite, &dwWritten, NULL) && (dwWritten == dwWrite);
+            pc += dwWrite;
+            n -= dwWrite;
+        }
+    };
+#elif S64_OS == S64_OS_LINUX
+    int fd = open64(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, S_IREAD | S_IWRITE | S_IRGRP | S_IROTH);
+    if (fd < 0)
+        return NO_ACCESS;
+    auto put = [&](const void* p, size_t n)
+    {
+        const char* pc = static_cast<const char*>(p);
+        while (bOK && n)
+        {
+            ssize_t nDone = write(fd, pc, n);
+            bOK = nDone > 0;
+            if (bOK)
+            {
+                pc += nDone;
+                n -= static_cast<size_t>(nDone);
+            }
+        }
+    };
+#endif
+    put(&ih, sizeof(ih));
+    put(vChan.data(), vChan.size()*sizeof(TIdxChan));
+    for (const auto& v : vTables)
+        put(v.data(), v.size()*sizeof(TIdxBlock));
+
+#if S64_OS == S64_OS_WINDOWS
+    CloseHandle(hFile);
+    bOK = bOK && MoveFileEx(tmp.c_str(), name.c_str(), MOVEFILE_REPLACE_EXISTING);
+    if (!bOK)
+        DeleteFile(tmp.c_str());
+#elif S64_OS == S64_OS_LINUX
+    bOK = (close(fd) == 0) && bOK;
+    bOK = bOK && (rename(tmp.c_str(), name.c_str()) == 0);
+    if (!bOK)
+        unlink(tmp.c_str());
+#endif
+    return bOK ? S64_OK : BAD_WRITE;
+}
+
+//! Get the table of the data blocks in use by the channel
+/*!
+You _must not_ hold the channel mutex. The data blocks must be on disk, so commit the channel
+first if it is written. The index gives the offsets of the blocks, then the head and first
+time of each block is read, many blocks at a time. A wrapped ring archive channel does not
+have a table as its blocks are not in time order in the index.
+\param vBlk     Returned holding one item per data block in use, or empty if there are no
+                blocks or the channel is a wrapped ring archive.
+\param nFrom    The number of the first data block wanted. Blocks before the first block in
+                use are never returned.
+\return         S64_OK (0) or a negative error code.
+*/
+int CSon64Chan::FlatBlocks(vector<TIdxBlock>& vBlk, uint64_t nFrom)
+{
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    vBlk.clear();
+    const TChanHead& ch = m_chanHead;   // to save typing
+    nFrom = max(nFrom, ch.m_nFirstBlock);
+    if (!ch.m_doIndex || (ch.m_nBlocks <= nFrom) || ch.RingOldLap())
+        return S64_OK;
+
+    // If we are using an index file, it already holds the table
+    uint64_t nFlat;
+    const TIdxBlock* pFlat = m_bmRead.Flat(nFlat);
+    if (pFlat && (nFlat == ch.m_nBlocks - ch.m_nFirstBlock))
+    {
+        vBlk.assign(pFlat + (nFrom - ch.m_nFirstBlock), pFlat + nFlat);
+        return S64_OK;
+    }
+
+    uint64_t nSpan = 1;                 // data blocks per item of the top index block
+    for (unsigned int i = DepthFor(); i > 1; --i)
+        nSpan *= DLUItems;
+    vector<TDiskOff> vDO;
+    int err = CollectBlocks(ch.m_doIndex, nSpan, 0, nFrom, ch.m_nBlocks, vDO);
+    if (err)
+        return err;
+
+    // All data blocks start with the block head followed by the time of the first item
+    struct TBlockStart
+    {
+        TDiskBlockHead m_head;
+        TSTime64 m_time;
+    };
+    vector<TBlockStart> vStart(min(vDO.size(), nIdxBatch));
+    vector<TIOReq> vReq;
+    vBlk.reserve(vDO.size());
+    for (size_t i = 0; i < vDO.size(); i += nIdxBatch)
+    {
+        const size_t n = min(vDO.size() - i, nIdxBatch);
+        vReq.clear();
+        for (size_t j = 0; j < n; ++j)
+            vReq.emplace_back(&vStart[j], static_cast<uint32_t>(sizeof(TBlockStart)), vDO[i+j]);
+        err = m_file.ReadBatch(vReq.data(), n);
+        if (err)
+            return err;
+        for (size_t j = 0; j < n; ++j)
+        {
+            if (vStart[j].m_head.m_nItems == 0) // blocks in use are never empty
+                return CORRUPT_FILE;
+            TIdxBlock b;
+            b.m_time = vStart[j].m_time;
+            b.m_do = vDO[i+j];
+            b.m_nItems = vStart[j].m_head.m_nItems;
+            b.m_pad = 0;
+            vBlk.push_back(b);
+        }
+    }
+    return S64_OK;
+}
+
+//! Write the .s64idx index file for this data file
+/*!
+The index file holds a flat table of the data blocks of each channel. When a data file is
+opened read only with the eOF_index flag, a matching index file is memory mapped and used
+in place of the index blocks in the data file, so that the first read of any time in a
+channel needs a single data block read. If the file is open for writing it is committed
+first. If the file was opened with eOF_makeIndex, this is done for you when the file is
+closed as needed, so you only need this to make an index at some other time.
+\return S64_OK (0) or a negative error code.
+*/
+int TSon64File::WriteIndexFile()
+{
+    if ((m_file == NOFILE_ID) || m_sName.empty())
+        return NO_FILE;
+    int err = m_bReadOnly ? S64_OK : Commit();
+    if (err)
+        return err;
+
+    vector<vector<TIdxBlock>> vTables;
+    vector<TChanHead> vChanHead;
+    TFileHead head;
+    {
+        TChRdLock lock(m_mutChans);     // we are not changing the #chans
+        vTables.resize(m_vChan.size());
+        for (size_t i = 0; i < m_vChan.size(); ++i)
+        {
+            if (m_vChan[i])
+            {
+                err = m_vChan[i]->FlatBlocks(vTables[i]);
+                if (err)
+                    return err;
+            }
+        }
+        THeadLock lockHead(m_mutHead);
+        head = m_Head;
+        vChanHead = m_vChanHead;
+    }
+    return CIndexFile::Write(IndexName(m_sName), head, vChanHead, vTables);
+}
+
+//! Map the index file if it matches this file and pass the channel tables to the channels
+/*!
+This is used when a file is opened read only. No other thread can be using the file.
+*/
+void TSon64File::MapIndexFile()
+{
+    unique_ptr<CIndexFile> pIdx(new CIndexFile);
+    if (!pIdx->Map(IndexName(m_sName), m_Head, m_vChanHead))
+        return;
+    for (size_t i = 0; i < m_vChan.size(); ++i)
+    {
+        uint64_t nBlocks;
+        const TIdxBlock* pBlocks = pIdx->Blocks(static_cast<TChanNum>(i), nBlocks);
+        if (m_vChan[i] && pBlocks)
+            m_vChan[i]->m_bmRead.SetFlat(pBlocks, nBlocks);
+    }
+    m_pIdx = std::move(pIdx);
+}
+
+//! Stop the channels using the index file and release it
+void TSon64File::UnmapIndexFile()
+{
+    if (!m_pIdx)
+        return;
+    for (auto& pChan : m_vChan)
+    {
+        if (pChan)
+        {
+            CSon64Chan::TChanLock lock(pChan->m_mutex);
+            pChan->m_bmRead.SetFlat(nullptr, 0);
+        }
+    }
+    m_pIdx.reset();
+}
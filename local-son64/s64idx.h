@@ -0,0 +1,100 @@
+// s64idx.h
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __S64IDX_H__
+#define __S64IDX_H__
+//! \file s64idx.h
+//! \brief The optional index file that holds a flat table of the data blocks of each channel
+//! \internal
+
+#include "s64priv.h"
+
+namespace ceds64
+{
+    //! The head of an index file
+    /*!
+     The index file is named by adding ".s64idx" to the data file name. It holds this head,
+     then one TIdxChan for each channel in the data file, then the TIdxBlock tables of all the
+     channels. It is only used if it matches the data file it was made from, so if the data
+     file is written by code that does not know about index files, the index is ignored.
+    */
+    struct TIdxHead
+    {
+        char m_magic[8];                //!< Identifies the file, set to "S64IDX" with 0 fill
+        uint32_t m_nVersion;            //!< The index file version, currently 1
+        uint32_t m_nChans;              //!< The number of TIdxChan items
+        TDiskOff m_doNextBlock;         //!< Must match TFileHead::m_doNextBlock of the data file
+        uint64_t m_nBlocks;             //!< The total number of TIdxBlock items
+    };
+
+    //! The description of the block table of one channel in an index file
+    struct TIdxChan
+    {
+        uint64_t m_nBlocks;             //!< Must match TChanHead::m_nBlocks
+        uint64_t m_nFirstBlock;         //!< Must match TChanHead::m_nFirstBlock
+        TDiskOff m_doIndex;             //!< Must match TChanHead::m_doIndex
+        TSTime64 m_lastTime;            //!< Must match TChanHead::m_lastTime
+        uint64_t m_nEntry;              //!< Index of the first TIdxBlock of this channel
+        uint64_t m_nEntries;            //!< Number of TIdxBlock items, 0 if no table
+        TChanID m_chanID;               //!< Must match TChanHead::m_chanID
+        uint16_t m_pad[3];              //!< Spare, set to 0
+    };
+
+    //! One data block in a channel block table
+    /*!
+     There is one of these for each data block in use by the channel, in the order of the
+     channel index, which is time order. For waveform channels, m_nItems counts the TWave
+     sections in the block, not the data points.
+    */
+    struct TIdxBlock
+    {
+        TSTime64 m_time;                //!< The time of the first item in the block
+        TDiskOff m_do;                  //!< The disk offset of the block in the data file
+        uint32_t m_nItems;              //!< The number of items in the block
+        uint32_t m_pad;                 //!< Spare, set to 0
+    };
+
+    //! A memory mapped index file
+    class CIndexFile
+    {
+    public:
+        CIndexFile();
+        ~CIndexFile();
+        bool Map(const TFilePath& name, const TFileHead& head, const std::vector<TChanHead>& vChanHead);
+        const TIdxBlock* Blocks(TChanNum chan, uint64_t& nBlocks) const;
+        static int Write(const TFilePath& name, const TFileHead& head, const std::vector<TChanHead>& vChanHead,
+                         const std::vector<std::vector<TIdxBlock>>& vTables);
+
+    private:
+        void Unmap();
+        static bool ValidBlocks(const TIdxBlock* pBlk, uint64_t nBlocks, TDiskOff doEnd);
+
+        const uint8_t* m_pMap;          //!< The start of the mapped file, or nullptr
+        size_t m_nMap;                  //!< The bytes mapped
+        std::vector<bool> m_vValid;     //!< true for each channel whose table can be used
+#if S64_OS == S64_OS_WINDOWS
+        HANDLE m_hMap;                  //!< The file mapping object
+#endif
+        CIndexFile(const CIndexFile&);  // = delete; NO copy constructor
+    };
+}
+#endif
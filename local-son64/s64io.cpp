@@ -0,0 +1,426 @@
+// s64io.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64io.cpp
+//! \brief Positional and io_uring block I/O engines
+/*!
+\internal
+The library reads and writes whole data and index blocks at known offsets, so every
+transfer is positional and there is no file pointer to manage. Where a caller has several
+blocks to move (the pieces of the header, the modified index blocks of a channel at a
+commit) it passes them as one list. On Linux, if the kernel allows it, the list is passed to
+an io_uring in one system call and the transfers run concurrently. Otherwise, and for lists
+of one transfer, we use pread()/pwrite() (or ReadFile()/WriteFile() with an offset).
+*/
+#include <assert.h>
+#include <string.h>
+#include <vector>
+#include "s64priv.h"
+#include "s64io.h"
+
+#if S64_OS == S64_OS_LINUX
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define S64_IO_URING                    // we can build the io_uring engine
+#endif
+#endif
+#endif
+
+using namespace ceds64;
+using namespace std;
+
+//! Make a transfer of one item
+/*!
+\param req      The transfer to make.
+\param bWrite   True to write to the file, false to read.
+\return         S64_OK (0) or BAD_READ or BAD_WRITE if the transfer was not complete.
+*/
+int CIOEngine::Transfer(const TIOReq& req, bool bWrite)
+{
+    const int errBad = bWrite ? BAD_WRITE : BAD_READ;
+#if S64_OS == S64_OS_WINDOWS
+    OVERLAPPED ov = {};                 // a synchronous handle, so only used for the offset
+    ov.Offset = static_cast<DWORD>(req.m_offset);
+    ov.OffsetHigh = static_cast<DWORD>(req.m_offset >> 32);
+    DWORD dwDone = 0;
+    if (bWrite)
+        return (WriteFile(req.m_file, req.m_pBuf, req.m_nBytes, &dwDone, &ov) && (dwDone == req.m_nBytes)) ? S64_OK : errBad;
+
+    BOOL bOK = ReadFile(req.m_file, req.m_pBuf, req.m_nBytes, &dwDone, &ov);
+    if (!bOK)
+    {
+        // If we fail due to network problem, then try very hard to recover as it may go
+        // away with a few retries...
+        DWORD dwError = GetLastError();
+        int iRetry = 100;
+        while (!bOK && ((dwError == ERROR_NETNAME_DELETED) || (dwError == ERROR_NETWORK_BUSY)) && (--iRetry > 0))
+        {
+            bOK = ReadFile(req.m_file, req.m_pBuf, req.m_nBytes, &dwDone, &ov);
+            if (!bOK)
+                dwError = GetLastError();
+        }
+    }
+    return (bOK && (dwDone == req.m_nBytes)) ? S64_OK : errBad;
+#elif S64_OS == S64_OS_LINUX
+    char* p = static_cast<char*>(req.m_pBuf);
+    uint32_t nLeft = req.m_nBytes;
+    TDiskOff offset = req.m_offset;
+    while (nLeft)
+    {
+        ssize_t n = bWrite ? pwrite64(req.m_file, p, nLeft, offset) : pread64(req.m_file, p, nLeft, offset);
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0)                     // error, or end of file on a read
+            return errBad;
+        p += n;
+        nLeft -= static_cast<uint32_t>(n);
+        offset += n;
+    }
+    return S64_OK;
+#endif
+}
+
+//! Read a list of items from the file
+/*!
+\param pReq The list of n transfers.
+\param n    The number of transfers.
+\return     S64_OK (0) if all the reads were complete, else a negative error code. The
+            transfers are all made (or attempted) in either case.
+*/
+int CIOEngine::Read(const TIOReq* pReq, size_t n)
+{
+    int err = S64_OK;
+    for (size_t i = 0; i < n; ++i)
+    {
+        int locErr = Transfer(pReq[i], false);
+        if (locErr && (err == 0))
+            err = locErr;
+    }
+    return err;
+}
+
+//! Write a list of items to the file
+/*!
+\param pReq The list of n transfers.
+\param n    The number of transfers.
+\return     S64_OK (0) if all the writes were complete, else a negative error code. The
+            transfers are all made (or attempted) in either case.
+*/
+int CIOEngine::Write(const TIOReq* pReq, size_t n)
+{
+    int err = S64_OK;
+    for (size_t i = 0; i < n; ++i)
+    {
+        int locErr = Transfer(pReq[i], true);
+        if (locErr && (err == 0))
+            err = locErr;
+    }
+    return err;
+}
+
+#ifdef S64_IO_URING
+//! An engine that passes lists of transfers to an io_uring
+/*!
+The ring is created the first time we have more than one transfer to make. If the kernel
+does not support io_uring, or it is not allowed (it is often disabled in containers), or
+the ring fails later, we quietly use positional I/O from then on.
+*/
+class CUringIO : public CIOEngine
+{
+public:
+    CUringIO();
+    ~CUringIO();
+    virtual int Read(const TIOReq* pReq, size_t n);
+    virtual int Write(const TIOReq* pReq, size_t n);
+    virtual const char* Name() const { return (m_fd >= 0) ? "io_uring" : "positional"; }
+
+private:
+    enum {nEntries = 64};               //!< The ring size, the most transfers per submission
+    bool Setup();
+    int Submit(const TIOReq* pReq, size_t n, bool bWrite);
+    int Enter(unsigned nSubmit, unsigned nWait);
+
+    int m_fd;                           //!< The ring file descriptor or -1
+    bool m_bTried;                      //!< Set once we have tried to create the ring
+    void* m_pSQ;                        //!< The mapped submission queue ring
+    size_t m_nSQ;                       //!< The bytes mapped at m_pSQ
+    void* m_pCQ;                        //!< The mapped completion queue ring (may be m_pSQ)
+    size_t m_nCQ;                       //!< The bytes mapped at m_pCQ
+    io_uring_sqe* m_pSQEs;              //!< The mapped submission queue entries
+    size_t m_nSQEs;                     //!< The bytes mapped at m_pSQEs
+    unsigned* m_pSqTail;                //!< Submission queue tail, we write this
+    unsigned m_sqMask;                  //!< Submission queue index mask
+    unsigned* m_pSqArray;               //!< Maps submission queue slots to entries
+    unsigned* m_pCqHead;                //!< Completion queue head, we write this
+    unsigned* m_pCqTail;                //!< Completion queue tail, the kernel writes this
+    unsigned m_cqMask;                  //!< Completion queue index mask
+    io_uring_cqe* m_pCQEs;              //!< The completion queue entries
+    vector<iovec> m_vIov;               //!< One buffer description per queued transfer
+};
+
+CUringIO::CUringIO()
+    : m_fd( -1 )
+    , m_bTried( false )
+    , m_pSQ( MAP_FAILED )
+    , m_nSQ( 0 )
+    , m_pCQ( MAP_FAILED )
+    , m_nCQ( 0 )
+    , m_pSQEs( static_cast<io_uring_sqe*>(MAP_FAILED) )
+    , m_nSQEs( 0 )
+    , m_pSqTail( nullptr )
+    , m_sqMask( 0 )
+    , m_pSqArray( nullptr )
+    , m_pCqHead( nullptr )
+    , m_pCqTail( nullptr )
+    , m_cqMask( 0 )
+    , m_pCQEs( nullptr )
+    , m_vIov( nEntries )
+{
+}
+
+CUringIO::~CUringIO()
+{
+    if (m_pSQEs != MAP_FAILED)
+        munmap(m_pSQEs, m_nSQEs);
+    if ((m_pCQ != MAP_FAILED) && (m_pCQ != m_pSQ))
+        munmap(m_pCQ, m_nCQ);
+    if (m_pSQ != MAP_FAILED)
+        munmap(m_pSQ, m_nSQ);
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+//! Create the ring and map it into our address space
+/*!
+\return true if the ring is ready for use.
+*/
+bool CUringIO::Setup()
+{
+    m_bTried = true;
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, nEntries, &p));
+    if (fd < 0)
+        return false;
+
+    m_nSQ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_nCQ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    const bool bSingle = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (bSingle)                        // both rings share one mapping
+        m_nSQ = m_nCQ = max(m_nSQ, m_nCQ);
+    m_pSQ = mmap(nullptr, m_nSQ, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (m_pSQ != MAP_FAILED)
+        m_pCQ = bSingle ? m_pSQ : mmap(nullptr, m_nCQ, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    m_nSQEs = p.sq_entries * sizeof(io_uring_sqe);
+    if (m_pCQ != MAP_FAILED)
+        m_pSQEs = static_cast<io_uring_sqe*>(mmap(nullptr, m_nSQEs, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+    if (m_pSQEs == MAP_FAILED)
+    {
+        close(fd);                      // the destructor unmaps what we did map
+        return false;
+    }
+
+    char* pSQ = static_cast<char*>(m_pSQ);
+    m_pSqTail = reinterpret_cast<unsigned*>(pSQ + p.sq_off.tail);
+    m_sqMask = *reinterpret_cast<unsigned*>(pSQ + p.sq_off.ring_mask);
+    m_pSqArray = reinterpret_cast<unsigned*>(pSQ + p.sq_off.array);
+    char* pCQ = static_cast<char*>(m_pCQ);
+    m_pCqHead = reinterpret_cast<unsigned*>(pCQ + p.cq_off.head);
+    m_pCqTail = reinterpret_cast<unsigned*>(pCQ + p.cq_off.tail);
+    m_cqMask = *reinterpret_cast<unsigned*>(pCQ + p.cq_off.ring_mask);
+    m_pCQEs = reinterpret_cast<io_uring_cqe*>(pCQ + p.cq_off.cqes);
+    m_fd = fd;
+    return true;
+}
+
+//! Submit queued entries and/or wait for completions
+/*!
+\param nSubmit  The number of new entries in the submission queue.
+\param nWait    The number of completions to wait for.
+\return         The number of entries submitted (>= 0) or -errno.
+*/
+int CUringIO::Enter(unsigned nSubmit, unsigned nWait)
+{
+    while (true)
+    {
+        int ret = static_cast<int>(syscall(__NR_io_uring_enter, m_fd, nSubmit, nWait, nWait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+        if (ret >= 0)
+            return ret;
+        if (errno != EINTR)
+            return -errno;
+    }
+}
+
+//! Pass up to nEntries transfers to the ring and wait for them all to complete
+/*!
+\param pReq     The list of n transfers, n <= nEntries.
+\param n        The number of transfers.
+\param bWrite   True to write, false to read.
+\return         S64_OK (0) or a negative error code. If the ring fails, it is closed and the
+                transfers it did not accept are made with positional I/O.
+*/
+int CUringIO::Submit(const TIOReq* pReq, size_t n, bool bWrite)
+{
+    assert(n <= nEntries);
+    const unsigned tail = *m_pSqTail;   // only we write this, so no need to synchronise
+    for (unsigned i = 0; i < n; ++i)
+    {
+        m_vIov[i].iov_base = pReq[i].m_pBuf;
+        m_vIov[i].iov_len = pReq[i].m_nBytes;
+        const unsigned slot = (tail + i) & m_sqMask;
+        io_uring_sqe& sqe = m_pSQEs[slot];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = bWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe.fd = pReq[i].m_file;
+        sqe.off = static_cast<uint64_t>(pReq[i].m_offset);
+        sqe.addr = reinterpret_cast<uint64_t>(&m_vIov[i]);
+        sqe.len = 1;
+        sqe.user_data = i;
+        m_pSqArray[slot] = slot;
+    }
+    __atomic_store_n(m_pSqTail, tail + static_cast<unsigned>(n), __ATOMIC_RELEASE);
+
+    int err = S64_OK;
+    int ret = Enter(static_cast<unsigned>(n), static_cast<unsigned>(n));
+    const size_t nSubmit = (ret > 0) ? static_cast<size_t>(ret) : 0;
+    vector<bool> vDone(n, false);
+    size_t nDone = 0;
+    while (nDone < nSubmit)             // collect all the completions of what was accepted
+    {
+        unsigned head = *m_pCqHead;     // only we write this
+        if (head == __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE))
+        {
+            ret = Enter(0, 1);          // wait for more
+            if (ret < 0)
+                break;
+            continue;
+        }
+        const io_uring_cqe& cqe = m_pCQEs[head & m_cqMask];
+        const size_t i = static_cast<size_t>(cqe.user_data);
+        if (cqe.res < 0)
+        {
+            if (err == 0)
+                err = bWrite ? BAD_WRITE : BAD_READ;
+        }
+        else if (static_cast<uint32_t>(cqe.res) < pReq[i].m_nBytes)
+        {
+            TIOReq rest(static_cast<char*>(pReq[i].m_pBuf) + cqe.res, pReq[i].m_nBytes - cqe.res, pReq[i].m_offset + cqe.res);
+            rest.m_file = pReq[i].m_file;
+            int locErr = Transfer(rest, bWrite);    // finish a short transfer
+            if (locErr && (err == 0))
+                err = locErr;
+        }
+        vDone[i] = true;
+        ++nDone;
+        __atomic_store_n(m_pCqHead, head + 1, __ATOMIC_RELEASE);
+    }
+
+    if (nDone < n)                      // the ring has failed, so give up on it
+    {
+        // We cannot withdraw entries that were not accepted, and we cannot tell if those that
+        // were accepted and did not complete will run, so we never use the ring again.
+        munmap(m_pSQEs, m_nSQEs);
+        m_pSQEs = static_cast<io_uring_sqe*>(MAP_FAILED);
+        close(m_fd);                    // this waits for outstanding transfers
+        m_fd = -1;
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (!vDone[i])
+            {
+                int locErr = Transfer(pReq[i], bWrite);
+                if (locErr && (err == 0))
+                    err = locErr;
+            }
+        }
+    }
+    return err;
+}
+
+//! Read a list of items, passing them to the ring if there is more than one
+int CUringIO::Read(const TIOReq* pReq, size_t n)
+{
+    if ((n > 1) && !m_bTried)
+        Setup();
+    if ((n <= 1) || (m_fd < 0))
+        return CIOEngine::Read(pReq, n);
+
+    int err = S64_OK;
+    for (size_t i = 0; (i < n) && (m_fd >= 0); i += nEntries)
+    {
+        int locErr = Submit(pReq + i, min<size_t>(n - i, nEntries), false);
+        if (locErr && (err == 0))
+            err = locErr;
+        if ((m_fd < 0) && (i + nEntries < n))   // the ring failed, do the rest ourselves
+        {
+            locErr = CIOEngine::Read(pReq + i + nEntries, n - i - nEntries);
+            if (locErr && (err == 0))
+                err = locErr;
+        }
+    }
+    return err;
+}
+
+//! Write a list of items, passing them to the ring if there is more than one
+int CUringIO::Write(const TIOReq* pReq, size_t n)
+{
+    if ((n > 1) && !m_bTried)
+        Setup();
+    if ((n <= 1) || (m_fd < 0))
+        return CIOEngine::Write(pReq, n);
+
+    int err = S64_OK;
+    for (size_t i = 0; (i < n) && (m_fd >= 0); i += nEntries)
+    {
+        int locErr = Submit(pReq + i, min<size_t>(n - i, nEntries), true);
+        if (locErr && (err == 0))
+            err = locErr;
+        if ((m_fd < 0) && (i + nEntries < n))   // the ring failed, do the rest ourselves
+        {
+            locErr = CIOEngine::Write(pReq + i + nEntries, n - i - nEntries);
+            if (locErr && (err == 0))
+                err = locErr;
+        }
+    }
+    return err;
+}
+#endif
+
+//! Make the best I/O engine for this system
+/*!
+\param bBatch   If false, make the positional engine, which makes one system call per
+                transfer. If true, make an engine that passes lists of transfers to the
+                OS in one call if the OS supports this.
+\return         The new engine.
+*/
+unique_ptr<CIOEngine> CIOEngine::Make(bool bBatch)
+{
+#ifdef S64_IO_URING
+    if (bBatch)
+        return unique_ptr<CIOEngine>(new CUringIO);
+#endif
+    return unique_ptr<CIOEngine>(new CIOEngine);
+}
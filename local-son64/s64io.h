@@ -0,0 +1,68 @@
+// s64io.h
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __S64IO_H__
+#define __S64IO_H__
+//! \file s64io.h
+//! \brief The engines that move blocks between memory and the data file
+//! \internal
+
+#include <memory>
+#include "s64priv.h"
+
+namespace ceds64
+{
+    //! One positional transfer between memory and a file
+    struct TIOReq
+    {
+        TS64FH m_file;                  //!< The file handle to use
+        void* m_pBuf;                   //!< The memory to read into or write from
+        uint32_t m_nBytes;              //!< The number of bytes to transfer
+        TDiskOff m_offset;              //!< The file offset of the transfer
+
+        TIOReq() : m_file(NOFILE_ID), m_pBuf(nullptr), m_nBytes(0), m_offset(0) {}
+        TIOReq(const void* pBuf, uint32_t nBytes, TDiskOff offset)
+            : m_file(NOFILE_ID), m_pBuf(const_cast<void*>(pBuf)), m_nBytes(nBytes), m_offset(offset) {}
+    };
+
+    //! Reads and writes lists of blocks at given file offsets
+    /*!
+     The base class uses positional I/O, one system call per transfer, and is available on all
+     systems. Derived classes can pass a whole list to the OS in one call. A list is complete
+     when Read() or Write() returns, whatever the engine. The caller must serialise the use of
+     an engine (TSon64File holds m_mutFile).
+    */
+    class CIOEngine
+    {
+    public:
+        virtual ~CIOEngine() {}
+        virtual int Read(const TIOReq* pReq, size_t n);
+        virtual int Write(const TIOReq* pReq, size_t n);
+        virtual const char* Name() const { return "positional"; }
+
+        static std::unique_ptr<CIOEngine> Make(bool bBatch = true);
+
+    protected:
+        static int Transfer(const TIOReq& req, bool bWrite);
+    };
+}
+#endif
@@ -94,13 +94,21 @@ int CMarkerChan::EditMarker(TSTime64 t, const TMarker* pM, size_t nCopy)
 
     // If in the buffer we just need to change there and mark the buffer as modified
     if (m_pWr && (t >= m_pWr->FirstTime())) // could be buffered
-        return m_pWr->EditMarker(t, pM, nCopy);
+    {
+        int err = m_pWr->EditMarker(t, pM, nCopy);
+        if ((err > 0) && m_pWr->DiskOff())  // if data on disk changed...
+            InvalidateStats();              // ...the summary must be made again
+        return err;
+    }
 
     int err = m_bmRead.LoadBlock(t);        // get block with this data
     if (err < 0)
         return err;
 
-    return m_bmRead.DataBlock().EditMarker(t, pM, nCopy);
+    err = m_bmRead.DataBlock().EditMarker(t, pM, nCopy);
+    if (err > 0)                            // data on disk has changed...
+        InvalidateStats();                  // ...so the summary must be made again
+    return err;
 }
 
 //-------------------------------- Handle level channels ---------------------------------------------
@@ -750,11 +758,20 @@ int TSon64File::WriteMarkers(TChanNum chan, const TMarker* pData, size_t count)
     if (count == 0)
         return 0;
 
-    TChRdLock lock(m_mutChans);     // we are not changing the #chans
-    if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
-        return NO_CHANNEL;
+    int err;
+    TSTime64 tPrev;                 // last time before the write
+    {
+        TChRdLock lock(m_mutChans);     // we are not changing the #chans
+        if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+            return NO_CHANNEL;
 
-    return m_vChan[chan]->WriteData(pData, count);
+        tPrev = m_vChan[chan]->MaxTime();
+        err = m_vChan[chan]->WriteData(pData, count);
+    }
+
+    if (err == 0)                   // we must not hold m_mutChans for this
+        AddToCounts(chan, pData, sizeof(TMarker), count, true, tPrev);
+    return err;
 }
 
 //! Read marker data from a marker or extended marker channel
@@ -804,6 +821,8 @@ int TSon64File::EditMarker(TChanNum chan, TSTime64 t, const TMarker* pM, size_t
     TChRdLock lock(m_mutChans);     // we are not changing the #chans
     if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
         return NO_CHANNEL;
+    if (nCopy > sizeof(TMarker))    // changing attached data, such as TextMark text...
+        ++m_nEditGen;               // ...makes text indexes out of date
     return m_vChan[chan]->EditMarker(t, pM, nCopy);
 }
 
@@ -32,6 +32,10 @@
 #include <list>
 #include <string>
 #include <memory>
+#include <functional>
+#include <map>
+#include <atomic>
+#include <future>
 
 #include <thread>
 #include <mutex>
@@ -76,6 +80,23 @@ namespace ceds64
     class TSon64File;
     class CSon64Chan;
     class CSFilter;
+    class CDataBlock;
+    class CTextIndex;
+    class CCountPyramid;
+    class CRankIndex;
+    struct TSnapReader;
+    class CReadPool;
+    struct TDirectBuf;
+    class CIOEngine;
+    struct TIOReq;
+    class CIndexFile;
+    struct TIdxBlock;
+
+#ifdef _UNICODE
+    typedef std::wstring TFilePath;     //!< A file name as passed to the OS
+#else
+    typedef std::string TFilePath;      //!< A file name as passed to the OS
+#endif
 
     //! Constants defining file system sizes
     /*!
@@ -304,6 +325,28 @@ namespace ceds64
         DLUItems = (DLSize-DBHSize)/sizeof(TDiskTableItem), //!< Items in a lookup table (standard value 255)
     };
 
+    //! One item in the file free block map
+    /*!
+     The free block map lists the data blocks released by deleted channels so that they can
+     be used by any channel. It is held in one disk block that is part of the file header,
+     and is sorted by disk offset. Runs of blocks from a deleted channel remember the channel
+     so that the channel can still be undeleted as long as none of its blocks have been used.
+    */
+    struct TFreeRun
+    {
+        TDiskOff    m_do;               //!< Disk offset of the first DBSize block in the run
+        uint32_t    m_nBlocks;          //!< The number of contiguous blocks in the run
+        uint16_t    m_chan;             //!< The deleted channel that owned the blocks or FreeRunNoChan
+        uint16_t    m_pad;              //!< Padding, set to 0
+    };
+    static_assert(sizeof(TFreeRun) == 16, "TFreeRun is wrong size");
+
+    enum
+    {
+        FreeRunNoChan = 0xffff,         //!< TFreeRun::m_chan value for blocks with no owner
+        FreeRunsMax = (DBSize-DBHSize)/sizeof(TFreeRun), //!< Maximum runs in the free block map (4095)
+    };
+
 
     //! 0x800 byte header for the file
     /*!
@@ -324,7 +367,9 @@ namespace ceds64
         uint32_t    m_nChannels;        //!< number of channels this file has headers for
         uint32_t    m_nChanHeadSize;    //!< bytes per channel header (multiple of 8, please)
         std::array<s64strid, FHComments> m_comments; //!< Space for comments, being the index in the string table.
-		std::array<uint32_t, 225> m_pad;     //!< Pad the header to 0x800 bytes
+        TDiskOff    m_doFreeMap;        //!< File offset of the free block map or 0 if none
+        uint32_t    m_nFreeRuns;        //!< Number of TFreeRun items in the free block map
+		std::array<uint32_t, 222> m_pad;     //!< Pad the header to 0x800 bytes
 
         uint32_t    m_nHeaderExt;       //!< number of extra header blocks used
         TDiskOff    m_doNextBlock;      //!< Next position to write to in the file
@@ -347,6 +392,28 @@ namespace ceds64
     enum 
     {
         ChanFlag_LevelHigh = 1,         //!< Set for level channel to indicate init state
+        ChanFlag_BlocksFree = 2,        //!< Set for a deleted channel with blocks in the free map
+        ChanFlag_Stats = 4,             //!< Set when TChanHead::m_stats describes the channel data
+        ChanFlag_RingWrap = 8,          //!< Set when a ring archive channel has reused its first block
+    };
+
+    //! Summary statistics of the data in a channel
+    /*!
+     These are held in the channel header, so are saved in the file, and are returned by
+     TSon64File::ChanStats(). For waveforms, the items are the data points. The value range
+     is for Adc, AdcMark, RealWave and RealMark data and is 0 for other channel types. In
+     the channel header, Adc and AdcMark values are the 16-bit integers as stored.
+    */
+    struct TChanStats
+    {
+        uint64_t    m_nItems;           //!< The number of items (or waveform points)
+        TSTime64    m_tFirst;           //!< The time of the first item or -1 if none
+        TSTime64    m_tLast;            //!< The time of the last item or -1 if none
+        double      m_dMin;             //!< The smallest data value
+        double      m_dMax;             //!< The largest data value
+
+        void Clear() {m_nItems = 0; m_tFirst = m_tLast = -1; m_dMin = m_dMax = 0.0;} //!< Set no data
+        void Add(const TChanStats& rhs);
     };
 
     //! The channel header as stored on disk.
@@ -385,8 +452,12 @@ namespace ceds64
         double      m_dYLow;            //!< suggested low value for y axis
         double      m_dYHigh;           //!< suggested high value for y axis
 
-        uint64_t    m_flags;            //!< flags space. Currently only bit 0 = level starts high
-        std::array<uint64_t, 19> m_pad; //!< space for the future that is initialised to 0
+        uint64_t    m_flags;            //!< flags space. See ChanFlag_LevelHigh and ChanFlag_BlocksFree
+        TChanStats  m_stats;            //!< summary of the data on disk if ChanFlag_Stats is set
+        TChanStats  m_statsBase;        //!< summary of the data before the last block on disk
+        uint64_t    m_nRingBlocks;      //!< data blocks kept by a ring archive channel, 0 if not a ring
+        uint64_t    m_nFirstBlock;      //!< index of the first data block in use, earlier blocks were dropped
+        std::array<uint64_t, 7> m_pad;  //!< space for the future that is initialised to 0
 
         TChanHead();
 		void ResetForReuse();           //!< set a deleted channel for reuse
@@ -409,9 +480,92 @@ namespace ceds64
         {
             return m_nAllocatedBlocks > m_nBlocks;
         }
+        bool StatsValid() const         //!< True if m_stats is valid for the data on disk
+        {
+            // Older library versions do not update m_stats, so check it matches the data
+            return (m_flags & ChanFlag_Stats) && (m_stats.m_tLast == (m_nBlocks ? m_lastTime : -1));
+        }
+        //! True if a ring archive channel still holds blocks written before it last wrapped
+        /*!
+        The blocks m_nBlocks to m_nAllocatedBlocks-1 then hold the oldest data, followed by
+        the blocks 0 to m_nBlocks-1.
+        */
+        bool RingOldLap() const
+        {
+            return (m_flags & ChanFlag_RingWrap) && ReusingBlocks();
+        }
+        void ClearStats();
         int Undelete();
     };
 
+    static_assert(sizeof(TChanHead) == 0x110, "sizeof(TChanHead) has changed");
+
+    //! Flags for the shape features in TSpikeFeatures::m_shape
+    enum
+    {
+        SpikePeak = 1,                  //!< The maximum value of each trace
+        SpikeTrough = 2,                //!< The minimum value of each trace
+        SpikeWidth = 4,                 //!< The time in seconds between the trough and the peak
+    };
+
+    //! The features computed for each spike by TSon64File::ExtractFeatures()
+    /*!
+     The features for each spike are, for each trace (column) in turn, the shape features
+     selected in m_shape in the order peak, trough, width; then one value per PCA basis
+     vector. Values are in the channel units. Each basis vector (and the mean) holds
+     rows x columns values in the same row-major order as the AdcMark data.
+    */
+    struct TSpikeFeatures
+    {
+        int m_shape;                    //!< Combination of SpikePeak, SpikeTrough and SpikeWidth
+        int m_nBasis;                   //!< The number of PCA basis vectors
+        const float* m_pBasis;          //!< m_nBasis basis vectors, one after the other
+        const float* m_pMean;           //!< Mean spike subtracted before projection, or nullptr
+
+        TSpikeFeatures(int shape = SpikePeak | SpikeTrough | SpikeWidth, int nBasis = 0,
+                       const float* pBasis = nullptr, const float* pMean = nullptr)
+            : m_shape( shape ), m_nBasis( nBasis ), m_pBasis( pBasis ), m_pMean( pMean )
+        {}
+
+        //! The number of features per spike for a channel with nCols traces
+        size_t Count(size_t nCols) const
+        {
+            size_t nShape = ((m_shape & SpikePeak) ? 1 : 0) + ((m_shape & SpikeTrough) ? 1 : 0) +
+                            ((m_shape & SpikeWidth) ? 1 : 0);
+            return nCols*nShape + m_nBasis;
+        }
+    };
+
+    //! A time window for the batched reads TSon64File::ReadEventWindows() and ReadWaveWindows()
+    struct TReadWindow
+    {
+        TChanNum m_chan;                //!< The channel to read
+        TSTime64 m_tFrom;               //!< The start of the window
+        TSTime64 m_tUpto;               //!< One tick beyond the end of the window
+        int m_nMax;                     //!< The maximum number of items to read
+        int m_nRead;                    //!< Returned as the number of items read
+        TSTime64 m_tFirst;              //!< Returned as the time of the first item, or -1
+
+        TReadWindow(TChanNum chan = 0, TSTime64 tFrom = 0, TSTime64 tUpto = 0, int nMax = 0)
+            : m_chan( chan ), m_tFrom( tFrom ), m_tUpto( tUpto ), m_nMax( nMax ), m_nRead( 0 ), m_tFirst( -1 )
+        {}
+    };
+
+    //! A flag used to cancel asynchronous reads such as TSon64File::ReadWaveAsync()
+    /*!
+     One flag can be shared by many reads, for example all the reads for one display update.
+    */
+    class TAsyncCancel
+    {
+        std::atomic<bool> m_bCancel;    //!< Set to cancel the reads
+
+    public:
+        TAsyncCancel() : m_bCancel( false ) {}
+        void Cancel() {m_bCancel = true;}                   //!< Cancel reads using this flag
+        void Reset() {m_bCancel = false;}                   //!< Allow the flag to be reused
+        bool Cancelled() const {return m_bCancel;}          //!< True if the reads are cancelled
+    };
+
     //! The object that implements a 64-bit SON data file
     /*!
     This class defines the user interface to the data files. This is the native
@@ -447,6 +601,9 @@ namespace ceds64
         virtual DllClass int Commit(int flags = 0);
         virtual DllClass bool IsModified() const;
         virtual DllClass int FlushSysBuffers();
+        DllClass int SetDirectWrite(bool bDirect);
+        DllClass bool DirectWrite() const;
+        DllClass int WriteIndexFile();
 
         virtual DllClass double GetTimeBase() const;
         virtual DllClass void SetTimeBase(double dSecPerTick);
@@ -521,12 +678,69 @@ namespace ceds64
 
         virtual DllClass int WriteExtMarks(TChanNum chan, const TExtMark* pData, size_t count);
         virtual DllClass int ReadExtMarks(TChanNum chan, TExtMark* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter = nullptr);
-    
+
+        virtual DllClass int Prefetch(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto);
+        virtual DllClass int Release(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto);
+
+        // SON64 extensions that are not part of CSon64File. These work on the disk blocks
+        // directly, so they are only available between SON64 files.
+        DllClass int CopyChannel(TChanNum srcChan, TSon64File& dst, TChanNum dstChan, TSTime64 tFrom = 0, TSTime64 tUpto = TSTIME64_MAX, TSTime64 tShift = 0);
+        DllClass int CopyChannels(const TChanNum* pSrc, size_t nChans, TSon64File& dst, const TChanNum* pDst, TSTime64 tFrom = 0, TSTime64 tUpto = TSTIME64_MAX, TSTime64 tShift = 0);
+        DllClass int ExtractEpoch(const char* szName, TSTime64 tFrom, TSTime64 tUpto, bool bShiftToZero = false);
+        DllClass int FindPrevious(TChanNum chan, const TSTime64* pQuery, size_t n, TSTime64* pOut, const CSFilter* pFilter = nullptr);
+        DllClass int FindNearest(TChanNum chan, const TSTime64* pQuery, size_t n, TSTime64* pOut, const CSFilter* pFilter = nullptr);
+        DllClass int ExtractSnippets(TChanNum trigChan, const TChanNum* pSrc, size_t nSrc, TChanNum dstChan, size_t nPoints, int nPre,
+                                     TSTime64 tFrom = 0, TSTime64 tUpto = TSTIME64_MAX, const CSFilter* pFilter = nullptr);
+        DllClass int ExtractSnippets(const TSTime64* pTimes, size_t nTimes, const TChanNum* pSrc, size_t nSrc, TChanNum dstChan,
+                                     size_t nPoints, int nPre, double dRate = 0.0);
+        DllClass int ExtractFeatures(TChanNum chan, const TSpikeFeatures& spec, float* pOut, size_t nMax, TSTime64* pTimes = nullptr,
+                                     TSTime64 tFrom = 0, TSTime64 tUpto = TSTIME64_MAX, const CSFilter* pFilter = nullptr);
+        DllClass int ExtractFeatures(TChanNum chan, const TSpikeFeatures& spec, TChanNum dstChan,
+                                     TSTime64 tFrom = 0, TSTime64 tUpto = TSTIME64_MAX, const CSFilter* pFilter = nullptr);
+
+        DllClass int FindText(TChanNum chan, const char* szFind, TSTime64* pTimes, int nMax, TSTime64 tFrom = 0,
+                              TSTime64 tUpto = TSTIME64_MAX, bool bWords = false);
+        DllClass int SaveTextIndex(const char* szPath);
+        DllClass int LoadTextIndex(const char* szPath);
+        DllClass int FindRealMarks(TChanNum chan, size_t nRow, size_t nCol, float fLo, float fHi, TSTime64* pTimes, int nMax,
+                                   TSTime64 tFrom = 0, TSTime64 tUpto = TSTIME64_MAX, const CSFilter* pFilter = nullptr);
+        DllClass int FindRealMarks(TChanNum chan, size_t nRow, size_t nCol, float fLo, float fHi, TExtMark* pData, int nMax,
+                                   TSTime64 tFrom = 0, TSTime64 tUpto = TSTIME64_MAX, const CSFilter* pFilter = nullptr);
+
+        DllClass int SetChanRing(TChanNum chan, uint64_t nBlocks);
+        DllClass int64_t ChanRing(TChanNum chan) const;
+        DllClass TSTime64 ChanMinTime(TChanNum chan) const;
+        DllClass int ChanStats(TChanNum chan, TChanStats& stats);
+        DllClass int TruncateBefore(TChanNum chan, TSTime64 t);
+        DllClass int DropRange(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto);
+        DllClass int EventCounts(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto, int nBins, uint32_t* pCounts,
+                                 const CSFilter* pFilter = nullptr);
+        DllClass int ReadEventWindows(TReadWindow* pWin, size_t nWin, TSTime64* pData, const CSFilter* pFilter = nullptr);
+        DllClass int ReadWaveWindows(TReadWindow* pWin, size_t nWin, short* pData, const CSFilter* pFilter = nullptr);
+        DllClass int ReadWaveWindows(TReadWindow* pWin, size_t nWin, float* pData, const CSFilter* pFilter = nullptr);
+        DllClass std::future<int> ReadWaveAsync(TChanNum chan, short* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                                                TSTime64& tFirst, const CSFilter* pFilter = nullptr,
+                                                const TAsyncCancel* pCancel = nullptr);
+        DllClass std::future<int> ReadWaveAsync(TChanNum chan, float* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                                                TSTime64& tFirst, const CSFilter* pFilter = nullptr,
+                                                const TAsyncCancel* pCancel = nullptr);
+        DllClass std::future<int> ReadEventsAsync(TChanNum chan, TSTime64* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                                                  const CSFilter* pFilter = nullptr, const TAsyncCancel* pCancel = nullptr);
+        DllClass std::future<TSTime64> PrevNTimeAsync(TChanNum chan, TSTime64 tStart, TSTime64 tEnd = 0, uint32_t n = 1,
+                                                      const CSFilter* pFilter = nullptr, bool bAsWave = false,
+                                                      const TAsyncCancel* pCancel = nullptr);
+
+        DllClass int64_t ItemIndexAt(TChanNum chan, TSTime64 t);
+        DllClass int ReadEventsByIndex(TChanNum chan, TSTime64* pData, uint64_t nFirst, int nMax);
+        DllClass int ReadMarkersByIndex(TChanNum chan, TMarker* pData, uint64_t nFirst, int nMax);
+
         // This is the end of the defined interface. Anything that is DllClass from here on is
         // so that it can be used by S64Fix.
     protected:
         int DllClass Read(void* pBuffer, uint32_t bytes, TDiskOff offset);
         int Write(const void* pBuffer, uint32_t bytes, TDiskOff offset);
+        int ReadBatch(TIOReq* pReq, size_t n);  // read a list of blocks in one go
+        int WriteBatch(TIOReq* pReq, size_t n); // write a list of blocks in one go
         int ReadHeader(void* pBuffer, uint32_t bytes, uint32_t hOffset);
         int WriteHeader(const void* pBuffer, uint32_t bytes, uint32_t hOffset);
         int ZeroExtraData();
@@ -534,15 +748,48 @@ namespace ceds64
         DllClass TChanHead& ChanHead(TChanNum n); // export so visible to S64Fix
         TDiskOff DllClass GetFileSize();        // not const due to mutex use
 
-        TDiskOff AllocateDiskBlock();           // Allocate the next disk block
+        TDiskOff AllocateDiskBlock(TDiskOff doNear = 0); // Allocate the next disk block
         TDiskOff AllocateIndexBlock();          // Allocate the next index block
 
 
     private:
-        TDiskOff LockedAllocateDiskBlock();     // Head is already locked
+        TDiskOff LockedAllocateDiskBlock(TDiskOff doNear = 0); // Head is already locked
+        int ReadFreeMap();                      // Head is already locked
+        int LockedMarkReuse();                  // Head is already locked
+        bool LockedAddFreeRun(const TFreeRun& r); // Head is already locked
+        int WriteFreeMap();                     // Head is already locked
+        int ReleaseChanBlocks(TChanNum chan);   // pass deleted channel blocks to the free map
+        int ReclaimChanBlocks(TChanNum chan, bool bReuse = false); // take deleted channel blocks back
+        size_t FreeDataBlocks(std::vector<TDiskOff>& vDO); // pass unwanted data blocks to the free map
         int WriteChanHeader(TChanNum chan);     // called from channels
         int CreateChannelFromHeader(TChanNum chan);
         int CreateChannelsFromHeaders();        // create all the channels
+        int CopyChanDef(TChanNum srcChan, TSon64File& dst, TChanNum dstChan);
+        int CreateSnippetChan(const TChanNum* pSrc, size_t nSrc, TChanNum dstChan, size_t nPoints, int nPre, double dRate);
+        int AppendChanBlocks(TChanNum chan, std::vector<std::unique_ptr<CDataBlock>>& vBlk);
+        typedef std::function<int(const TMarker* pMark, const float* pFeat, size_t n)> TFeatureSink;
+        int ExtractFeatures(TChanNum chan, const TSpikeFeatures& spec, const TFeatureSink& sink,
+                            TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter);
+        int TextIndex(TChanNum chan, const CTextIndex*& pIdx);  // m_mutText is held
+        TSTime64 TextStamp(TChanNum chan, TChanID& id) const;
+        TDiskOff TextRoot(TChanNum chan, uint64_t& nFirstBlock) const;
+        void AddToTextIndex(TChanNum chan, const TExtMark* pData, size_t count, TSTime64 tPrev);
+        int FindValues(TChanNum chan, size_t nRow, size_t nCol, float fLo, float fHi, TSTime64* pTimes,
+                       TExtMark* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter);
+        int CountPyramid(TChanNum chan, const CCountPyramid*& pCount);  // m_mutCount is held
+        void AddToCounts(TChanNum chan, const void* pData, size_t nStride, size_t count, bool bCodes, TSTime64 tPrev);
+        int RankStart(TChanNum chan, TSTime64 t, uint64_t nItem, TSTime64& tStart, uint64_t& nBefore);
+        int ItemStart(TChanNum chan, uint64_t nItem, TSTime64& tFrom);
+        int ReadEventsWith(TChanNum chan, TSTime64* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                           const CSFilter* pFilter, TSnapReader* pReader);
+        int FindSorted(TChanNum chan, const TSTime64* pQuery, const size_t* pOrder, size_t n, TSTime64* pOut,
+                       const CSFilter* pFilter, bool bNearest);
+        int FindEvents(TChanNum chan, const TSTime64* pQuery, size_t n, TSTime64* pOut,
+                       const CSFilter* pFilter, bool bNearest);
+        void PostToPool(std::function<void(bool bRun)> task);
+        void MapIndexFile();
+        void UnmapIndexFile();
+        int AdviseBlocks(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto, bool bNeed);
 
         struct xfer
         {
@@ -558,6 +805,13 @@ namespace ceds64
         int ReadStringStore();
 
         TS64FH m_file;                  // the file handle
+        TS64FH m_fileDirect;            // second handle for uncached block writes, or NOFILE_ID
+        std::unique_ptr<TDirectBuf> m_pDirectBuf;   // aligned copy of blocks for m_fileDirect
+        std::unique_ptr<CIOEngine> m_pIO;   // moves blocks to and from disk, uses m_mutFile
+        TFilePath m_sName;              // the name the file was opened or created with
+        bool m_bUseIdx;                 // set if we use the .s64idx index file
+        bool m_bMakeIdx;                // set if we write the .s64idx index file on Close()
+        std::unique_ptr<CIndexFile> m_pIdx; // the mapped index file, read only files only
         typedef std::lock_guard<std::mutex> TFileLock;
         std::mutex m_mutFile;           // file access mutex
         bool m_bReadOnly;               // are we read only
@@ -571,6 +825,17 @@ namespace ceds64
 
         string_store m_ss;              // the string store. Uses the head lock mutex
 
+        std::vector<TFreeRun> m_vFree;  // the free block map. Uses the head lock mutex
+        bool m_bFreeDirty;              // true if the free block map needs writing
+
+        std::map<TChanNum, std::unique_ptr<CTextIndex>> m_mapText;  // TextMark channel indexes
+        std::mutex m_mutText;           // text index mutex, take before m_mutChans
+        std::map<TChanNum, std::unique_ptr<CCountPyramid>> m_mapCount; // event count summaries
+        std::mutex m_mutCount;          // event count mutex, take before m_mutChans
+        std::map<TChanNum, std::unique_ptr<CRankIndex>> m_mapRank; // item numbers of data blocks
+        std::mutex m_mutRank;           // item number mutex, take before m_mutChans
+        std::atomic<uint32_t> m_nEditGen; // incremented when channel data is reset or edited
+
         // This area handles the channel list. We keep the TChanHead stuff together so
         // it is efficient to write it all in one go. The two vectors have a shared
         // mutex (multiple readers, single writer). You only need to hold the write
@@ -582,7 +847,83 @@ namespace ceds64
         mutable std::shared_mutex m_mutChans; // shared mutex to the channel list
         typedef std::unique_lock<std::shared_mutex> TChWrLock;
         typedef std::shared_lock<std::shared_mutex> TChRdLock;
+
+        // The asynchronous read threads. This is last so it is destroyed first.
+        std::unique_ptr<CReadPool> m_pPool;
+        std::mutex m_mutPool;           // protects creating, posting to and destroying m_pPool
+    };
+
+    //! The reduction applied to each channel and window by RunQuery()
+    enum TQueryReduce
+    {
+        QueryCount,                     //!< The number of events or waveform points
+        QueryMean,                      //!< The mean waveform value, or the event rate per second
+        QueryHist,                      //!< Event counts in TFileQuery::m_nBins equal bins
+    };
+
+    //! A query that RunQuery() applies to each file in a list
+    /*!
+     The windows are in seconds so that files with different time bases can share a query.
+     If m_prepare is set, it is called with each opened file and a copy of the query, so the
+     windows and channels can be set for that file, for example from a marker channel. It
+     must not change the number of channels or windows, so the results can be merged.
+    */
+    struct TFileQuery
+    {
+        std::vector<TChanNum> m_vChans; //!< The channels to query
+        std::vector<std::pair<double, double>> m_vWin; //!< The window start and end times in seconds
+        TQueryReduce m_reduce;          //!< What to work out for each channel and window
+        int m_nBins;                    //!< The bins per window for QueryHist
+        std::function<int(TSon64File& file, TFileQuery& query)> m_prepare;  //!< Per-file set up or empty
+
+        TFileQuery(TQueryReduce reduce = QueryCount, int nBins = 1)
+            : m_reduce( reduce ), m_nBins( nBins )
+        {}
+
+        //! The number of results for each file
+        size_t Size() const
+        {
+            return m_vChans.size() * m_vWin.size() * ((m_reduce == QueryHist) ? m_nBins : 1);
+        }
+    };
+
+    //! The results of RunQuery() for one file, or merged across files
+    /*!
+     There is a result for each channel, window and (for QueryHist) bin, with the bin index
+     changing fastest. For QueryCount and QueryHist the result is the total count. For
+     QueryMean of a waveform it is the mean of all the points; of an event channel it is the
+     mean of the rates in each file.
+    */
+    struct TQueryResult
+    {
+        int m_err;                      //!< S64_OK (0) or the first error for the file(s)
+        size_t m_nFiles;                //!< The number of files that are included
+        double m_dSeconds;              //!< Time taken to open and read the file(s)
+        std::vector<double> m_vSum;     //!< The sum for each result
+        std::vector<uint64_t> m_vN;     //!< The number of values in each sum
+
+        TQueryResult() : m_err( 0 ), m_nFiles( 0 ), m_dSeconds( 0.0 ) {}
+
+        //! Get a result
+        /*!
+        \param i    The index of the result: (channel * windows + window) * bins + bin.
+        \param reduce The reduction used by the query.
+        \return     The count, or for QueryMean the mean (0 if there were no values).
+        */
+        double Value(size_t i, TQueryReduce reduce) const
+        {
+            if (reduce != QueryMean)
+                return m_vSum[i];
+            return m_vN[i] ? m_vSum[i] / m_vN[i] : 0.0;
+        }
     };
+
+    //! Called by RunQuery() as each file is completed, with the file index and results
+    typedef std::function<void(size_t iFile, const TQueryResult& result)> TQueryProgress;
+
+    DllClass int RunQuery(const std::vector<std::string>& vFiles, const TFileQuery& query, TQueryResult& merged,
+                          std::vector<TQueryResult>* pPerFile = nullptr, const TQueryProgress& progress = nullptr,
+                          unsigned int nThreads = 0, unsigned int nMaxIO = 4);
 }
 #undef DllClass
 #endif
@@ -0,0 +1,359 @@
+// s64query.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64query.cpp
+//! \brief Running one query across many data files in parallel
+/*!
+\internal
+Each file is opened only when a thread is ready to query it, and the channels are checked
+against the file header before any data is read. The files are handed out to the threads
+one at a time from a shared counter, so a thread that finishes a small file takes the next
+file and the threads stay busy until the list is done. A gate limits how many threads are
+reading from the disk at once, so a slow disk is not swamped. It is held only for the disk
+reads, not while the data is reduced, so one thread can reduce while another reads. The
+results for each file are kept and merged in file order at the end, so the merged result
+does not depend on the timing.
+*/
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <thread>
+#include "s64priv.h"
+
+using namespace std;
+using namespace ceds64;
+
+//! Number of items we read from a channel at a time
+static const int nQueryBuf = 16384;
+
+//! Limits the number of threads that are reading files at the same time
+class CIOGate
+{
+    mutex m_mutex;                      //!< Protects m_nFree
+    condition_variable m_cv;            //!< Signalled when a slot is released
+    unsigned int m_nFree;               //!< The number of free slots
+
+public:
+    explicit CIOGate(unsigned int nSlots) : m_nFree( nSlots ) {}
+
+    //! Wait for a free slot and take it
+    void Enter()
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_cv.wait(lock, [this]{return m_nFree > 0;});
+        --m_nFree;
+    }
+
+    //! Release a slot taken by Enter()
+    void Leave()
+    {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            ++m_nFree;
+        }
+        m_cv.notify_one();
+    }
+};
+
+//! Holds a CIOGate slot for the lifetime of the object
+class CIOGateLock
+{
+    CIOGate& m_gate;                    //!< The gate we hold a slot in
+public:
+    explicit CIOGateLock(CIOGate& gate) : m_gate( gate ) {m_gate.Enter();}
+    ~CIOGateLock() {m_gate.Leave();}
+};
+
+//! Check that a channel can be used with a query, using only the file header
+/*!
+\param file     The open file.
+\param chan     The channel to check.
+\param reduce   The query reduction.
+\return         S64_OK (0), NO_CHANNEL or CHANNEL_TYPE.
+*/
+static int CheckQueryChan(const TSon64File& file, TChanNum chan, TQueryReduce reduce)
+{
+    const TDataKind kind = file.ChanKind(chan);
+    if (kind == ChanOff)
+        return NO_CHANNEL;
+    if ((reduce == QueryHist) && ((kind == Adc) || (kind == RealWave)))
+        return CHANNEL_TYPE;            // only event-based channels have time histograms
+    return S64_OK;
+}
+
+//! Reduce the events of a channel in a window
+/*!
+\param file     The open file.
+\param chan     An event-based channel.
+\param tFrom    The start of the window.
+\param tUpto    The end of the window (not included).
+\param q        The query.
+\param pSum     The sums for this channel and window (m_nBins of them for QueryHist).
+\param pN       The value counts for this channel and window.
+\param buf      Workspace of nQueryBuf times.
+\param gate     Held for each read of the data.
+\return         S64_OK (0) or a negative error code.
+*/
+static int ReduceEvents(TSon64File& file, TChanNum chan, TSTime64 tFrom, TSTime64 tUpto, const TFileQuery& q,
+                        double* pSum, uint64_t* pN, vector<TSTime64>& buf, CIOGate& gate)
+{
+    const int nBins = (q.m_reduce == QueryHist) ? q.m_nBins : 1;
+    const TSTime64 tWidth = (tUpto - tFrom + nBins - 1) / nBins;    // as for EventCounts()
+    vector<uint64_t> vCount(nBins, 0);
+    TSTime64 t = tFrom;
+    while (t < tUpto)
+    {
+        int n;
+        {
+            CIOGateLock io(gate);       // we are about to use the disk
+            n = file.ReadEvents(chan, buf.data(), nQueryBuf, t, tUpto);
+        }
+        if (n < 0)
+            return n;
+        if (nBins == 1)
+            vCount[0] += n;
+        else
+        {
+            for (int i = 0; i < n; ++i)
+                ++vCount[static_cast<size_t>((buf[i] - tFrom) / tWidth)];
+        }
+        if (n < nQueryBuf)
+            break;
+        t = buf[n-1] + 1;
+    }
+
+    if (q.m_reduce == QueryMean)        // a rate per second
+    {
+        pSum[0] = vCount[0] / ((tUpto - tFrom) * file.GetTimeBase());
+        pN[0] = 1;
+    }
+    else
+    {
+        for (int i = 0; i < nBins; ++i)
+        {
+            pSum[i] = static_cast<double>(vCount[i]);
+            pN[i] = 1;
+        }
+    }
+    return S64_OK;
+}
+
+//! Reduce the points of a waveform channel in a window
+/*!
+\param file     The open file.
+\param chan     A waveform channel.
+\param tFrom    The start of the window.
+\param tUpto    The end of the window (not included).
+\param q        The query (QueryCount or QueryMean).
+\param pSum     Set to the count or to the sum of the values in user units.
+\param pN       Set to the number of points.
+\param buf      Workspace of nQueryBuf values.
+\param gate     Held for each read of the data.
+\return         S64_OK (0) or a negative error code.
+*/
+static int ReduceWave(TSon64File& file, TChanNum chan, TSTime64 tFrom, TSTime64 tUpto, const TFileQuery& q,
+                      double* pSum, uint64_t* pN, vector<float>& buf, CIOGate& gate)
+{
+    const TSTime64 tDvd = file.ChanDivide(chan);
+    if (tDvd <= 0)
+        return CHANNEL_TYPE;
+    uint64_t nPoints = 0;
+    double dSum = 0.0;
+    TSTime64 t = tFrom;
+    while (t < tUpto)
+    {
+        TSTime64 tFirst;
+        int n;
+        {
+            CIOGateLock io(gate);       // we are about to use the disk
+            n = file.ReadWave(chan, buf.data(), nQueryBuf, t, tUpto, tFirst);
+        }
+        if (n < 0)
+            return n;
+        if (n == 0)
+            break;
+        nPoints += n;
+        if (q.m_reduce == QueryMean)
+        {
+            for (int i = 0; i < n; ++i)
+                dSum += buf[i];
+        }
+        t = tFirst + n*tDvd;            // on past the points, or across a gap
+    }
+    *pSum = (q.m_reduce == QueryMean) ? dSum : static_cast<double>(nPoints);
+    *pN = nPoints;
+    return S64_OK;
+}
+
+//! Open a file and run a query on it
+/*!
+\param szFile   The file to open, read only.
+\param shared   The query shared by all the files.
+\param res      Set to the results for this file.
+\param gate     Limits the number of threads reading from the disk at once.
+*/
+static void QueryFile(const char* szFile, const TFileQuery& shared, TQueryResult& res, CIOGate& gate)
+{
+    const auto tStart = chrono::steady_clock::now();
+    TFileQuery local;                   // only used if the query is changed for this file
+    const TFileQuery* pQ = &shared;
+    res.m_vSum.assign(shared.Size(), 0.0);
+    res.m_vN.assign(shared.Size(), 0);
+
+    TSon64File file;
+    int err;
+    {
+        CIOGateLock io(gate);           // we are about to use the disk
+        err = file.Open(szFile, 1);     // read only, this reads the headers
+        if ((err == 0) && shared.m_prepare)
+        {
+            local = shared;
+            err = local.m_prepare(file, local);
+            if ((err == 0) && (local.Size() != shared.Size()))
+                err = BAD_PARAM;        // the results could not be merged
+            pQ = &local;
+        }
+    }
+    const TFileQuery& q = *pQ;
+    for (size_t i = 0; (err == 0) && (i < q.m_vChans.size()); ++i)
+        err = CheckQueryChan(file, q.m_vChans[i], q.m_reduce);
+
+    // All is well, so read the data
+    const double dTickPerSec = (err == 0) ? 1.0 / file.GetTimeBase() : 0.0;
+    const size_t nBins = (q.m_reduce == QueryHist) ? q.m_nBins : 1;
+    vector<TSTime64> vTimes;
+    vector<float> vWave;
+    for (size_t iChan = 0; (err == 0) && (iChan < q.m_vChans.size()); ++iChan)
+    {
+        const TChanNum chan = q.m_vChans[iChan];
+        const TDataKind kind = file.ChanKind(chan);
+        const bool bWave = (kind == Adc) || (kind == RealWave);
+        if (bWave)
+            vWave.resize(nQueryBuf);
+        else
+            vTimes.resize(nQueryBuf);
+        for (size_t iWin = 0; (err == 0) && (iWin < q.m_vWin.size()); ++iWin)
+        {
+            const TSTime64 tFrom = max<TSTime64>(0, llround(q.m_vWin[iWin].first * dTickPerSec));
+            const TSTime64 tUpto = llround(q.m_vWin[iWin].second * dTickPerSec);
+            if (tUpto <= tFrom)         // an empty window has no results
+                continue;
+            const size_t iRes = (iChan * q.m_vWin.size() + iWin) * nBins;
+            if (bWave)
+                err = ReduceWave(file, chan, tFrom, tUpto, q, &res.m_vSum[iRes], &res.m_vN[iRes], vWave, gate);
+            else
+                err = ReduceEvents(file, chan, tFrom, tUpto, q, &res.m_vSum[iRes], &res.m_vN[iRes], vTimes, gate);
+        }
+    }
+    file.Close();
+
+    res.m_err = err;
+    res.m_nFiles = (err == 0) ? 1 : 0;
+    res.m_dSeconds = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+}
+
+//! Run the same query on a list of files in parallel and merge the results
+/*!
+This is for analyses that apply one query, for example spike counts in a set of condition
+windows, to many recordings. Each file is opened read only when a thread is ready for it
+and the query channels are checked against the file header before any data is read. The
+files are shared out between the threads as each thread becomes free. Files that cannot be
+opened or queried are left out of the merged result.
+\param vFiles   The list of files to query.
+\param query    The query to apply to each file.
+\param merged   Set to the results merged across all the files that were queried without
+                error. Its m_dSeconds is the elapsed time for the whole run.
+\param pPerFile If not nullptr, set to the results for each file, in the order of vFiles.
+\param progress If set, this is called as each file is completed. Calls are not made at the
+                same time, but can be made from any of the threads.
+\param nThreads The number of threads to use, 0 for one per processor.
+\param nMaxIO   The maximum number of threads reading from the disk at once, 0 for no limit.
+\return         S64_OK (0) if all the files were queried, else the error for the first file
+                in the list that failed.
+*/
+int ceds64::RunQuery(const vector<string>& vFiles, const TFileQuery& query, TQueryResult& merged,
+                     vector<TQueryResult>* pPerFile, const TQueryProgress& progress,
+                     unsigned int nThreads, unsigned int nMaxIO)
+{
+    if ((query.m_reduce == QueryHist) && (query.m_nBins < 1))
+        return BAD_PARAM;
+    const auto tStart = chrono::steady_clock::now();
+    const size_t nFiles = vFiles.size();
+    vector<TQueryResult> vRes(nFiles);
+
+    if (nThreads == 0)
+        nThreads = max(1u, thread::hardware_concurrency());
+    nThreads = static_cast<unsigned int>(min<size_t>(nThreads, nFiles));
+    CIOGate gate(nMaxIO ? nMaxIO : max(nThreads, 1u));
+
+    atomic<size_t> next(0);             // the next file to query
+    mutex mutProgress;                  // so progress calls are one at a time
+    auto worker = [&]()
+    {
+        size_t i;
+        while ((i = next++) < nFiles)
+        {
+            QueryFile(vFiles[i].c_str(), query, vRes[i], gate);
+            if (progress)
+            {
+                lock_guard<mutex> lock(mutProgress);
+                progress(i, vRes[i]);
+            }
+        }
+    };
+
+    vector<thread> vThreads;
+    for (unsigned int i = 1; i < nThreads; ++i)
+        vThreads.emplace_back(worker);
+    worker();                           // this thread does its share
+    for (auto& t : vThreads)
+        t.join();
+
+    // Merge in file order so the result does not depend on the thread timing
+    int err = 0;
+    merged = TQueryResult();
+    merged.m_vSum.assign(query.Size(), 0.0);
+    merged.m_vN.assign(query.Size(), 0);
+    for (const auto& r : vRes)
+    {
+        if (r.m_err)
+        {
+            if (err == 0)
+                err = r.m_err;
+            continue;
+        }
+        for (size_t i = 0; i < merged.m_vSum.size(); ++i)
+        {
+            merged.m_vSum[i] += r.m_vSum[i];
+            merged.m_vN[i] += r.m_vN[i];
+        }
+        ++merged.m_nFiles;
+    }
+    merged.m_err = err;
+    merged.m_dSeconds = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+    if (pPerFile)
+        pPerFile->swap(vRes);
+    return err;
+}
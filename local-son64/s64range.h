@@ -37,6 +37,7 @@
 namespace ceds64
 {
     struct TChanHead;
+    struct TSnapReader;
 
     //! This is passed around reading routine to keep track of the work to be done
     /*!
@@ -53,6 +54,7 @@ namespace ceds64
         uint16_t    m_nFlags;       //!< bit 0 is first time flag for contiguous waveforms
         uint16_t    m_nUnused;      //!< Was m_nTrace for reading from WaveMark as wave
         const TChanHead* m_pChanHead; //!< Needed to extract waveform from WaveMark
+        TSnapReader* m_pReader;     //!< A snapshot reader owned by the caller, or nullptr
     public:
         //! Construct a range
         /*!
@@ -69,7 +71,7 @@ namespace ceds64
         */
         CSRange(TSTime64 tFrom, TSTime64 tUpto, size_t nMax, bool bFirst = true, int nAllowed = 10)
             : m_tFrom(tFrom), m_tUpto(tUpto), m_nMax(nMax), m_nAllowed(nAllowed),
-            m_nFlags(bFirst), m_nUnused(0), m_pChanHead( nullptr )
+            m_nFlags(bFirst), m_nUnused(0), m_pChanHead( nullptr ), m_pReader( nullptr )
         {
             assert(tFrom < tUpto);
         }
@@ -123,6 +125,14 @@ namespace ceds64
         void SetChanHead(const TChanHead* pChanHead){m_pChanHead = pChanHead;}
         const TChanHead* ChanHead() const {return m_pChanHead;} //!< Get the channel head
 
+        //! Set a snapshot reader for the read to use (see s64snap.cpp)
+        /*!
+        \param pReader A reader that the caller owns and uses for a series of reads of one
+                       channel, or nullptr for the usual behaviour.
+        */
+        void SetReader(TSnapReader* pReader){m_pReader = pReader;}
+        TSnapReader* Reader() const {return m_pReader;} //!< Get the snapshot reader, if any
+
         // Operations
 
         //! Reduce the available count by n because n items have been read/skipped.
@@ -0,0 +1,272 @@
+// s64rank.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64rank.cpp
+//! \brief Finding event-based items by their position in the channel
+/*!
+\internal
+Each event-based channel can have a table of the first time of each data block and the
+number of items before it. It is made from the data block heads the first time it is needed
+(or from the index file table, if there is one) and is extended as blocks are added, so an
+item number or the item number of a time is found with a binary search and a read of part of
+one block. Items are numbered from 0, which is the first item the channel now holds.
+*/
+#include <assert.h>
+#include <algorithm>
+#include "s64priv.h"
+#include "s64chan.h"
+#include "s64idx.h"
+#include "s64rank.h"
+
+using namespace std;
+using namespace ceds64;
+
+static const int nRankBuf = 4096;       // items read at a time when counting or skipping
+
+CRankIndex::CRankIndex(TChanID id, uint32_t nGen, uint64_t nFirstBlock)
+    : m_chanID( id )
+    , m_nGen( nGen )
+    , m_nFirstBlock( nFirstBlock )
+    , m_nLastItems( 0 )
+{
+}
+
+//! Add blocks to the table
+/*!
+\param vBlk The blocks to add. If the table is not empty, the first block is the last block
+            in the table, read again as it may have grown since.
+*/
+void CRankIndex::Add(const vector<TIdxBlock>& vBlk)
+{
+    size_t i = 0;
+    if (!m_vTime.empty() && !vBlk.empty())
+        m_nLastItems = vBlk[i++].m_nItems;
+    for (; i < vBlk.size(); ++i)
+    {
+        m_vBefore.push_back(m_vTime.empty() ? 0 : m_vBefore.back() + m_nLastItems);
+        m_vTime.push_back(vBlk[i].m_time);
+        m_nLastItems = vBlk[i].m_nItems;
+    }
+}
+
+//! Find the block to start from to count the items before a time
+/*!
+\param t        The time to find.
+\param tStart   Returned as the first time in the last block that starts at or before t, or
+                0 if there is no such block.
+\param nBefore  Returned as the number of items before tStart.
+*/
+void CRankIndex::BlockAt(TSTime64 t, TSTime64& tStart, uint64_t& nBefore) const
+{
+    const size_t k = upper_bound(m_vTime.begin(), m_vTime.end(), t) - m_vTime.begin();
+    tStart = k ? m_vTime[k-1] : 0;
+    nBefore = k ? m_vBefore[k-1] : 0;
+}
+
+//! Find the block to start from to skip to an item number
+/*!
+\param nItem    The item number to find.
+\param tStart   Returned as the first time in the block that holds the item, or in the last
+                block if the item is after it.
+\param nBefore  Returned as the number of items before tStart.
+*/
+void CRankIndex::BlockOf(uint64_t nItem, TSTime64& tStart, uint64_t& nBefore) const
+{
+    const size_t k = upper_bound(m_vBefore.begin(), m_vBefore.end(), nItem) - m_vBefore.begin();
+    tStart = k ? m_vTime[k-1] : 0;
+    nBefore = k ? m_vBefore[k-1] : 0;
+}
+
+//! Get the range of data block numbers in use
+/*!
+\param nFirst   Returned as the number of the first block in use.
+\param nEnd     Returned as the number of the block after the last block in use.
+\return         False if this is a ring archive that holds blocks from before it wrapped,
+                so that the blocks are not in time order.
+*/
+bool CSon64Chan::BlockSpan(uint64_t& nFirst, uint64_t& nEnd)
+{
+    TChanLock lock(m_mutex);
+    nFirst = m_chanHead.m_nFirstBlock;
+    nEnd = m_chanHead.m_nBlocks;
+    return !m_chanHead.RingOldLap();
+}
+
+//! Find where to start reading to reach a time or an item number
+/*!
+You must not hold m_mutChans. The block table of the channel is made or extended as needed.
+\param chan     An event-based channel.
+\param t        The time to find, or -1 to find nItem.
+\param nItem    The item number to find when t is -1.
+\param tStart   Returned as the time to start reading from.
+\param nBefore  Returned as the number of channel items before tStart.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::RankStart(TChanNum chan, TSTime64 t, uint64_t nItem, TSTime64& tStart, uint64_t& nBefore)
+{
+    const TDataKind kind = ChanKind(chan);
+    if (kind == ChanOff)
+        return NO_CHANNEL;
+    if ((kind == Adc) || (kind == RealWave))
+        return CHANNEL_TYPE;
+
+    std::lock_guard<std::mutex> lock(m_mutRank);
+    const uint32_t nGen = m_nEditGen;
+    auto& pRank = m_mapRank[chan];
+    {
+        TChRdLock lockChans(m_mutChans);
+        if ((chan >= m_vChan.size()) || !m_vChan[chan])
+            return NO_CHANNEL;
+        CSon64Chan& ch = *m_vChan[chan];
+        uint64_t nFirst, nEnd;
+        if (!ch.BlockSpan(nFirst, nEnd))
+            return CHANNEL_TYPE;        // a wrapped ring archive has no fixed item numbers
+        const TChanID id = m_vChanHead[chan].m_chanID;
+        if (!pRank || (pRank->m_chanID != id) || (pRank->m_nGen != nGen) ||
+            (pRank->m_nFirstBlock != nFirst) || (pRank->End() > nEnd))
+            pRank.reset(new CRankIndex(id, nGen, nFirst));
+        if (pRank->End() < nEnd)        // blocks have been added
+        {
+            vector<TIdxBlock> vBlk;
+            int err = ch.FlatBlocks(vBlk, max(pRank->End(), nFirst + 1) - 1);
+            if (err)
+            {
+                pRank.reset();
+                return err;
+            }
+            pRank->Add(vBlk);
+        }
+    }
+
+    if (t >= 0)
+        pRank->BlockAt(t, tStart, nBefore);
+    else
+        pRank->BlockOf(nItem, tStart, nBefore);
+    return S64_OK;
+}
+
+//! Find the time to read from to start at an item number
+/*!
+\param chan     An event-based channel.
+\param nItem    The item number.
+\param tFrom    Returned as the time of the item.
+\return         S64_OK (0), 1 if the channel does not have the item, or a negative error code.
+*/
+int TSon64File::ItemStart(TChanNum chan, uint64_t nItem, TSTime64& tFrom)
+{
+    uint64_t nBefore;
+    int err = RankStart(chan, -1, nItem, tFrom, nBefore);
+    if (err)
+        return err;
+
+    uint64_t nSkip = nItem - nBefore;
+    vector<TSTime64> vTime(static_cast<size_t>(min<uint64_t>(nSkip, nRankBuf)));
+    while (nSkip)
+    {
+        const int nWant = static_cast<int>(min<uint64_t>(nSkip, nRankBuf));
+        const int n = ReadEvents(chan, vTime.data(), nWant, tFrom, TSTIME64_MAX);
+        if (n <= 0)
+            return n ? n : 1;
+        nSkip -= n;
+        tFrom = vTime[n-1] + 1;
+    }
+    return S64_OK;
+}
+
+//! Get the item number of the first item at or after a time
+/*!
+Items in event-based channels are numbered from 0, which is the first item the channel holds.
+The first use for a channel reads the head of each data block (or uses the index file if
+there is one) to make a table of the item numbers of the blocks, which is kept up to date
+as data is written. After that, this reads part of at most one block.
+\param chan     An event, marker or extended marker channel.
+\param t        The time to find. The result is the number of channel items before t.
+\return         The item number or a negative error code. This is CHANNEL_TYPE for a
+                ring archive channel that holds data from before it last wrapped.
+*/
+int64_t TSon64File::ItemIndexAt(TChanNum chan, TSTime64 t)
+{
+    if (t < 0)
+        return BAD_PARAM;
+    TSTime64 tFrom;
+    uint64_t nBefore;
+    int err = RankStart(chan, t, 0, tFrom, nBefore);
+    if (err)
+        return err;
+
+    vector<TSTime64> vTime(nRankBuf);
+    while (tFrom < t)
+    {
+        const int n = ReadEvents(chan, vTime.data(), nRankBuf, tFrom, t);
+        if (n < 0)
+            return n;
+        nBefore += n;
+        if (n < nRankBuf)
+            break;
+        tFrom = vTime[n-1] + 1;
+    }
+    return static_cast<int64_t>(nBefore);
+}
+
+//! Read event times by item number
+/*!
+This reads the times of items nFirst onwards of an event-based channel. See ItemIndexAt()
+for how items are numbered and found.
+\param chan     An event, marker or extended marker channel.
+\param pData    The buffer to read into.
+\param nFirst   The number of the first item to read.
+\param nMax     The maximum number of items to read.
+\return         The number of items read (0 if the channel has no item nFirst) or a negative
+                error code.
+*/
+int TSon64File::ReadEventsByIndex(TChanNum chan, TSTime64* pData, uint64_t nFirst, int nMax)
+{
+    if (nMax <= 0)
+        return BAD_PARAM;
+    TSTime64 tFrom;
+    int err = ItemStart(chan, nFirst, tFrom);
+    if (err)
+        return (err > 0) ? 0 : err;
+    return ReadEvents(chan, pData, nMax, tFrom, TSTIME64_MAX);
+}
+
+//! Read markers by item number
+/*!
+This reads items nFirst onwards of a marker-based channel. See ItemIndexAt() for how items
+are numbered and found.
+\param chan     A marker or extended marker channel.
+\param pData    The buffer to read into.
+\param nFirst   The number of the first item to read.
+\param nMax     The maximum number of items to read.
+\return         The number of items read (0 if the channel has no item nFirst) or a negative
+                error code.
+*/
+int TSon64File::ReadMarkersByIndex(TChanNum chan, TMarker* pData, uint64_t nFirst, int nMax)
+{
+    if (nMax <= 0)
+        return BAD_PARAM;
+    TSTime64 tFrom;
+    int err = ItemStart(chan, nFirst, tFrom);
+    if (err)
+        return (err > 0) ? 0 : err;
+    return ReadMarkers(chan, pData, nMax, tFrom, TSTIME64_MAX);
+}
@@ -0,0 +1,66 @@
+// s64rank.h
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __S64RANK_H__
+#define __S64RANK_H__
+//! \file s64rank.h
+//! \brief Item numbers of the data blocks of a channel
+//! \internal
+
+#include <cstdint>
+#include <vector>
+#include "s64.h"
+
+namespace ceds64
+{
+    struct TIdxBlock;
+
+    //! The first time and the number of items before each data block of a channel
+    /*!
+     This lets us find the item number of a time, or the time of an item number, by a binary
+     search of the table then a read of part of one data block. All the data blocks except
+     the last are full and do not change, so when blocks are added, we re-read the old last
+     block and add the new ones. Items after the last block are in the write buffer.
+
+     The object records the state of the channel it was built from so that the owner can
+     tell if it is still current.
+    */
+    class CRankIndex
+    {
+    public:
+        TChanID m_chanID;               //!< The channel ID when the table was made
+        uint32_t m_nGen;                //!< The file edit generation when the table was made
+        uint64_t m_nFirstBlock;         //!< The number of the first data block in the table
+
+        CRankIndex(TChanID id, uint32_t nGen, uint64_t nFirstBlock);
+        uint64_t End() const {return m_nFirstBlock + m_vTime.size();} //!< Block number after the table
+        void Add(const std::vector<TIdxBlock>& vBlk);
+        void BlockAt(TSTime64 t, TSTime64& tStart, uint64_t& nBefore) const;
+        void BlockOf(uint64_t nItem, TSTime64& tStart, uint64_t& nBefore) const;
+
+    private:
+        std::vector<TSTime64> m_vTime;  //!< The first item time of each block
+        std::vector<uint64_t> m_vBefore;//!< The number of items before each block
+        uint32_t m_nLastItems;          //!< Items in the last block when it was read
+    };
+}
+#endif
@@ -0,0 +1,232 @@
+// s64snap.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64snap.cpp
+//! \brief Reading a channel that is being written without holding up the writer
+/*!
+\internal
+A channel read holds the channel mutex, which the writer also needs, so a long read from
+the disk holds up data acquisition. While a channel has a write buffer, a read that needs
+data from the disk takes a snapshot of the channel instead. Holding the mutex, we copy:
+- the channel head, which fixes the number of blocks and the root of the index,
+- the write index blocks, which may be newer than the versions on disk,
+- the part of the write buffer that the read wants.
+
+Appending data does not change data blocks that are before the write buffer, so the disk
+part of the read is then done without the mutex, by a block manager that works from the
+copies. The block manager and the copies are kept in a TSnapReader for the next read. If
+only data was appended since then, the reader keeps the blocks it holds and we copy just
+the items added to the write index blocks. The result is the data as it was when the
+snapshot was taken; data written after that is not seen.
+
+Operations that change or free blocks that are already on disk (editing markers, writing
+over waveforms, dropping data, deleting and reusing channels) increment m_nRewrite before
+they change the disk. If it has changed by the end of the read, the read may hold a mix of
+old and new data, so we throw it away and the caller reads again holding the mutex. Ring
+archive channels reuse their oldest blocks as they are written, so they always read
+holding the mutex.
+
+Until then, the read must not fail badly on a block that has changed under it. Blocks that
+the channel releases to the free block map while snapshot reads are in progress are held in
+m_vFreeLater until the last read is done, so no other channel can write over them. Blocks
+that the channel reuses itself only ever hold data and index blocks of the same channel, and
+the block manager checks the item counts of index blocks in all builds, so a read of a
+changed block gives wrong data, which is thrown away, or an error, not a crash.
+
+A marker edit or waveform overwrite changes the data block held by m_bmRead, which is only
+written to disk when the block manager moves on. We save it before the snapshot so that the
+read sees the change.
+
+A caller that makes many reads of one channel from several threads (FindPrevious() and
+FindNearest()) can give each thread a TSnapReader of its own with CSRange::SetReader(). Reads
+with one are snapshot reads even if the channel is not being written, so the threads do not
+queue for the channel mutex or share m_bmRead while they read the disk.
+*/
+
+#include <assert.h>
+#include "s64priv.h"
+#include "s64chan.h"
+
+using namespace ceds64;
+using namespace std;
+
+namespace
+{
+    const size_t MaxIdleSnap = 4;       // idle snapshot block managers kept by each channel
+
+    // Copy the items added to a write index block since we copied it. Returns false if it is
+    // now a different block, which we copy whole.
+    bool CopyTail(CIndex& dst, const CIndex& src)
+    {
+        if (dst.GetDiskOffset() != src.GetDiskOffset())
+        {
+            dst = src;
+            return false;
+        }
+        TDiskLookup& d = *dst.GetTable();
+        const TDiskLookup& s = *src.GetTable();
+        const unsigned int nFrom = std::min(d.m_nItems, s.m_nItems);
+        std::copy(s.m_items.begin() + nFrom, s.m_items.begin() + s.m_nItems, d.m_items.begin() + nFrom);
+        static_cast<TDiskBlockHead&>(d) = s;
+        return true;
+    }
+
+    // Bring a reader up to date with a channel that has only had data appended since the
+    // last snapshot. Data blocks already on disk do not change, apart from the one that was
+    // the write buffer, which may have been written again with more data. The write index
+    // blocks only gain items until they are full, when the channel moves on to new ones.
+    void Appended(TSnapReader& rd, const TChanHead& head, const VIndex& vAppend)
+    {
+        CBlockManager& bm = *rd.m_pBM;
+        if (rd.m_doWr && (bm.DataBlock().DiskOff() == rd.m_doWr))
+            bm.DataBlock().SetDiskOff(0);   // read it again if we want it
+        if (head.ReusingBlocks())           // write index blocks are rewritten as blocks are reused
+        {
+            bm.Forget();
+            rd.m_vAppend = vAppend;
+            return;
+        }
+        bool bSame = rd.m_vAppend.size() == vAppend.size();
+        if (!bSame)                         // the index has grown a level
+            rd.m_vAppend = vAppend;
+        else
+        {
+            for (size_t i = 0; i < vAppend.size(); ++i)
+                bSame = CopyTail(rd.m_vAppend[i], vAppend[i]) && bSame;
+        }
+        if (!bSame)                         // the index blocks we hold may be out of date...
+            bm.Invalidate();                // ...so find the path to the data again
+    }
+}
+
+//! Read from a snapshot of the channel without holding the channel mutex
+/*!
+You _must not_ hold the channel mutex. This does the same job as the read loop that the
+channel read routines run while holding the mutex: read blocks from the disk until we reach
+the write buffer, then read from the write buffer.
+\param r     The range to read. If we return false, this is unchanged.
+\param copy  Copies items from a block to the output. It is passed the number of items
+             already read, so it knows where to put them.
+\param bWave True for a waveform read, where data in the write buffer is only wanted if it
+             is contiguous with the data read from disk (or if nothing has been read).
+\param nRead Set to the number of items read or a negative error code if we return true,
+             else set to 0.
+\return      true if the read was done. false if there is no write buffer and r has no
+             reader, the read does not need the disk, or a change to the data on disk spoilt
+             the read. In these cases you must read holding the channel mutex.
+*/
+bool CSon64Chan::SnapRead(CSRange& r, const TSnapCopy& copy, bool bWave, int& nRead)
+{
+    nRead = 0;
+    const CSRange r0(r);                // so we can undo the read
+    unique_ptr<CDataBlock> pWr;         // the part of the write buffer we may want
+    TSTime64 tBufStart;                 // the start of the write buffer at the snapshot
+    TSnapReader* pOwn = r.Reader();     // a reader that the caller owns, if any
+    TSnapReader snap;                   // else one of ours to read with
+    TSnapReader& rd = pOwn ? *pOwn : snap;
+    {
+        TChanLock lock(m_mutex);        // take ownership of the channel
+        if ((!m_pWr && !pOwn) || m_chanHead.m_nRingBlocks || (m_chanHead.m_nBlocks == 0))
+            return false;               // not being written, or no disk data
+        tBufStart = m_pWr ? m_pWr->FirstTime() : TSTIME64_MAX;
+        if (r.From() >= tBufStart)      // all the data is in the write buffer...
+            return false;               // ...which is quick to read holding the mutex
+        if (m_bmRead.Unsaved() && m_bmRead.SaveIfUnsaved()) // we must see any edited data
+            return false;
+
+        if (m_pWr && (r.Upto() > tBufStart))
+            pWr.reset(CopyRange(*m_pWr, tBufStart, r.Upto()));
+
+        if (!pOwn && !m_vSnap.empty())
+        {
+            snap = std::move(m_vSnap.back());
+            m_vSnap.pop_back();
+        }
+        if (!rd.m_pBM || (rd.m_pChan != this))
+        {
+            rd.m_pBM.reset(new CBlockManager(*this));
+            rd.m_pBM->SetDataBlock(NewDataBlock());
+            rd.m_pChan = this;
+            rd.m_vAppend = m_vAppend;
+        }
+        else if (rd.m_nRewrite != m_nRewrite)
+        {
+            rd.m_pBM->Forget();         // blocks on disk have changed
+            rd.m_vAppend = m_vAppend;
+        }
+        else
+            Appended(rd, m_chanHead, m_vAppend);
+        rd.m_head = m_chanHead;
+        rd.m_doWr = m_pWr ? m_pWr->DiskOff() : 0;
+        rd.m_nRewrite = m_nRewrite;
+        ++m_nSnapActive;                // blocks we may read are not freed until we are done
+
+        uint64_t nFlat, nSnapFlat;      // use the index file table if the channel does
+        const TIdxBlock* pFlat = m_bmRead.Flat(nFlat);
+        if ((rd.m_pBM->Flat(nSnapFlat) != pFlat) || (nSnapFlat != nFlat))
+            rd.m_pBM->SetFlat(pFlat, nFlat);
+    }
+
+    CBlockManager& bm = *rd.m_pBM;
+    bm.SetView(rd.m_head, rd.m_vAppend);
+    bool bDone = false;                 // set when the read is complete
+    int err = bm.LoadBlock(r.From());   // get the block
+    if (err < 0)
+    {
+        nRead = err;
+        bDone = true;
+    }
+
+    // Read blocks up to the write buffer, as for a read holding the mutex
+    while (!bDone && (err == 0) && (bm.DataBlock().FirstTime() < tBufStart))
+    {
+        nRead += copy(bm.DataBlock(), r, static_cast<size_t>(nRead));
+        bDone = !r.CanContinue();
+        if (!bDone)
+            err = bm.NextBlock();       // fetch next block
+    }
+
+    // Then read our copy of the write buffer. Waveform data must be contiguous.
+    if (!bDone && pWr && r.CanContinue() && (r.Upto() > tBufStart) &&
+        (!bWave || r.First() || (r.From() == tBufStart)))
+        nRead += copy(*pWr, r, static_cast<size_t>(nRead));
+
+    bool bOK;                           // true if nothing on disk changed under us
+    {
+        TChanLock lock(m_mutex);
+        bOK = rd.m_nRewrite == m_nRewrite;
+        if ((--m_nSnapActive == 0) && !m_vFreeLater.empty())
+        {
+            m_file.FreeDataBlocks(m_vFreeLater);    // the blocks held while we read
+        }
+        if (!bOK)
+            bm.Forget();
+        if (!pOwn && (m_vSnap.size() < MaxIdleSnap))
+            m_vSnap.push_back(std::move(snap));
+    }
+    if (!bOK)                           // the read must be done again
+    {
+        r = r0;
+        nRead = 0;
+    }
+    return bOK;
+}
@@ -0,0 +1,747 @@
+// s64spike.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64spike.cpp
+//! \brief Building and processing AdcMark (WaveMark) spike channels
+/*!
+\internal
+Snippets are cut from the source waveform channels through a window of contiguous data
+that is moved forwards through each source as the (time ordered) triggers advance, so each
+part of the source is read once, however many triggers use it. The snippets are built
+into full CExtMarkBlock data blocks that are appended to the new channel directly.
+
+Spike features are computed from copies of the AdcMark data blocks, taken a batch at a
+time, so the memory used does not depend on the channel size. The items are used where
+they lie in each block and the blocks of a batch are shared between several threads.
+*/
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+#include "s64priv.h"
+#include "s64chan.h"
+
+using namespace std;
+using namespace ceds64;
+
+//! Number of trigger times we read at a time
+static const int nTrigBuf = 4096;
+
+//! Number of full data blocks we collect before appending them to the channel
+static const size_t nSnipBatch = 16;
+
+//! Number of AdcMark data blocks we process at a time when computing features
+static const size_t nFeatBatch = 64;
+
+//! Builds extended marker items in place in data blocks for appending to a channel
+class CItemBuilder
+{
+    TChanNum m_chan;            //!< The channel the blocks are for
+    size_t m_nObjSize;          //!< Size of each item
+    unique_ptr<CExtMarkBlock> m_pBlk;   //!< The block being filled
+public:
+    vector<unique_ptr<CDataBlock>> m_vFull; //!< Blocks that are ready to append
+
+    CItemBuilder(TChanNum chan, size_t nObjSize)
+        : m_chan( chan )
+        , m_nObjSize( nObjSize )
+    {}
+
+    //! Get the space for the next item, set to all zeros
+    /*!
+    The item is not part of the block until you call Push().
+    */
+    TExtMark* Next()
+    {
+        if (!m_pBlk)
+            m_pBlk.reset(new CExtMarkBlock(m_chan, m_nObjSize));
+        uint8_t* pItem = reinterpret_cast<uint8_t*>(m_pBlk->DataBlock()->m_event) + m_pBlk->size()*m_nObjSize;
+        memset(pItem, 0, m_nObjSize);   // so rounding space is set to 0
+        return reinterpret_cast<TExtMark*>(pItem);
+    }
+
+    //! Add the item returned by Next() to the block
+    void Push()
+    {
+        ++m_pBlk->m_nItems;
+        if (m_pBlk->full())
+            m_vFull.push_back(move(m_pBlk));
+    }
+
+    //! Move any partly filled block to the list of blocks to append
+    void Finish()
+    {
+        if (m_pBlk && !m_pBlk->empty())
+            m_vFull.push_back(move(m_pBlk));
+    }
+};
+
+//! A window of contiguous data in a waveform channel that moves forwards in time
+class CWaveWindow
+{
+    TSon64File& m_file;         //!< The file holding the channel
+    TChanNum m_chan;            //!< The source channel
+    TSTime64 m_tDvd;            //!< The channel sample interval
+    vector<short> m_vData;      //!< The window data
+    int m_nData;                //!< Points in the window
+    TSTime64 m_tStart;          //!< Time of m_vData[0]
+public:
+    /*!
+    \param file     The file holding the channel.
+    \param chan     The waveform channel.
+    \param tDvd     The sample interval of the channel.
+    \param nPoints  The snippet size. The window is several times larger than this.
+    */
+    CWaveWindow(TSon64File& file, TChanNum chan, TSTime64 tDvd, size_t nPoints)
+        : m_file( file )
+        , m_chan( chan )
+        , m_tDvd( tDvd )
+        , m_vData( max<size_t>(32768, 8*nPoints) )
+        , m_nData( 0 )
+        , m_tStart( -1 )
+    {}
+
+    //! Get a contiguous snippet of data
+    /*!
+    \param t        The snippet start time. We use the first point at or after this time
+                    as long as it is less than one sample interval later.
+    \param nPoints  The number of points in the snippet.
+    \param tFirst   Returned as the time of the first point.
+    \return         Pointer to the snippet, nullptr if the data is not contiguous (or
+                    does not exist) or an error in which case err is set.
+    */
+    const short* Snippet(TSTime64 t, size_t nPoints, TSTime64& tFirst, int& err)
+    {
+        if (t >= m_tStart)              // see if the snippet is already in the window
+        {
+            TSTime64 index = (t - m_tStart + m_tDvd - 1) / m_tDvd;
+            if (index + static_cast<TSTime64>(nPoints) <= m_nData)
+            {
+                tFirst = m_tStart + index*m_tDvd;
+                return m_vData.data() + index;
+            }
+        }
+
+        // Move the window forwards to start at the snippet
+        m_nData = m_file.ReadWave(m_chan, m_vData.data(), static_cast<int>(m_vData.size()),
+                                  t, TSTIME64_MAX, m_tStart);
+        if (m_nData < 0)
+        {
+            err = m_nData;
+            m_nData = 0;
+            return nullptr;
+        }
+        if ((m_nData < static_cast<int>(nPoints)) || (m_tStart >= t + m_tDvd))
+            return nullptr;             // not enough contiguous data
+        tFirst = m_tStart;
+        return m_vData.data();
+    }
+};
+
+//! Cuts snippets from waveform channels and builds them into AdcMark data blocks
+class CSnipper : public CItemBuilder
+{
+    size_t m_nPoints;           //!< Points (rows) in each snippet
+    TSTime64 m_tPre;            //!< Time from the snippet start to the trigger
+    vector<CWaveWindow> m_vSrc; //!< One window per source (column)
+    TSTime64 m_tLast;           //!< The last snippet time added
+public:
+    CSnipper(TSon64File& file, const TChanNum* pSrc, size_t nSrc, TChanNum dstChan,
+             size_t nPoints, int nPre, TSTime64 tDvd, size_t nObjSize)
+        : CItemBuilder( dstChan, nObjSize )
+        , m_nPoints( nPoints )
+        , m_tPre( nPre*tDvd )
+        , m_tLast( -1 )
+    {
+        for (size_t i = 0; i < nSrc; ++i)
+            m_vSrc.emplace_back(file, pSrc[i], tDvd, nPoints);
+    }
+
+    //! Add a snippet for a trigger
+    /*!
+    Triggers must be added in time order. Triggers that do not have contiguous data in all
+    the source channels are ignored.
+    \param trig The trigger time and the marker codes to use.
+    \return     1 if a snippet was added, 0 if not, or a negative error code.
+    */
+    int Add(const TMarker& trig)
+    {
+        TSTime64 t = trig.m_time - m_tPre;  // snippet start
+        if ((t < 0) || (t <= m_tLast))      // snippets must have increasing times
+            return 0;
+
+        TAdcMark* pAM = static_cast<TAdcMark*>(Next());
+        const size_t nCols = m_vSrc.size();
+        TSTime64 tFirst = -1;               // the time of the first column
+        for (size_t col = 0; col < nCols; ++col)
+        {
+            int err = 0;
+            TSTime64 tCol;
+            const short* pData = m_vSrc[col].Snippet(t, m_nPoints, tCol, err);
+            if (!pData || ((col > 0) && (tCol != tFirst)))
+                return err;                 // no snippet; may be an error
+            tFirst = tCol;
+            short* pTo = pAM->Shorts() + col;   // data is stored by rows
+            for (size_t i = 0; i < m_nPoints; ++i, pTo += nCols)
+                *pTo = pData[i];
+        }
+
+        static_cast<TMarker&>(*pAM) = trig; // copy the codes...
+        pAM->m_time = tFirst;               // ...and use the snippet time
+        m_tLast = tFirst;
+        Push();
+        return 1;
+    }
+};
+
+//! Check the source channels and create the AdcMark channel for ExtractSnippets()
+/*!
+\param pSrc     The nSrc source channels.
+\param nSrc     The number of source channels.
+\param dstChan  The unused channel to create.
+\param nPoints  The number of points in each snippet.
+\param nPre     The points before the trigger.
+\param dRate    The expected snippet rate.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::CreateSnippetChan(const TChanNum* pSrc, size_t nSrc, TChanNum dstChan, size_t nPoints, int nPre, double dRate)
+{
+    if ((nSrc == 0) || (nPoints == 0) || (nPre < 0) || (static_cast<size_t>(nPre) >= nPoints))
+        return BAD_PARAM;
+    const TSTime64 tDvd = ChanDivide(pSrc[0]);
+    for (size_t i = 0; i < nSrc; ++i)
+    {
+        TDataKind kind = ChanKind(pSrc[i]);
+        if (kind == ChanOff)
+            return NO_CHANNEL;
+        if ((kind != Adc) || (ChanDivide(pSrc[i]) != tDvd))
+            return CHANNEL_TYPE;
+    }
+    if (ChanKind(dstChan) != ChanOff)
+        return CHANNEL_USED;
+
+    int err = SetExtMarkChan(dstChan, dRate, AdcMark, nPoints, nSrc, PhyChan(pSrc[0]), tDvd, nPre);
+    if (err == 0)                       // the data has the same units as the first source
+    {
+        double d;
+        GetChanScale(pSrc[0], d);
+        SetChanScale(dstChan, d);
+        GetChanOffset(pSrc[0], d);
+        SetChanOffset(dstChan, d);
+        int nSz = GetChanUnits(pSrc[0]);
+        if (nSz > 0)
+        {
+            vector<char> units(nSz);
+            GetChanUnits(pSrc[0], nSz, units.data());
+            SetChanUnits(dstChan, units.data());
+        }
+    }
+    return err;
+}
+
+//! Append built data blocks to a channel
+/*!
+\param chan The channel, which must exist.
+\param vBlk The data blocks to append, in time order. This is cleared. The channel is
+            then committed.
+\return     S64_OK (0) or a negative error code.
+*/
+int TSon64File::AppendChanBlocks(TChanNum chan, vector<unique_ptr<CDataBlock>>& vBlk)
+{
+    int err = S64_OK;
+    if (!vBlk.empty())
+    {
+        TChRdLock lock(m_mutChans);     // we are not changing the #chans
+        err = m_vChan[chan] ? m_vChan[chan]->AppendBlocks(vBlk) : NO_CHANNEL;
+        if (err == 0)                   // write the channel header
+            err = m_vChan[chan]->Commit();
+        vBlk.clear();
+    }
+    return err;
+}
+
+//! Build an AdcMark channel from waveform snippets around trigger events
+/*!
+This creates a new AdcMark channel with one column per source channel and cuts a snippet
+from each source for each trigger. Triggers that do not have a full, contiguous snippet in
+all the sources (or that would overlap the previous snippet start) are skipped. The sources
+are read forwards through a window, so each part of the sources is read once, and the data
+blocks are built complete and appended to the new channel directly.
+\param trigChan The trigger channel. This can be an event channel, or a marker or
+                derived channel, in which case the marker codes are copied.
+\param pSrc     The list of nSrc source Adc channels. These must have the same sample
+                interval. For a tetrode, list the 4 channels.
+\param nSrc     The number of source channels.
+\param dstChan  An unused channel to be created as the AdcMark channel.
+\param nPoints  The number of points in each snippet.
+\param nPre     The number of points before the trigger time.
+\param tFrom    The start of the time range for triggers.
+\param tUpto    The end of the time range for triggers (not included).
+\param pFilter  If the trigger is a marker or derived type, a filter to select the triggers.
+\return         The number of snippets written or a negative error code.
+*/
+int TSon64File::ExtractSnippets(TChanNum trigChan, const TChanNum* pSrc, size_t nSrc, TChanNum dstChan,
+                                size_t nPoints, int nPre, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    if (m_bReadOnly)
+        return READ_ONLY;
+    const TDataKind trigKind = ChanKind(trigChan);
+    if ((trigKind == ChanOff) || (trigKind == Adc) || (trigKind == RealWave))
+        return (trigKind == ChanOff) ? NO_CHANNEL : CHANNEL_TYPE;
+    const bool bMarker = (trigKind != EventFall) && (trigKind != EventRise) && (trigKind != EventBoth);
+
+    int err = CreateSnippetChan(pSrc, nSrc, dstChan, nPoints, nPre, IdealRate(trigChan));
+    if (err)
+        return err;
+
+    CSnipper snip(*this, pSrc, nSrc, dstChan, nPoints, nPre, ChanDivide(pSrc[0]), ItemSize(dstChan));
+    vector<TMarker> vTrig(nTrigBuf);
+    vector<TSTime64> vTimes(bMarker ? 0 : nTrigBuf);
+    int nSnips = 0;
+    if (tFrom < 0)
+        tFrom = 0;
+    while ((err == 0) && (tFrom < tUpto))
+    {
+        int n;
+        if (bMarker)
+            n = ReadMarkers(trigChan, vTrig.data(), nTrigBuf, tFrom, tUpto, pFilter);
+        else
+        {
+            n = ReadEvents(trigChan, vTimes.data(), nTrigBuf, tFrom, tUpto);
+            for (int i = 0; i < n; ++i)
+                vTrig[i].Init(vTimes[i]);
+        }
+        if (n <= 0)
+        {
+            err = n;
+            break;
+        }
+
+        for (int i = 0; (err == 0) && (i < n); ++i)
+        {
+            err = snip.Add(vTrig[i]);
+            if (err > 0)
+            {
+                ++nSnips;
+                err = 0;
+            }
+        }
+        if ((err == 0) && (snip.m_vFull.size() >= nSnipBatch))
+            err = AppendChanBlocks(dstChan, snip.m_vFull);
+        tFrom = vTrig[n-1].m_time + 1;
+        if (n < nTrigBuf)
+            break;
+    }
+
+    snip.Finish();
+    if (err == 0)
+        err = AppendChanBlocks(dstChan, snip.m_vFull);
+    return err ? err : nSnips;
+}
+
+//! Build an AdcMark channel from waveform snippets around a list of times
+/*!
+This is the same as the version of ExtractSnippets() that takes a trigger channel, except
+that the trigger times are passed in and all the marker codes are 0.
+\param pTimes   The list of nTimes trigger times, in ascending order.
+\param nTimes   The number of trigger times.
+\param pSrc     The list of nSrc source Adc channels.
+\param nSrc     The number of source channels.
+\param dstChan  An unused channel to be created as the AdcMark channel.
+\param nPoints  The number of points in each snippet.
+\param nPre     The number of points before the trigger time.
+\param dRate    The expected snippet rate, used to set the channel buffering.
+\return         The number of snippets written or a negative error code.
+*/
+int TSon64File::ExtractSnippets(const TSTime64* pTimes, size_t nTimes, const TChanNum* pSrc, size_t nSrc,
+                                TChanNum dstChan, size_t nPoints, int nPre, double dRate)
+{
+    if (m_bReadOnly)
+        return READ_ONLY;
+    if (!is_sorted(pTimes, pTimes+nTimes))
+        return BAD_PARAM;
+    int err = CreateSnippetChan(pSrc, nSrc, dstChan, nPoints, nPre, dRate);
+    if (err)
+        return err;
+
+    CSnipper snip(*this, pSrc, nSrc, dstChan, nPoints, nPre, ChanDivide(pSrc[0]), ItemSize(dstChan));
+    int nSnips = 0;
+    TMarker trig;
+    for (size_t i = 0; (err == 0) && (i < nTimes); ++i)
+    {
+        trig.Init(pTimes[i]);
+        err = snip.Add(trig);
+        if (err > 0)
+        {
+            ++nSnips;
+            err = 0;
+        }
+        if ((err == 0) && (snip.m_vFull.size() >= nSnipBatch))
+            err = AppendChanBlocks(dstChan, snip.m_vFull);
+    }
+
+    snip.Finish();
+    if (err == 0)
+        err = AppendChanBlocks(dstChan, snip.m_vFull);
+    return err ? err : nSnips;
+}
+
+//! Dot product of a float vector with waveform data
+/*!
+We keep eight partial sums so that the compiler can vectorise the loop without needing
+to reorder the floating point additions.
+\param pB   The float vector.
+\param pX   The waveform data.
+\param n    The number of values in each.
+\return     The sum of pB[i]*pX[i].
+*/
+static float Dot(const float* pB, const short* pX, size_t n)
+{
+    float sum[8] = {0};
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        for (int j = 0; j < 8; ++j)
+            sum[j] += pB[i+j] * pX[i+j];
+    }
+    float total = ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+    for (; i < n; ++i)
+        total += pB[i] * pX[i];
+    return total;
+}
+
+//! The spikes and their features from one data block
+struct TBlockFeatures
+{
+    vector<TMarker> m_vMark;    //!< The time and codes of each spike
+    vector<float> m_vFeat;      //!< The features, one row per spike
+};
+
+//! Computes the features of AdcMark items
+class CFeatureCalc
+{
+    size_t m_nRows;             //!< Points in each trace
+    size_t m_nCols;             //!< Traces in each item
+    int m_shape;                //!< The shape features to compute
+    size_t m_nBasis;            //!< The number of PCA basis vectors
+    const float* m_pBasis;      //!< The basis vectors, each of m_nRows*m_nCols values
+    float m_fScale;             //!< User units per ADC bit
+    float m_fOffset;            //!< User units offset
+    float m_fWidth;             //!< Seconds per point
+    vector<float> m_vConst;     //!< Part of each projection due to the offset and mean
+public:
+    size_t m_nFeat;             //!< The number of features per spike
+
+    /*!
+    \param spec     The features to compute.
+    \param nRows    The points per trace.
+    \param nCols    The number of traces.
+    \param dScale   The channel scale.
+    \param dOffset  The channel offset.
+    \param dSecs    The channel sample interval in seconds.
+    */
+    CFeatureCalc(const TSpikeFeatures& spec, size_t nRows, size_t nCols, double dScale, double dOffset, double dSecs)
+        : m_nRows( nRows )
+        , m_nCols( nCols )
+        , m_shape( spec.m_shape )
+        , m_nBasis( spec.m_nBasis )
+        , m_pBasis( spec.m_pBasis )
+        , m_fScale( static_cast<float>(dScale / 6553.6) )
+        , m_fOffset( static_cast<float>(dOffset) )
+        , m_fWidth( static_cast<float>(dSecs) )
+        , m_vConst( spec.m_nBasis, 0.0f )
+        , m_nFeat( spec.Count(nCols) )
+    {
+        // b.(scale*x + offset - mean) = scale*(b.x) + b.(offset - mean)
+        const size_t n = m_nRows*m_nCols;
+        for (size_t k = 0; k < m_nBasis; ++k)
+        {
+            const float* pB = m_pBasis + k*n;
+            double d = 0.0;
+            for (size_t i = 0; i < n; ++i)
+                d += pB[i] * (dOffset - (spec.m_pMean ? spec.m_pMean[i] : 0.0f));
+            m_vConst[k] = static_cast<float>(d);
+        }
+    }
+
+    //! Compute the features of one AdcMark item
+    /*!
+    \param item The item to process.
+    \param pOut Where to write the m_nFeat features.
+    */
+    void Calc(const TAdcMark& item, float* pOut) const
+    {
+        const short* pData = item.Shorts();
+        if (m_shape)
+        {
+            for (size_t col = 0; col < m_nCols; ++col)
+            {
+                const short* p = pData + col;   // data is stored by rows
+                short vMax = *p;
+                short vMin = *p;
+                size_t iMax = 0;
+                size_t iMin = 0;
+                for (size_t row = 1; row < m_nRows; ++row)
+                {
+                    p += m_nCols;
+                    if (*p > vMax)
+                    {
+                        vMax = *p;
+                        iMax = row;
+                    }
+                    else if (*p < vMin)
+                    {
+                        vMin = *p;
+                        iMin = row;
+                    }
+                }
+                if (m_fScale < 0)       // a negative scale swaps peak and trough
+                {
+                    swap(vMax, vMin);
+                    swap(iMax, iMin);
+                }
+                if (m_shape & SpikePeak)
+                    *pOut++ = vMax*m_fScale + m_fOffset;
+                if (m_shape & SpikeTrough)
+                    *pOut++ = vMin*m_fScale + m_fOffset;
+                if (m_shape & SpikeWidth)
+                    *pOut++ = static_cast<float>((iMax > iMin) ? iMax - iMin : iMin - iMax) * m_fWidth;
+            }
+        }
+
+        const size_t n = m_nRows*m_nCols;
+        for (size_t k = 0; k < m_nBasis; ++k)
+            *pOut++ = m_fScale*Dot(m_pBasis + k*n, pData, n) + m_vConst[k];
+    }
+
+    //! Compute the features of all the wanted items in a data block
+    /*!
+    \param blk      An AdcMark data block.
+    \param nObjSize The size of each item in the block.
+    \param pFilter  A filter to select the items or nullptr.
+    \param out      Cleared, then filled with the spikes and their features.
+    */
+    void Block(const CDataBlock& blk, size_t nObjSize, const CSFilter* pFilter, TBlockFeatures& out) const
+    {
+        out.m_vMark.clear();
+        out.m_vFeat.resize(blk.size()*m_nFeat);
+        const uint8_t* pItem = reinterpret_cast<const uint8_t*>(blk.DataBlock()->m_event);
+        for (uint32_t i = 0; i < blk.size(); ++i, pItem += nObjSize)
+        {
+            const TAdcMark& am = *reinterpret_cast<const TAdcMark*>(pItem);
+            if (!pFilter || pFilter->Filter(am))
+            {
+                Calc(am, out.m_vFeat.data() + out.m_vMark.size()*m_nFeat);
+                out.m_vMark.push_back(am);
+            }
+        }
+        out.m_vFeat.resize(out.m_vMark.size()*m_nFeat);
+    }
+};
+
+//! Compute features for the spikes in an AdcMark channel and pass them on
+/*!
+The channel is read a batch of data blocks at a time. The blocks in each batch are shared
+between several threads, then the results are passed to the sink in time order. We only
+hold the channel list lock while we collect the blocks, so the sink can use the file.
+\param chan     The AdcMark channel.
+\param spec     The features to compute.
+\param sink     Called with the spikes and features of each block, in time order. It
+                returns the number of spikes used or a negative error code. If it uses
+                fewer spikes than it is passed, we stop.
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range (not included).
+\param pFilter  A filter to select the spikes or nullptr.
+\return         The number of spikes passed to and used by the sink or a negative error.
+*/
+int TSon64File::ExtractFeatures(TChanNum chan, const TSpikeFeatures& spec, const TFeatureSink& sink,
+                                TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    const TDataKind kind = ChanKind(chan);
+    if (kind != AdcMark)
+        return (kind == ChanOff) ? NO_CHANNEL : CHANNEL_TYPE;
+    if ((spec.m_nBasis < 0) || ((spec.m_nBasis > 0) && !spec.m_pBasis))
+        return BAD_PARAM;
+    size_t nRows = 0;
+    size_t nCols = 0;
+    GetExtMarkInfo(chan, &nRows, &nCols);
+    if (spec.Count(nCols) == 0)
+        return BAD_PARAM;
+    double dScale, dOffset;
+    GetChanScale(chan, dScale);
+    GetChanOffset(chan, dOffset);
+    const CFeatureCalc calc(spec, nRows, nCols, dScale, dOffset, ChanDivide(chan)*GetTimeBase());
+    const size_t nObjSize = ItemSize(chan);
+    if (tFrom < 0)
+        tFrom = 0;
+
+    int err = S64_OK;
+    if (!m_bReadOnly)                   // get all the data onto disk
+    {
+        TChRdLock lock(m_mutChans);
+        err = m_vChan[chan] ? m_vChan[chan]->Commit() : NO_CHANNEL;
+    }
+
+    const size_t nThreads = max(1u, thread::hardware_concurrency());
+    vector<unique_ptr<CDataBlock>> vBlk;
+    vBlk.reserve(nFeatBatch);
+    vector<TBlockFeatures> vOut;
+    int nSpikes = 0;
+    bool bMore = true;                  // cleared when the sink is full
+    while ((err == 0) && bMore && (tFrom < tUpto))
+    {
+        {
+            TChRdLock lock(m_mutChans);
+            err = m_vChan[chan] ? m_vChan[chan]->CopyBlocksOut(vBlk, tFrom, tUpto, nFeatBatch) : NO_CHANNEL;
+        }
+        if (err || vBlk.empty())
+            break;
+
+        vOut.resize(vBlk.size());
+        atomic<size_t> next(0);         // the next block to process
+        auto worker = [&]()
+        {
+            size_t i;
+            while ((i = next++) < vBlk.size())
+                calc.Block(*vBlk[i], nObjSize, pFilter, vOut[i]);
+        };
+        vector<thread> vThreads;
+        for (size_t i = 1; i < min(nThreads, vBlk.size()); ++i)
+            vThreads.emplace_back(worker);
+        worker();                       // this thread does its share
+        for (auto& t : vThreads)
+            t.join();
+
+        for (size_t i = 0; bMore && (i < vOut.size()); ++i)
+        {
+            const size_t n = vOut[i].m_vMark.size();
+            if (n == 0)
+                continue;
+            int nUsed = sink(vOut[i].m_vMark.data(), vOut[i].m_vFeat.data(), n);
+            if (nUsed < 0)
+            {
+                err = nUsed;
+                break;
+            }
+            nSpikes += nUsed;
+            bMore = static_cast<size_t>(nUsed) == n;
+        }
+    }
+    return err ? err : nSpikes;
+}
+
+//! Compute features for the spikes in an AdcMark channel into a matrix
+/*!
+This reads the AdcMark data blocks directly, rather than copying out each item, and
+computes the features using several threads. Only a limited number of data blocks are
+held in memory at a time, so any size of channel can be processed.
+\param chan     The AdcMark channel.
+\param spec     The features to compute. Use TSpikeFeatures::Count() to get the number
+                of features per spike.
+\param pOut     The matrix to fill, one row of features per spike.
+\param nMax     The maximum number of spikes (rows) to return.
+\param pTimes   If not nullptr, an array of nMax values set to the spike times.
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range (not included).
+\param pFilter  A filter to select the spikes or nullptr.
+\return         The number of spikes returned or a negative error code.
+*/
+int TSon64File::ExtractFeatures(TChanNum chan, const TSpikeFeatures& spec, float* pOut, size_t nMax, TSTime64* pTimes,
+                                TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    size_t nCols = 0;
+    int err = GetExtMarkInfo(chan, nullptr, &nCols);
+    if (err < 0)
+        return err;
+    if (nMax == 0)
+        return 0;
+    const size_t nFeat = spec.Count(nCols);
+
+    size_t nDone = 0;                   // spikes written to the matrix
+    auto sink = [&](const TMarker* pMark, const float* pFeat, size_t n) -> int
+    {
+        n = min(n, nMax - nDone);
+        copy(pFeat, pFeat + n*nFeat, pOut + nDone*nFeat);
+        if (pTimes)
+        {
+            for (size_t i = 0; i < n; ++i)
+                pTimes[nDone+i] = pMark[i].m_time;
+        }
+        nDone += n;
+        return static_cast<int>(n);
+    };
+    return ExtractFeatures(chan, spec, sink, tFrom, tUpto, pFilter);
+}
+
+//! Compute features for the spikes in an AdcMark channel into a RealMark channel
+/*!
+This works as the version that fills a matrix, except that the features are written to a
+new RealMark channel with one row per feature. Each RealMark item has the time and marker
+codes of the spike. The data blocks of the new channel are built complete and appended to
+the channel directly.
+\param chan     The AdcMark channel.
+\param spec     The features to compute.
+\param dstChan  An unused channel to be created as the RealMark channel.
+\param tFrom    The start of the time range.
+\param tUpto    The end of the time range (not included).
+\param pFilter  A filter to select the spikes or nullptr.
+\return         The number of spikes written or a negative error code.
+*/
+int TSon64File::ExtractFeatures(TChanNum chan, const TSpikeFeatures& spec, TChanNum dstChan,
+                                TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    if (m_bReadOnly)
+        return READ_ONLY;
+    size_t nCols = 0;
+    int err = GetExtMarkInfo(chan, nullptr, &nCols);
+    if (err < 0)
+        return err;
+    if (ChanKind(chan) != AdcMark)
+        return CHANNEL_TYPE;
+    const size_t nFeat = spec.Count(nCols);
+    if ((nFeat == 0) || (nFeat > 0xffff))
+        return BAD_PARAM;
+    if (ChanKind(dstChan) != ChanOff)
+        return CHANNEL_USED;
+    err = SetExtMarkChan(dstChan, IdealRate(chan), RealMark, nFeat, 1, PhyChan(chan));
+    if (err)
+        return err;
+
+    CItemBuilder build(dstChan, ItemSize(dstChan));
+    auto sink = [&](const TMarker* pMark, const float* pFeat, size_t n) -> int
+    {
+        for (size_t i = 0; i < n; ++i, pFeat += nFeat)
+        {
+            TRealMark* pRM = static_cast<TRealMark*>(build.Next());
+            static_cast<TMarker&>(*pRM) = pMark[i];
+            copy(pFeat, pFeat + nFeat, pRM->Floats());
+            build.Push();
+        }
+        int locErr = (build.m_vFull.size() >= nSnipBatch) ? AppendChanBlocks(dstChan, build.m_vFull) : S64_OK;
+        return locErr ? locErr : static_cast<int>(n);
+    };
+    int nSpikes = ExtractFeatures(chan, spec, sink, tFrom, tUpto, pFilter);
+
+    build.Finish();
+    err = AppendChanBlocks(dstChan, build.m_vFull);
+    return (nSpikes < 0) ? nSpikes : (err ? err : nSpikes);
+}
@@ -0,0 +1,1311 @@
+// s64srv.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64srv.cpp
+//! \brief A local data server that shares opened files between processes, and its client
+/*!
+\internal
+A client connects to the server socket. The server makes a shared memory area for the
+connection and passes its file descriptor back with the first message (SCM_RIGHTS), so
+both sides map the same pages. The client then sends a SrvHello request with the protocol
+version it speaks, which must match the version in the first message. After that, each call
+is one TSrvReq (plus a file name or a TSrvFilter) sent to the server and one TSrvRep sent
+back. Data read for the client is read by the server straight into the shared memory.
+*/
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include "s64srv.h"
+#include "s64filt.h"
+
+#if S64_OS == S64_OS_LINUX
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace ceds64;
+using namespace std;
+
+namespace
+{
+    const uint32_t MaxExtra = 65536;    // largest extra data (file name or filter) we accept
+
+    // Send all of a buffer. Returns true if done, false if the connection failed.
+    bool SendAll(int fd, const void* pBuf, size_t nBytes)
+    {
+        const char* p = static_cast<const char*>(pBuf);
+        while (nBytes)
+        {
+            ssize_t n = send(fd, p, nBytes, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            p += n;
+            nBytes -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Receive all of a buffer. Returns true if done, false if the connection failed or closed.
+    bool RecvAll(int fd, void* pBuf, size_t nBytes)
+    {
+        char* p = static_cast<char*>(pBuf);
+        while (nBytes)
+        {
+            ssize_t n = recv(fd, p, nBytes, 0);
+            if (n <= 0)
+            {
+                if ((n < 0) && (errno == EINTR))
+                    continue;
+                return false;
+            }
+            p += n;
+            nBytes -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Fill in a socket address, returns false if the path is too long
+    bool SockAddr(const string& sPath, sockaddr_un& addr)
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (sPath.empty() || (sPath.size() >= sizeof(addr.sun_path)))
+            return false;
+        memcpy(addr.sun_path, sPath.c_str(), sPath.size());
+        return true;
+    }
+
+    // Limit a requested item count to what fits in the shared memory and in an int
+    int Fit(int64_t nWant, size_t nShm, size_t nSize)
+    {
+        int64_t nMax = static_cast<int64_t>(std::min<size_t>(nShm / nSize, INT_MAX));
+        return static_cast<int>(std::max<int64_t>(0, std::min(nWant, nMax)));
+    }
+
+    // True if the process at the other end of a socket runs as our effective user or as root
+    bool PeerAllowed(int fd)
+    {
+        ucred cred;
+        socklen_t nLen = sizeof(cred);
+        if ((getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &nLen) != 0) || (nLen != sizeof(cred)))
+            return false;
+        return (cred.uid == geteuid()) || (cred.uid == 0);
+    }
+
+    // Copy a filter into the form that is sent to the server
+    void ToSrvFilter(const CSFilter& filt, TSrvFilter& sf)
+    {
+        memset(&sf, 0, sizeof(sf));
+        sf.m_mode = filt.GetMode();
+        sf.m_nLayers = filt.GetLayers();
+        sf.m_nColumn = filt.GetColumn();
+        for (int i = 0; i < std::min(sf.m_nLayers, SrvFilterLayers); ++i)
+            filt.GetElements(sf.m_mask[i], i);
+    }
+
+    // Build a filter from what a client sent. Returns false if it is not a valid filter.
+    bool FromSrvFilter(const std::vector<char>& vExtra, CSFilter& filt)
+    {
+        TSrvFilter sf;
+        if (vExtra.size() != sizeof(sf))
+            return false;
+        memcpy(&sf, vExtra.data(), sizeof(sf));
+        if (((sf.m_mode != CSFilter::eM_and) && (sf.m_mode != CSFilter::eM_or)) ||
+            (sf.m_nLayers != filt.GetLayers()) || (sf.m_nLayers > SrvFilterLayers) ||
+            (sf.m_nColumn < -1))
+            return false;
+        for (int i = 0; i < sf.m_nLayers; ++i)
+            filt.SetElements(sf.m_mask[i], i);
+        filt.SetColumn(sf.m_nColumn);
+        filt.SetMode(static_cast<CSFilter::eMode>(sf.m_mode));  // last, as it resets the active state
+        return true;
+    }
+}
+
+//==================================== Server ====================================
+
+//! A connected client
+struct TSon64Server::TSession
+{
+    int m_fd;                           //!< The connected socket
+    void* m_pShm;                       //!< The shared memory or nullptr
+    std::shared_ptr<TSon64File> m_pFile;    //!< The file the client has open
+    std::thread m_th;                   //!< The thread that serves the client
+    std::atomic<bool> m_bDone;          //!< Set when the thread has finished
+
+    explicit TSession(int fd) : m_fd( fd ), m_pShm( nullptr ), m_bDone( false ) {}
+};
+
+//! A file held open by the server
+struct TSon64Server::TCached
+{
+    std::shared_ptr<TSon64File> m_pFile;    //!< The open file
+    off_t m_size;                       //!< The file size when opened
+    struct timespec m_mtime;            //!< The modification time when opened
+};
+
+//! Construct a server, which does nothing until Start() is called
+/*!
+\param nShmBytes  The shared memory size for each client. Larger reads are split.
+\param iOpenFlags The flags to use when opening files (eOF_index uses index files that match).
+                  eOF_makeIndex is ignored, so the server never writes index files.
+*/
+TSon64Server::TSon64Server(size_t nShmBytes, int iOpenFlags)
+    : m_nShmBytes( std::max<size_t>(nShmBytes, 65536) )
+    , m_iOpenFlags( iOpenFlags & (eOF_index | eOF_test) )
+    , m_fdListen( -1 )
+    , m_nSockDev( 0 )
+    , m_nSockIno( 0 )
+    , m_bStop( false )
+{
+}
+
+TSon64Server::~TSon64Server()
+{
+    Stop();
+}
+
+//! Start listening for clients on a Unix domain socket
+/*!
+A socket already at the path is removed only if no server is listening on it. The new
+socket can only be used by its owner. Clients are served until Stop() is called.
+\param szSocket The socket path.
+\return S64_OK (0), BAD_PARAM if the path is not usable, or NO_ACCESS if we could not
+        listen on the socket, or the path is in use by something else.
+*/
+int TSon64Server::Start(const char* szSocket)
+{
+    if (m_fdListen >= 0)
+        return NO_ACCESS;               // already started
+    sockaddr_un addr;
+    if (!szSocket || !SockAddr(szSocket, addr))
+        return BAD_PARAM;
+
+    // Only remove a socket left behind by a server that has gone; anything else is not ours
+    struct stat st;
+    if (lstat(szSocket, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+            return NO_ACCESS;
+        int fdTry = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const bool bStale = (fdTry >= 0) &&
+            (connect(fdTry, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) && (errno == ECONNREFUSED);
+        if (fdTry >= 0)
+            close(fdTry);
+        if (!bStale)
+            return NO_ACCESS;           // a server is listening, or we cannot tell
+        unlink(szSocket);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NO_ACCESS;
+    if ((bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) ||
+        (chmod(szSocket, S_IRUSR | S_IWUSR) != 0) ||  // before listen(), so no one can connect yet
+        (lstat(szSocket, &st) != 0) ||
+        (listen(fd, 64) != 0))
+    {
+        close(fd);
+        return NO_ACCESS;
+    }
+
+    m_nSockDev = st.st_dev;             // so Stop() removes our socket and nothing else
+    m_nSockIno = st.st_ino;
+    m_sSocket = szSocket;
+    m_fdListen = fd;
+    m_bStop = false;
+    m_thListen = std::thread(&TSon64Server::Listen, this);
+    return S64_OK;
+}
+
+//! Stop the server, disconnect all clients and close all the files
+void TSon64Server::Stop()
+{
+    if (m_fdListen < 0)
+        return;
+    m_bStop = true;
+    shutdown(m_fdListen, SHUT_RDWR);    // wakes up accept()
+    if (m_thListen.joinable())
+        m_thListen.join();
+    close(m_fdListen);
+    m_fdListen = -1;
+    struct stat st;
+    if ((lstat(m_sSocket.c_str(), &st) == 0) && (st.st_dev == m_nSockDev) && (st.st_ino == m_nSockIno))
+        unlink(m_sSocket.c_str());      // still the socket we made
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutSession);
+        for (auto& pS : m_lSession)
+            shutdown(pS->m_fd, SHUT_RDWR);  // wakes up the recv() of each client
+        for (auto& pS : m_lSession)
+            if (pS->m_th.joinable())
+                pS->m_th.join();
+        m_lSession.clear();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutFiles);
+    m_mFiles.clear();                   // closes files that no client has open
+}
+
+size_t TSon64Server::Files() const
+{
+    std::lock_guard<std::mutex> lock(m_mutFiles);
+    return m_mFiles.size();
+}
+
+// Accept clients until we are stopped. Each client gets its own thread.
+void TSon64Server::Listen()
+{
+    while (!m_bStop)
+    {
+        int fd = accept4(m_fdListen, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if ((errno == EINTR) || (errno == ECONNABORTED))
+                continue;
+            break;                      // shut down, or a fatal error
+        }
+        if (!PeerAllowed(fd))
+        {
+            close(fd);                  // we would open files for it with our rights
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutSession);
+        if (m_bStop)
+        {
+            close(fd);
+            break;
+        }
+        for (auto it = m_lSession.begin(); it != m_lSession.end();)   // tidy finished clients
+        {
+            if ((*it)->m_bDone)
+            {
+                (*it)->m_th.join();
+                it = m_lSession.erase(it);
+            }
+            else
+                ++it;
+        }
+        m_lSession.emplace_back(new TSession(fd));
+        TSession* pS = m_lSession.back().get();
+        pS->m_th = std::thread(&TSon64Server::Serve, this, pS);
+    }
+}
+
+// Serve one client until it disconnects or we are stopped
+void TSon64Server::Serve(TSession* pS)
+{
+    // Make the shared memory and pass it to the client with the first reply
+    TSrvRep rep = {};
+    int fdShm = memfd_create("son64srv", MFD_CLOEXEC);
+    if ((fdShm >= 0) && (ftruncate(fdShm, static_cast<off_t>(m_nShmBytes)) == 0))
+    {
+        void* p = mmap(nullptr, m_nShmBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fdShm, 0);
+        pS->m_pShm = (p == MAP_FAILED) ? nullptr : p;
+    }
+    rep.m_ret = pS->m_pShm ? static_cast<int64_t>(m_nShmBytes) : NO_MEMORY;
+    rep.m_n = SrvProtocol;
+
+    iovec iov = {&rep, sizeof(rep)};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char cmsgBuf[CMSG_SPACE(sizeof(int))] = {};
+    if (pS->m_pShm)
+    {
+        msg.msg_control = cmsgBuf;
+        msg.msg_controllen = sizeof(cmsgBuf);
+        cmsghdr* pC = CMSG_FIRSTHDR(&msg);
+        pC->cmsg_level = SOL_SOCKET;
+        pC->cmsg_type = SCM_RIGHTS;
+        pC->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(pC), &fdShm, sizeof(int));
+    }
+    bool bOK = (sendmsg(pS->m_fd, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(rep))) && pS->m_pShm;
+    if (fdShm >= 0)
+        close(fdShm);                   // the mapping keeps the memory
+
+    // The client must say which protocol it speaks before it can ask for anything
+    TSrvReq req;
+    bOK = bOK && RecvAll(pS->m_fd, &req, sizeof(req)) && (req.m_op == SrvHello) && (req.m_nExtra == 0);
+    if (bOK)
+    {
+        rep = TSrvRep();
+        rep.m_ret = (req.m_n == SrvProtocol) ? S64_OK : BAD_PARAM;
+        rep.m_n = SrvProtocol;
+        bOK = SendAll(pS->m_fd, &rep, sizeof(rep)) && (rep.m_ret == S64_OK);
+    }
+
+    std::vector<char> vExtra;
+    while (bOK && !m_bStop && RecvAll(pS->m_fd, &req, sizeof(req)))
+    {
+        if (req.m_nExtra > MaxExtra)
+            break;                      // not a client we understand
+        vExtra.resize(req.m_nExtra);
+        if (req.m_nExtra && !RecvAll(pS->m_fd, vExtra.data(), vExtra.size()))
+            break;
+        rep = TSrvRep();
+        rep.m_ret = Handle(*pS, req, vExtra, rep);
+        bOK = SendAll(pS->m_fd, &rep, sizeof(rep));
+    }
+
+    pS->m_pFile.reset();
+    if (pS->m_pShm)
+        munmap(pS->m_pShm, m_nShmBytes);
+    pS->m_pShm = nullptr;
+    close(pS->m_fd);
+    pS->m_bDone = true;
+}
+
+//! Get a file, opening it if it is not open or has changed since we opened it
+/*!
+\param szName The file name from the client.
+\param err    Set to S64_OK (0) or a negative error code.
+\return       The file, or an empty pointer if err is set.
+*/
+std::shared_ptr<TSon64File> TSon64Server::GetFile(const char* szName, int& err)
+{
+    char szReal[PATH_MAX];
+    struct stat st;
+    if (!realpath(szName, szReal) || (stat(szReal, &st) != 0))
+    {
+        err = NO_FILE;
+        return std::shared_ptr<TSon64File>();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutFiles);
+    auto& pC = m_mFiles[szReal];
+    if (pC && (pC->m_size == st.st_size) &&
+        (pC->m_mtime.tv_sec == st.st_mtim.tv_sec) && (pC->m_mtime.tv_nsec == st.st_mtim.tv_nsec))
+    {
+        err = S64_OK;
+        return pC->m_pFile;             // still valid, share it
+    }
+
+    // We must (re)open the file. Clients with the old copy keep it until they close it.
+    auto pFile = std::make_shared<TSon64File>();
+    err = pFile->Open(szReal, 1, m_iOpenFlags);
+    if (err != S64_OK)
+    {
+        m_mFiles.erase(szReal);
+        return std::shared_ptr<TSon64File>();
+    }
+    pC = std::make_shared<TCached>();
+    pC->m_pFile = pFile;
+    pC->m_size = st.st_size;
+    pC->m_mtime = st.st_mtim;
+    return pFile;
+}
+
+//! Carry out one request from a client
+/*!
+\param s      The client session.
+\param req    The request.
+\param vExtra The extra data: a file name for SrvOpen, else empty or a TSrvFilter.
+\param rep    The reply, which we fill in apart from m_ret.
+\return       The result to put in rep.m_ret.
+*/
+int TSon64Server::Handle(TSession& s, const TSrvReq& req, const std::vector<char>& vExtra, TSrvRep& rep)
+{
+    if (req.m_op == SrvOpen)
+    {
+        s.m_pFile.reset();
+        if (vExtra.empty() || vExtra.back())
+            return BAD_PARAM;           // the name must be terminated
+        int err;
+        s.m_pFile = GetFile(vExtra.data(), err);
+        if (s.m_pFile)
+            rep.m_d1 = s.m_pFile->GetTimeBase();
+        return err;
+    }
+    if (req.m_op == SrvClose)
+    {
+        s.m_pFile.reset();
+        return S64_OK;
+    }
+    if (!s.m_pFile)
+        return NO_FILE;
+
+    TSon64File& f = *s.m_pFile;
+    void* p = s.m_pShm;
+    const size_t nShm = m_nShmBytes;
+    const TChanNum chan = static_cast<TChanNum>(req.m_chan);
+    CSFilter filt;                      // a filter sent with a read
+    const CSFilter* pFilt = nullptr;
+    if (!vExtra.empty())
+    {
+        if (!FromSrvFilter(vExtra, filt))
+            return BAD_PARAM;
+        pFilt = &filt;
+    }
+    const int nSz = Fit(req.m_n, nShm, 1);  // bytes for a string or extra data read
+
+    switch (req.m_op)
+    {
+    case SrvGetFreeChan:  return f.GetFreeChan();
+    case SrvTimeBase:     rep.m_d1 = f.GetTimeBase(); return S64_OK;
+    case SrvExtraData:    return f.GetExtraData(p, static_cast<uint32_t>(nSz), static_cast<uint32_t>(req.m_t1));
+    case SrvExtraSize:    return static_cast<int>(f.GetExtraDataSize());
+    case SrvFileComment:  return f.GetFileComment(req.m_chan, nSz, nSz ? static_cast<char*>(p) : nullptr);
+    case SrvMaxChans:     return f.MaxChans();
+    case SrvAppID:        return f.AppID(static_cast<TCreator*>(p));
+    case SrvTimeDate:     return f.TimeDate(static_cast<TTimeDate*>(p));
+    case SrvVersion:      return f.GetVersion();
+    case SrvFileSize:     rep.m_t = static_cast<TSTime64>(f.FileSize()); return S64_OK;
+    case SrvChanBytes:    rep.m_t = static_cast<TSTime64>(f.ChanBytes(chan)); return S64_OK;
+    case SrvMaxTime:      rep.m_t = f.MaxTime(req.m_flags != 0); return S64_OK;
+    case SrvChanKind:     return f.ChanKind(chan);
+    case SrvChanDivide:   rep.m_t = f.ChanDivide(chan); return S64_OK;
+    case SrvIdealRate:    rep.m_d1 = f.IdealRate(chan); return S64_OK;
+    case SrvPhyChan:      return f.PhyChan(chan);
+    case SrvChanComment:  return f.GetChanComment(chan, nSz, nSz ? static_cast<char*>(p) : nullptr);
+    case SrvChanTitle:    return f.GetChanTitle(chan, nSz, nSz ? static_cast<char*>(p) : nullptr);
+    case SrvChanUnits:    return f.GetChanUnits(chan, nSz, nSz ? static_cast<char*>(p) : nullptr);
+    case SrvChanScale:    return f.GetChanScale(chan, rep.m_d1);
+    case SrvChanOffset:   return f.GetChanOffset(chan, rep.m_d1);
+    case SrvChanYRange:   return f.GetChanYRange(chan, rep.m_d1, rep.m_d2);
+    case SrvChanMaxTime:  rep.m_t = f.ChanMaxTime(chan); return S64_OK;
+    case SrvItemSize:     return f.ItemSize(chan);
+    case SrvPrevNTime:
+        rep.m_t = f.PrevNTime(chan, req.m_t1, req.m_t2, static_cast<uint32_t>(req.m_n), pFilt, req.m_flags != 0);
+        return S64_OK;
+    case SrvExtMarkInfo:
+    {
+        size_t nRows = 0, nCols = 0;
+        int err = f.GetExtMarkInfo(chan, &nRows, &nCols);
+        rep.m_n = static_cast<int64_t>(nRows);
+        rep.m_t = static_cast<TSTime64>(nCols);
+        return err;
+    }
+    case SrvReadEvents:
+        return f.ReadEvents(chan, static_cast<TSTime64*>(p), Fit(req.m_n, nShm, sizeof(TSTime64)), req.m_t1, req.m_t2, pFilt);
+    case SrvReadMarkers:
+        return f.ReadMarkers(chan, static_cast<TMarker*>(p), Fit(req.m_n, nShm, sizeof(TMarker)), req.m_t1, req.m_t2, pFilt);
+    case SrvReadLevels:
+    {
+        bool bLevel = false;
+        int n = f.ReadLevels(chan, static_cast<TSTime64*>(p), Fit(req.m_n, nShm, sizeof(TSTime64)), req.m_t1, req.m_t2, bLevel);
+        rep.m_n = bLevel;
+        return n;
+    }
+    case SrvReadWaveS:
+        rep.m_n = f.ChanDivide(chan);
+        return f.ReadWave(chan, static_cast<short*>(p), Fit(req.m_n, nShm, sizeof(short)), req.m_t1, req.m_t2, rep.m_t, pFilt);
+    case SrvReadWaveF:
+        rep.m_n = f.ChanDivide(chan);
+        return f.ReadWave(chan, static_cast<float*>(p), Fit(req.m_n, nShm, sizeof(float)), req.m_t1, req.m_t2, rep.m_t, pFilt);
+    case SrvReadExtMarks:
+    {
+        int nSize = f.ItemSize(chan);
+        if (nSize <= 0)
+            return (nSize < 0) ? nSize : CHANNEL_TYPE;
+        rep.m_n = nSize;
+        return f.ReadExtMarks(chan, static_cast<TExtMark*>(p), Fit(req.m_n, nShm, nSize), req.m_t1, req.m_t2, pFilt);
+    }
+    case SrvPrefetch:     return f.Prefetch(chan, req.m_t1, req.m_t2);
+    case SrvRelease:      return f.Release(chan, req.m_t1, req.m_t2);
+    default:
+        return BAD_PARAM;
+    }
+}
+
+//==================================== Client ====================================
+
+//! Construct a client of the server listening on a given socket
+/*!
+No connection is made until a file is opened.
+\param szSocket The socket path passed to TSon64Server::Start().
+*/
+TSon64Client::TSon64Client(const char* szSocket)
+    : m_sSocket( szSocket ? szSocket : "" )
+    , m_fd( -1 )
+    , m_pShm( nullptr )
+    , m_nShm( 0 )
+    , m_bOpen( false )
+    , m_dTimeBase( 1.0e-6 )
+{
+}
+
+TSon64Client::~TSon64Client()
+{
+    if (m_bOpen)
+        Close();
+    Disconnect();
+}
+
+// Connect to the server and map the shared memory it sends us. You must hold m_mutex.
+int TSon64Client::Connect()
+{
+    if (m_fd >= 0)
+        return S64_OK;
+    sockaddr_un addr;
+    if (!SockAddr(m_sSocket, addr))
+        return BAD_PARAM;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NO_ACCESS;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+    {
+        close(fd);
+        return NO_ACCESS;
+    }
+
+    TSrvRep rep = {};
+    iovec iov = {&rep, sizeof(rep)};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char cmsgBuf[CMSG_SPACE(sizeof(int))] = {};
+    msg.msg_control = cmsgBuf;
+    msg.msg_controllen = sizeof(cmsgBuf);
+    ssize_t n;
+    do
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    while ((n < 0) && (errno == EINTR));
+
+    int fdShm = -1;
+    cmsghdr* pC = (n == static_cast<ssize_t>(sizeof(rep))) ? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (pC && (pC->cmsg_level == SOL_SOCKET) && (pC->cmsg_type == SCM_RIGHTS))
+        memcpy(&fdShm, CMSG_DATA(pC), sizeof(int));
+    void* p = MAP_FAILED;
+    if ((fdShm >= 0) && (rep.m_ret > 0))
+    {
+        p = mmap(nullptr, static_cast<size_t>(rep.m_ret), PROT_READ | PROT_WRITE, MAP_SHARED, fdShm, 0);
+        close(fdShm);
+    }
+    if (p == MAP_FAILED)
+    {
+        close(fd);
+        return (rep.m_ret < 0) ? static_cast<int>(rep.m_ret) : NO_ACCESS;
+    }
+
+    m_fd = fd;
+    m_pShm = p;
+    m_nShm = static_cast<size_t>(rep.m_ret);
+
+    // Both sides must speak the same protocol
+    TSrvReq req = {SrvHello, 0, SrvProtocol};
+    if ((rep.m_n != SrvProtocol) ||
+        !SendAll(m_fd, &req, sizeof(req)) ||
+        !RecvAll(m_fd, &rep, sizeof(rep)) ||
+        (rep.m_ret != S64_OK))
+    {
+        Disconnect();
+        return NO_ACCESS;
+    }
+    return S64_OK;
+}
+
+// Drop the connection to the server. You must hold m_mutex (or be the destructor).
+void TSon64Client::Disconnect()
+{
+    if (m_pShm)
+        munmap(m_pShm, m_nShm);
+    m_pShm = nullptr;
+    m_nShm = 0;
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+}
+
+//! Send a request to the server and get the reply
+/*!
+You must hold m_mutex.
+\param req    The request. We set m_nExtra.
+\param rep    Returned holding the reply.
+\param pFilter nullptr or a filter to send with the request.
+\return S64_OK (0) if we have a reply, NO_FILE if there is no file open, BAD_PARAM if the
+        filter has more than SrvFilterLayers layers, or BAD_READ if the connection failed.
+*/
+int TSon64Client::Call(TSrvReq& req, TSrvRep& rep, const CSFilter* pFilter) const
+{
+    if (!m_bOpen || (m_fd < 0))
+        return NO_FILE;
+    if (pFilter && (pFilter->GetLayers() > SrvFilterLayers))
+        return BAD_PARAM;               // the server could not build it
+    TSrvFilter sf;
+    if (pFilter)
+        ToSrvFilter(*pFilter, sf);
+    req.m_nExtra = pFilter ? static_cast<uint32_t>(sizeof(sf)) : 0;
+    if (!SendAll(m_fd, &req, sizeof(req)) ||
+        (pFilter && !SendAll(m_fd, &sf, req.m_nExtra)) ||
+        !RecvAll(m_fd, &rep, sizeof(rep)))
+        return BAD_READ;
+    return S64_OK;
+}
+
+// Call the server and return m_ret, or the error if the call failed
+#define CALL_RET(req, rep) { int err = Call(req, rep); if (err) return err; }
+
+// Read a string (a comment, title or units) in the same way as TSon64File
+int TSon64Client::GetString(TSrvOp op, int n, int nSz, char* sz) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {op, n};
+    req.m_n = (sz && (nSz > 0)) ? std::min<int64_t>(nSz, m_nShm) : 0;
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    if ((rep.m_ret >= 0) && req.m_n)
+    {
+        const char* pS = static_cast<const char*>(m_pShm);
+        size_t nCopy = strnlen(pS, static_cast<size_t>(req.m_n - 1));
+        memcpy(sz, pS, nCopy);
+        sz[nCopy] = 0;
+    }
+    return static_cast<int>(rep.m_ret);
+}
+
+//! Read event-based items, splitting the read if it will not fit in the shared memory
+/*!
+All the event-based item types start with their time, which we use to continue a split read.
+\param op      The read operation.
+\param chan    The channel to read.
+\param pData   The buffer for the items.
+\param nSize   The item size, or 0 to ask the server for it.
+\param nMax    The maximum items to read.
+\param tFrom   The first time to read.
+\param tUpto   The time to read up to (but not including).
+\param pFilter nullptr or a filter to send with the read.
+\param pLevel  If not nullptr, set to the level returned by the first read.
+\return The items read or a negative error code.
+*/
+int TSon64Client::ReadItems(TSrvOp op, TChanNum chan, void* pData, size_t nSize, int nMax, TSTime64 tFrom,
+                            TSTime64 tUpto, const CSFilter* pFilter, bool* pLevel)
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {op, chan};
+    TSrvRep rep;
+    if (nSize == 0)                     // we must ask for the item size
+    {
+        TSrvReq reqSz = {SrvItemSize, chan};
+        CALL_RET(reqSz, rep);
+        if (rep.m_ret <= 0)
+            return (rep.m_ret < 0) ? static_cast<int>(rep.m_ret) : CHANNEL_TYPE;
+        nSize = static_cast<size_t>(rep.m_ret);
+    }
+
+    char* pOut = static_cast<char*>(pData);
+    int nRead = 0;
+    while ((nRead < nMax) && (tFrom < tUpto))
+    {
+        const int nWant = Fit(nMax - nRead, m_nShm, nSize);
+        req.m_n = nWant;
+        req.m_t1 = tFrom;
+        req.m_t2 = tUpto;
+        int err = Call(req, rep, pFilter);
+        if (err == S64_OK)
+            err = (rep.m_ret < 0) ? static_cast<int>(rep.m_ret) : 0;
+        if (err)
+            return nRead ? nRead : err;
+        if (pLevel && (nRead == 0))
+            *pLevel = rep.m_n != 0;
+
+        const int n = static_cast<int>(rep.m_ret);
+        memcpy(pOut, m_pShm, n * nSize);
+        pOut += n * nSize;
+        nRead += n;
+        if (n < nWant)                  // the read is complete
+            break;
+        TSTime64 tLast;
+        memcpy(&tLast, pOut - nSize, sizeof(TSTime64));
+        tFrom = tLast + 1;              // continue after the last item
+    }
+    return nRead;
+}
+
+//! Read waveform data, splitting the read if it will not fit in the shared memory
+/*!
+The parts of a split read must be contiguous, as for a single read.
+*/
+template <typename T>
+int TSon64Client::ReadWaveT(TSrvOp op, TChanNum chan, T* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                            TSTime64& tFirst, const CSFilter* pFilter)
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {op, chan};
+    TSrvRep rep;
+    int nRead = 0;
+    TSTime64 tNext = -1;                // where the next part must start
+    while ((nRead < nMax) && (tFrom < tUpto))
+    {
+        const int nWant = Fit(nMax - nRead, m_nShm, sizeof(T));
+        req.m_n = nWant;
+        req.m_t1 = tFrom;
+        req.m_t2 = tUpto;
+        int err = Call(req, rep, pFilter);
+        if (err == S64_OK)
+            err = (rep.m_ret < 0) ? static_cast<int>(rep.m_ret) : 0;
+        if (err)
+            return nRead ? nRead : err;
+
+        const int n = static_cast<int>(rep.m_ret);
+        if (nRead == 0)
+            tFirst = rep.m_t;
+        else if ((n == 0) || (rep.m_t != tNext))    // not contiguous, so we are done
+            break;
+        memcpy(pData + nRead, m_pShm, n * sizeof(T));
+        nRead += n;
+        if ((n < nWant) || (rep.m_n <= 0))
+            break;
+        tNext = rep.m_t + n * rep.m_n;
+        tFrom = tNext;
+    }
+    return nRead;
+}
+
+int TSon64Client::Create(const char* szName, uint16_t nChannels, uint32_t nFUser)
+{
+    return READ_ONLY;
+}
+
+//! Open a file through the server
+/*!
+The file is always opened read only, so an iOpenMode of 0 (read/write) fails. The flags
+are ignored; the server decides how it opens files.
+*/
+int TSon64Client::Open(const char* szName, int iOpenMode, int flags)
+{
+    if (!szName)
+        return BAD_PARAM;
+    if (iOpenMode == 0)
+        return READ_ONLY;
+    if (m_bOpen)
+        Close();
+
+    TCliLock lock(m_mutex);
+    int err = Connect();
+    if (err)
+        return err;
+    TSrvReq req = {SrvOpen};
+    req.m_nExtra = static_cast<uint32_t>(strlen(szName) + 1);
+    TSrvRep rep;
+    if ((req.m_nExtra > MaxExtra) ||
+        !SendAll(m_fd, &req, sizeof(req)) ||
+        !SendAll(m_fd, szName, req.m_nExtra) ||
+        !RecvAll(m_fd, &rep, sizeof(rep)))
+    {
+        Disconnect();
+        return (req.m_nExtra > MaxExtra) ? BAD_PARAM : NO_ACCESS;
+    }
+    m_bOpen = rep.m_ret == S64_OK;
+    if (m_bOpen)
+        m_dTimeBase = rep.m_d1;
+    return static_cast<int>(rep.m_ret);
+}
+
+bool TSon64Client::CanWrite() const
+{
+    return false;
+}
+
+//! Close the file. The connection is kept for the next Open().
+int TSon64Client::Close()
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvClose};
+    TSrvRep rep;
+    int err = Call(req, rep);
+    if (err == BAD_READ)
+        Disconnect();
+    m_bOpen = false;
+    return (err == NO_FILE) ? NO_FILE : S64_OK;
+}
+
+int TSon64Client::EmptyFile()
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::GetFreeChan() const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvGetFreeChan};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    return static_cast<int>(rep.m_ret);
+}
+
+int TSon64Client::Commit(int flags)
+{
+    return S64_OK;                      // nothing to write
+}
+
+bool TSon64Client::IsModified() const
+{
+    return false;
+}
+
+int TSon64Client::FlushSysBuffers()
+{
+    return S64_OK;
+}
+
+double TSon64Client::GetTimeBase() const
+{
+    return m_dTimeBase;                 // fixed for a read only file, so sent by Open()
+}
+
+void TSon64Client::SetTimeBase(double dSecPerTick)
+{
+}
+
+int TSon64Client::SetExtraData(const void* pData, uint32_t nBytes, uint32_t nOffset)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::GetExtraData(void* pData, uint32_t nBytes, uint32_t nOffset)
+{
+    TCliLock lock(m_mutex);
+    if (nBytes > m_nShm)
+        return NO_EXTRA;
+    TSrvReq req = {SrvExtraData};
+    req.m_n = nBytes;
+    req.m_t1 = nOffset;
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    if (rep.m_ret == S64_OK)
+        memcpy(pData, m_pShm, nBytes);
+    return static_cast<int>(rep.m_ret);
+}
+
+uint32_t TSon64Client::GetExtraDataSize() const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvExtraSize};
+    TSrvRep rep;
+    return (Call(req, rep) == S64_OK) ? static_cast<uint32_t>(rep.m_ret) : 0;
+}
+
+int TSon64Client::SetFileComment(int n, const char* szComment)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::GetFileComment(int n, int nSz, char* szComment) const
+{
+    return GetString(SrvFileComment, n, nSz, szComment);
+}
+
+int TSon64Client::MaxChans() const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvMaxChans};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    return static_cast<int>(rep.m_ret);
+}
+
+int TSon64Client::AppID(TCreator* pRead, const TCreator* pWrite)
+{
+    if (pWrite)
+        return READ_ONLY;
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvAppID};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    if (pRead && (rep.m_ret == S64_OK))
+        memcpy(pRead, m_pShm, sizeof(TCreator));
+    return static_cast<int>(rep.m_ret);
+}
+
+int TSon64Client::TimeDate(TTimeDate* pTDGet, const TTimeDate* pTDSet)
+{
+    if (pTDSet)
+        return READ_ONLY;
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvTimeDate};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    if (pTDGet && (rep.m_ret == S64_OK))
+        memcpy(pTDGet, m_pShm, sizeof(TTimeDate));
+    return static_cast<int>(rep.m_ret);
+}
+
+int TSon64Client::GetVersion() const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvVersion};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    return static_cast<int>(rep.m_ret);
+}
+
+uint64_t TSon64Client::FileSize() const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvFileSize};
+    TSrvRep rep;
+    return (Call(req, rep) == S64_OK) ? static_cast<uint64_t>(rep.m_t) : 0;
+}
+
+uint64_t TSon64Client::ChanBytes(TChanNum chan) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvChanBytes, chan};
+    TSrvRep rep;
+    return (Call(req, rep) == S64_OK) ? static_cast<uint64_t>(rep.m_t) : 0;
+}
+
+TSTime64 TSon64Client::MaxTime(bool bReadChans) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvMaxTime};
+    req.m_flags = bReadChans;
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    return rep.m_t;
+}
+
+void TSon64Client::ExtendMaxTime(TSTime64 t)
+{
+}
+
+TDataKind TSon64Client::ChanKind(TChanNum chan) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvChanKind, chan};
+    TSrvRep rep;
+    if ((Call(req, rep) != S64_OK) || (rep.m_ret < 0))
+        return ChanOff;
+    return static_cast<TDataKind>(rep.m_ret);
+}
+
+TSTime64 TSon64Client::ChanDivide(TChanNum chan) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvChanDivide, chan};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    return rep.m_t;
+}
+
+//! Get the ideal rate. The rate cannot be changed, so dRate is ignored.
+double TSon64Client::IdealRate(TChanNum chan, double dRate)
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvIdealRate, chan};
+    TSrvRep rep;
+    return (Call(req, rep) == S64_OK) ? rep.m_d1 : 0.0;
+}
+
+int TSon64Client::PhyChan(TChanNum chan) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvPhyChan, chan};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    return static_cast<int>(rep.m_ret);
+}
+
+int TSon64Client::SetChanComment(TChanNum chan, const char* szComment)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::GetChanComment(TChanNum chan, int nSz, char* szComment) const
+{
+    return GetString(SrvChanComment, chan, nSz, szComment);
+}
+
+int TSon64Client::SetChanTitle(TChanNum chan, const char* szTitle)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::GetChanTitle(TChanNum chan, int nSz, char* szTitle) const
+{
+    return GetString(SrvChanTitle, chan, nSz, szTitle);
+}
+
+int TSon64Client::SetChanScale(TChanNum chan, double dScale)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::GetChanScale(TChanNum chan, double& dScale) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvChanScale, chan};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    if (rep.m_ret == S64_OK)
+        dScale = rep.m_d1;
+    return static_cast<int>(rep.m_ret);
+}
+
+int TSon64Client::SetChanOffset(TChanNum chan, double dOffset)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::GetChanOffset(TChanNum chan, double& dOffset) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvChanOffset, chan};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    if (rep.m_ret == S64_OK)
+        dOffset = rep.m_d1;
+    return static_cast<int>(rep.m_ret);
+}
+
+int TSon64Client::SetChanUnits(TChanNum chan, const char* szUnits)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::GetChanUnits(TChanNum chan, int nSz, char* szUnits) const
+{
+    return GetString(SrvChanUnits, chan, nSz, szUnits);
+}
+
+TSTime64 TSon64Client::ChanMaxTime(TChanNum chan) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvChanMaxTime, chan};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    return rep.m_t;
+}
+
+TSTime64 TSon64Client::PrevNTime(TChanNum chan, TSTime64 sTime, TSTime64 eTime, uint32_t n,
+                                 const CSFilter* pFilter, bool bAsWave)
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvPrevNTime, chan, n, sTime, eTime};
+    req.m_flags = bAsWave;
+    TSrvRep rep;
+    int err = Call(req, rep, pFilter);
+    return err ? err : rep.m_t;
+}
+
+int TSon64Client::ChanDelete(TChanNum chan)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::ChanUndelete(TChanNum chan, eCU action)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::GetChanYRange(TChanNum chan, double& dLow, double& dHigh) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvChanYRange, chan};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    if (rep.m_ret == S64_OK)
+    {
+        dLow = rep.m_d1;
+        dHigh = rep.m_d2;
+    }
+    return static_cast<int>(rep.m_ret);
+}
+
+int TSon64Client::SetChanYRange(TChanNum chan, double dLow, double dHigh)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::ItemSize(TChanNum chan) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvItemSize, chan};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    return static_cast<int>(rep.m_ret);
+}
+
+void TSon64Client::Save(int chan, TSTime64 t, bool bSave)
+{
+}
+
+void TSon64Client::SaveRange(int chan, TSTime64 tFrom, TSTime64 tUpto)
+{
+}
+
+bool TSon64Client::IsSaving(TChanNum chan, TSTime64 tAt) const
+{
+    return true;
+}
+
+int TSon64Client::NoSaveList(TChanNum chan, TSTime64* pTimes, int nMax, TSTime64 tFrom, TSTime64 tUpto) const
+{
+    return 0;
+}
+
+int TSon64Client::LatestTime(int chan, TSTime64 t)
+{
+    return READ_ONLY;
+}
+
+double TSon64Client::SetBuffering(int chan, size_t nBytes, double dSeconds)
+{
+    return 0.0;
+}
+
+int TSon64Client::SetEventChan(TChanNum chan, double dRate, TDataKind evtKind, int iPhyCh)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::WriteEvents(TChanNum chan, const TSTime64* pData, size_t count)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::ReadEvents(TChanNum chan, TSTime64* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    return ReadItems(SrvReadEvents, chan, pData, sizeof(TSTime64), nMax, tFrom, tUpto, pFilter);
+}
+
+int TSon64Client::SetMarkerChan(TChanNum chan, double dRate, TDataKind kind, int iPhyChan)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::WriteMarkers(TChanNum chan, const TMarker* pData, size_t count)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::ReadMarkers(TChanNum chan, TMarker* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    return ReadItems(SrvReadMarkers, chan, pData, sizeof(TMarker), nMax, tFrom, tUpto, pFilter);
+}
+
+int TSon64Client::EditMarker(TChanNum chan, TSTime64 t, const TMarker* pM, size_t nCopy)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::SetLevelChan(TChanNum chan, double dRate, int iPhyChan)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::SetInitLevel(TChanNum chan, bool bLevel)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::WriteLevels(TChanNum chan, const TSTime64* pData, size_t count)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::ReadLevels(TChanNum chan, TSTime64* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, bool& bLevel)
+{
+    return ReadItems(SrvReadLevels, chan, pData, sizeof(TSTime64), nMax, tFrom, tUpto, nullptr, &bLevel);
+}
+
+int TSon64Client::SetTextMarkChan(TChanNum chan, double dRate, size_t nMax, int iPhyChan)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::SetExtMarkChan(TChanNum chan, double dRate, TDataKind kind, size_t nRows, size_t nCols, int iPhyChan, TSTime64 lDvd, int nPre)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::GetExtMarkInfo(TChanNum chan, size_t *pRows, size_t* pCols) const
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvExtMarkInfo, chan};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    if (pRows)
+        *pRows = static_cast<size_t>(rep.m_n);
+    if (pCols)
+        *pCols = static_cast<size_t>(rep.m_t);
+    return static_cast<int>(rep.m_ret);
+}
+
+int TSon64Client::SetWaveChan(TChanNum chan, TSTime64 lDvd, TDataKind wKind, double dRate, int iPhyCh)
+{
+    return READ_ONLY;
+}
+
+TSTime64 TSon64Client::WriteWave(TChanNum chan, const short* pData, size_t count, TSTime64 tFrom)
+{
+    return READ_ONLY;
+}
+
+TSTime64 TSon64Client::WriteWave(TChanNum chan, const float* pData, size_t count, TSTime64 tFrom)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::ReadWave(TChanNum chan, short* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, TSTime64& tFirst, const CSFilter* pFilter)
+{
+    return ReadWaveT(SrvReadWaveS, chan, pData, nMax, tFrom, tUpto, tFirst, pFilter);
+}
+
+int TSon64Client::ReadWave(TChanNum chan, float* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, TSTime64& tFirst, const CSFilter* pFilter)
+{
+    return ReadWaveT(SrvReadWaveF, chan, pData, nMax, tFrom, tUpto, tFirst, pFilter);
+}
+
+int TSon64Client::WriteExtMarks(TChanNum chan, const TExtMark* pData, size_t count)
+{
+    return READ_ONLY;
+}
+
+int TSon64Client::ReadExtMarks(TChanNum chan, TExtMark* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    return ReadItems(SrvReadExtMarks, chan, pData, 0, nMax, tFrom, tUpto, pFilter);
+}
+
+//! Pass the advice to the server, which has the file open
+int TSon64Client::Prefetch(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto)
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvPrefetch, chan, 0, tFrom, tUpto};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    return static_cast<int>(rep.m_ret);
+}
+
+//! Pass the advice to the server, which has the file open
+int TSon64Client::Release(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto)
+{
+    TCliLock lock(m_mutex);
+    TSrvReq req = {SrvRelease, chan, 0, tFrom, tUpto};
+    TSrvRep rep;
+    CALL_RET(req, rep);
+    return static_cast<int>(rep.m_ret);
+}
+
+#endif
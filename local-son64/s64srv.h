@@ -0,0 +1,312 @@
+// s64srv.h
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __S64SRV_H__
+#define __S64SRV_H__
+//! \file s64srv.h
+//! \brief A local data server that shares opened files between processes, and its client
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "s64priv.h"
+#include "s64filt.h"
+
+//! The DllClass macro marks objects that are visible outside the library
+#if   S64_OS == S64_OS_WINDOWS
+#ifndef S64_NOTDLL
+#ifdef DLL_SON64
+#define DllClass __declspec(dllexport)
+#else
+#define DllClass __declspec(dllimport)
+#endif
+#endif
+#endif
+
+#ifndef DllClass
+#define DllClass
+#endif
+
+#if S64_OS == S64_OS_LINUX
+namespace ceds64
+{
+    //! The operations a TSon64Client can ask a TSon64Server to do
+    /*!
+    \internal
+    */
+    enum TSrvOp : int32_t
+    {
+        SrvOpen = 1, SrvClose, SrvGetFreeChan, SrvTimeBase, SrvExtraData, SrvExtraSize,
+        SrvFileComment, SrvMaxChans, SrvAppID, SrvTimeDate, SrvVersion, SrvFileSize,
+        SrvChanBytes, SrvMaxTime, SrvChanKind, SrvChanDivide, SrvIdealRate, SrvPhyChan,
+        SrvChanComment, SrvChanTitle, SrvChanScale, SrvChanOffset, SrvChanUnits,
+        SrvChanMaxTime, SrvPrevNTime, SrvChanYRange, SrvItemSize, SrvReadEvents,
+        SrvReadMarkers, SrvReadLevels, SrvExtMarkInfo, SrvReadWaveS, SrvReadWaveF,
+        SrvReadExtMarks, SrvPrefetch, SrvRelease, SrvHello,
+    };
+
+    //! The version of the client/server protocol
+    /*!
+    \internal
+    Change this if TSrvOp, TSrvReq, TSrvRep or TSrvFilter change. The server sends it with
+    the first reply and the client must send it back in a SrvHello request before it asks
+    for anything else; a mismatch on either side ends the connection.
+    */
+    const int32_t SrvProtocol = 1;
+
+    //! The most filter layers that can be sent to the server
+    /*!
+    \internal
+    CSFilter::GetElements() and SetElements() only reach layers 0-3.
+    */
+    const int SrvFilterLayers = 4;
+
+    //! A CSFilter as it is sent to the server
+    /*!
+    \internal
+    The server checks each field and builds its own CSFilter with the public CSFilter
+    interface, so a client cannot give it a filter that CSFilter itself would not allow.
+    */
+    struct TSrvFilter
+    {
+        int32_t m_mode;                 //!< The filter mode, one of CSFilter::eMode
+        int32_t m_nLayers;              //!< The layers in m_mask, must match CSFilter::GetLayers()
+        int32_t m_nColumn;              //!< The column, -1 for all
+        int32_t m_pad;                  //!< Spare, set to 0
+        uint8_t m_mask[SrvFilterLayers][TMask::NBit / 8]; //!< The layer masks, as CSFilter::GetElements()
+    };
+
+    //! A request sent from a client to the server
+    /*!
+    \internal
+    It is followed by m_nExtra bytes, which hold a file name or a TSrvFilter.
+    */
+    struct TSrvReq
+    {
+        int32_t m_op;                   //!< What to do, one of TSrvOp
+        int32_t m_chan;                 //!< The channel (or comment) number
+        int64_t m_n;                    //!< A count or size
+        TSTime64 m_t1;                  //!< The first time argument
+        TSTime64 m_t2;                  //!< The second time argument
+        double m_d;                     //!< A double argument
+        uint32_t m_nExtra;              //!< Bytes of extra data that follow
+        uint32_t m_flags;               //!< Op-specific flags (bAsWave, bReadChans, open flags)
+    };
+
+    //! The reply from the server. Bulk results are in the shared memory.
+    /*!
+    \internal
+    */
+    struct TSrvRep
+    {
+        int64_t m_ret;                  //!< The result, or a negative error code
+        TSTime64 m_t;                   //!< A time result (the first time of a wave read)
+        int64_t m_n;                    //!< An integer result (rows, channel divide)
+        double m_d1;                    //!< First double result
+        double m_d2;                    //!< Second double result
+    };
+
+    //! A local server that holds data files open for any number of client processes
+    /*!
+     Many short-lived analysis programs that open the same files each pay the cost of
+     opening them, reading the channel indices and reading blocks. The server keeps each
+     file it is asked for open, read only, so these costs are paid once, and all clients
+     share the index caches. It listens on a Unix domain socket. Each client connection
+     has its own thread and its own shared memory area; data is read straight into the
+     shared memory, so it is not copied through the socket.
+
+     A file is reopened if its size or modification time has changed since it was opened,
+     for example because it was being written. Clients that have the old copy open keep it
+     until they close it.
+
+     The server opens files with its own rights, so it only serves clients that run as the
+     same user as the server (or as root), as reported by SO_PEERCRED, and the socket is
+     made accessible only to its owner. Start() does not remove anything at the socket path
+     unless it is a socket that no server is listening on.
+
+     To run a daemon, call Start() and then wait until you want to stop it. This is only
+     available on Linux.
+    */
+    class DllClass TSon64Server
+    {
+    public:
+        explicit TSon64Server(size_t nShmBytes = 16 << 20, int iOpenFlags = eOF_index);
+        ~TSon64Server();
+        int Start(const char* szSocket);
+        void Stop();
+        size_t Files() const;           //!< The number of files held open
+
+    private:
+        struct TSession;
+        struct TCached;
+        void Listen();
+        void Serve(TSession* pS);
+        int Handle(TSession& s, const TSrvReq& req, const std::vector<char>& vExtra, TSrvRep& rep);
+        std::shared_ptr<TSon64File> GetFile(const char* szName, int& err);
+
+        const size_t m_nShmBytes;       //!< Size of the shared memory for each client
+        const int m_iOpenFlags;         //!< Flags used to open all files
+        int m_fdListen;                 //!< The listening socket or -1
+        std::string m_sSocket;          //!< The socket path
+        uint64_t m_nSockDev;            //!< The device of the socket we made, checked by Stop()
+        uint64_t m_nSockIno;            //!< The inode of the socket we made, checked by Stop()
+        std::atomic<bool> m_bStop;      //!< Set to stop the server
+        std::thread m_thListen;         //!< Accepts connections
+        std::list<std::unique_ptr<TSession>> m_lSession;   //!< The connected clients
+        std::mutex m_mutSession;        //!< Protects m_lSession
+        std::map<std::string, std::shared_ptr<TCached>> m_mFiles;  //!< Open files by real path
+        mutable std::mutex m_mutFiles;  //!< Protects m_mFiles
+    };
+
+    //! A read-only data file that is served by a TSon64Server
+    /*!
+     This is used in the same way as a TSon64File opened read only. Operations that would
+     change the file return READ_ONLY. Reads are passed to the server and the results are
+     collected from the shared memory area. A read that asks for more data than fits in the
+     shared memory is split into several requests. If the connection to the server is lost,
+     calls return BAD_READ. Filters can have at most SrvFilterLayers (4) layers; a read with
+     a filter that has more returns BAD_PARAM without asking the server.
+    */
+    class DllClass TSon64Client : public ceds64::CSon64File
+    {
+    private:
+        std::string m_sSocket;          //!< The server socket path
+        int m_fd;                       //!< Socket connected to the server or -1
+        void* m_pShm;                   //!< The shared memory or nullptr
+        size_t m_nShm;                  //!< Size of the shared memory
+        bool m_bOpen;                   //!< Set if a file is open
+        double m_dTimeBase;             //!< The file time base, fetched by Open()
+        mutable std::mutex m_mutex;     //!< Serialises use of the connection
+        typedef std::lock_guard<std::mutex> TCliLock;
+
+        int Connect();
+        void Disconnect();
+        int Call(TSrvReq& req, TSrvRep& rep, const CSFilter* pFilter = nullptr) const;
+        int GetString(TSrvOp op, int n, int nSz, char* sz) const;
+        int ReadItems(TSrvOp op, TChanNum chan, void* pData, size_t nSize, int nMax, TSTime64 tFrom,
+                      TSTime64 tUpto, const CSFilter* pFilter, bool* pLevel = nullptr);
+        template <typename T>
+        int ReadWaveT(TSrvOp op, TChanNum chan, T* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto,
+                      TSTime64& tFirst, const CSFilter* pFilter);
+
+        // Items from here on are part of the defined interface CSon64File
+    public:
+        explicit TSon64Client(const char* szSocket);
+        virtual ~TSon64Client();
+        virtual int Create(const char* szName, uint16_t nChannels, uint32_t nFUser = 0);
+        virtual int Open(const char* szName, int iOpenMode = 1, int flags = ceds64::eOF_none);
+        virtual bool CanWrite() const;
+        virtual int Close();
+        virtual int EmptyFile();
+        virtual int GetFreeChan() const;
+        virtual int Commit(int flags = 0);
+        virtual bool IsModified() const;
+        virtual int FlushSysBuffers();
+
+        virtual double GetTimeBase() const;
+        virtual void SetTimeBase(double dSecPerTick);
+        virtual int SetExtraData(const void* pData, uint32_t nBytes, uint32_t nOffset);
+        virtual int GetExtraData(void* pData, uint32_t nBytes, uint32_t nOffset);
+        virtual uint32_t GetExtraDataSize() const;
+        virtual int SetFileComment(int n, const char* szComment);
+        virtual int GetFileComment(int n, int nSz = 0, char* szComment = nullptr) const;
+        virtual int MaxChans() const;
+        virtual int AppID(TCreator* pRead, const TCreator* pWrite = nullptr);
+        virtual int TimeDate(TTimeDate* pTDGet, const TTimeDate* pTDSet = nullptr);
+        virtual int GetVersion() const;
+        virtual uint64_t FileSize() const;
+        virtual uint64_t ChanBytes(TChanNum chan) const;
+        virtual TSTime64 MaxTime(bool bReadChans = true) const;
+        virtual void ExtendMaxTime(TSTime64 t);
+
+        virtual TDataKind ChanKind(TChanNum chan) const;
+        virtual TSTime64 ChanDivide(TChanNum chan) const;
+        virtual double IdealRate(TChanNum chan, double dRate = -1.0);
+        virtual int PhyChan(TChanNum) const;
+        virtual int SetChanComment(TChanNum chan, const char* szComment);
+        virtual int GetChanComment(TChanNum chan, int nSz = 0, char* szComment = nullptr) const;
+        virtual int SetChanTitle(TChanNum chan, const char* szTitle);
+        virtual int GetChanTitle(TChanNum chan, int nSz = 0, char* szTitle = nullptr) const;
+        virtual int SetChanScale(TChanNum chan, double dScale);
+        virtual int GetChanScale(TChanNum chan, double& dScale) const;
+        virtual int SetChanOffset(TChanNum chan, double dOffset);
+        virtual int GetChanOffset(TChanNum chan, double& dOffset) const;
+        virtual int SetChanUnits(TChanNum chan, const char* szUnits);
+        virtual int GetChanUnits(TChanNum chan, int nSz = 0, char* szUnits = nullptr) const;
+        virtual TSTime64 ChanMaxTime(TChanNum chan) const;
+        virtual TSTime64 PrevNTime(TChanNum chan, TSTime64 sTime, TSTime64 eTime = 0,
+                                   uint32_t n = 1, const CSFilter* pFilter = nullptr, bool bAsWave = false);
+        virtual int ChanDelete(TChanNum chan);
+        virtual int ChanUndelete(TChanNum chan, eCU action=eCU_kind);
+        virtual int GetChanYRange(TChanNum chan, double& dLow, double& dHigh) const;
+        virtual int SetChanYRange(TChanNum chan, double dLow, double dHigh);
+        virtual int ItemSize(TChanNum chan) const;
+
+        virtual void Save(int chan, TSTime64 t, bool bSave);
+        virtual void SaveRange(int chan, TSTime64 tFrom, TSTime64 tUpto);
+        virtual bool IsSaving(TChanNum chan, TSTime64 tAt) const;
+        virtual int NoSaveList(TChanNum chan, TSTime64* pTimes, int nMax, TSTime64 tFrom = -1, TSTime64 tUpto = TSTIME64_MAX) const;
+        virtual int LatestTime(int chan, TSTime64 t);
+        virtual double SetBuffering(int chan, size_t nBytes, double dSeconds = 0.0);
+
+        virtual int SetEventChan(TChanNum chan, double dRate, TDataKind evtKind = EventFall, int iPhyCh=-1);
+        virtual int WriteEvents(TChanNum chan, const TSTime64* pData, size_t count);
+        virtual int ReadEvents(TChanNum chan, TSTime64* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter = nullptr);
+
+        virtual int SetMarkerChan(TChanNum chan, double dRate, TDataKind kind = Marker, int iPhyChan = -1);
+        virtual int WriteMarkers(TChanNum chan, const TMarker* pData, size_t count);
+        virtual int ReadMarkers(TChanNum chan, TMarker* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter = nullptr);
+        virtual int EditMarker(TChanNum chan, TSTime64 t, const TMarker* pM, size_t nCopy = sizeof(TMarker));
+
+        virtual int SetLevelChan(TChanNum chan, double dRate, int iPhyChan = -1);
+        virtual int SetInitLevel(TChanNum chan, bool bLevel);
+        virtual int WriteLevels(TChanNum chan, const TSTime64* pData, size_t count);
+        virtual int ReadLevels(TChanNum chan, TSTime64* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, bool& bLevel);
+
+        virtual int SetTextMarkChan(TChanNum chan, double dRate, size_t nMax, int iPhyChan = -1);
+        virtual int SetExtMarkChan(TChanNum chan, double dRate, TDataKind kind, size_t nRows, size_t nCols = 1, int iPhyChan = -1, TSTime64 lDvd = 0, int nPre=0);
+        virtual int GetExtMarkInfo(TChanNum chan, size_t *pRows = nullptr, size_t* pCols = nullptr) const;
+
+        virtual int SetWaveChan(TChanNum chan, TSTime64 lDvd, TDataKind wKind, double dRate = 0.0, int iPhyCh=-1);
+        virtual TSTime64 WriteWave(TChanNum chan, const short* pData, size_t count, TSTime64 tFrom);
+        virtual TSTime64 WriteWave(TChanNum chan, const float* pData, size_t count, TSTime64 tFrom);
+        virtual int ReadWave(TChanNum chan, short* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, TSTime64& tFirst, const CSFilter* pFilter = nullptr);
+        virtual int ReadWave(TChanNum chan, float* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, TSTime64& tFirst, const CSFilter* pFilter = nullptr);
+
+        virtual int WriteExtMarks(TChanNum chan, const TExtMark* pData, size_t count);
+        virtual int ReadExtMarks(TChanNum chan, TExtMark* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter = nullptr);
+
+        virtual int Prefetch(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto);
+        virtual int Release(TChanNum chan, TSTime64 tFrom, TSTime64 tUpto);
+
+        // This is the end of the defined interface
+    };
+}
+#endif
+
+#undef DllClass
+#endif
@@ -0,0 +1,554 @@
+// s64text.cpp
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//! \file s64text.cpp
+//! \brief Inverted index of the text in TextMark channels
+/*!
+\internal
+The index of a channel is built the first time the channel is searched and is then kept
+up to date as items are written. Each index records the channel ID and last time of its
+channel, and the file edit generation (which moves on when any channel is reset, emptied
+or has marker data edited). If these do not match the channel at search time, the index
+is built again. Indexes can be saved to and loaded from a sidecar file so that a file can
+be searched without reading the channel data.
+*/
+#include <assert.h>
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
+#include "s64priv.h"
+#include "s64chan.h"
+#include "s64text.h"
+
+using namespace std;
+using namespace ceds64;
+
+//! The identifier at the start of a text index sidecar file
+static const char szTextID[8] = {'S', '6', '4', 'T', 'E', 'X', 'T', '2'};
+
+//! Identifies the data file that a text index sidecar file belongs to
+struct TTextFileStamp
+{
+    TTimeDate m_tdZeroTick;             //!< TFileHead::m_tdZeroTick of the data file
+    double m_dSecPerTick;               //!< TFileHead::m_dSecPerTick of the data file
+};
+
+//! Identifies the channel data that a saved text index was made from
+struct TTextChanStamp
+{
+    TDiskOff m_doIndex;                 //!< TChanHead::m_doIndex, the top of the channel index
+    uint64_t m_nFirstBlock;             //!< TChanHead::m_nFirstBlock, changed by dropping data
+};
+
+//! Number of TextMark items we read at a time when building an index
+static const int nTextBuf = 1024;
+
+//! Test if a character is part of a token
+/*!
+Letters and digits form tokens. Bytes with the top bit set are treated as letters so
+that UTF-8 text is kept in words.
+*/
+static bool IsTokenChar(char c)
+{
+    return (static_cast<unsigned char>(c) >= 0x80) || (isalnum(static_cast<unsigned char>(c)) != 0);
+}
+
+//! Convert a string to lower case
+static string LowerCase(const char* p, size_t n)
+{
+    string s(p, n);
+    for (auto& c : s)
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    return s;
+}
+
+//! Keep the items in a that are also in b (both in ascending order)
+static void Intersect(vector<uint32_t>& a, const vector<uint32_t>& b)
+{
+    a.erase(set_intersection(a.begin(), a.end(), b.begin(), b.end(), a.begin()), a.end());
+}
+
+CTextIndex::CTextIndex()
+    : m_chanID( 0 )
+    , m_tLast( -1 )
+    , m_nGen( 0 )
+    , m_vOff( 1, 0 )
+{
+}
+
+//! Add the text of one item to the index
+/*!
+Items must be added in time order.
+\param t        The item time.
+\param pText    The item text, which is 0 terminated unless it fills the item.
+\param nMax     The maximum length of the text.
+*/
+void CTextIndex::Add(TSTime64 t, const char* pText, size_t nMax)
+{
+    size_t len = 0;
+    while ((len < nMax) && pText[len])
+        ++len;
+    m_text += LowerCase(pText, len);
+    m_vOff.push_back(static_cast<uint32_t>(m_text.size()));
+    m_vTime.push_back(t);
+    AddTokens(static_cast<uint32_t>(m_vTime.size() - 1));
+    m_tLast = t;
+}
+
+//! Add the tokens of an item to the token lists
+void CTextIndex::AddTokens(uint32_t item)
+{
+    const char* p = m_text.data() + m_vOff[item];
+    const char* pEnd = m_text.data() + m_vOff[item+1];
+    while (p < pEnd)
+    {
+        while ((p < pEnd) && !IsTokenChar(*p))
+            ++p;
+        const char* pTok = p;
+        while ((p < pEnd) && IsTokenChar(*p))
+            ++p;
+        if (p > pTok)
+        {
+            TPosting& post = m_mapTok[string(pTok, p)];
+            if (post.empty() || (post.back() != item))
+                post.push_back(item);
+        }
+    }
+}
+
+//! Get the items that might hold a search string
+/*!
+\param find     The search string in lower case.
+\param bWords   If true, each token in find must match a whole token in the item. If false,
+                the tokens at the ends of find may be part of a longer token.
+\param work     Space used to build the result.
+\return         Pointer to the candidate items (in ascending order) or nullptr if find has
+                no tokens, so all items are candidates.
+*/
+const CTextIndex::TPosting* CTextIndex::Candidates(const string& find, bool bWords, TPosting& work) const
+{
+    bool bFirst = true;                 // true until we have the first token list
+    size_t i = 0;
+    while (i < find.size())
+    {
+        while ((i < find.size()) && !IsTokenChar(find[i]))
+            ++i;
+        const size_t iTok = i;
+        while ((i < find.size()) && IsTokenChar(find[i]))
+            ++i;
+        if (i == iTok)
+            break;
+
+        const string tok(find, iTok, i - iTok);
+        const bool bStart = bWords || (iTok > 0);           // token must start a text token
+        const bool bEnd = bWords || (i < find.size());      // token must end a text token
+        TPosting items;                 // the items that can match this token
+        if (bStart && bEnd)
+        {
+            auto it = m_mapTok.find(tok);
+            if (it != m_mapTok.end())
+                items = it->second;
+        }
+        else                            // check each token in the index
+        {
+            for (const auto& kv : m_mapTok)
+            {
+                const string& s = kv.first;
+                size_t pos = s.find(tok);
+                if (pos == string::npos)
+                    continue;
+                if (bStart)             // must be a prefix of the token
+                {
+                    if (s.compare(0, tok.size(), tok) != 0)
+                        continue;
+                }
+                else if (bEnd)          // must be a suffix of the token
+                {
+                    if ((s.size() < tok.size()) || (s.compare(s.size() - tok.size(), tok.size(), tok) != 0))
+                        continue;
+                }
+                TPosting merged(items.size() + kv.second.size());
+                merged.erase(set_union(items.begin(), items.end(), kv.second.begin(), kv.second.end(), merged.begin()), merged.end());
+                items.swap(merged);
+            }
+        }
+
+        if (bFirst)
+            work.swap(items);
+        else
+            Intersect(work, items);
+        bFirst = false;
+        if (work.empty())
+            break;
+    }
+    return bFirst ? nullptr : &work;
+}
+
+//! Search the index for items holding text
+/*!
+The search ignores the case of letters.
+\param szFind   The text to search for.
+\param bWords   If true, an item matches if it holds all the tokens (runs of letters and
+                digits) in szFind as whole words, in any order. If false, an item matches
+                if it holds szFind as a substring.
+\param pTimes   Filled in with the times of the matching items in time order.
+\param nMax     The maximum number of times to return.
+\param tFrom    The start of the time range to search.
+\param tUpto    The end of the time range (not included).
+\return         The number of times returned.
+*/
+int CTextIndex::Find(const char* szFind, bool bWords, TSTime64* pTimes, int nMax, TSTime64 tFrom, TSTime64 tUpto) const
+{
+    const string find = LowerCase(szFind, strlen(szFind));
+    const uint32_t iFrom = static_cast<uint32_t>(lower_bound(m_vTime.begin(), m_vTime.end(), tFrom) - m_vTime.begin());
+    const uint32_t iUpto = static_cast<uint32_t>(lower_bound(m_vTime.begin(), m_vTime.end(), tUpto) - m_vTime.begin());
+    if ((nMax <= 0) || (iFrom >= iUpto))
+        return 0;
+
+    TPosting work;
+    const TPosting* pCand = Candidates(find, bWords, work);
+    auto match = [&](uint32_t item) -> bool
+    {
+        if (bWords && pCand)            // the token lists are an exact answer
+            return true;
+        const char* pText = m_text.data() + m_vOff[item];
+        const char* pEnd = m_text.data() + m_vOff[item+1];
+        return search(pText, pEnd, find.begin(), find.end()) != pEnd || find.empty();
+    };
+
+    int n = 0;
+    if (pCand)
+    {
+        auto it = lower_bound(pCand->begin(), pCand->end(), iFrom);
+        for (; (it != pCand->end()) && (*it < iUpto) && (n < nMax); ++it)
+        {
+            if (match(*it))
+                pTimes[n++] = m_vTime[*it];
+        }
+    }
+    else
+    {
+        for (uint32_t item = iFrom; (item < iUpto) && (n < nMax); ++item)
+        {
+            if (match(item))
+                pTimes[n++] = m_vTime[item];
+        }
+    }
+    return n;
+}
+
+//! Write the index to a sidecar file
+/*!
+\param pFile    The file to write to.
+\param chan     The channel that the index belongs to.
+\return         true if all was written.
+*/
+bool CTextIndex::Save(FILE* pFile, TChanNum chan) const
+{
+    const uint16_t head[4] = {chan, m_chanID, 0, 0};
+    const uint64_t sizes[2] = {m_vTime.size(), m_text.size()};
+    return (fwrite(head, sizeof(head), 1, pFile) == 1) &&
+           (fwrite(&m_tLast, sizeof(m_tLast), 1, pFile) == 1) &&
+           (fwrite(sizes, sizeof(sizes), 1, pFile) == 1) &&
+           (fwrite(m_vTime.data(), sizeof(TSTime64), m_vTime.size(), pFile) == m_vTime.size()) &&
+           (fwrite(m_vOff.data(), sizeof(uint32_t), m_vOff.size(), pFile) == m_vOff.size()) &&
+           (fwrite(m_text.data(), 1, m_text.size(), pFile) == m_text.size());
+}
+
+//! Read an index written by Save() and rebuild the token lists
+/*!
+\param pFile    The file to read from.
+\param chan     Returned as the channel that the index belongs to.
+\return         true if a consistent index was read.
+*/
+bool CTextIndex::Load(FILE* pFile, TChanNum& chan)
+{
+    uint16_t head[4];
+    uint64_t sizes[2];
+    if ((fread(head, sizeof(head), 1, pFile) != 1) ||
+        (fread(&m_tLast, sizeof(m_tLast), 1, pFile) != 1) ||
+        (fread(sizes, sizeof(sizes), 1, pFile) != 1) ||
+        (sizes[0] >= UINT32_MAX) || (sizes[1] >= UINT32_MAX))
+        return false;
+    chan = head[0];
+    m_chanID = head[1];
+    m_vTime.resize(static_cast<size_t>(sizes[0]));
+    m_vOff.resize(static_cast<size_t>(sizes[0]) + 1);
+    m_text.resize(static_cast<size_t>(sizes[1]));
+    if ((fread(m_vTime.data(), sizeof(TSTime64), m_vTime.size(), pFile) != m_vTime.size()) ||
+        (fread(m_vOff.data(), sizeof(uint32_t), m_vOff.size(), pFile) != m_vOff.size()) ||
+        (fread(&m_text[0], 1, m_text.size(), pFile) != m_text.size()))
+        return false;
+    if ((m_vOff.front() != 0) || (m_vOff.back() != m_text.size()) ||
+        !is_sorted(m_vOff.begin(), m_vOff.end()) || !is_sorted(m_vTime.begin(), m_vTime.end()))
+        return false;
+
+    m_mapTok.clear();
+    for (uint32_t i = 0; i < m_vTime.size(); ++i)
+        AddTokens(i);
+    return true;
+}
+
+//! Get the text index of a TextMark channel, building it if it is missing or out of date
+/*!
+You must hold m_mutText and must not hold m_mutChans.
+\param chan The TextMark channel.
+\param pIdx Returned pointing at the index.
+\return     S64_OK (0) or a negative error code.
+*/
+int TSon64File::TextIndex(TChanNum chan, const CTextIndex*& pIdx)
+{
+    const TDataKind kind = ChanKind(chan);
+    if (kind != TextMark)
+        return (kind == ChanOff) ? NO_CHANNEL : CHANNEL_TYPE;
+
+    TChanID id;
+    const TSTime64 tLast = TextStamp(chan, id);
+    auto& pText = m_mapText[chan];
+    if (pText && (pText->m_chanID == id) && (pText->m_tLast == tLast) && (pText->m_nGen == m_nEditGen))
+    {
+        pIdx = pText.get();
+        return S64_OK;
+    }
+
+    // Build a new index from the channel data
+    unique_ptr<CTextIndex> pNew(new CTextIndex);
+    pNew->m_chanID = id;
+    pNew->m_nGen = m_nEditGen;
+    const size_t nObjSize = ItemSize(chan);
+    const size_t nText = nObjSize - sizeof(TMarker);
+    vector<uint8_t> buf(nTextBuf*nObjSize);
+    TSTime64 tFrom = 0;
+    while (true)
+    {
+        int n = ReadExtMarks(chan, reinterpret_cast<TExtMark*>(buf.data()), nTextBuf, tFrom, TSTIME64_MAX);
+        if (n < 0)
+            return n;
+        for (int i = 0; i < n; ++i)
+        {
+            const TTextMark& tm = *reinterpret_cast<const TTextMark*>(buf.data() + i*nObjSize);
+            pNew->Add(tm.m_time, tm.Chars(), nText);
+        }
+        if (n < nTextBuf)
+            break;
+        tFrom = pNew->m_tLast + 1;
+    }
+    // If items were written while we read, we may hold items after tLast, so cannot match
+    pNew->m_tLast = (pNew->size() && (pNew->m_tLast > tLast)) ? -2 : tLast;
+    pText = move(pNew);
+    pIdx = pText.get();
+    return S64_OK;
+}
+
+//! Get the state of a channel that a text index must match
+/*!
+You must not hold m_mutChans.
+\param chan The channel.
+\param id   Returned as the channel ID.
+\return     The last time in the channel.
+*/
+TSTime64 TSon64File::TextStamp(TChanNum chan, TChanID& id) const
+{
+    TChRdLock lock(m_mutChans);
+    id = (chan < m_vChanHead.size()) ? m_vChanHead[chan].m_chanID : 0;
+    return ((chan < m_vChanHead.size()) && m_vChan[chan]) ? m_vChan[chan]->MaxTime() : -1;
+}
+
+//! Get where the data of a channel lies on disk, to match a saved text index to the channel
+/*!
+You must not hold m_mutChans. The index of a channel moves when the channel is rewritten or
+grows a level, and the first block changes when data is dropped from the start.
+\param chan         The channel.
+\param nFirstBlock  Returned holding TChanHead::m_nFirstBlock.
+\return             TChanHead::m_doIndex, or 0 if chan is out of range.
+*/
+TDiskOff TSon64File::TextRoot(TChanNum chan, uint64_t& nFirstBlock) const
+{
+    TChRdLock lock(m_mutChans);
+    if (chan >= m_vChanHead.size())
+    {
+        nFirstBlock = 0;
+        return 0;
+    }
+    nFirstBlock = m_vChanHead[chan].m_nFirstBlock;
+    return m_vChanHead[chan].m_doIndex;
+}
+
+//! Add newly written TextMark items to the channel index, if there is one
+/*!
+You must not hold m_mutChans. If the index is not up to date with the channel state
+before the write, it is left alone and will be rebuilt when next used.
+\param chan     The TextMark channel.
+\param pData    The items that were written.
+\param count    The number of items.
+\param tPrev    The last time in the channel before the write.
+*/
+void TSon64File::AddToTextIndex(TChanNum chan, const TExtMark* pData, size_t count, TSTime64 tPrev)
+{
+    std::lock_guard<std::mutex> lock(m_mutText);
+    auto it = m_mapText.find(chan);
+    if ((it == m_mapText.end()) || (it->second->m_tLast != tPrev) || (it->second->m_nGen != m_nEditGen))
+        return;
+
+    CTextIndex& idx = *it->second;
+    const size_t nObjSize = ItemSize(chan);
+    const size_t nText = nObjSize - sizeof(TMarker);
+    const uint8_t* pItem = reinterpret_cast<const uint8_t*>(pData);
+    for (size_t i = 0; i < count; ++i, pItem += nObjSize)
+    {
+        const TTextMark& tm = *reinterpret_cast<const TTextMark*>(pItem);
+        idx.Add(tm.m_time, tm.Chars(), nText);
+    }
+}
+
+//! Search a TextMark channel for items holding text
+/*!
+The first search of a channel builds an index of the channel text (unless one was loaded
+by LoadTextIndex()). This is kept up to date as items are written, so later searches do not
+read the channel data. The search ignores the case of letters.
+\param chan     The TextMark channel to search.
+\param szFind   The text to search for.
+\param pTimes   Filled in with the times of the matching items in time order.
+\param nMax     The maximum number of times to return.
+\param tFrom    The start of the time range to search.
+\param tUpto    The end of the time range (not included).
+\param bWords   If false, an item matches if it holds szFind as a substring. If true, an
+                item matches if it holds each token (run of letters and digits) in szFind
+                as a whole word, in any order.
+\return         The number of times returned or a negative error code.
+*/
+int TSon64File::FindText(TChanNum chan, const char* szFind, TSTime64* pTimes, int nMax, TSTime64 tFrom, TSTime64 tUpto, bool bWords)
+{
+    if (!szFind)
+        return BAD_PARAM;
+    std::lock_guard<std::mutex> lock(m_mutText);
+    const CTextIndex* pIdx = nullptr;
+    int err = TextIndex(chan, pIdx);
+    if (err)
+        return err;
+    if (ChanRing(chan) > 0)         // the index holds text a ring archive has replaced
+        tFrom = std::max(tFrom, ChanMinTime(chan));
+    return pIdx->Find(szFind, bWords, pTimes, nMax, tFrom, tUpto);
+}
+
+//! Save the text indexes of all TextMark channels to a sidecar file
+/*!
+Channels that have not been searched are indexed first. The file can be given to
+LoadTextIndex() when this data file is next opened.
+\param szPath   The name of the sidecar file to write.
+\return         The number of channel indexes saved or a negative error code.
+*/
+int TSon64File::SaveTextIndex(const char* szPath)
+{
+    TTextFileStamp fs;
+    {
+        THeadLock lock(m_mutHead);
+        fs.m_tdZeroTick = m_Head.m_tdZeroTick;
+        fs.m_dSecPerTick = m_Head.m_dSecPerTick;
+    }
+    std::lock_guard<std::mutex> lock(m_mutText);
+    vector<pair<TChanNum, const CTextIndex*>> vIdx;
+    for (TChanNum chan = 0; chan < MaxChans(); ++chan)
+    {
+        if (ChanKind(chan) == TextMark)
+        {
+            const CTextIndex* pIdx = nullptr;
+            int err = TextIndex(chan, pIdx);
+            if (err)
+                return err;
+            vIdx.emplace_back(chan, pIdx);
+        }
+    }
+
+    FILE* pFile = fopen(szPath, "wb");
+    if (!pFile)
+        return NO_ACCESS;
+    const uint32_t nIdx = static_cast<uint32_t>(vIdx.size());
+    bool bOK = (fwrite(szTextID, sizeof(szTextID), 1, pFile) == 1) &&
+               (fwrite(&nIdx, sizeof(nIdx), 1, pFile) == 1) &&
+               (fwrite(&fs, sizeof(fs), 1, pFile) == 1);
+    for (size_t i = 0; bOK && (i < vIdx.size()); ++i)
+    {
+        TTextChanStamp cs;
+        cs.m_doIndex = TextRoot(vIdx[i].first, cs.m_nFirstBlock);
+        bOK = (fwrite(&cs, sizeof(cs), 1, pFile) == 1) && vIdx[i].second->Save(pFile, vIdx[i].first);
+    }
+    if (fclose(pFile) != 0)
+        bOK = false;
+    return bOK ? static_cast<int>(nIdx) : BAD_WRITE;
+}
+
+//! Load text indexes written by SaveTextIndex()
+/*!
+The sidecar file must have been saved from this data file; we check the time and date of
+tick 0 and the tick period. An index is only used if its channel is a TextMark channel with
+the same channel ID, last time and index position on disk as when the index was saved, so
+data that was dropped since is not found. Other indexes are ignored.
+\param szPath   The name of the sidecar file to read.
+\return         The number of channel indexes used or a negative error code. WRONG_FILE
+                means that the sidecar file is not a text index or is for another data file.
+*/
+int TSon64File::LoadTextIndex(const char* szPath)
+{
+    FILE* pFile = fopen(szPath, "rb");
+    if (!pFile)
+        return NO_ACCESS;
+    char id[sizeof(szTextID)];
+    uint32_t nIdx = 0;
+    TTextFileStamp fs;
+    int err = ((fread(id, sizeof(id), 1, pFile) == 1) && (fread(&nIdx, sizeof(nIdx), 1, pFile) == 1) &&
+               (fread(&fs, sizeof(fs), 1, pFile) == 1)) ? S64_OK : BAD_READ;
+    if ((err == 0) && (memcmp(id, szTextID, sizeof(id)) != 0))
+        err = WRONG_FILE;
+    if (err == 0)
+    {
+        THeadLock lock(m_mutHead);
+        if ((memcmp(&fs.m_tdZeroTick, &m_Head.m_tdZeroTick, sizeof(TTimeDate)) != 0) ||
+            (fs.m_dSecPerTick != m_Head.m_dSecPerTick))
+            err = WRONG_FILE;           // saved from another data file
+    }
+
+    int nUsed = 0;
+    std::lock_guard<std::mutex> lock(m_mutText);
+    for (uint32_t i = 0; (err == 0) && (i < nIdx); ++i)
+    {
+        unique_ptr<CTextIndex> pIdx(new CTextIndex);
+        TChanNum chan;
+        TTextChanStamp cs;
+        if ((fread(&cs, sizeof(cs), 1, pFile) != 1) || !pIdx->Load(pFile, chan))
+        {
+            err = CORRUPT_FILE;
+            break;
+        }
+        TChanID chanID;
+        uint64_t nFirstBlock;
+        if ((ChanKind(chan) == TextMark) && (TextStamp(chan, chanID) == pIdx->m_tLast) && (chanID == pIdx->m_chanID) &&
+            (TextRoot(chan, nFirstBlock) == cs.m_doIndex) && (nFirstBlock == cs.m_nFirstBlock))
+        {
+            pIdx->m_nGen = m_nEditGen;
+            m_mapText[chan] = move(pIdx);
+            ++nUsed;
+        }
+    }
+    fclose(pFile);
+    return err ? err : nUsed;
+}
@@ -0,0 +1,73 @@
+// s64text.h
+/*
+    Copyright (C) Cambridge Electronic Design Limited 2012-2015
+    Author: Greg P. Smith
+    Web: ced.co.uk email: greg@ced.co.uk
+
+    This file is part of SON64, the 64-bit SON data library.
+
+    SON64 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    SON64 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SON64.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __S64TEXT_H__
+#define __S64TEXT_H__
+//! \file s64text.h
+//! \brief Inverted index of the text in TextMark channels
+//! \internal
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "s64.h"
+
+namespace ceds64
+{
+    //! An inverted index of the text held in a TextMark channel
+    /*!
+     The text of each item is held in lower case with its time, and each token (a run of
+     letters and digits) maps to the list of items that hold it. A token search uses the
+     lists directly. A substring search uses the lists of the tokens in the search string
+     to find candidate items, then checks the text of each candidate.
+
+     The index records the state of the channel it was built from so that the owner can
+     tell if the index is still current.
+    */
+    class CTextIndex
+    {
+    public:
+        TChanID m_chanID;               //!< The channel ID when the index was made
+        TSTime64 m_tLast;               //!< Time of the last item in the channel that is indexed
+        uint32_t m_nGen;                //!< The file edit generation when the index was made
+
+        CTextIndex();
+        void Add(TSTime64 t, const char* pText, size_t nMax);
+        int Find(const char* szFind, bool bWords, TSTime64* pTimes, int nMax, TSTime64 tFrom, TSTime64 tUpto) const;
+        size_t size() const {return m_vTime.size();}    //!< The number of indexed items
+        bool Save(FILE* pFile, TChanNum chan) const;
+        bool Load(FILE* pFile, TChanNum& chan);
+
+    private:
+        typedef std::vector<uint32_t> TPosting;         //!< Item indices in ascending order
+        std::vector<TSTime64> m_vTime;  //!< The time of each item
+        std::vector<uint32_t> m_vOff;   //!< Start of each item text in m_text, plus the end
+        std::string m_text;             //!< The text of all the items in lower case
+        std::unordered_map<std::string, TPosting> m_mapTok; //!< Tokens to items
+
+        void AddTokens(uint32_t item);
+        const TPosting* Candidates(const std::string& find, bool bWords, TPosting& work) const;
+    };
+}
+#endif
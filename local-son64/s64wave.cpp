@@ -126,6 +126,8 @@ int CAdcChan::ChangeData(const short* pData, size_t count, TSTime64 tFrom)
         int nUsed = m_pWr->ChangeWave(pData, count, tFrom, first);
         if (nUsed > 0)          // if we updated something...
         {
+            if (m_pWr->DiskOff())   // the buffer is already on disk...
+                InvalidateStats();  // ...so the data range may have changed
             assert(first < count);
             count = first;      // change count left to do
             if (count == 0)     // if we used the lot...
@@ -144,6 +146,7 @@ int CAdcChan::ChangeData(const short* pData, size_t count, TSTime64 tFrom)
         int nUsed = m_bmRead.DataBlock().ChangeWave(pData, count, tFrom, first);
         if (nUsed > 0)          // if we updated something...
         {
+            InvalidateStats();  // the data range may have changed
             first += nUsed;     // next index in pData to use
             assert(first <= count);
             count -= first;     // count left to do
@@ -175,6 +178,11 @@ int CAdcChan::ReadData(short* pData, CSRange& r, TSTime64& tFirst, const CSFilte
 
     int nRead = 0;                          // will be the count of read data
 
+    // If the channel is being written, do not hold up the writer while we read the disk
+    if (SnapRead(r, [pData, &tFirst](const CDataBlock& db, CSRange& rs, size_t nDone)
+                    {short* p = pData + nDone; return db.GetData(p, rs, tFirst);}, true, nRead))
+        return nRead;
+
     TChanLock lock(m_mutex);                // take ownership of the channel
 
     // If we have a write buffer, and our time range includes data in the buffer, use that
@@ -602,6 +610,8 @@ int CRealWChan::ChangeData(const float* pData, size_t count, TSTime64 tFrom)
         int nUsed = m_pWr->ChangeWave(pData, count, tFrom, first);
         if (nUsed > 0)          // if we updated something...
         {
+            if (m_pWr->DiskOff())   // the buffer is already on disk...
+                InvalidateStats();  // ...so the data range may have changed
             assert(first < count);
             count = first;      // change count left to do
             if (count == 0)     // if we used the lot...
@@ -620,6 +630,7 @@ int CRealWChan::ChangeData(const float* pData, size_t count, TSTime64 tFrom)
         int nUsed = m_bmRead.DataBlock().ChangeWave(pData, count, tFrom, first);
         if (nUsed > 0)          // if we updated something...
         {
+            InvalidateStats();  // the data range may have changed
             first += nUsed;     // next index in pData to use
             assert(first <= count);
             count -= first;     // count left to do
@@ -651,6 +662,11 @@ int CRealWChan::ReadData(float* pData, CSRange& r, TSTime64& tFirst, const CSFil
 
     int nRead = 0;                          // will be the count of read data
 
+    // If the channel is being written, do not hold up the writer while we read the disk
+    if (SnapRead(r, [pData, &tFirst](const CDataBlock& db, CSRange& rs, size_t nDone)
+                    {float* p = pData + nDone; return db.GetData(p, rs, tFirst);}, true, nRead))
+        return nRead;
+
     TChanLock lock(m_mutex);                // take ownership of the channel
 
     // If we have a write buffer, and our time range includes data in the buffer, use that
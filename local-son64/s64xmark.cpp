@@ -25,6 +25,7 @@
 
 #include <iostream>      // for debugging messages
 #include <assert.h>
+#include <algorithm>
 #include "s64priv.h"
 #include "s64chan.h"
 #include "s64range.h"
@@ -32,6 +33,9 @@
 using namespace std;
 using namespace ceds64;
 
+//! The number of RealMark values for which FindValues() keeps the block value ranges
+static const size_t MaxValueRanges = 8;
+
     // circ_iterator specializations for TExtMark which is a variable size
 
     //! Increment operator specialization for TExtMark
@@ -389,6 +393,15 @@ int CExtMarkChan::ReadData(TExtMark* pData, CSRange& r, const CSFilter* pFilter)
 
     int nRead = 0;                          // will be the count of read data
 
+    // If the channel is being written, do not hold up the writer while we read the disk
+    const size_t nSize = m_chanHead.m_nObjSize; // bytes per item
+    if (SnapRead(r, [pData, pFilter, nSize](const CDataBlock& db, CSRange& rs, size_t nDone)
+                    {
+                        TExtMark* p = reinterpret_cast<TExtMark*>(reinterpret_cast<char*>(pData) + nDone*nSize);
+                        return db.GetData(p, rs, pFilter);
+                    }, false, nRead))
+        return nRead;
+
     TChanLock lock(m_mutex);                // take ownership of the channel
 
     // If we have a write buffer, and our time range includes data in the buffer, use that
@@ -440,13 +453,118 @@ int CExtMarkChan::EditMarker(TSTime64 t, const TMarker* pM, size_t nCopy)
 
     // If in the buffer we just need to change there and mark the buffer as modified
     if (m_pWr && (t >= m_pWr->FirstTime())) // could be buffered
-        return m_pWr->EditMarker(t, pM, nCopy);
+    {
+        int err = m_pWr->EditMarker(t, pM, nCopy);
+        if ((err > 0) && m_pWr->DiskOff())  // if data on disk changed...
+            InvalidateStats();              // ...the value range may be wrong
+        return err;
+    }
 
     int err = m_bmRead.LoadBlock(t);        // get block with this data
     if (err < 0)
         return err;
 
-    return m_bmRead.DataBlock().EditMarker(t, pM, nCopy);
+    err = m_bmRead.DataBlock().EditMarker(t, pM, nCopy);
+    if (err > 0)                            // data on disk has changed...
+        InvalidateStats();                  // ...so the value range may be wrong
+    return err;
+}
+
+//! Find the items with a float value in a range in a RealMark channel
+/*!
+You _must not_ hold the channel mutex. Only data that is on disk is searched, so commit
+the channel first. We keep the range of the value in each data block (apart from the
+last, which can still change) so that blocks that cannot hold a match are not read. The
+ranges are made on the first search for a value and are extended as the channel grows. We
+keep the ranges of the MaxValueRanges most recently searched values, so searches that move
+between rows or columns do not rescan the channel.
+\param nOff     The byte offset of the value in each item.
+\param fLo      The lowest value to find.
+\param fHi      The highest value to find.
+\param pTimes   If not nullptr, set to the times of the found items.
+\param pData    If not nullptr, set to copies of the found items.
+\param nMax     The maximum number of items to find.
+\param tFrom    The start of the time range to search.
+\param tUpto    The end of the time range (not included).
+\param pFilter  Either nullptr or a filter to select the items.
+\param nGen     The file edit generation. If this changes, the value ranges are rebuilt.
+\return         The number of items found or a negative error code.
+*/
+int CExtMarkChan::FindValues(size_t nOff, float fLo, float fHi, TSTime64* pTimes, TExtMark* pData, int nMax,
+                             TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter, uint32_t nGen)
+{
+    TChanLock lock(m_mutex);            // take ownership of the channel
+    auto itVR = find_if(m_vRanges.begin(), m_vRanges.end(), [nOff](const TValueRanges& vr){return vr.m_nOff == nOff;});
+    if (itVR == m_vRanges.end())        // a new value, so forget the least recently used
+    {
+        if (m_vRanges.size() >= MaxValueRanges)
+            m_vRanges.pop_back();
+        m_vRanges.insert(m_vRanges.begin(), TValueRanges{nOff, nGen, {}});
+    }
+    else                                // move it to the front
+        std::rotate(m_vRanges.begin(), itVR, itVR+1);
+    vector<TBlockRange>& vRange = m_vRanges.front().m_vRange;
+    if (m_vRanges.front().m_nGen != nGen)
+    {
+        vRange.clear();                 // the ranges are out of date
+        m_vRanges.front().m_nGen = nGen;
+    }
+
+    // Bring the block value ranges up to date
+    int err = m_bmRead.LoadBlock(vRange.empty() ? 0 : vRange.back().m_tLast + 1);
+    while (err == 0)
+    {
+        TBlockRange br;
+        const CExtMarkBlock& blk = static_cast<const CExtMarkBlock&>(m_bmRead.DataBlock());
+        br.m_tLast = blk.LastTime();
+        blk.ValueRange(nOff, br.m_fMin, br.m_fMax);
+        err = m_bmRead.NextBlock();
+        if (err == 0)                   // the last block is left out
+            vRange.push_back(br);
+    }
+    if (err < 0)
+        return err;
+
+    const size_t nObjSize = m_chanHead.m_nObjSize;
+    vector<uint32_t> vIdx;
+    int n = 0;
+    auto it = vRange.cbegin();
+    TSTime64 t = tFrom;                 // where we search next
+    while ((n < nMax) && (t < tUpto))
+    {
+        // Skip over blocks that cannot hold a value in range
+        while ((it != vRange.cend()) && ((it->m_tLast < t) || (it->m_fMax < fLo) || (it->m_fMin > fHi)))
+        {
+            if (it->m_tLast >= t)
+                t = it->m_tLast + 1;
+            ++it;
+        }
+        if (t >= tUpto)
+            break;
+
+        err = m_bmRead.LoadBlock(t);
+        if (err)
+            break;
+        const CExtMarkBlock& blk = static_cast<const CExtMarkBlock&>(m_bmRead.DataBlock());
+        if (blk.FirstTime() >= tUpto)
+            break;
+        vIdx.resize(blk.size());
+        const size_t nFound = blk.FindValues(nOff, fLo, fHi, vIdx.data());
+        const uint8_t* pBase = reinterpret_cast<const uint8_t*>(blk.DataBlock()->m_event);
+        for (size_t i = 0; (i < nFound) && (n < nMax); ++i)
+        {
+            const TExtMark& item = *reinterpret_cast<const TExtMark*>(pBase + vIdx[i]*nObjSize);
+            if ((item.m_time < t) || (item.m_time >= tUpto) || (pFilter && !pFilter->Filter(item)))
+                continue;
+            if (pTimes)
+                pTimes[n] = item.m_time;
+            if (pData)
+                memcpy(reinterpret_cast<uint8_t*>(pData) + n*nObjSize, &item, nObjSize);
+            ++n;
+        }
+        t = blk.LastTime() + 1;
+    }
+    return (err < 0) ? err : n;
 }
 
 //=================================== Buffered version ===============================================
@@ -1072,11 +1190,28 @@ int TSon64File::WriteExtMarks(TChanNum chan, const TExtMark* pData, size_t count
     if (count == 0)
         return 0;
 
-    TChRdLock lock(m_mutChans);     // we are not changing the #chans
-    if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
-        return NO_CHANNEL;
+    int err;
+    TSTime64 tPrev;                 // last time before the write
+    bool bText;
+    size_t nStride;                 // bytes per item
+    {
+        TChRdLock lock(m_mutChans);     // we are not changing the #chans
+        if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+            return NO_CHANNEL;
+
+        tPrev = m_vChan[chan]->MaxTime();
+        bText = m_vChan[chan]->ChanKind() == TextMark;
+        nStride = m_vChan[chan]->GetObjSize();
+        err = m_vChan[chan]->WriteData(pData, count);
+    }
 
-    return m_vChan[chan]->WriteData(pData, count);
+    if (err == 0)                   // we must not hold m_mutChans for this
+    {
+        if (bText)
+            AddToTextIndex(chan, pData, count, tPrev);
+        AddToCounts(chan, pData, nStride, count, true, tPrev);
+    }
+    return err;
 }
 
 // chan     The channel number in the file (0 up to m_vChanHead.size())
@@ -1111,3 +1246,80 @@ int TSon64File::ReadExtMarks(TChanNum chan, TExtMark* pData, int nMax, TSTime64
         pData = (TExtMark*)((char*)pData + n*m_vChan[chan]->m_chanHead.m_nObjSize);
     }
 }
+
+//! Find RealMark items with a float value in a range
+/*!
+\param chan     The RealMark channel.
+\param nRow     The row of the value to test.
+\param nCol     The column of the value to test.
+\param fLo      The lowest value to find.
+\param fHi      The highest value to find.
+\param pTimes   If not nullptr, set to the times of the found items.
+\param pData    If not nullptr, set to copies of the found items.
+\param nMax     The maximum number of items to find.
+\param tFrom    The start of the time range to search.
+\param tUpto    The end of the time range (not included).
+\param pFilter  Either nullptr or a filter to select the items.
+\return         The number of items found or a negative error code.
+*/
+int TSon64File::FindValues(TChanNum chan, size_t nRow, size_t nCol, float fLo, float fHi, TSTime64* pTimes,
+                           TExtMark* pData, int nMax, TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    if ((nMax <= 0) || (tFrom >= tUpto) || (tUpto < 0))
+        return 0;
+
+    TChRdLock lock(m_mutChans);     // we are not changing the #chans
+    if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+        return NO_CHANNEL;
+    CSon64Chan& ch = *m_vChan[chan];
+    if (ch.ChanKind() != RealMark)
+        return CHANNEL_TYPE;
+    if ((nRow >= ch.GetRows()) || (nCol >= ch.GetCols()))
+        return BAD_PARAM;
+
+    if (!m_bReadOnly)               // only data on disk is searched
+    {
+        int err = ch.Commit();
+        if (err)
+            return err;
+    }
+
+    // The values in each item are stored by rows
+    const size_t nOff = sizeof(TMarker) + (nRow*ch.GetCols() + nCol)*sizeof(float);
+    return static_cast<CExtMarkChan&>(ch).FindValues(nOff, fLo, fHi, pTimes, pData, nMax,
+                                                      tFrom, tUpto, pFilter, m_nEditGen);
+}
+
+//! Find the times of RealMark items with a value in a range
+/*!
+This reads the channel data blocks directly and skips blocks that cannot hold a value in
+the range without reading them. The value ranges of the blocks are kept from the first
+search of each channel, so later searches of the same row and column are much faster.
+\param chan     The RealMark channel.
+\param nRow     The row of the value to test.
+\param nCol     The column of the value to test (usually 0).
+\param fLo      The lowest value to find.
+\param fHi      The highest value to find. Values equal to fLo or fHi are found.
+\param pTimes   Set to the times of the found items.
+\param nMax     The maximum number of times to return.
+\param tFrom    The start of the time range to search.
+\param tUpto    The end of the time range (not included).
+\param pFilter  Either nullptr or a filter to select the items.
+\return         The number of times returned or a negative error code.
+*/
+int TSon64File::FindRealMarks(TChanNum chan, size_t nRow, size_t nCol, float fLo, float fHi, TSTime64* pTimes, int nMax,
+                              TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    return FindValues(chan, nRow, nCol, fLo, fHi, pTimes, nullptr, nMax, tFrom, tUpto, pFilter);
+}
+
+//! Find RealMark items with a value in a range
+/*!
+This is the same as the version that returns times, except that it returns copies of the
+whole items. pData must have space for nMax items of size ItemSize(chan).
+*/
+int TSon64File::FindRealMarks(TChanNum chan, size_t nRow, size_t nCol, float fLo, float fHi, TExtMark* pData, int nMax,
+                              TSTime64 tFrom, TSTime64 tUpto, const CSFilter* pFilter)
+{
+    return FindValues(chan, nRow, nCol, fLo, fHi, nullptr, pData, nMax, tFrom, tUpto, pFilter);
+}
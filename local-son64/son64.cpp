@@ -27,16 +27,35 @@
 #include "s64priv.h"
 #include "s64chan.h"
 #include "s64range.h"
+#include "s64text.h"
+#include "s64count.h"
+#include "s64rank.h"
+#include "s64async.h"
+#include "s64io.h"
+#include "s64idx.h"
 
 using namespace ceds64;
+
+//! An aligned buffer for uncached writes of blocks that are not aligned in memory
+struct ceds64::TDirectBuf
+{
+    alignas(DLSize) uint8_t m_data[DBSize]; //!< Space for the largest block we write
+};
+
 //-----------------TSon64File -----------------------------------------------
 
 TSon64File::TSon64File()
     : m_file( NOFILE_ID )
+    , m_fileDirect( NOFILE_ID )
+    , m_pIO( CIOEngine::Make() )
+    , m_bUseIdx( false )
+    , m_bMakeIdx( false )
     , m_bReadOnly( false )
     , m_bHeadDirty( false )
     , m_bOldFile( false )
     , m_dBufferedSecs( 0.0 )
+    , m_bFreeDirty( false )
+    , m_nEditGen( 0 )
 {
     m_Head.Init(32, 0);         // make it tidy
 }
@@ -105,7 +124,10 @@ int TSon64File::Create(const wchar_t* szName, uint16_t nChans, uint32_t nFUser)
         return NO_FILE;
 
     m_bReadOnly = false;            // must be able to write!
+    m_sName = szName;               // in case an index file is wanted
     m_Head.Init(nChans, nFUser);    // create the header
+    m_vFree.clear();                // no free blocks
+    m_bFreeDirty = false;
     int err = WriteHeader(&m_Head, sizeof(m_Head), 0);
     if (err == 0)
         err = ZeroExtraData();      // make sure the extra data all holds 0's
@@ -181,6 +203,10 @@ int TSon64File::Open(const wchar_t* szName, int iOpenMode, int flags)
             err = CreateChannelsFromHeaders();
     }
 
+    // We only need the free block map if we can write
+    if ((err == 0) && !m_bReadOnly)
+        err = ReadFreeMap();
+
     // If the file on disk is bigger than the next block we would allocate for it, we have a
     // problem, as the file was probably not closed properly. Any writes to it will cause it
     // to overwrite possible wanted data.
@@ -202,6 +228,14 @@ int TSon64File::Open(const wchar_t* szName, int iOpenMode, int flags)
         m_file = NOFILE_ID;
     }
 
+    if ((err == 0) && (flags & eOF_direct) && !m_bReadOnly)
+        SetDirectWrite(true);       // if this is not possible, we use normal writes
+    if (m_file != NOFILE_ID)
+        m_sName = szName;           // in case an index file is wanted
+    m_bUseIdx = (err == 0) && (flags & eOF_index);
+    m_bMakeIdx = (err == 0) && (flags & eOF_makeIndex);
+    if (m_bUseIdx && m_bReadOnly)   // the file cannot change, so...
+        MapIndexFile();             // ...use the index file if it matches
     m_bOldFile = true;          // signal this is an old file
     return err;
 }
@@ -240,7 +274,10 @@ int TSon64File::Create(const char* szName, uint16_t nChans, uint32_t nFUser)
         return NO_FILE;
 
     m_bReadOnly = false;            // must be able to write!
+    m_sName = szName;               // in case an index file is wanted
     m_Head.Init(nChans, nFUser);    // create the header
+    m_vFree.clear();                // no free blocks
+    m_bFreeDirty = false;
     int err = WriteHeader(&m_Head, sizeof(m_Head), 0);
     if (err == 0)
         err = ZeroExtraData();      // make sure the extra data all holds 0's
@@ -320,6 +357,10 @@ int TSon64File::Open(const char* szName, int iOpenMode, int flags)
             err = CreateChannelsFromHeaders();
     }
 
+    // We only need the free block map if we can write
+    if ((err == 0) && !m_bReadOnly)
+        err = ReadFreeMap();
+
     // If the file on disk is bigger than the next block we would allocate for it, we have a
     // problem, as the file was probably not closed properly. Any writes to it will cause it
     // to overwrite possible wanted data.
@@ -341,6 +382,14 @@ int TSon64File::Open(const char* szName, int iOpenMode, int flags)
         m_file = NOFILE_ID;
     }
 
+    if ((err == 0) && (flags & eOF_direct) && !m_bReadOnly)
+        SetDirectWrite(true);       // if this is not possible, we use normal writes
+    if (m_file != NOFILE_ID)
+        m_sName = szName;           // in case an index file is wanted
+    m_bUseIdx = (err == 0) && (flags & eOF_index);
+    m_bMakeIdx = (err == 0) && (flags & eOF_makeIndex);
+    if (m_bUseIdx && m_bReadOnly)   // the file cannot change, so...
+        MapIndexFile();             // ...use the index file if it matches
     m_bOldFile = true;          // signal this is an old file
     return err;
 #endif
@@ -369,7 +418,7 @@ bool TSon64File::IsModified() const
 {
     {
         THeadLock lock(m_mutHead);
-        if (m_bHeadDirty)
+        if (m_bHeadDirty || m_bFreeDirty)
             return true;
         if (m_ss.IsModified())
             return true;
@@ -422,6 +471,14 @@ int TSon64File::Commit(int flags)
                 err = locErr;
         }
 
+        // The free map may allocate a block, so must be written before the head
+        if (m_bFreeDirty)
+        {
+            int locErr = WriteFreeMap();
+            if (locErr && (err == 0))
+                err = locErr;
+        }
+
         if (m_bHeadDirty)
         {
             int locErr = WriteHeader(&m_Head, sizeof(m_Head), 0);
@@ -463,25 +520,110 @@ int TSon64File::FlushSysBuffers()
     return S64_OK;
 }
 
+//! Write data and index blocks past the OS file cache
+/*!
+Long recordings write a lot of data that will not be read again soon. With normal writes,
+this data fills the OS file cache, pushing out more useful data, and the OS writes it to
+disk in bursts that can stall the writing thread. When this is set, whole data and index
+blocks are written directly to the disk (O_DIRECT in Linux, FILE_FLAG_NO_BUFFERING in
+Windows) through a second file handle. Header writes, which are small and not aligned,
+still use the OS cache. Reads are not changed. Not all file systems allow this.
+\param bDirect  Set true to write blocks directly, false for normal writes.
+\return         S64_OK (0), NO_FILE, READ_ONLY, or NO_ACCESS if the OS or the file system
+                cannot do this, in which case normal writes are used.
+*/
+int TSon64File::SetDirectWrite(bool bDirect)
+{
+    if (m_file == NOFILE_ID)
+        return NO_FILE;
+    if (m_bReadOnly)
+        return READ_ONLY;
+
+    TFileLock lock(m_mutFile);
+    if (bDirect == (m_fileDirect != NOFILE_ID))
+        return S64_OK;                  // nothing to change
+    if (!bDirect)
+    {
+#if   S64_OS == S64_OS_WINDOWS
+        CloseHandle(m_fileDirect);
+#elif S64_OS == S64_OS_LINUX
+        close(m_fileDirect);
+#endif
+        m_fileDirect = NOFILE_ID;
+        return S64_OK;
+    }
+
+    TS64FH file = NOFILE_ID;
+#if   S64_OS == S64_OS_WINDOWS
+    file = ReOpenFile(m_file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                      FILE_FLAG_NO_BUFFERING);
+#elif (S64_OS == S64_OS_LINUX) && defined(O_DIRECT)
+    char szPath[32];                    // open the file again through our handle
+    snprintf(szPath, sizeof(szPath), "/proc/self/fd/%d", m_file);
+    file = open64(szPath, O_RDWR | O_BINARY | O_DIRECT);
+    if (file < 0)
+        file = NOFILE_ID;
+#endif
+    if (file == NOFILE_ID)
+        return NO_ACCESS;
+    if (!m_pDirectBuf)
+        m_pDirectBuf.reset(new TDirectBuf);
+    m_fileDirect = file;
+    return S64_OK;
+}
+
+//! Test if data and index blocks are written past the OS file cache (see SetDirectWrite())
+bool TSon64File::DirectWrite() const
+{
+    return m_fileDirect != NOFILE_ID;
+}
+
 // Close down an open file. This should write any dirty sections in the file header and
 // channel information. For now, just close the handle. We assume that opening and closing
 // of files is carefully controlled. We do not expect competing threads to close down the
 // same file.
 int TSon64File::Close()
 {
+    std::unique_ptr<CReadPool> pPool;
+    {
+        std::lock_guard<std::mutex> lockPool(m_mutPool);
+        pPool = std::move(m_pPool);
+    }
+    pPool.reset();                  // cancel queued async reads, wait for running reads
+
     if (m_file == NOFILE_ID)
         return NO_FILE;
 
     int err = m_bReadOnly ? S64_OK : Commit();
     FlushSysBuffers();          // Does nothing if m_bReadOnly is true
 
+    // If we were asked to maintain the index file and it may be missing or out of date
+    if (m_bMakeIdx && (!m_bReadOnly || !m_pIdx))
+        WriteIndexFile();       // failure does not matter, the index file is optional
+    UnmapIndexFile();
+    m_bUseIdx = false;
+    m_bMakeIdx = false;
+
     TFileLock lock(m_mutFile);
 #if   S64_OS == S64_OS_WINDOWS
     CloseHandle(m_file);
+    if (m_fileDirect != NOFILE_ID)
+        CloseHandle(m_fileDirect);
 #elif S64_OS == S64_OS_LINUX
     close(m_file);
+    if (m_fileDirect != NOFILE_ID)
+        close(m_fileDirect);
 #endif
     m_file = NOFILE_ID;
+    m_fileDirect = NOFILE_ID;
+
+    std::lock_guard<std::mutex> lockText(m_mutText);
+    m_mapText.clear();              // text indexes belong to the file
+    std::lock_guard<std::mutex> lockCount(m_mutCount);
+    m_mapCount.clear();             // as do event counts
+    std::lock_guard<std::mutex> lockRank(m_mutRank);
+    m_mapRank.clear();              // and item number tables
+    ++m_nEditGen;                   // nothing cached from this file can match the next one
     return err;
 }
 
@@ -511,6 +653,7 @@ int TSon64File::EmptyFile()
         }
     }
     ExtendMaxTime(-1);              // say the file has no data anymore
+    ++m_nEditGen;                   // any text indexes are now out of date
 
     return err;
 }
@@ -527,10 +670,25 @@ diagnostic purposes (for example, the S64Fix program does this).
 */
 int TSon64File::Read(void* pBuffer, uint32_t bytes, TDiskOff offset)
 {
-    if (offset < 0)
-        return PAST_SOF;
+    TIOReq req(pBuffer, bytes, offset);
+    return ReadBatch(&req, 1);
+}
 
-    int err = S64_OK;
+//! Read a list of blocks from the file
+/*!
+\internal
+The reads are passed to the I/O engine as one list, so the OS can run them together.
+\param pReq The list of n reads. We fill in the file handle.
+\param n    The number of reads.
+\return     S64_OK (0) if all the reads were complete, else a negative error code.
+*/
+int TSon64File::ReadBatch(TIOReq* pReq, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (pReq[i].m_offset < 0)
+            return PAST_SOF;
+    }
 
     TFileLock lock(m_mutFile);  // acquire file lock
 
@@ -538,49 +696,9 @@ int TSon64File::Read(void* pBuffer, uint32_t bytes, TDiskOff offset)
     if (m_file == NOFILE_ID)
         return NO_FILE;
 
-#if S64_OS == S64_OS_WINDOWS
-    LARGE_INTEGER llOffset;
-    llOffset.QuadPart = (LONGLONG)offset;
-    if (SetFilePointerEx(m_file, llOffset, NULL, FILE_BEGIN) == 0)
-        err = BAD_READ;
-    else
-    {
-        DWORD dwRead;
-        if (!ReadFile(m_file, pBuffer, bytes, &dwRead, NULL))
-        {
-            DWORD dwError = GetLastError();     // attempt to find out why
-            int iRetry = 100;                   // a retry count
-
-            // If we fail due to network problem, then try very hard to
-            // recover as it may go away with a few retries...
-            err = BAD_READ;
-            while (((dwError == ERROR_NETNAME_DELETED) ||
-                    (dwError == ERROR_NETWORK_BUSY)) &&
-                   (--iRetry > 0))
-            {
-                if (ReadFile(m_file, pBuffer, bytes, &dwRead, NULL))
-                {
-                    err = 0;
-#ifdef _DEBUG
-//                    OutputDebugString("TSon64File::Read() Recovered network failure\n");
-#endif
-                    break;
-                }
-                dwError = GetLastError();       // attempt to find out why
-            }
-        }
-
-        if ((err == 0) && (dwRead != bytes))
-            err = BAD_READ;
-    }
-#elif S64_OS == S64_OS_LINUX
-    if (lseek64(m_file, offset, SEEK_SET) != offset)
-        return BAD_READ;
-    if (read(m_file, pBuffer, bytes) != bytes)
-        return BAD_READ;
-#endif  // OS dependant code
-
-    return err;
+    for (size_t i = 0; i < n; ++i)
+        pReq[i].m_file = m_file;
+    return m_pIO->Read(pReq, n);
 }
 
 //! Get the physical size of the data file on disk by asking the OS for it
@@ -615,37 +733,60 @@ TDiskOff TSon64File::GetFileSize()
 */
 int TSon64File::Write(const void* pBuffer, uint32_t bytes, TDiskOff offset)
 {
-    int err = S64_OK;
-    assert(m_file != NULL);
-    
+    TIOReq req(pBuffer, bytes, offset);
+    return WriteBatch(&req, 1);
+}
+
+//! Write a list of blocks to the file
+/*!
+\internal
+The writes are passed to the I/O engine as one list, so the OS can run them together. The
+order in which the writes reach the disk is not defined, so the list must not write the
+same place twice.
+\param pReq The list of n writes. We fill in the file handle.
+\param n    The number of writes.
+\return     S64_OK (0) if all the writes were complete, else a negative error code.
+*/
+int TSon64File::WriteBatch(TIOReq* pReq, size_t n)
+{
+    assert(m_file != NOFILE_ID);
     if (m_file == NOFILE_ID)
         return NO_FILE;
 
     if (m_bReadOnly)
         return READ_ONLY;
 
-    if (offset < 0)
-        return PAST_SOF;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (pReq[i].m_offset < 0)
+            return PAST_SOF;
+    }
 
     TFileLock lock(m_mutFile);  // acquire file lock
-#if S64_OS == S64_OS_WINDOWS
-    DWORD   dwWritten;
-    LARGE_INTEGER llOffset;
-    llOffset.QuadPart = (LONGLONG)offset;
-    if (SetFilePointerEx(m_file, llOffset, NULL, FILE_BEGIN) == 0)
-        err = BAD_WRITE;
-    else if (!WriteFile(m_file, pBuffer, bytes, &dwWritten, NULL))
-        err = BAD_WRITE;
-    else if (dwWritten != bytes)
-        err = BAD_WRITE;
-#elif S64_OS == S64_OS_LINUX
-    if (lseek64(m_file, offset, SEEK_SET) != offset)
-        return BAD_WRITE;
-    if (write(m_file, pBuffer, bytes) != bytes)
-        return BAD_WRITE;
-#endif
 
-    return err;
+    // Whole data and index blocks can be written past the OS cache. The buffer must be
+    // aligned in memory, so copy it if it is not. We have one aligned buffer, so if it is
+    // already in use in this list, the write goes through the OS cache.
+    bool bDirectBufUsed = false;
+    for (size_t i = 0; i < n; ++i)
+    {
+        TIOReq& req = pReq[i];
+        req.m_file = m_file;
+        if ((m_fileDirect != NOFILE_ID) && (req.m_nBytes <= DBSize) && ((req.m_nBytes & (DLSize-1)) == 0) &&
+            ((req.m_offset & (DLSize-1)) == 0))
+        {
+            if (reinterpret_cast<uintptr_t>(req.m_pBuf) & (DLSize-1))
+            {
+                if (bDirectBufUsed)
+                    continue;
+                memcpy(m_pDirectBuf->m_data, req.m_pBuf, req.m_nBytes);
+                req.m_pBuf = m_pDirectBuf->m_data;
+                bDirectBufUsed = true;
+            }
+            req.m_file = m_fileDirect;
+        }
+    }
+    return m_pIO->Write(pReq, n);
 }
 
 //====================== Get and Set File and channel comments =============
@@ -1012,12 +1153,222 @@ int TSon64File::ChanDelete(TChanNum chan)
             {
                 m_vChan[chan]->Commit();    // update on disk
                 m_vChan[chan].reset();      // kill off the channel object
+                err = ReleaseChanBlocks(chan);  // let other channels use the space
+                if (err > 0)                // no room in the map, so the deleted...
+                    err = S64_OK;           // ...channel keeps its blocks, as it always did
             }
         }
     }
     return err;
 }
 
+//! Pass the data blocks of a deleted channel to the free block map
+/*!
+\internal
+You must hold the m_mutChans write lock and must not hold the head mutex. The channel
+index is left intact and the blocks are marked as belonging to the channel so that it
+can be undeleted (or reused) as long as none of the blocks have been allocated. The
+index blocks are not released as they share disk blocks with other channels. If the map
+has no room for the blocks, they are left with the channel, as before.
+\param chan The deleted channel.
+\return     S64_OK (0), 1 if the map had no room and the channel keeps its blocks, or a
+            negative error code.
+*/
+int TSon64File::ReleaseChanBlocks(TChanNum chan)
+{
+    if (m_bReadOnly)
+        return READ_ONLY;
+    TChanHead& ch = m_vChanHead[chan];
+    if (!ch.IsDeleted() || (ch.m_flags & ChanFlag_BlocksFree) || !ch.m_doIndex)
+        return S64_OK;
+
+    // Collect the data block offsets by walking down the index one level at a time
+    const uint64_t nBlocks = std::max(ch.m_nBlocks, ch.m_nAllocatedBlocks);
+    vector<TDiskOff> vDO(1, ch.m_doIndex);
+    TDiskLookup dlu;
+    size_t level = 0;
+    do
+    {
+        vector<TDiskOff> vNext;
+        for (auto pos : vDO)
+        {
+            int err = Read(&dlu, DLSize, pos);
+            if (err)
+                return err;
+            level = dlu.GetLevel();
+            for (unsigned int i = 0; (i < dlu.m_nItems) && (i < DLUItems); ++i)
+                vNext.push_back(dlu.m_items[i].m_do);
+        }
+        vDO.swap(vNext);
+    } while ((level > 1) && !vDO.empty());
+
+    if (vDO.size() > nBlocks)           // ignore items beyond the channel blocks
+        vDO.resize(static_cast<size_t>(nBlocks));
+    vDO.erase(vDO.begin(), vDO.begin() + static_cast<size_t>(std::min<uint64_t>(ch.m_nFirstBlock, vDO.size())));
+    std::sort(vDO.begin(), vDO.end());
+
+    // Make the channel runs, then merge them into the map
+    vector<TFreeRun> vRun;
+    for (auto pos : vDO)
+    {
+        if ((pos == 0) || (pos & (DBSize-1)))
+            return CORRUPT_FILE;
+        if (!vRun.empty() && (vRun.back().m_do + static_cast<TDiskOff>(vRun.back().m_nBlocks)*DBSize == pos))
+            ++vRun.back().m_nBlocks;
+        else
+            vRun.push_back(TFreeRun{pos, 1, static_cast<uint16_t>(chan), 0});
+    }
+
+    THeadLock lock(m_mutHead);
+    if (vRun.empty())
+        return S64_OK;
+    if (m_vFree.size() + vRun.size() > FreeRunsMax)
+        return 1;                       // no room, so leave the blocks with the channel
+    int err = LockedMarkReuse();        // older libraries must not undelete the channel
+    if (err)
+        return err;
+    size_t nOld = m_vFree.size();
+    m_vFree.insert(m_vFree.end(), vRun.begin(), vRun.end());
+    std::inplace_merge(m_vFree.begin(), m_vFree.begin()+nOld, m_vFree.end(),
+                       [](const TFreeRun& a, const TFreeRun& b){return a.m_do < b.m_do;});
+    m_bFreeDirty = true;
+
+    ch.m_flags |= ChanFlag_BlocksFree;
+    return WriteHeader(&ch, sizeof(TChanHead), m_Head.m_nChanStart + sizeof(TChanHead)*chan);
+}
+
+//! Add a run of blocks to the free block map
+/*!
+\internal
+You must hold the head mutex. A run that touches a map run with the same owner is joined to
+it, so it does not need a map item of its own.
+\param r    The run to add. It must not overlap any run in the map.
+\return     true if the run was added, false if the map is full.
+*/
+bool TSon64File::LockedAddFreeRun(const TFreeRun& r)
+{
+    auto it = lower_bound(m_vFree.begin(), m_vFree.end(), r.m_do,
+                          [](const TFreeRun& f, TDiskOff pos){return f.m_do < pos;});
+    const TDiskOff doEnd = r.m_do + static_cast<TDiskOff>(r.m_nBlocks)*DBSize;
+    auto itPrev = (it == m_vFree.begin()) ? m_vFree.end() : it - 1;
+    const bool bPrev = (itPrev != m_vFree.end()) && (itPrev->m_chan == r.m_chan) &&
+                       (itPrev->m_do + static_cast<TDiskOff>(itPrev->m_nBlocks)*DBSize == r.m_do);
+    const bool bNext = (it != m_vFree.end()) && (it->m_chan == r.m_chan) && (it->m_do == doEnd);
+    if (bPrev && bNext)                 // the run fills the gap between two runs
+    {
+        itPrev->m_nBlocks += r.m_nBlocks + it->m_nBlocks;
+        m_vFree.erase(it);
+    }
+    else if (bPrev)                     // the run follows a map run
+        itPrev->m_nBlocks += r.m_nBlocks;
+    else if (bNext)                     // the run comes just before a map run
+    {
+        it->m_do = r.m_do;
+        it->m_nBlocks += r.m_nBlocks;
+    }
+    else if (m_vFree.size() < FreeRunsMax)
+        m_vFree.insert(it, r);
+    else
+        return false;                   // no room in the map
+    m_bFreeDirty = true;
+    return true;
+}
+
+//! Pass data blocks that a channel no longer uses to the free block map
+/*!
+\internal
+You must not hold the head mutex. The blocks are not owned by any channel, so they can be
+allocated at once. Runs that touch runs already in the map are joined to them. If the map
+is still too full, the blocks that do not fit are returned so that the caller can keep
+them, as ReleaseChanBlocks() leaves a deleted channel its blocks.
+\param vDO  The disk offsets of the data blocks. This is sorted. It is returned holding the
+            blocks that could not be added to the map.
+\return     The number of blocks added to the map.
+*/
+size_t TSon64File::FreeDataBlocks(vector<TDiskOff>& vDO)
+{
+    std::sort(vDO.begin(), vDO.end());
+    vector<TFreeRun> vRun;
+    for (auto pos : vDO)
+    {
+        if (!vRun.empty() && (vRun.back().m_do + static_cast<TDiskOff>(vRun.back().m_nBlocks)*DBSize == pos))
+            ++vRun.back().m_nBlocks;
+        else
+            vRun.push_back(TFreeRun{pos, 1, FreeRunNoChan, 0});
+    }
+
+    THeadLock lock(m_mutHead);
+    if (vRun.empty() || LockedMarkReuse())  // if we cannot mark the file...
+        return 0;                       // ...the caller keeps the blocks
+    size_t nFreed = 0;
+    vector<TDiskOff> vKeep;             // the blocks that do not fit
+    for (const auto& r : vRun)
+    {
+        if (LockedAddFreeRun(r))
+            nFreed += r.m_nBlocks;
+        else
+        {
+            for (uint32_t i = 0; i < r.m_nBlocks; ++i)
+                vKeep.push_back(r.m_do + static_cast<TDiskOff>(i)*DBSize);
+        }
+    }
+    vDO.swap(vKeep);
+    return nFreed;
+}
+
+//! Take back the data blocks of a deleted channel from the free block map
+/*!
+\internal
+You must hold the m_mutChans write lock and must not hold the head mutex. This is called
+before a deleted channel is undeleted or reused. If none of the channel blocks have been
+allocated, they are removed from the map and the channel is as it was before it was
+deleted. Otherwise the remaining blocks stay in the map and the channel loses its data.
+\param chan     The deleted channel.
+\param bReuse   Set if the channel is to be reused rather than undeleted. A channel that
+                had blocks dropped from its start cannot reuse its index, so in this case
+                the blocks are left in the map for anyone to use.
+\return         1 if the channel has all its data blocks, 0 if the data is lost, or a
+                negative error code if the channel header could not be written.
+*/
+int TSon64File::ReclaimChanBlocks(TChanNum chan, bool bReuse)
+{
+    TChanHead& ch = m_vChanHead[chan];
+    if (!(ch.m_flags & ChanFlag_BlocksFree))
+        return 1;                       // blocks were never released
+
+    THeadLock lock(m_mutHead);
+    uint64_t nFree = 0;
+    for (const auto& r : m_vFree)
+    {
+        if (r.m_chan == chan)
+            nFree += r.m_nBlocks;
+    }
+
+    const bool bAll = (nFree == std::max(ch.m_nBlocks, ch.m_nAllocatedBlocks) - ch.m_nFirstBlock) &&
+                      !(bReuse && ch.m_nFirstBlock);
+    if (bAll)                           // remove the channel blocks from the map
+    {
+        m_vFree.erase(std::remove_if(m_vFree.begin(), m_vFree.end(),
+                                     [chan](const TFreeRun& r){return r.m_chan == chan;}), m_vFree.end());
+    }
+    else                                // blocks are now free for anyone
+    {
+        for (auto& r : m_vFree)
+        {
+            if (r.m_chan == chan)
+                r.m_chan = FreeRunNoChan;
+        }
+        ch.m_doIndex = 0;               // the channel has no data
+        ch.m_nBlocks = ch.m_nAllocatedBlocks = ch.m_nFirstBlock = 0;
+        ch.m_lastTime = -1;
+    }
+    m_bFreeDirty = true;
+
+    ch.m_flags &= ~ChanFlag_BlocksFree;
+    int err = WriteHeader(&ch, sizeof(TChanHead), m_Head.m_nChanStart + sizeof(TChanHead)*chan);
+    return err ? err : (bAll ? 1 : 0);
+}
+
 int TSon64File::ChanUndelete(TChanNum chan, eCU action)
 {
     switch (action)
@@ -1040,7 +1391,21 @@ int TSon64File::ChanUndelete(TChanNum chan, eCU action)
                 return NO_CHANNEL;
             if (!m_vChanHead[chan].IsDeleted())
                 return CHANNEL_TYPE;
-            int err = m_vChanHead[chan].Undelete();   // restore the channel
+            int err = ReclaimChanBlocks(chan);
+            if (err < 0)
+                return err;
+            if (err == 0)                   // if the channel space was reused...
+            {
+                THeadLock lockHead(m_mutHead);  // ...the channel cannot be restored
+                TChanHead& ch = m_vChanHead[chan];
+                m_ss.Sub(ch.m_title);
+                m_ss.Sub(ch.m_units);
+                m_ss.Sub(ch.m_comment);
+                ch.ResetForReuse();
+                err = WriteHeader(&ch, sizeof(TChanHead), m_Head.m_nChanStart + sizeof(TChanHead)*chan);
+                return err ? err : NO_BLOCK;
+            }
+            err = m_vChanHead[chan].Undelete();   // restore the channel
             if (err == S64_OK)
             {
                 err = CreateChannelFromHeader(chan);
@@ -1081,6 +1446,88 @@ int TSon64File::ItemSize(TChanNum chan) const
     else
         return static_cast<int>(m_vChan[chan]->GetObjSize());
 }
+
+//! Get summary statistics of the data in a channel
+/*!
+The summary is saved in the channel header and is kept up to date as data is written, so
+this is usually immediate. For files written by older versions of the library, or after
+data on disk is edited, the first call reads the channel data to make the summary. If the
+file is writable, the channel is committed first, and the summary is saved with the file.
+\param chan     The channel number.
+\param stats    Returned holding the item count (data points for waveforms), the first and
+                last item times and, for Adc, AdcMark, RealWave and RealMark channels, the
+                range of the data values in user units.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::ChanStats(TChanNum chan, TChanStats& stats)
+{
+    TChRdLock lock(m_mutChans);     // we are not changing the #chans
+    if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+        return NO_CHANNEL;
+
+    if (!m_bReadOnly)               // the summary is of the data on disk
+    {
+        int err = m_vChan[chan]->Commit();
+        if (err)
+            return err;
+    }
+    return m_vChan[chan]->GetStats(stats);
+}
+
+//! Make a channel a ring archive that keeps a fixed number of data blocks
+/*!
+This is for continuous monitoring where the file should hold the most recent data and never
+grow. Once the channel has written nBlocks data blocks, it goes back and reuses its blocks
+from the first one, so each new block replaces the oldest data. The index blocks are reused
+with the data blocks, so the disk space used by the channel is fixed. Readers see the data
+from ChanMinTime() to ChanMaxTime(), and the start time moves on as the data is replaced.
+The setting is saved with the file. Each block holds up to DBSize (64 kB) of data, less a
+small header, so the blocks for a time span can be estimated from the channel data rate.
+\param chan     The channel number.
+\param nBlocks  The data blocks to keep, or 0 to stop ring mode. This can be changed until the
+                ring wraps for the first time, but it cannot be less than the number of blocks
+                the channel already owns.
+\return         S64_OK (0) or a negative error code.
+*/
+int TSon64File::SetChanRing(TChanNum chan, uint64_t nBlocks)
+{
+    if (m_bReadOnly)
+        return READ_ONLY;
+    TChRdLock lock(m_mutChans);     // we are not changing the #chans
+    if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+        return NO_CHANNEL;
+    return m_vChan[chan]->SetRing(nBlocks);
+}
+
+//! Get the number of data blocks kept by a ring archive channel
+/*!
+\param chan The channel number.
+\return     The data blocks kept by the channel, 0 if it is not a ring archive, or a negative
+            error code.
+*/
+int64_t TSon64File::ChanRing(TChanNum chan) const
+{
+    TChRdLock lock(m_mutChans);     // we are not changing the #chans
+    if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+        return NO_CHANNEL;
+    return static_cast<int64_t>(m_vChan[chan]->GetRing());
+}
+
+//! Get the time of the first item in a channel
+/*!
+This is the start of the data that can be read from the channel. For a ring archive channel,
+this moves on as the oldest data is replaced. Buffered data that is not being saved is not
+included.
+\param chan The channel number.
+\return     The first item time, -1 if the channel has no data, or a negative error code.
+*/
+TSTime64 TSon64File::ChanMinTime(TChanNum chan) const
+{
+    TChRdLock lock(m_mutChans);     // we are not changing the #chans
+    if ((chan >= m_vChanHead.size()) || !m_vChan[chan])
+        return NO_CHANNEL;
+    return m_vChan[chan]->MinTime();
+}
 //==========================================================================
 // Saving operations only have any effect if the channels are buffered
 void TSon64File::Save(int chan, TSTime64 t, bool bSave)
@@ -1344,7 +1791,7 @@ double TSon64File::SetBuffering(int chan, size_t nBytes, double dSeconds)
  We are about to reuse a channel. You can only do this if the channel has been
  deleted. Once this operation is complete, you cannot undelete the channel. We
  release all the channel resources. If there were used blocks we will now be
- re-using them.
+ re-using them, unless they were passed to the free block map and some have been used.
 */
 int TSon64File::ResetForReuse(TChanNum chan)
 {
@@ -1352,5 +1799,14 @@ int TSon64File::ResetForReuse(TChanNum chan)
         return READ_ONLY;
     if (chan >= m_vChanHead.size()) // this is a really bad error!
         return NO_CHANNEL;
-    return m_vChan[chan] ? m_vChan[chan]->ResetForReuse() : S64_OK;
+    ++m_nEditGen;                   // any text index of the channel is out of date
+    if (m_vChan[chan])
+        return m_vChan[chan]->ResetForReuse();
+    if (m_vChanHead[chan].IsDeleted())
+    {
+        int err = ReclaimChanBlocks(chan, true);  // reuse the old blocks if we still can
+        if (err < 0)
+            return err;
+    }
+    return S64_OK;
 }